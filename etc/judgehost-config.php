@@ -17,3 +17,238 @@ define('USE_CHROOT', true);
 // the submission can write to. Also the environment variable TMPDIR will
 // be set to this directory
 define('CREATE_WRITABLE_TEMP_DIR', getenv('DOMJUDGE_CREATE_WRITABLE_TEMP_DIR') ? true : false);
+
+// Start a persistent runguard server for each judging that performs
+// the privileged setup once and then handles the runs of all its
+// testcases, instead of starting a new runguard via sudo per run.
+// This reduces the per testcase overhead for problems with many
+// small testcases.
+define('RUNGUARD_SERVER', false);
+
+// Number of children the runguard server keeps forked, chrooted and
+// running as the run user, ready to execute the next run. This cuts
+// the latency between a run request and the start of the program.
+define('RUNGUARD_SERVER_POOL', 2);
+
+// Number of cgroups the runguard server keeps created in advance. A run
+// is passed one instead of creating its own, and deletes it only after
+// it has reported its result, which takes both off the time between
+// testcases. This requires cgroup v2; set to 0 to disable.
+define('RUNGUARD_SERVER_CGROUP_POOL', 2);
+
+// Let runguard bind mount the pre-built chroot tree into the chroot of
+// each run, inside the private mount namespace of that run, instead of
+// running chroot-startstop.sh with sudo mount/umount for each judging.
+// The mounts are then only visible to the run and vanish with it. Note
+// that customisations of chroot-startstop.sh are not used in this case.
+define('RUNGUARD_CHROOT_MOUNTS', false);
+
+// Use a compressed read-only image of the pre-built chroot tree, as
+// created with the -I option of dj_make_chroot or dj_make_chroot_docker.
+// It must be placed at the chroot dir with '.img' appended, e.g.
+// '/chroot/domjudge.img', together with its '.sha256' file: this path
+// is fixed in etc/sudoers-domjudge. When set, the first judgedaemon on
+// a host loop mounts it on the chroot dir, so only this one file needs
+// to be distributed to judgehosts. Its SHA-256 hash is added as
+// 'chroot-image' to the metadata of each run. Set to false to use the
+// chroot tree directly.
+define('CHROOT_IMAGE', false);
+
+// Run and compare each testcase with the compiled testcase_run program
+// instead of the testcase_run.sh shell script. It performs the same
+// steps, but without spawning helper programs for each of them, which
+// otherwise dominates the judging time of small testcases.
+define('NATIVE_TESTCASE_RUN', false);
+
+// Hash the program output while it is being written and skip running
+// the compare script when it is byte-for-byte identical to the
+// testcase output. This saves a full pass over large outputs, but
+// note that no judge feedback is generated for such testcases.
+define('SKIP_COMPARE_ON_HASH_MATCH', false);
+
+// Run the default compare script on the program output already while
+// the program runs, and abort the program as soon as its output is
+// wrong. This saves waiting for the timelimit of a submission that
+// is wrong early on; such a run gets a wrong answer verdict even when
+// it would have exceeded the timelimit later. This is only used for
+// problems with the 'compare' executable as compare script. It gets
+// the script limits of the compare script; when it falls more than
+// 16 MB of output behind, it is stopped and the run is judged as usual.
+// It runs as the user '<runuser>-compare' (e.g. 'domjudge-run-compare'
+// or 'domjudge-run-X-compare' with '-n X'), which must be created
+// like the run user.
+define('STREAM_COMPARE', false);
+
+// Kill a submission as soon as it writes more than the output limit,
+// instead of discarding the excess output until it exits or reaches
+// the timelimit. It then always gets an output limit verdict, also
+// when it would have crashed or timed out otherwise.
+define('KILL_ON_OUTPUT_LIMIT', false);
+
+// Give a memory limit verdict to a submission that runguard killed for
+// running out of memory or thrashing at its memory limit, instead of
+// the run error (or timelimit) that this otherwise results in. This
+// needs cgroups; the verdict should be enabled in 'results_prio'.
+define('MEMORY_LIMIT_VERDICT', false);
+
+// Run the testcases that failed most often per second of runtime in
+// earlier judgings of a problem first, instead of in rank order, such
+// that wrong submissions are rejected sooner with lazy evaluation.
+// The final verdict is taken in rank order over the testcases judged.
+// When several results share the highest priority in 'results_prio'
+// (the default), which of these a wrong submission gets may depend on
+// the order: this is only reordered then when set to 'always'.
+define('FAIL_FAST_TESTCASE_ORDER', false);
+
+// Maximum total size in bytes of the testcase files cached on this
+// host, shared by all judgedaemons. Least recently used files are
+// removed when it is exceeded; set to 0 to keep all files.
+define('TESTCASE_CACHE_SIZE', 0);
+
+// Store the testcase files in the cache compressed with zstd at this
+// level (1-19), or uncompressed when 0. The testcase runners then
+// decompress them through a pipe while they are read, to the stdin of
+// the program and, for the default compare script, of the compare
+// script: the uncompressed data is never written to disk. Other
+// compare scripts and interactive problems get decompressed copies in
+// the workdir. Needs the zstd program; the cache is not converted
+// when this is changed, so clear it then.
+define('TESTCASE_CACHE_COMPRESS', 0);
+
+// Number of parallel downloads to prefetch the testcase files of a
+// judging with, while the submission is compiled and run. Set to 0 to
+// download each testcase only when it is run.
+define('TESTCASE_PREFETCH', 4);
+
+// Cache compile results on this host, keyed by the sources, compile
+// script, entry point, limits and chroot. Rejudging then only reruns
+// the testcases. Changes to compilers outside the chroot are not
+// detected: remove JUDGEDIR/compile-cache after upgrading them.
+define('COMPILE_CACHE', false);
+
+// Number of seconds to cache the configuration of the domserver for.
+// All settings are fetched with a single request, instead of one
+// request per setting for each judging. Set to 0 to not cache them.
+define('CONFIG_CACHE_TTL', 60);
+
+// Number of seconds the domserver may hold a request for a new
+// judging until a submission arrives (long-poll), instead of this
+// judgedaemon polling every few seconds. The domserver checks for
+// submissions as often as the judgedaemon would (every 5 seconds), so
+// this saves the HTTP requests in between but not latency, and each
+// waiting judgedaemon occupies a PHP worker on the domserver. It is
+// only used with a single domserver endpoint. Note that the
+// judgedaemon may take this long to exit on a signal while idle. Set
+// to 0 to disable.
+define('NEXT_JUDGING_WAIT', 0);
+
+// Run the testcases of a judging in parallel, each on one of these
+// CPU cores, given as a comma separated list such as '2,3,4,5'. Results
+// are still reported in testcase order and with lazy evaluation the
+// runs of later testcases are cancelled at the first wrong one. The
+// cores should be dedicated to this judgedaemon. The run on the N-th
+// core (counting from 0) runs as the user '<runuser>-tN', e.g.
+// 'domjudge-run-t0' or 'domjudge-run-X-t0' with '-n X', and only that
+// user can access its testcase directory, using POSIX ACLs (setfacl).
+// These users must be created like the run user. Leave empty to run
+// testcases one at a time; this also disables RUNGUARD_SERVER.
+define('PARALLEL_TESTCASE_CPUS', '');
+
+// Unix socket of the judgesched core scheduler of this host. When set,
+// the judgedaemons on this host lease a core from it for each compile
+// and testcase run, running testcases of a judging in parallel on all
+// free cores, instead of each using the fixed core given by its '-n'
+// option. Start 'judgesched --socket=<path> --cpus=<list>' with the
+// judging cores first; it keeps the SMT siblings of these idle. This
+// overrides PARALLEL_TESTCASE_CPUS and also disables RUNGUARD_SERVER.
+// Parallel runs use the run users '<runuser>-tN' as described above: a
+// judging runs as many testcases in parallel as there are such users
+// with consecutive N from 0, and one at a time if there are none.
+define('JUDGE_SCHEDULER_SOCKET', '');
+
+// Compile the next submission while the testcases of the current one
+// run: the judgedaemon claims the next judging early and compiles it
+// with nice 10 on these CPU cores, e.g. '0' or '0-1'. These must not
+// be used for running testcases, so that timing is not affected.
+// The compile runs as the user '<runuser>-compile' (e.g.
+// 'domjudge-run-compile' or 'domjudge-run-X-compile' with '-n X'),
+// which must be created like the run user. Leave empty to compile
+// each submission when it is judged.
+define('COMPILE_AHEAD_CPUS', '');
+
+// Unix datagram socket of the judgemetrics exporter of this host. When
+// set, the judgedaemon sends the times, memory usage and runguard phase
+// times of each compile and testcase run, the queue wait and the
+// duration of each judging there, to be served to Prometheus. Start it
+// as 'judgemetrics --socket=<path> --listen=<port>'. Leave empty to not
+// collect metrics.
+define('JUDGEHOST_METRICS_SOCKET', '');
+
+// Throttle the block I/O of submissions, such that a single run cannot
+// slow down other judgedaemons on the same host. This is a comma
+// separated list of cgroup io.max style limits 'rbps', 'wbps', 'riops'
+// and 'wiops', e.g. 'rbps=52428800,wbps=52428800'. Leave empty to not
+// limit block I/O.
+define('RUN_IO_MAX', '');
+
+// When the judgedaemon is bound to a cpuset (option -n), allocate the
+// memory of submissions on the NUMA node(s) of that cpuset and record
+// the CPU frequency governor and frequency in the run metadata. Set to
+// 'smt' to additionally keep the SMT siblings of the cpuset idle.
+define('RUN_TIMING_PROFILE', false);
+
+// Record the number of syscalls, a per syscall breakdown of the most
+// common ones and the minor and major page faults of submissions in
+// the run metadata, to explain timing differences with other hosts.
+// These are counted by the kernel, without slowing down the program,
+// but the syscall counts require tracefs (with syscall tracepoints).
+define('RUN_SYSCALL_PROFILE', false);
+
+// Relay the data of interactive problems through runpipe instead of
+// connecting the programs directly. This records per direction byte
+// and message counts and the response times of the jury program and
+// the submission, such that it is visible which side used the time.
+define('RUNPIPE_RELAY', false);
+
+// Capacity in bytes of the pipes between the jury program and the
+// submission of interactive problems, 0 for the kernel default. A
+// larger capacity lets protocols with large messages run without
+// both sides blocking on a full pipe.
+define('RUNPIPE_PIPE_SIZE', 0);
+
+// Abort an interactive run when no data has been exchanged for this
+// many milliseconds while neither the jury program nor the submission
+// uses any cpu time, i.e. both are blocked waiting for each other.
+// This gives a timelimit verdict without waiting for the wall time
+// limit. Set to 0 to disable; a non-zero value implies RUNPIPE_RELAY.
+define('RUNPIPE_IDLE_TIMEOUT', 0);
+
+// Evict the workdir of a finished judging from the kernel filesystem
+// cache in the background, instead of waiting for it before fetching
+// the next judging. The eviction then overlaps with the next runs, so
+// it uses a single thread on the CPUs the judgedaemon itself may run
+// on: pin the judgedaemon (e.g. with taskset) to CPUs other than those
+// used for testcases to keep their timing unaffected.
+define('EVICT_ASYNC', false);
+
+// Size of a tmpfs to mount on the working directory of each judging,
+// e.g. '2G' or '25%' of RAM; leave empty to use the judgehost disk.
+// Submission output then never hits the disk and needs no eviction
+// afterwards. Note that tmpfs pages written by a submission are
+// charged to its memory cgroup. The tmpfs of a judging is kept until
+// the next judging starts, so it can still be inspected. This requires
+// the rule for lib/judge/mount-workdir-tmpfs.sh in etc/sudoers-domjudge.
+define('WORKDIR_TMPFS_SIZE', '');
+
+// Keep files in the kernel filesystem cache that were part of the
+// workdir of more than this many judgings, such as the testcase data
+// that the testcase directories link to. Set to 0 to evict everything.
+define('EVICT_KEEP_HOT', 1);
+
+// Let runguard reclaim the page cache charged to the cgroup of each
+// compile and testcase run when it finishes, instead of evicting the
+// workdir file by file afterwards. The file walk is still used when
+// the kernel does not support this (it needs cgroup v2 with
+// memory.reclaim, or cgroup v1). Note that this also drops shared
+// files, such as a language runtime, that were first read by a run.
+define('EVICT_CGROUP_RECLAIM', false);
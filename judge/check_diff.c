@@ -0,0 +1,222 @@
+/*
+   check_diff -- check that program output is identical to the expected output.
+
+   Part of the DOMjudge Programming Contest Jury System and licensed
+   under the GNU GPL. See README and COPYING for details.
+
+
+   Program specifications:
+
+   This is a native replacement for the 'diff -a' in check_diff.sh and
+   takes the same arguments:
+
+     check_diff <testdata.in> <program.out> <testdata.out> [<feedbackdir>]
+
+   Only whether the files are identical and where they first differ is
+   determined, so no edit script is computed. Both files are mapped into
+   memory and compared in blocks with memcmp, which the C library
+   vectorizes; lines are counted with memchr only up to the first
+   difference. Identical files give no output. Otherwise a short
+   excerpt of the differing line in both files is written to stdout,
+   with the byte offset, line and column of the first difference.
+   With a feedback directory as fourth argument, the byte offset is also
+   written there to diffposition.txt, in the format of the default
+   compare program.
+
+   Exits 0 when the files could be compared, non-zero on errors.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "lib.error.h"
+#include "lib.misc.h"
+
+#define PROGRAM "check_diff"
+
+/* Bytes compared per memcmp call before locating the difference. */
+#define BLOCK_SIZE 65536
+
+/* Maximum number of bytes of context shown around a difference. */
+#define CONTEXT 40
+
+const char *progname;
+
+/* An input file held completely in memory, mapped where possible. */
+struct input {
+	const char *data;
+	size_t size;
+};
+
+static void read_input(const char *name, struct input *in)
+{
+	struct stat st;
+	size_t alloc;
+	ssize_t nread;
+	char *buf;
+	void *p;
+	int fd;
+
+	in->data = "";
+	in->size = 0;
+	if ( (fd = open(name, O_RDONLY))<0 ) error(errno, "cannot open '%s'", name);
+	if ( fstat(fd, &st)!=0 ) error(errno, "cannot stat '%s'", name);
+
+	if ( S_ISREG(st.st_mode) ) {
+		if ( st.st_size>0 ) {
+			p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if ( p==MAP_FAILED ) error(errno, "cannot map '%s'", name);
+			posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+			in->data = p;
+			in->size = st.st_size;
+		}
+		close(fd);
+		return;
+	}
+
+	/* Fall back to reading everything, e.g. from a pipe. */
+	alloc = BLOCK_SIZE;
+	if ( (buf = malloc(alloc))==NULL ) error(errno, "cannot allocate memory");
+	while ( (nread = read(fd, buf+in->size, alloc-in->size))!=0 ) {
+		if ( nread<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno, "cannot read '%s'", name);
+		}
+		in->size += nread;
+		if ( in->size==alloc ) {
+			alloc *= 2;
+			if ( (buf = realloc(buf, alloc))==NULL ) error(errno, "cannot allocate memory");
+		}
+	}
+	in->data = buf;
+	close(fd);
+}
+
+/* Return the offset of the first byte where a and b differ, or the
+ * size of the smallest when one is a prefix of the other.
+ */
+static size_t first_difference(const struct input *a, const struct input *b)
+{
+	size_t pos, len, size;
+
+	size = a->size<b->size ? a->size : b->size;
+	for(pos=0; pos<size; pos+=len) {
+		len = size-pos<BLOCK_SIZE ? size-pos : BLOCK_SIZE;
+		if ( memcmp(a->data+pos, b->data+pos, len)!=0 ) break;
+	}
+	while ( pos<size && a->data[pos]==b->data[pos] ) pos++;
+
+	return pos;
+}
+
+/* Print 'len' bytes at 'data' quoted, with non-printable characters
+ * escaped as in C, and return the number of characters printed.
+ */
+static int print_quoted(const char *data, size_t len)
+{
+	int n = 0;
+	size_t i;
+	unsigned char c;
+
+	for(i=0; i<len; i++) {
+		c = data[i];
+		switch ( c ) {
+		case '\n': n += printf("\\n"); break;
+		case '\r': n += printf("\\r"); break;
+		case '\t': n += printf("\\t"); break;
+		case '\\': n += printf("\\\\"); break;
+		case '"':  n += printf("\\\""); break;
+		default:
+			if ( c>=0x20 && c<0x7f ) {
+				putchar(c);
+				n++;
+			} else {
+				n += printf("\\x%02x", c);
+			}
+		}
+	}
+	return n;
+}
+
+/* Print the excerpt of 'in' from 'start' to at most CONTEXT bytes
+ * after 'pos', up to the end of the line. Returns the number of
+ * characters printed before the byte at 'pos'.
+ */
+static int print_excerpt(const char *label, const struct input *in, size_t start, size_t pos)
+{
+	const char *eol;
+	size_t end;
+	int n;
+
+	end = in->size-pos<CONTEXT ? in->size : pos+CONTEXT;
+	if ( pos<in->size && (eol = memchr(in->data+pos, '\n', end-pos))!=NULL ) {
+		end = eol - in->data + 1;
+	}
+
+	n = printf("%-10s%s\"", label, start>0 && in->data[start-1]!='\n' ? "..." : "");
+	n += print_quoted(in->data+start, pos-start);
+	print_quoted(in->data+pos, end-pos);
+	printf("\"%s\n", end<in->size && in->data[end-1]!='\n' ? "..." : "");
+	if ( pos>=in->size ) printf("%-10s(end of file)\n", "");
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	struct input program, expected;
+	size_t pos, start, line, i;
+	const char *nl;
+	char *path;
+	FILE *diffpos;
+	int n;
+
+	progname = argv[0];
+
+	if ( argc<4 || argc>5 ) {
+		error(0, "usage: %s <testdata.in> <program.out> <testdata.out> [<feedbackdir>]",
+		      PROGRAM);
+	}
+	read_input(argv[2], &program);
+	read_input(argv[3], &expected);
+
+	pos = first_difference(&program, &expected);
+	if ( pos==program.size && pos==expected.size ) return 0;
+
+	/* The line of the difference starts after the last newline before
+	 * it, which is the same in both files. */
+	line = 1;
+	start = 0;
+	for(i=0; i<pos && (nl = memchr(program.data+i, '\n', pos-i))!=NULL; i=start) {
+		start = nl - program.data + 1;
+		line++;
+	}
+
+	printf("Output differs at byte %zu (line %zu, column %zu):\n",
+	       pos, line, pos-start+1);
+	if ( pos-start>CONTEXT ) start = pos-CONTEXT;
+	n = print_excerpt("program:", &program, start, pos);
+	print_excerpt("expected:", &expected, start, pos);
+	printf("%*s^\n", n, "");
+
+	if ( argc>4 ) {
+		path = allocstr("%s/diffposition.txt", argv[4]);
+		if ( (diffpos = fopen(path, "w"))==NULL ||
+		     fprintf(diffpos, "%zu %zu", pos, pos)<0 || fclose(diffpos)!=0 ) {
+			error(errno, "cannot write '%s'", path);
+		}
+		free(path);
+	}
+
+	if ( fflush(stdout)!=0 ) error(errno, "cannot write output");
+
+	return 0;
+}
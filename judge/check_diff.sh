@@ -14,6 +14,13 @@ TESTIN="$1"
 PROGRAM="$2"
 TESTOUT="$3"
 
+# The native check_diff only reports the first difference, but is much
+# faster on large outputs. Remove this to use the diff options above.
+CHECK_DIFF="$(dirname "$0")/check_diff"
+if [ -x "$CHECK_DIFF" ]; then
+	exec "$CHECK_DIFF" "$TESTIN" "$PROGRAM" "$TESTOUT"
+fi
+
 diff -a "$PROGRAM" "$TESTOUT"
 EXITCODE=$?
 
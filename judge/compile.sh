@@ -145,7 +145,7 @@ fi
 exitcode=0
 $GAINROOT "$RUNGUARD" ${DEBUG:+-v} $CPUSET_OPT -u "$RUNUSER" -g "$RUNGROUP" \
 	-m $SCRIPTMEMLIMIT -t $SCRIPTTIMELIMIT -c -f $SCRIPTFILELIMIT -s $SCRIPTFILELIMIT \
-	-M "$WORKDIR/compile.meta" $ENVIRONMENT_VARS -- \
+	${RECLAIM_CACHE:+--reclaim-cache} -M "$WORKDIR/compile.meta" $ENVIRONMENT_VARS -- \
 	"$COMPILE_SCRIPT" program "$MEMLIMIT" "$@" >"$WORKDIR/compile.tmp" 2>&1 || \
 	exitcode=$?
 
@@ -1,114 +1,513 @@
+/*
+   evict -- evict all files in a directory from the kernel filesystem cache.
+
+   Part of the DOMjudge Programming Contest Jury System and licensed
+   under the GNU GPL. See README and COPYING for details.
+
+
+   Program specifications:
+
+   The directory trees are walked with a pool of worker threads that
+   take directories from a shared queue. All lookups are relative to
+   directory file descriptors (openat/fstatat), so no full paths need
+   to be resolved by the kernel. Files and directories are tracked by
+   device and inode number, such that hardlinked files (e.g. copies of
+   the executable in each testcase directory) are evicted only once,
+   and loops through symlinked directories are avoided.
+
+   With --async the program daemonizes before walking, so that the
+   caller does not have to wait for the eviction, and by default uses
+   a single worker thread. Warnings are then only logged to syslog, if
+   configured.
+
+   Files can be kept cached selectively: by include/exclude patterns
+   matched against the path relative to the directory argument or the
+   file name, and with --keep-hot=N by a state file that counts in how
+   many runs each file (identified by device, inode, modification time
+   and size) was encountered. Files encountered in more than N runs
+   are kept, such as testcase data that testdata.in/out symlink to and
+   that is read again by the next judging of the same problem.
+ */
+
+/* For fdopendir() and openat() */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include "lib.error.h"
 #include "lib.misc.h"
 
 #define PROGRAM "evict"
 #define VERSION DOMJUDGE_VERSION "/" REVISION
 
+/* Maximum and default maximum number of worker threads. */
+#define MAX_JOBS 64
+#define DEFAULT_MAX_JOBS 8
+
+/* Number of buckets of the hash table of seen inodes. */
+#define INODE_HASH_SIZE 4096
+
+/* Maximum number of include/exclude patterns. */
+#define MAX_PATTERNS 64
+
+/* Number of runs after which unseen files are dropped from the state. */
+#define STATE_MAX_AGE 100
+
 extern int errno;
 const char *progname;
 
 int be_verbose;
 int show_help;
 int show_version;
+int run_async;
+int njobs;
+
+char *include_patterns[MAX_PATTERNS];
+char *exclude_patterns[MAX_PATTERNS];
+int ninclude, nexclude;
+
+long keep_hot;
+char *statefilename;
+long staterun;
 
 struct option const long_opts[] = {
 	{"verbose", no_argument,       NULL,         'v'},
+	{"jobs",    required_argument, NULL,         'j'},
+	{"async",   no_argument,       &run_async,    1 },
+	{"include", required_argument, NULL,         'I'},
+	{"exclude", required_argument, NULL,         'x'},
+	{"keep-hot", required_argument, NULL,        'k'},
+	{"state",   required_argument, NULL,         's'},
 	{"help",    no_argument,       &show_help,    1 },
 	{"version", no_argument,       &show_version, 1 },
 	{ NULL,     0,                 NULL,          0 }
 };
 
+/* A directory still to be walked, with an open file descriptor; the
+   relative path points into path after the directory argument, at
+   offset reloff (also in the paths of its subdirectories), and is ""
+   for the directory argument itself. */
+struct dirjob {
+	int fd;
+	char *path;
+	int reloff;
+	const char *relpath;
+	struct dirjob *next;
+};
+
+struct inode {
+	dev_t dev;
+	ino_t ino;
+	struct inode *next;
+};
+
+/* Usage state of a file for --keep-hot, loaded from the state file. */
+struct fileuse {
+	dev_t dev;
+	ino_t ino;
+	long long mtime;
+	long long size;
+	long count;
+	long lastrun;
+	struct fileuse *next;
+};
+
+/* Queue of directories to walk; pending counts the directories queued
+   plus the ones being walked, the walk is done when it drops to zero. */
+struct dirjob *queue;
+int pending;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+
+struct inode *seen_inodes[INODE_HASH_SIZE];
+pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fileuse *file_uses[INODE_HASH_SIZE];
+pthread_mutex_t fileuse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Statistics per worker thread, summed after the walk. */
+struct walkstats {
+	long nfiles;
+	long nkept;
+	long ndirs;
+	long long nbytes;
+};
+
 void usage()
 {
 	printf("\
-Usage: %s [OPTION]... DIRECTORY\n\
-Evicts all files in a directory from the kernel filesystem cache\n\
+Usage: %s [OPTION]... DIRECTORY...\n\
+Evicts all files in directories from the kernel filesystem cache\n\
 \n\
+  -j, --jobs=N         use N worker threads (default: number of CPUs, max %d,\n\
+                         or 1 with --async)\n\
+      --async          return immediately and evict in the background\n\
+  -I, --include=PATTERN  only evict files matching PATTERN\n\
+  -x, --exclude=PATTERN  do not evict files matching PATTERN\n\
+  -k, --keep-hot=N     do not evict files encountered in more than N runs,\n\
+                         as counted in the file given by --state\n\
+  -s, --state=FILE     file to keep usage counts of files in\n\
   -v, --verbose        display some extra warnings and information\n\
       --help           display this help and exit\n\
       --version        output version information and exit\n\
-\n", progname);
+\n\
+Patterns are shell wildcard patterns matched against the file path\n\
+relative to DIRECTORY and the file name; both options can be repeated.\n\
+\n", progname, DEFAULT_MAX_JOBS);
 	exit(0);
 }
 
-void evict_directory(char *dirname) {
+unsigned long inode_hash(dev_t dev, ino_t ino)
+{
+	return ((unsigned long)ino ^ ((unsigned long)dev << 7)) % INODE_HASH_SIZE;
+}
+
+/* Returns whether the inode of s was seen before and marks it seen. */
+int inode_seen(const struct stat *s)
+{
+	struct inode *node;
+	unsigned long h;
+	int found = 0;
+
+	h = inode_hash(s->st_dev, s->st_ino);
+
+	pthread_mutex_lock(&inode_lock);
+	for(node=seen_inodes[h]; node!=NULL; node=node->next) {
+		if ( node->ino==s->st_ino && node->dev==s->st_dev ) {
+			found = 1;
+			break;
+		}
+	}
+	if ( !found ) {
+		if ( (node = malloc(sizeof(struct inode)))==NULL ) {
+			error(errno, "cannot allocate memory");
+		}
+		node->dev = s->st_dev;
+		node->ino = s->st_ino;
+		node->next = seen_inodes[h];
+		seen_inodes[h] = node;
+	}
+	pthread_mutex_unlock(&inode_lock);
+
+	return found;
+}
+
+/* Look up the usage state of file s, optionally creating it. */
+struct fileuse *find_fileuse(dev_t dev, ino_t ino, int create)
+{
+	struct fileuse *use;
+	unsigned long h = inode_hash(dev, ino);
+
+	for(use=file_uses[h]; use!=NULL; use=use->next) {
+		if ( use->ino==ino && use->dev==dev ) return use;
+	}
+	if ( !create ) return NULL;
+
+	if ( (use = calloc(1, sizeof(struct fileuse)))==NULL ) {
+		error(errno, "cannot allocate memory");
+	}
+	use->dev = dev;
+	use->ino = ino;
+	use->next = file_uses[h];
+	file_uses[h] = use;
+
+	return use;
+}
+
+/* Count the use of file s in this run, returns the number of runs it
+   was used in. A changed file with a recycled inode starts anew. */
+long count_fileuse(const struct stat *s)
+{
+	struct fileuse *use;
+	long count;
+
+	pthread_mutex_lock(&fileuse_lock);
+	use = find_fileuse(s->st_dev, s->st_ino, 1);
+	if ( use->mtime!=(long long)s->st_mtime || use->size!=(long long)s->st_size ) {
+		use->mtime = s->st_mtime;
+		use->size = s->st_size;
+		use->count = 0;
+	}
+	if ( use->lastrun!=staterun || use->count==0 ) {
+		use->count++;
+		use->lastrun = staterun;
+	}
+	count = use->count;
+	pthread_mutex_unlock(&fileuse_lock);
+
+	return count;
+}
+
+/* Read the state file: a line `run <number>' followed by lines with
+   `<dev> <ino> <mtime> <size> <count> <lastrun>'. */
+void read_state(FILE *statefile)
+{
+	struct fileuse *use;
+	unsigned long long dev, ino;
+	long long mtime, size;
+	long count, lastrun;
+
+	staterun = 0;
+	if ( fscanf(statefile, "run %ld\n", &staterun)!=1 ) return;
+
+	while ( fscanf(statefile, "%llu %llu %lld %lld %ld %ld\n",
+	               &dev, &ino, &mtime, &size, &count, &lastrun)==6 ) {
+		use = find_fileuse((dev_t)dev, (ino_t)ino, 1);
+		use->mtime = mtime;
+		use->size = size;
+		use->count = count;
+		use->lastrun = lastrun;
+	}
+}
+
+/* Write the state of this run, dropping files not seen for a long time. */
+void write_state(FILE *statefile)
+{
+	struct fileuse *use;
+	int h;
+
+	fprintf(statefile, "run %ld\n", staterun);
+	for(h=0; h<INODE_HASH_SIZE; h++) {
+		for(use=file_uses[h]; use!=NULL; use=use->next) {
+			if ( use->lastrun<staterun-STATE_MAX_AGE ) continue;
+			fprintf(statefile, "%llu %llu %lld %lld %ld %ld\n",
+			        (unsigned long long)use->dev, (unsigned long long)use->ino,
+			        use->mtime, use->size, use->count, use->lastrun);
+		}
+	}
+}
+
+int match_patterns(char **patterns, int npatterns, const char *relpath, const char *name)
+{
+	int i;
+
+	for(i=0; i<npatterns; i++) {
+		if ( fnmatch(patterns[i], name, 0)==0 ||
+		     fnmatch(patterns[i], relpath, 0)==0 ) return 1;
+	}
+	return 0;
+}
+
+/* Returns whether file name in directory job with stat s should be
+   kept in the cache according to the patterns and usage policy. */
+int keep_file(struct dirjob *job, const char *name, const struct stat *s)
+{
+	char *relpath;
+	int keep = 0;
+
+	if ( ninclude>0 || nexclude>0 ) {
+		relpath = ( job->relpath[0]=='\0' ? strdup(name) : allocstr("%s/%s", job->relpath, name) );
+		if ( ninclude>0 && !match_patterns(include_patterns,ninclude,relpath,name) ) keep = 1;
+		if ( nexclude>0 &&  match_patterns(exclude_patterns,nexclude,relpath,name) ) keep = 1;
+		free(relpath);
+	}
+
+	if ( !keep && keep_hot>0 && count_fileuse(s)>keep_hot ) keep = 1;
+
+	return keep;
+}
+
+/* Add directory fd to the queue, unless it was already walked. */
+void queue_directory(int fd, char *path, int reloff)
+{
+	struct dirjob *job;
+	struct stat s;
+
+	if ( fstat(fd, &s)!=0 ) {
+		warning(errno, "Unable to stat directory: %s", path);
+		close(fd);
+		free(path);
+		return;
+	}
+	if ( inode_seen(&s) ) {
+		close(fd);
+		free(path);
+		return;
+	}
+
+	if ( (job = malloc(sizeof(struct dirjob)))==NULL ) {
+		error(errno, "cannot allocate memory");
+	}
+	job->fd = fd;
+	job->path = path;
+	job->reloff = reloff;
+	job->relpath = ( reloff>(int)strlen(path) ? "" : path + reloff );
+
+	pthread_mutex_lock(&queue_lock);
+	job->next = queue;
+	queue = job;
+	pending++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Evict file name relative to directory dirfd from the cache. */
+void evict_file(int dirfd, struct dirjob *job, const char *name,
+                struct walkstats *stats)
+{
+	const char *dirname = job->path;
+	struct stat s;
+	int fd;
+
+	/* Do not block on opening FIFOs or devices, these are skipped. */
+	fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if ( fd == -1 ) {
+		warning(errno, "Unable to open file: %s/%s", dirname, name);
+		return;
+	}
+	if ( fstat(fd, &s)!=0 ) {
+		warning(errno, "Unable to stat file: %s/%s", dirname, name);
+	} else if ( S_ISREG(s.st_mode) && (s.st_nlink<=1 || !inode_seen(&s)) ) {
+		if ( keep_file(job, name, &s) ) {
+			stats->nkept++;
+			if (be_verbose) logmsg(LOG_DEBUG, "Kept file: %s/%s", dirname, name);
+		} else if ( posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) ) {
+			warning(errno, "Unable to evict file: %s/%s", dirname, name);
+		} else {
+			stats->nfiles++;
+			stats->nbytes += s.st_size;
+			if (be_verbose) logmsg(LOG_DEBUG, "Evicted file: %s/%s", dirname, name);
+		}
+	}
+	if ( close(fd)!=0 ) {
+		warning(errno, "Unable to close file: %s/%s", dirname, name);
+	}
+}
+
+void evict_directory(struct dirjob *job, struct walkstats *stats)
+{
 	DIR *dir;
 	struct dirent *entry;
-	int fd;
-	char *entry_path;
 	struct stat s;
+	int fd, isdir;
 
-	dir = opendir(dirname);
-	if (dir != NULL) {
-		if (be_verbose) logmsg(LOG_INFO, "Evicting all files in directory: %s", dirname);
+	if ( (dir = fdopendir(job->fd))==NULL ) {
+		warning(errno, "Unable to open directory: %s", job->path);
+		close(job->fd);
+		return;
+	}
+	if (be_verbose) logmsg(LOG_INFO, "Evicting all files in directory: %s", job->path);
+	stats->ndirs++;
+
+	/* Read everything in the directory */
+	while ( (entry = readdir(dir)) != NULL ) {
+		/* skip over current/parent directory entries */
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
 
-		/* Read everything in the directory */
-		while ( (entry = readdir(dir)) != NULL ) {
-			/* skip over current/parent directory entries */
-			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+		/* Symlinks are followed, as stat() did before. */
+		if ( entry->d_type==DT_UNKNOWN || entry->d_type==DT_LNK ) {
+			if ( fstatat(dirfd(dir), entry->d_name, &s, 0) < 0 ) {
+				if (be_verbose) logerror(errno, "Unable to stat file/directory: %s/%s",
+				                         job->path, entry->d_name);
 				continue;
 			}
+			isdir = S_ISDIR(s.st_mode);
+		} else {
+			isdir = ( entry->d_type==DT_DIR );
+		}
 
-			/* Construct the full file path */
-			entry_path = allocstr("%s/%s", dirname, entry->d_name);
-
-			if (stat(entry_path, &s) < 0) {
-				if (be_verbose) logerror(errno, "Unable to stat file/directory: %s\n", entry_path);
-				free(entry_path);
+		if ( isdir ) {
+			/* Queue subdirectories for one of the workers */
+			fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if ( fd == -1 ) {
+				warning(errno, "Unable to open directory: %s/%s", job->path, entry->d_name);
 				continue;
 			}
-			if (S_ISDIR(s.st_mode)) {
-				/* Recurse into subdirectories */
-				evict_directory(entry_path);
-			} else {
-				/* evict this file from the cache */
-				fd = open(entry_path, O_RDONLY, 0);
-				if (fd == -1) {
-					warning(errno, "Unable to open file: %s", entry_path);
-				} else {
-					if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
-						warning(errno, "Unable to evict file: %s\n", entry_path);
-					}
-					if (be_verbose) logmsg(LOG_DEBUG, "Evicted file: %s", entry_path);
-					if ( close(fd)!=0 ) {
-						warning(errno, "Unable to close file: %s", entry_path);
-					}
-				}
-			}
-			free(entry_path);
+			queue_directory(fd, allocstr("%s/%s", job->path, entry->d_name),
+			                job->reloff);
+		} else {
+			evict_file(dirfd(dir), job, entry->d_name, stats);
 		}
-		if ( closedir(dir)!=0 ) {
-			warning(errno, "Unable to close directory: %s", dirname);
+	}
+	if ( closedir(dir)!=0 ) {
+		warning(errno, "Unable to close directory: %s", job->path);
+	}
+}
+
+void *walk_worker(void *arg)
+{
+	struct walkstats *stats = (struct walkstats *) arg;
+	struct dirjob *job;
+
+	while ( 1 ) {
+		pthread_mutex_lock(&queue_lock);
+		while ( queue==NULL && pending>0 ) {
+			pthread_cond_wait(&queue_cond, &queue_lock);
 		}
-	} else {
-		warning(errno, "Unable to open directory: %s", dirname);
+		if ( queue==NULL ) {
+			pthread_mutex_unlock(&queue_lock);
+			return NULL;
+		}
+		job = queue;
+		queue = job->next;
+		pthread_mutex_unlock(&queue_lock);
+
+		evict_directory(job, stats);
+		free(job->path);
+		free(job);
+
+		pthread_mutex_lock(&queue_lock);
+		if ( --pending==0 ) pthread_cond_broadcast(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
 	}
 }
 
 int main(int argc, char *argv[])
 {
-	int opt;
-	char* dirname;
+	int opt, i, fd, statefd = -1;
+	char *ptr;
+	FILE *statefile;
+	pthread_t threads[MAX_JOBS];
+	struct walkstats stats[MAX_JOBS];
 
 	progname = argv[0];
 
 	/* Parse command-line options */
-	be_verbose = show_help = show_version = 0;
+	be_verbose = show_help = show_version = run_async = 0;
+	njobs = 0;
 	opterr = 0;
-	while ( (opt = getopt_long(argc,argv,"+v",long_opts,(int *) 0))!=-1 ) {
+	while ( (opt = getopt_long(argc,argv,"+I:j:k:s:vx:",long_opts,(int *) 0))!=-1 ) {
 		switch ( opt ) {
 		case 0:   /* long-only option */
 			break;
+		case 'j': /* jobs option */
+			njobs = strtol(optarg, &ptr, 10);
+			if ( *ptr!='\0' || njobs<1 || njobs>MAX_JOBS ) {
+				error(0, "invalid number of jobs specified: `%s'", optarg);
+			}
+			break;
+		case 'I': /* include option */
+			if ( ninclude>=MAX_PATTERNS ) error(0, "too many include patterns");
+			include_patterns[ninclude++] = optarg;
+			break;
+		case 'x': /* exclude option */
+			if ( nexclude>=MAX_PATTERNS ) error(0, "too many exclude patterns");
+			exclude_patterns[nexclude++] = optarg;
+			break;
+		case 'k': /* keep-hot option */
+			keep_hot = strtol(optarg, &ptr, 10);
+			if ( *ptr!='\0' || keep_hot<0 ) {
+				error(0, "invalid number of runs specified: `%s'", optarg);
+			}
+			break;
+		case 's': /* state option */
+			statefilename = optarg;
+			break;
 		case 'v': /* verbose option */
 			be_verbose = 1;
 			verbose = LOG_DEBUG;
@@ -130,10 +529,79 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	/* directory to evict */
-	dirname = argv[optind];
+	/* In the background, eviction may overlap with the next runs, so
+	   do not let it compete for more than one CPU with them. */
+	if ( njobs==0 && run_async ) njobs = 1;
+	if ( njobs==0 ) {
+		njobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if ( njobs<1 ) njobs = 1;
+		if ( njobs>DEFAULT_MAX_JOBS ) njobs = DEFAULT_MAX_JOBS;
+	}
+
+	if ( keep_hot>0 && statefilename==NULL ) {
+		error(0, "option --keep-hot requires --state");
+	}
+
+	if ( run_async ) daemonize(NULL);
+
+	/* Lock the state file for the whole run, since concurrent runs
+	   would otherwise lose each other's updates. */
+	if ( statefilename!=NULL ) {
+		if ( (statefd = open(statefilename, O_RDWR | O_CREAT | O_CLOEXEC, 0640))==-1 ) {
+			error(errno, "cannot open state file `%s'", statefilename);
+		}
+		if ( flock(statefd, LOCK_EX)!=0 ) {
+			error(errno, "cannot lock state file `%s'", statefilename);
+		}
+		if ( (statefile = fdopen(dup(statefd), "r"))==NULL ) {
+			error(errno, "cannot read state file `%s'", statefilename);
+		}
+		read_state(statefile);
+		fclose(statefile);
+		staterun++;
+	}
+
+	/* directories to evict */
+	for(i=optind; i<argc; i++) {
+		fd = open(argv[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if ( fd == -1 ) {
+			warning(errno, "Unable to open directory: %s", argv[i]);
+			continue;
+		}
+		queue_directory(fd, strdup(argv[i]), strlen(argv[i])+1);
+	}
+
+	/* The main thread is worker 0. */
+	memset(stats, 0, sizeof(stats));
+	for(i=1; i<njobs; i++) {
+		if ( pthread_create(&threads[i], NULL, walk_worker, &stats[i])!=0 ) {
+			warning(0, "cannot create worker thread, using %d", i);
+			njobs = i;
+			break;
+		}
+	}
+	walk_worker(&stats[0]);
+	for(i=1; i<njobs; i++) {
+		pthread_join(threads[i], NULL);
+		stats[0].nfiles += stats[i].nfiles;
+		stats[0].nkept  += stats[i].nkept;
+		stats[0].ndirs  += stats[i].ndirs;
+		stats[0].nbytes += stats[i].nbytes;
+	}
+
+	if ( statefd>=0 ) {
+		if ( ftruncate(statefd, 0)!=0 || lseek(statefd, 0, SEEK_SET)!=0 ||
+		     (statefile = fdopen(statefd, "w"))==NULL ) {
+			error(errno, "cannot write state file `%s'", statefilename);
+		}
+		write_state(statefile);
+		if ( fclose(statefile)!=0 ) {
+			error(errno, "cannot write state file `%s'", statefilename);
+		}
+	}
 
-	evict_directory(dirname);
+	if (be_verbose) logmsg(LOG_INFO, "Evicted %ld files (%lld bytes) and kept %ld in %ld directories using %d threads",
+	                       stats[0].nfiles, stats[0].nbytes, stats[0].nkept, stats[0].ndirs, njobs);
 
 	return 0;
 }
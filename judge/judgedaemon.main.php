@@ -53,6 +53,19 @@ function setup_curl_handle(string $restuser, string $restpass)
     curl_setopt($curl_handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
     curl_setopt($curl_handle, CURLOPT_USERPWD, $restuser . ":" . $restpass);
     curl_setopt($curl_handle, CURLOPT_RETURNTRANSFER, true);
+    // Keep the connection to the domserver alive between requests. Use
+    // HTTP/2 over TLS when available, such that the prefetch transfers
+    // are multiplexed over a single connection; curl falls back to
+    // HTTP/1.1 otherwise.
+    curl_setopt($curl_handle, CURLOPT_TCP_KEEPALIVE, 1);
+    // Accept any compression of the responses that curl supports, so
+    // that the webserver can compress the (base64 encoded) testcase
+    // files in transfer if it is configured to.
+    curl_setopt($curl_handle, CURLOPT_ENCODING, '');
+    if (defined('CURL_HTTP_VERSION_2TLS')) {
+        curl_setopt($curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_setopt($curl_handle, CURLOPT_PIPEWAIT, true);
+    }
     return $curl_handle;
 }
 
@@ -71,12 +84,14 @@ function close_curl_handles()
  * Perform a request to the REST API and handle any errors.
  * $url is the part appended to the base DOMjudge $resturl.
  * $verb is the HTTP method to use: GET, POST, PUT, or DELETE
- * $data is the urlencoded data passed as GET or POST parameters.
+ * $data is the urlencoded data passed as GET or POST parameters, or
+ * for POST an array of fields (possibly CURLFile's) to send as
+ * multipart/form-data.
  * When $failonerror is set to false, any error will be turned into a
  * warning and null is returned.
  */
 $lastrequest = '';
-function request(string $url, string $verb = 'GET', string $data = '', bool $failonerror = true)
+function request(string $url, string $verb = 'GET', $data = '', bool $failonerror = true)
 {
     global $endpoints, $endpointID, $lastrequest;
 
@@ -141,13 +156,30 @@ function request(string $url, string $verb = 'GET', string $data = '', bool $fai
 }
 
 /**
- * Retrieve a value from the configuration through the REST API.
+ * Retrieve a value from the configuration through the REST API. All
+ * values are fetched at once and cached for CONFIG_CACHE_TTL seconds.
  */
 function dbconfig_get_rest(string $name)
 {
-    $res = request('config', 'GET', 'name=' . urlencode($name));
-    $res = dj_json_decode($res);
-    return $res[$name];
+    global $endpoints, $endpointID;
+
+    if (CONFIG_CACHE_TTL <= 0) {
+        $res = request('config', 'GET', 'name=' . urlencode($name));
+        $res = dj_json_decode($res);
+        return $res[$name];
+    }
+
+    $endpoint = &$endpoints[$endpointID];
+    if (!isset($endpoint['config']) || now() - $endpoint['config_time'] >= CONFIG_CACHE_TTL) {
+        $endpoint['config'] = dj_json_decode(request('config', 'GET', ''));
+        $endpoint['config_time'] = now();
+    }
+    if (!array_key_exists($name, $endpoint['config'])) {
+        $res = request('config', 'GET', 'name=' . urlencode($name));
+        $res = dj_json_decode($res);
+        $endpoint['config'][$name] = $res[$name];
+    }
+    return $endpoint['config'][$name];
 }
 
 /**
@@ -160,17 +192,55 @@ function dbconfig_get_rest(string $name)
  * - FALSE or -1: no size limit imposed
  */
 function rest_encode_file(string $file, $sizelimit = true) : string
+{
+    $maxsize = rest_size_limit($sizelimit);
+    return urlencode(base64_encode(dj_file_get_contents($file, $maxsize)));
+}
+
+/**
+ * Write the gzip compressed contents of $file to $dest for uploading
+ * it as a file to the REST API, without reading it into memory. The
+ * contents are limited in size as with rest_encode_file(). Returns the
+ * size of the compressed file.
+ */
+function rest_compress_file(string $file, string $dest, $sizelimit = true) : int
+{
+    $maxsize = rest_size_limit($sizelimit);
+    if (! is_readable($file)) {
+        error("File is not readable: $file");
+    }
+    $in = fopen($file, 'rb');
+    $out = fopen('compress.zlib://' . $dest, 'wb');
+    if ($in === false || $out === false) {
+        error("Could not compress '$file' to '$dest'");
+    }
+    if (stream_copy_to_stream($in, $out, $maxsize) === false ||
+        ($maxsize >= 0 && filesize($file) > $maxsize &&
+         fwrite($out, "\n[output storage truncated after $maxsize B]\n") === false)) {
+        error("Could not compress '$file' to '$dest'");
+    }
+    fclose($in);
+    if (!fclose($out)) {
+        error("Could not compress '$file' to '$dest'");
+    }
+    clearstatcache(true, $dest);
+    return filesize($dest);
+}
+
+/**
+ * Return the size limit in bytes for rest_encode_file(), or -1 for
+ * no limit.
+ */
+function rest_size_limit($sizelimit) : int
 {
     if ($sizelimit===true) {
-        $maxsize = (int) dbconfig_get_rest('output_storage_limit', 50000);
+        return (int) dbconfig_get_rest('output_storage_limit', 50000);
     } elseif ($sizelimit===false || $sizelimit==-1) {
-        $maxsize = -1;
+        return -1;
     } elseif (is_int($sizelimit) && $sizelimit>0) {
-        $maxsize = $sizelimit;
-    } else {
-        error("Invalid argument sizelimit = '$sizelimit' specified.");
+        return $sizelimit;
     }
-    return urlencode(base64_encode(dj_file_get_contents($file, $maxsize)));
+    error("Invalid argument sizelimit = '$sizelimit' specified.");
 }
 
 $waittime = 5;
@@ -178,6 +248,23 @@ $waittime = 5;
 define('SCRIPT_ID', 'judgedaemon');
 define('PIDFILE', RUNDIR.'/judgedaemon.pid');
 
+// Content-addressed testcase store, see fetchTestcase().
+define('TESTCASE_CACHE_DIR', JUDGEDIR . '/testcase-cache');
+
+// Deployed executables by md5sum, see fetch_executable().
+define('EXECUTABLE_CACHE_DIR', JUDGEDIR . '/executable-cache');
+
+// Compile results, see compile_cache_key().
+define('COMPILE_CACHE_DIR', JUDGEDIR . '/compile-cache');
+
+// Files per request to the domserver: PHP silently drops uploads over
+// its max_file_uploads setting, which defaults to 20.
+define('MAX_FILE_UPLOADS', 20);
+
+// md5sums of testcase files used by the current judging, which are
+// never pruned from the cache.
+$testcase_cache_pinned = array();
+
 function usage()
 {
     echo "Usage: " . SCRIPT_ID . " [OPTION]...\n" .
@@ -200,108 +287,130 @@ function read_judgehostlog(int $n = 20) : string
 // fetches new executable from database if necessary
 // runs build to compile executable
 // returns array with absolute path to run script and possibly error message
-function fetch_executable(
-    string $workdirpath, string $execid, string $md5sum, bool $combined_run_compare = false) : array
+//
+// Executables are stored by md5sum in EXECUTABLE_CACHE_DIR, shared by
+// all judgedaemons on this host, and deployed only once under a lock.
+// They are built in place, since build scripts may refer to their own
+// absolute path.
+function fetch_executable(string $execid, string $md5sum, bool $combined_run_compare = false) : array
 {
-    $execpath = "$workdirpath/executable/" . $execid;
-    $execmd5path = $execpath . "/md5sum";
+    if (empty($md5sum)) {
+        return array(null, "unknown executable '" . $execid . "' specified");
+    }
+    // The generated build script depends on combined_run_compare.
+    $execpath = EXECUTABLE_CACHE_DIR . "/" . $md5sum . ($combined_run_compare ? '-combined' : '');
+    $execrunpath = $execpath . "/run";
     $execdeploypath = $execpath . "/.deployed";
+
+    if (file_exists($execdeploypath)) {
+        return array($execrunpath, null);
+    }
+
+    if (($lock = fopen("$execpath.lock", 'c')) === false || !flock($lock, LOCK_EX)) {
+        error("Could not lock '$execpath.lock'");
+    }
+    // Another judgedaemon may have deployed it while we waited.
+    if (file_exists($execdeploypath)) {
+        $res = array($execrunpath, null);
+    } else {
+        $res = deploy_executable($execpath, $execid, $md5sum, $combined_run_compare);
+        if (!isset($res[1])) {
+            // Create file to mark executable successfully deployed.
+            touch($execdeploypath);
+        }
+    }
+    flock($lock, LOCK_UN);
+    fclose($lock);
+
+    return $res;
+}
+
+// downloads, unzips and builds executable $execid in $execpath
+// returns array like fetch_executable()
+function deploy_executable(string $execpath, string $execid, string $md5sum, bool $combined_run_compare) : array
+{
     $execbuildpath = $execpath . "/build";
     $execrunpath = $execpath . "/run";
     $execzippath = $execpath . "/executable.zip";
-    if (empty($md5sum)) {
-        return array(null, "unknown executable '" . $execid . "' specified");
+
+    logmsg(LOG_INFO, "Fetching new executable '" . $execid . "'");
+    if (file_exists($execpath)) {
+        system("rm -rf '$execpath'");
+    }
+    if (!mkdir($execpath, 0755, true)) {
+        error("Could not create directory '$execpath'");
+    }
+    $content = request(sprintf('executables/%s', $execid), 'GET', '');
+    $content = base64_decode(dj_json_decode($content));
+    if (file_put_contents($execzippath, $content) === false) {
+        error("Could not create executable zip file in $execpath");
+    }
+    unset($content);
+    if (md5_file($execzippath) !== $md5sum) {
+        error("Zip file corrupted during download.");
     }
-    if (!file_exists($execpath) || !file_exists($execmd5path) ||
-        !file_exists($execdeploypath) ||
-        dj_file_get_contents($execmd5path) !== $md5sum) {
-        logmsg(LOG_INFO, "Fetching new executable '" . $execid . "'");
-        system("rm -rf $execpath");
-        system("mkdir -p '$execpath'", $retval);
-        if ($retval!=0) {
-            error("Could not create directory '$execpath'");
-        }
-        $content = request(sprintf('executables/%s', $execid), 'GET', '');
-        $content = base64_decode(dj_json_decode($content));
-        if (file_put_contents($execzippath, $content) === false) {
-            error("Could not create executable zip file in $execpath");
-        }
-        unset($content);
-        if (md5_file($execzippath) !== $md5sum) {
-            error("Zip file corrupted during download.");
-        }
-        if (file_put_contents($execmd5path, $md5sum) === false) {
-            error("Could not write md5sum to file.");
-        }
 
-        logmsg(LOG_DEBUG, "Unzipping");
-        system("unzip -Z $execzippath | grep -q ^l", $retval);
-        if ($retval===0) {
-            error("Zipfile $execzippath contains symlinks");
-        }
-        system("unzip -j -q -d $execpath $execzippath", $retval);
-        if ($retval!=0) {
-            error("Could not unzip zipfile in $execpath");
-        }
+    logmsg(LOG_DEBUG, "Unzipping");
+    unzip_executable($execzippath, $execpath);
 
-        $do_compile = true;
-        if (!file_exists($execbuildpath)) {
-            if (file_exists($execrunpath)) {
-                // 'run' already exists, 'build' does not => don't compile anything
-                logmsg(LOG_DEBUG, "'run' exists without 'build', we are done");
-                $do_compile = false;
-            } else {
-                // detect lang and write build file
-                $langexts = array(
-                        'c' => array('c'),
-                        'cpp' => array('cpp', 'C', 'cc'),
-                        'java' => array('java'),
-                        'py' => array('py', 'py2', 'py3')
-                );
-                $buildscript = "#!/bin/sh\n\n";
-                $execlang = false;
-                $source = "";
-                foreach ($langexts as $lang => $langext) {
-                    if (($handle = opendir($execpath)) === false) {
-                        error("Could not open $execpath");
-                    }
-                    while (($file = readdir($handle)) !== false) {
-                        $ext = pathinfo($file, PATHINFO_EXTENSION);
-                        if (in_array($ext, $langext)) {
-                            $execlang = $lang;
-                            $source = $file;
-                            break;
-                        }
-                    }
-                    closedir($handle);
-                    if ($execlang !== false) {
+    $do_compile = true;
+    if (!file_exists($execbuildpath)) {
+        if (file_exists($execrunpath)) {
+            // 'run' already exists, 'build' does not => don't compile anything
+            logmsg(LOG_DEBUG, "'run' exists without 'build', we are done");
+            $do_compile = false;
+        } else {
+            // detect lang and write build file
+            $langexts = array(
+                    'c' => array('c'),
+                    'cpp' => array('cpp', 'C', 'cc'),
+                    'java' => array('java'),
+                    'py' => array('py', 'py2', 'py3')
+            );
+            $buildscript = "#!/bin/sh\n\n";
+            $execlang = false;
+            $source = "";
+            foreach ($langexts as $lang => $langext) {
+                if (($handle = opendir($execpath)) === false) {
+                    error("Could not open $execpath");
+                }
+                while (($file = readdir($handle)) !== false) {
+                    $ext = pathinfo($file, PATHINFO_EXTENSION);
+                    if (in_array($ext, $langext)) {
+                        $execlang = $lang;
+                        $source = $file;
                         break;
                     }
                 }
-                if ($execlang === false) {
-                    return array(null, "executable must either provide an executable file named 'build' or a C/C++/Java or Python file.");
-                }
-                switch ($execlang) {
-                case 'c':
-                    $buildscript .= "gcc -Wall -O2 -std=gnu99 '$source' -o $execrunpath -lm\n";
-                    break;
-                case 'cpp':
-                    $buildscript .= "g++ -Wall -O2 -std=c++11 '$source' -o $execrunpath\n";
-                    break;
-                case 'java':
-                    $source = basename($source, ".java");
-                    $buildscript .= "javac -cp $execpath -d $execpath '$source'.java\n";
-                    $buildscript .= "echo '#!/bin/sh' > run\n";
-                    // no main class detection here
-                    $buildscript .= "echo 'java -cp $execpath '$source' >> run\n";
-                    break;
-                case 'py':
-                    $buildscript .= "echo '#!/bin/sh' > run\n";
-                    $buildscript .= "echo 'python '$source' >> run\n";
+                closedir($handle);
+                if ($execlang !== false) {
                     break;
                 }
-                if ( $combined_run_compare ) {
-                    $buildscript .= <<<'EOT'
+            }
+            if ($execlang === false) {
+                return array(null, "executable must either provide an executable file named 'build' or a C/C++/Java or Python file.");
+            }
+            switch ($execlang) {
+            case 'c':
+                $buildscript .= "gcc -Wall -O2 -std=gnu99 '$source' -o $execrunpath -lm\n";
+                break;
+            case 'cpp':
+                $buildscript .= "g++ -Wall -O2 -std=c++11 '$source' -o $execrunpath\n";
+                break;
+            case 'java':
+                $source = basename($source, ".java");
+                $buildscript .= "javac -cp $execpath -d $execpath '$source'.java\n";
+                $buildscript .= "echo '#!/bin/sh' > run\n";
+                // no main class detection here
+                $buildscript .= "echo 'java -cp $execpath '$source' >> run\n";
+                break;
+            case 'py':
+                $buildscript .= "echo '#!/bin/sh' > run\n";
+                $buildscript .= "echo 'python '$source' >> run\n";
+                break;
+            }
+            if ( $combined_run_compare ) {
+                $buildscript .= <<<'EOT'
 mv run runjury
 
 cat <<'EOF' > run
@@ -341,42 +450,74 @@ FEEDBACK="$1"; shift
 
 # Run the program while redirecting its stdin/stdout to 'runjury' via
 # 'runpipe'. Note that "$@" expands to separate, quoted arguments.
-exec ../dj-bin/runpipe -M "$META" ./runjury "$TESTIN" "$TESTOUT" "$FEEDBACK" = "$@"
+exec ../dj-bin/runpipe ${RUNPIPE_RELAY:+-r} ${RUNPIPE_PIPE_SIZE:+-p "$RUNPIPE_PIPE_SIZE"} \
+	${RUNPIPE_IDLE_TIMEOUT:+-i "$RUNPIPE_IDLE_TIMEOUT"} -M "$META" ./runjury "$TESTIN" "$TESTOUT" "$FEEDBACK" = "$@"
 EOF
 
 chmod +x run
 
 EOT;
-                }
-                if (file_put_contents($execbuildpath, $buildscript) === false) {
-                    error("Could not write file 'build' in $execpath");
-                }
-                chmod($execbuildpath, 0755);
             }
-        } elseif (!is_executable($execbuildpath)) {
-            return array(null, "Invalid executable, file 'build' exists but is not executable.");
-        }
-
-        if ($do_compile) {
-            logmsg(LOG_DEBUG, "Compiling");
-            $olddir = getcwd();
-            chdir($execpath);
-            system("./build", $retval);
-            if ($retval!=0) {
-                return array(null, "Could not run ./build in $execpath");
+            if (file_put_contents($execbuildpath, $buildscript) === false) {
+                error("Could not write file 'build' in $execpath");
             }
-            chdir($olddir);
+            chmod($execbuildpath, 0755);
         }
-        if (!file_exists($execrunpath) || !is_executable($execrunpath)) {
-            return array(null, "Invalid build file, must produce an executable file 'run'.");
+    } elseif (!is_executable($execbuildpath)) {
+        return array(null, "Invalid executable, file 'build' exists but is not executable.");
+    }
+
+    if ($do_compile) {
+        logmsg(LOG_DEBUG, "Compiling");
+        $olddir = getcwd();
+        chdir($execpath);
+        system("./build", $retval);
+        chdir($olddir);
+        if ($retval!=0) {
+            return array(null, "Could not run ./build in $execpath");
         }
     }
-    // Create file to mark executable successfully deployed.
-    touch($execdeploypath);
+    if (!file_exists($execrunpath) || !is_executable($execrunpath)) {
+        return array(null, "Invalid build file, must produce an executable file 'run'.");
+    }
 
     return array($execrunpath, null);
 }
 
+// extracts all files of $zipfile into $dir without their directory
+// paths, like 'unzip -j', keeping their unix permissions
+function unzip_executable(string $zipfile, string $dir)
+{
+    $zip = new ZipArchive();
+    if ($zip->open($zipfile) !== true) {
+        error("Could not open zipfile $zipfile");
+    }
+    for ($i = 0; $i < $zip->numFiles; $i++) {
+        $name = $zip->getNameIndex($i);
+        if (substr($name, -1) === '/') {
+            continue;
+        }
+        $mode = 0644;
+        if ($zip->getExternalAttributesIndex($i, $opsys, $attr) && $opsys === ZipArchive::OPSYS_UNIX) {
+            if ((($attr >> 16) & 0170000) === 0120000) {
+                error("Zipfile $zipfile contains symlinks");
+            }
+            if ((($attr >> 16) & 0777) !== 0) {
+                $mode = ($attr >> 16) & 0777 & ~umask();
+            }
+        }
+        $dest = $dir . '/' . basename($name);
+        if (($in = $zip->getStream($name)) === false ||
+            ($out = fopen($dest, 'wb')) === false ||
+            stream_copy_to_stream($in, $out) === false ||
+            !fclose($out) || !chmod($dest, $mode)) {
+            error("Could not unzip '$name' from zipfile in $dir");
+        }
+        fclose($in);
+    }
+    $zip->close();
+}
+
 $options = getopt("dv:n:hV");
 // FIXME: getopt doesn't return FALSE on parse failure as documented!
 if ($options===false) {
@@ -458,11 +599,28 @@ if (defined('SYSLOG') && SYSLOG) {
 if (! posix_getpwnam($runuser)) {
     error("runuser $runuser does not exist.");
 }
-$output = array();
-exec("ps -u '$runuser' -o pid= -o comm=", $output, $retval);
-if (count($output) != 0) {
-    error("found processes still running as '$runuser', check manually:\n" .
-          implode("\n", $output));
+$testcase_runusers = testcase_runusers();
+check_runuser_processes();
+
+// A compile ahead runs concurrently with the testcases of the current
+// judging, so it runs as a dedicated user.
+$compileuser = $runuser . '-compile';
+if (COMPILE_AHEAD_CPUS !== '') {
+    if (! posix_getpwnam($compileuser)) {
+        error("compile user $compileuser does not exist.");
+    }
+    check_user_processes($compileuser);
+}
+
+// The streaming compare runs concurrently with the program, so it runs
+// as a dedicated user that cannot access the program or testdata.
+$streamuser = $runuser . '-compare';
+putenv('STREAM_USER=' . $streamuser);
+if (STREAM_COMPARE) {
+    if (! posix_getpwnam($streamuser)) {
+        error("stream compare user $streamuser does not exist.");
+    }
+    check_user_processes($streamuser);
 }
 
 logmsg(LOG_NOTICE, "Judge started on $myhost [DOMjudge/".DOMJUDGE_VERSION."]");
@@ -475,7 +633,11 @@ read_credentials();
 // unprivileged user.
 umask(0022);
 
+// Mount the chroot image first, such that it provides the chroot tree.
+define('CHROOT_IMAGE_HASH', USE_CHROOT && CHROOT_IMAGE ? mount_chroot_image() : '');
+
 // Warn when chroot has been disabled. This has security implications.
+define('USE_CHROOT_MOUNTS', USE_CHROOT && RUNGUARD_CHROOT_MOUNTS && is_dir(CHROOTDIR));
 if (! USE_CHROOT) {
     logmsg(LOG_WARNING, "Chroot disabled. This reduces judgehost security.");
 } else {
@@ -487,12 +649,34 @@ if (! USE_CHROOT) {
         }
         logmsg(LOG_WARNING, "Pre-built chroot tree '".CHROOTDIR.
                "' not found: using minimal chroot.");
+    } elseif (USE_CHROOT_MOUNTS) {
+        // Runguard mounts the chroot tree itself for each run.
+        define('CHROOT_SCRIPT', '');
     } else {
         define('CHROOT_SCRIPT', 'chroot-startstop.sh');
     }
 }
 
 
+if (WORKDIR_TMPFS_SIZE !== '' && !preg_match('/^[0-9]+[kmg%]?$/i', WORKDIR_TMPFS_SIZE)) {
+    error("Invalid WORKDIR_TMPFS_SIZE '" . WORKDIR_TMPFS_SIZE . "'");
+}
+
+// Create the testcase cache shared by all judgedaemons on this host.
+if (!is_dir(TESTCASE_CACHE_DIR) && !@mkdir(TESTCASE_CACHE_DIR, 0700, true) &&
+    !is_dir(TESTCASE_CACHE_DIR)) {
+    error("Could not create " . TESTCASE_CACHE_DIR);
+}
+if (COMPILE_CACHE && !is_dir(COMPILE_CACHE_DIR) && !@mkdir(COMPILE_CACHE_DIR, 0700, true) &&
+    !is_dir(COMPILE_CACHE_DIR)) {
+    error("Could not create " . COMPILE_CACHE_DIR);
+}
+// The run user needs access to run and compare scripts in here.
+if (!is_dir(EXECUTABLE_CACHE_DIR) && !@mkdir(EXECUTABLE_CACHE_DIR, 0755, true) &&
+    !is_dir(EXECUTABLE_CACHE_DIR)) {
+    error("Could not create " . EXECUTABLE_CACHE_DIR);
+}
+
 // Perform setup work for each endpoint we are communicating with
 foreach ($endpoints as $endpointID => $endpoint) {
     logmsg(LOG_NOTICE, "Registering judgehost on endpoint " . $endpoint['url']);
@@ -500,11 +684,12 @@ foreach ($endpoints as $endpointID => $endpoint) {
 
     // Create directory where to test submissions
     $workdirpath = JUDGEDIR . "/$myhost/endpoint-$endpointID";
-    system("mkdir -p $workdirpath/testcase", $retval);
+    system("mkdir -p $workdirpath", $retval);
     if ($retval != 0) {
         error("Could not create $workdirpath");
     }
-    chmod("$workdirpath/testcase", 0700);
+    // Remove tmpfs workdirs left behind by a previous judgedaemon.
+    umount_workdir_tmpfs($workdirpath);
 
     // Auto-register judgehost via REST
     // If there are any unfinished judgings in the queue in my name,
@@ -525,14 +710,16 @@ if (isset($options['daemon'])) {
 }
 
 // Constantly check API for unjudged submissions
+$compile_ahead = null;
 $endpointIDs = array_keys($endpoints);
 $currentEndpoint = 0;
 while (true) {
 
-    // If all endpoints are waiting, sleep for a bit
+    // If all endpoints are waiting, sleep for a bit, unless the
+    // domserver already waited for new submissions (long-poll).
     $dosleep = true;
     foreach ($endpoints as $id=>$endpoint) {
-        if ($endpoint["waiting"] == false) {
+        if ($endpoint["waiting"] == false || !empty($endpoint["longpolled"])) {
             $dosleep = false;
             break;
         }
@@ -582,8 +769,15 @@ while (true) {
     }
 
     // Request open submissions to judge. Any errors will be treated as
-    // non-fatal: we will just keep on retrying in this loop.
-    $judging = request(sprintf('judgehosts/next-judging/%s', urlencode($myhost)), 'POST', '', false);
+    // non-fatal: we will just keep on retrying in this loop. With a
+    // single endpoint, let the domserver wait for a new submission.
+    // A domserver that does not support this returns right away and
+    // we fall back to sleeping between requests.
+    $wait = count($endpoints) == 1 ? NEXT_JUDGING_WAIT : 0;
+    $request_start = now();
+    $judging = request_next_judging($wait);
+    $endpoints[$endpointID]["longpolled"] = $wait > 0 && !is_null($judging) &&
+                                            now() - $request_start >= $wait / 2;
     // If $judging is null, an error occurred; don't try to decode.
     if (!is_null($judging)) {
         $row = dj_json_decode($judging);
@@ -606,6 +800,19 @@ while (true) {
 
     judge($row);
 
+    // Judge the submissions compiled ahead, from the same endpoint.
+    while ($compile_ahead !== null) {
+        if ($exitsignalled && !$gracefulexitsignalled) {
+            compile_ahead_abort();
+            request('judgehosts', 'POST', 'hostname=' . urlencode($myhost));
+            break;
+        }
+        $row = $compile_ahead['row'];
+        logmsg(LOG_NOTICE, "Judging submission s$row[submitid] (endpoint $endpointID) ".
+               "(t$row[teamid]/p$row[probid]/$row[langid]), id j$row[judgingid]...");
+        judge($row);
+    }
+
     // Check if we were interrupted while judging, if so, exit(to avoid sleeping)
     if ($exitsignalled) {
         logmsg(LOG_NOTICE, "Received signal, exiting.");
@@ -641,6 +848,14 @@ function disable(string $kind, string $idcolumn, $id, string $description, int $
 
 function read_metadata(string $filename)
 {
+    // Prefer the JSON metadata that runguard writes atomically at exit.
+    if (is_readable($filename . '.json')) {
+        $metadata = dj_json_decode(dj_file_get_contents($filename . '.json'));
+        return array_map(function ($value) {
+            return is_array($value) ? array_map('strval', $value) : (string)$value;
+        }, $metadata);
+    }
+
     if (!is_readable($filename)) return null;
 
     // Don't quite treat it as YAML, but simply key/value pairs.
@@ -649,21 +864,145 @@ function read_metadata(string $filename)
     return spyc_load($contents);
 }
 
+/**
+ * Request the next judging to judge from the domserver, waiting at most
+ * $wait seconds for one. Errors are not fatal and return null. The
+ * testcase statistics are only needed for testcase_order().
+ */
+function request_next_judging($wait)
+{
+    global $myhost;
+
+    $data = array();
+    if ($wait > 0) {
+        $data['wait'] = (string)$wait;
+    }
+    if (FAIL_FAST_TESTCASE_ORDER) {
+        $data['testcase_stats'] = '1';
+    }
+    return request(sprintf('judgehosts/next-judging/%s', urlencode($myhost)), 'POST',
+                   http_build_query($data), false);
+}
+
+/**
+ * Send judging runs in multipart requests of at most MAX_FILE_UPLOADS
+ * files each. The outputs of each run are attached as gzip compressed
+ * files named 'run<i>_<field>' for the i-th run in the request; these
+ * are removed once sent.
+ */
 function send_unsent_judging_runs($unsent_judging_runs, $myhost, $judgingid) {
-    request(
-        sprintf('judgehosts/add-judging-run/%s/%s', urlencode($myhost),
-            urlencode((string)$judgingid)),
-        'POST',
-        'batch=' . json_encode($unsent_judging_runs)
+    $requests = array();
+    $nfiles = 0;
+    foreach ($unsent_judging_runs as $judging_run) {
+        $nfiles += count($judging_run['files']);
+        if (empty($requests) || $nfiles > MAX_FILE_UPLOADS) {
+            $requests[] = array();
+            $nfiles = count($judging_run['files']);
+        }
+        $requests[count($requests) - 1][] = $judging_run;
+    }
+
+    foreach ($requests as $judging_runs) {
+        $batch = array();
+        $data = array();
+        foreach ($judging_runs as $i => $judging_run) {
+            $batch[] = $judging_run['run'];
+            foreach ($judging_run['files'] as $field => $file) {
+                $data["run{$i}_$field"] = new CURLFile($file, 'application/gzip', "$field.gz");
+            }
+        }
+        $data['batch'] = json_encode($batch);
+
+        request(
+            sprintf('judgehosts/add-judging-run/%s/%s', urlencode($myhost),
+                urlencode((string)$judgingid)),
+            'POST',
+            $data
+        );
+
+        foreach ($judging_runs as $judging_run) {
+            foreach ($judging_run['files'] as $file) {
+                unlink($file);
+            }
+        }
+    }
+}
+
+/**
+ * Start a runguard server listening on a socket in $workdir and
+ * point testcase_run.sh to it. Returns the process resource, or null
+ * if the server could not be started, in which case a runguard
+ * process is started for each run instead.
+ */
+function start_runguard_server(string $workdir, &$pipes)
+{
+    global $runuser;
+
+    $socket = "$workdir/runguard.sock";
+    $cmd = 'sudo -n ' . escapeshellarg(BINDIR . '/runguard') .
+        ' --server=' . escapeshellarg($socket) .
+        ' --user=' . escapeshellarg($runuser) .
+        ' --group=' . escapeshellarg(RUNGROUP) .
+        ' --pool=' . (int)RUNGUARD_SERVER_POOL .
+        ' --cgroup-pool=' . (int)RUNGUARD_SERVER_CGROUP_POOL;
+    // Pool children are chrooted in advance, matching the (chroot)
+    // root that testcase_run.sh passes for the submission runs.
+    if (USE_CHROOT) {
+        $cmd .= ' --pool-root=' . escapeshellarg($workdir);
+        if (USE_CHROOT_MOUNTS) {
+            $cmd .= ' --chroot-mounts';
+        }
+    }
+    $descriptors = array(
+        0 => array('pipe', 'r'),
+        1 => array('file', "$workdir/runguard-server.err", 'a'),
+        2 => array('file', "$workdir/runguard-server.err", 'a')
     );
+    $process = proc_open($cmd, $descriptors, $pipes);
+    if ($process === false) {
+        warning("Could not start runguard server, using runguard per run.");
+        return null;
+    }
+
+    // Wait (at most one second) for the server socket to appear.
+    for ($i = 0; $i < 100 && !file_exists($socket); $i++) {
+        usleep(10000);
+    }
+    if (!file_exists($socket)) {
+        warning("Runguard server did not start, using runguard per run.");
+        stop_runguard_server($process, $pipes);
+        return null;
+    }
+
+    logmsg(LOG_DEBUG, "Started runguard server on '$socket'");
+    putenv('RUNGUARD_SOCKET=' . $socket);
+    return $process;
+}
+
+function stop_runguard_server($process, array $pipes)
+{
+    putenv('RUNGUARD_SOCKET');
+    if (isset($pipes[0])) {
+        fclose($pipes[0]);
+    }
+    proc_close($process);
 }
 
 function judge(array $row)
 {
     global $EXITCODES, $myhost, $options, $workdirpath, $exitsignalled, $gracefulexitsignalled;
+    global $testcase_cache_pinned, $compile_ahead, $testcase_runusers;
+
+    $testcase_cache_pinned = array();
+    $judging_start = now();
+    $labels = metrics_labels(array('language' => $row['langid']));
+    if (isset($row['submittime'])) {
+        metrics_send(array("queue_wait_seconds " . max(0, $judging_start - $row['submittime']) . " $labels"));
+    }
 
     // Set configuration variables for called programs
     putenv('USE_CHROOT='               . (USE_CHROOT ? '1' : ''));
+    putenv('CHROOT_MOUNTS='            . (USE_CHROOT_MOUNTS ? '1' : ''));
     putenv('CREATE_WRITABLE_TEMP_DIR=' . (CREATE_WRITABLE_TEMP_DIR ? '1' : ''));
     putenv('SCRIPTTIMELIMIT='          . dbconfig_get_rest('script_timelimit'));
     putenv('SCRIPTMEMLIMIT='           . dbconfig_get_rest('script_memory_limit'));
@@ -671,11 +1010,22 @@ function judge(array $row)
     putenv('MEMLIMIT='                 . $row['memlimit']);
     putenv('FILELIMIT='                . $row['outputlimit']);
     putenv('PROCLIMIT='                . dbconfig_get_rest('process_limit'));
+    putenv('IOMAXLIMIT='               . RUN_IO_MAX);
+    putenv('TIMING_PROFILE='           . (RUN_TIMING_PROFILE === 'smt' ? 'smt' : (RUN_TIMING_PROFILE ? '1' : '')));
+    putenv('RUNPIPE_RELAY='            . (RUNPIPE_RELAY ? '1' : ''));
+    putenv('RUNPIPE_PIPE_SIZE='        . (RUNPIPE_PIPE_SIZE > 0 ? RUNPIPE_PIPE_SIZE : ''));
+    putenv('RUNPIPE_IDLE_TIMEOUT='     . (RUNPIPE_IDLE_TIMEOUT > 0 ? RUNPIPE_IDLE_TIMEOUT : ''));
+    putenv('RECLAIM_CACHE='            . (EVICT_CGROUP_RECLAIM ? '1' : ''));
+    putenv('KILL_ON_OUTPUT_LIMIT='     . (KILL_ON_OUTPUT_LIMIT ? '1' : ''));
+    putenv('MEMORY_LIMIT_VERDICT='     . (MEMORY_LIMIT_VERDICT ? '1' : ''));
+    putenv('PHASE_TIMES='              . (JUDGEHOST_METRICS_SOCKET !== '' ? '1' : ''));
+    putenv('SYSCALL_PROFILE='          . (RUN_SYSCALL_PROFILE ? '1' : ''));
     if ($row['entry_point'] !== null) {
         putenv('ENTRY_POINT=' . $row['entry_point']);
     } else {
         putenv('ENTRY_POINT');
     }
+    putenv('RUNGUARD_SOCKET');
 
     // Query output storage limit (in database once for this judging.
     $output_storage_limit = (int) dbconfig_get_rest('output_storage_limit', 50000);
@@ -685,68 +1035,55 @@ function judge(array $row)
         $cpuset_opt = "-n ${options['daemonid']}";
     }
 
-    // create workdir for judging
-    $workdir = "$workdirpath/c$row[cid]-s$row[submitid]-j$row[judgingid]";
+    // Use the compile started while judging the previous submission.
+    $compile = null;
+    if ($compile_ahead !== null && $compile_ahead['row']['judgingid'] == $row['judgingid']) {
+        $compile = $compile_ahead;
+        $compile_ahead = null;
+    }
 
-    logmsg(LOG_INFO, "Working directory: $workdir");
+    // Release the tmpfs of the previous judging.
+    umount_workdir_tmpfs($workdirpath, $compile['workdir'] ?? null);
 
-    // If a database gets reset without removing the judging
-    // directories, we might hit an old directory: rename it.
-    if (file_exists($workdir)) {
-        $oldworkdir = $workdir . '-old-' . getmypid() . '-' . strftime('%Y-%m-%d_%H:%M');
-        if (!rename($workdir, $oldworkdir)) {
-            error("Could not rename stale working directory to '$oldworkdir'");
+    if ($compile === null) {
+        $compile = compile_setup($row);
+        if ($compile === null) {
+            return;
         }
-        @chmod($oldworkdir, 0700);
-        warning("Found stale working directory; renamed to '$oldworkdir'");
-    }
-
-    system("mkdir -p '$workdir/compile'", $retval);
-    if ($retval != 0) {
-        error("Could not create '$workdir/compile'");
     }
-
-    // Make sure the workdir is accessible for the domjudge-run user.
-    // Will be revoked again after this run finished.
-    chmod($workdir, 0755);
+    $workdir = $compile['workdir'];
+    logmsg(LOG_INFO, "Working directory: $workdir");
 
     if (!chdir($workdir)) {
         error("Could not chdir to '$workdir'");
     }
 
-    // Get the source code from the DB and store in local file(s)
-    $sources = request(sprintf('contests/%s/submissions/%s/source-code', $row['cid'], $row['submitid']), 'GET', '');
-    $sources = dj_json_decode($sources);
-    $files = array();
-    foreach ($sources as $source) {
-        $srcfile = "$workdir/compile/$source[filename]";
-        $files[] = "'$source[filename]'";
-        if (file_put_contents($srcfile, base64_decode($source['source'])) === false) {
-            error("Could not create $srcfile");
+    // Compile the program.
+    // Download the testcases while compiling, in the order to run them.
+    $row['testcases'] = testcase_order($row['testcases']);
+    prefetch_start($row);
+
+    $compile_cache_key = $compile['cache_key'];
+    $compile_cached = false;
+    if (!empty($compile['ahead'])) {
+        $retval = compile_ahead_wait($compile);
+        $compile_cached = $compile['cached'];
+    } elseif ($compile_cache_key !== null &&
+        ($retval = compile_cache_restore($compile_cache_key, $workdir)) !== null) {
+        logmsg(LOG_INFO, "Using cached compile result $compile_cache_key");
+        $compile_cached = true;
+    } else {
+        $compile_cpuset_opt = $cpuset_opt;
+        if (JUDGE_SCHEDULER_SOCKET !== '') {
+            $lease = scheduler_acquire(1, true);
+            $compile_cpuset_opt = "-n $lease[0]";
+        }
+        $retval = run_command(LIBJUDGEDIR . "/compile.sh $compile_cpuset_opt '$compile[execrunpath]' '$workdir' " .
+                              implode(' ', $compile['files']));
+        if (JUDGE_SCHEDULER_SOCKET !== '') {
+            scheduler_release($lease);
         }
     }
-    if (count($files)==0) {
-        error("No submission files could be downloaded.");
-    }
-
-    if (empty($row['compile_script'])) {
-        error("No compile script specified for language " . $row['langid'] . ".");
-    }
-
-    list($execrunpath, $error) = fetch_executable(
-        $workdirpath,
-        $row['compile_script'],
-        $row['compile_script_md5sum']
-    );
-    if (isset($error)) {
-        logmsg(LOG_ERR, "fetching executable failed for compile script '" . $row['compile_script'] . "':" . $error);
-        disable('language', 'langid', $row['langid'], $error, $row['judgingid'], (string)$row['cid']);
-        return;
-    }
-
-    // Compile the program.
-    system(LIBJUDGEDIR . "/compile.sh $cpuset_opt '$execrunpath' '$workdir' " .
-           implode(' ', $files), $retval);
 
     if (is_readable($workdir . '/compile.out')) {
         $compile_output = dj_file_get_contents($workdir . '/compile.out', 50000);
@@ -757,6 +1094,10 @@ function judge(array $row)
 
     // Try to read metadata from file
     $metadata = read_metadata($workdir . '/compile.meta');
+
+    // Track whether runguard could drop the page cache of all runs, so
+    // that the workdir need not be evicted file by file afterwards.
+    $cache_reclaimed = EVICT_CGROUP_RECLAIM && isset($metadata['cache-reclaimed']);
     if (isset($metadata['internal-error'])) {
         alert('error');
         if (is_array($metadata['internal-error'])) {
@@ -794,6 +1135,17 @@ function judge(array $row)
         return;
     }
     $compile_success = ($EXITCODES[$retval]==='correct');
+    if (!$compile_cached && isset($metadata['wall-time'])) {
+        metrics_send(array("compile_seconds " . $metadata['wall-time'] . " $labels"));
+    }
+
+    // Cache the result, except when it may have been caused by load on
+    // this host: a compile that timed out is tried again next time.
+    if ($compile_cache_key !== null && !$compile_cached &&
+        in_array($EXITCODES[$retval], array('correct', 'compiler-error')) &&
+        !(isset($metadata['time-result']) && strpos($metadata['time-result'], 'timelimit') !== false)) {
+        compile_cache_store($compile_cache_key, $workdir, $retval);
+    }
 
     // pop the compilation result back into the judging table
     $args = 'compile_success=' . $compile_success .
@@ -807,6 +1159,7 @@ function judge(array $row)
 
     // compile error: our job here is done
     if (! $compile_success) {
+        prefetch_stop();
         // revoke readablity for domjudge-run user to this workdir
         chmod($workdir, 0700);
         logmsg(LOG_NOTICE, "Judging s$row[submitid]/j$row[judgingid]: compile error");
@@ -822,8 +1175,31 @@ function judge(array $row)
         }
     }
 
+    // Compile the next submission while the testcases of this one run.
+    compile_ahead_start();
+
+    // Optionally start a runguard server for all testcases of this
+    // judging. It stops when we close its stdin pipe, which also
+    // happens automatically when returning from this function.
+    $runguard_pipes = array();
+    $parallel_cpus = testcase_parallel_cpus();
+    $parallel = count($testcase_runusers) > 0;
+    if (RUNGUARD_SERVER && !$parallel && JUDGE_SCHEDULER_SOCKET === '') {
+        $runguard_server = start_runguard_server($workdir, $runguard_pipes);
+    }
+
+    // Make the compiled program available read-only to all testcases.
+    // The prepared children of a runguard server cannot mount it for
+    // a run, so it is copied per testcase then.
+    $compile_shared = !isset($runguard_server);
+    if ($compile_shared) {
+        share_compile_dir($workdir);
+    }
+
     // Query timelimit overshoot here once for all testcases
     $overshoot = dbconfig_get_rest('timelimit_overshoot');
+    $hardtimelimit = $row['maxruntime'] +
+                     overshoot_time($row['maxruntime'], $overshoot);
 
     $totalcases = 0;
     $lastcase_correct = true;
@@ -831,13 +1207,23 @@ function judge(array $row)
     $last_sent = now();
     $outstanding_data = 0;
     $update_every_X_seconds = dbconfig_get_rest('update_judging_seconds');
-    foreach ($row['testcases'] as $tc) {
+
+    // In parallel mode, upcoming testcases are started on the free
+    // cores while all testcases so far were correct. $inflight holds
+    // these runs in the order of $testcases (rank order, unless
+    // reordered by testcase_order()); results are processed in that order.
+    $testcases = array_values($row['testcases']);
+    $nextcase = 0;
+    $inflight = array();
+    while (true) {
         // Check whether we have received an exit signal(but not a graceful exit signal)
         if (function_exists('pcntl_signal_dispatch')) {
             pcntl_signal_dispatch();
         }
         if ($exitsignalled && !$gracefulexitsignalled) {
             logmsg(LOG_NOTICE, "Received HARD exit signal, aborting current judging.");
+            testcase_cancel($inflight);
+            compile_ahead_abort();
 
             // Make sure the domserver knows that we didn't finish this judging
             $unfinished = request('judgehosts', 'POST', 'hostname=' . urlencode($myhost));
@@ -851,120 +1237,172 @@ function judge(array $row)
             break;
         }
 
-        if (!$lastcase_correct) {
-            // get the next testcase
-            $testcase = request(sprintf('testcases/next-to-judge/%s', $row['judgingid']), 'GET', '');
-            $tc = dj_json_decode($testcase);
-            if ($tc === null) {
-                $disabled = dj_json_encode(array(
-                    'kind' => 'problem',
-                    'probid' => $row['probid']));
-                $judgehostlog = read_judgehostlog();
-                $error_id = request(
-                    'judgehosts/internal-error',
-                    'POST',
-                    'judgingid=' . urlencode((string)$row['judgingid']) .
-                    '&cid=' . urlencode((string)$row['cid']) .
-                    '&description=' . urlencode("no test cases found") .
-                    '&judgehostlog=' . urlencode(base64_encode($judgehostlog)) .
-                    '&disabled=' . urlencode($disabled)
-                );
-                logmsg(LOG_ERR, "No testcases found for p$row[probid] => internal error " . $error_id);
-                break;
+        if ($lastcase_correct && $parallel) {
+            // Start the remaining testcases on the free slots, each with
+            // its own run user. With the judge scheduler, lease cores for
+            // these, waiting for one if none are running.
+            $free_slots = array_values(array_diff(array_keys($testcase_runusers),
+                                                  array_column($inflight, 'slot')));
+            $free_slots = array_slice($free_slots, 0, count($testcases) - $nextcase);
+            if (count($free_slots) == 0) {
+                $free_cpus = array();
+            } elseif (JUDGE_SCHEDULER_SOCKET === '') {
+                $free_cpus = array();
+                foreach ($free_slots as $slot) {
+                    $free_cpus[] = $parallel_cpus[$slot];
+                }
+            } else {
+                $free_cpus = scheduler_acquire(count($free_slots), count($inflight) == 0);
+            }
+            foreach ($free_cpus as $i => $cpu) {
+                $tc = $testcases[$nextcase++];
+                $run = testcase_prepare($row, $tc, $workdir, $workdirpath, "-n $cpu",
+                                        $hardtimelimit, $compile_shared, $free_slots[$i]);
+                if ($run === null) {
+                    if (JUDGE_SCHEDULER_SOCKET !== '') {
+                        scheduler_release(array_slice($free_cpus, $i));
+                    }
+                    testcase_cancel($inflight);
+                    return;
+                }
+                logmsg(LOG_DEBUG, "Starting testcase $tc[rank] on cpu $cpu...");
+                $run['cpu'] = $cpu;
+                $run['slot'] = $free_slots[$i];
+                $run['leased'] = JUDGE_SCHEDULER_SOCKET !== '';
+                $run['start'] = now();
+                $run['process'] = testcase_start($run['cmd']);
+                $inflight[] = $run;
+            }
+        }
+
+        if (count($inflight) > 0) {
+            if (!testcase_poll($inflight)) {
+                continue;
+            }
+            $run = array_shift($inflight);
+            $tc = $run['tc'];
+            $retval = $run['exitcode'];
+            if (count($inflight) == 0) {
+                check_runuser_processes();
+            }
+        } else {
+            if ($lastcase_correct) {
+                if ($nextcase >= count($testcases)) {
+                    break;
+                }
+                $tc = $testcases[$nextcase++];
+            } else {
+                // get the next testcase
+                $testcase = request(sprintf('testcases/next-to-judge/%s', $row['judgingid']), 'GET', '');
+                $tc = dj_json_decode($testcase);
+                if ($tc === null) {
+                    $disabled = dj_json_encode(array(
+                        'kind' => 'problem',
+                        'probid' => $row['probid']));
+                    $judgehostlog = read_judgehostlog();
+                    $error_id = request(
+                        'judgehosts/internal-error',
+                        'POST',
+                        'judgingid=' . urlencode((string)$row['judgingid']) .
+                        '&cid=' . urlencode((string)$row['cid']) .
+                        '&description=' . urlencode("no test cases found") .
+                        '&judgehostlog=' . urlencode(base64_encode($judgehostlog)) .
+                        '&disabled=' . urlencode($disabled)
+                    );
+                    logmsg(LOG_ERR, "No testcases found for p$row[probid] => internal error " . $error_id);
+                    break;
+                }
+
+                // empty means: no more testcases for this judging.
+                if (empty($tc)) {
+                    break;
+                }
             }
 
-            // empty means: no more testcases for this judging.
-            if (empty($tc)) {
-                break;
+            logmsg(LOG_DEBUG, "Running testcase $tc[rank]...");
+            $run_cpuset_opt = $cpuset_opt;
+            if (JUDGE_SCHEDULER_SOCKET !== '') {
+                $lease = scheduler_acquire(1, true);
+                $run_cpuset_opt = "-n $lease[0]";
+            }
+            $run = testcase_prepare($row, $tc, $workdir, $workdirpath, $run_cpuset_opt,
+                                    $hardtimelimit, $compile_shared);
+            if ($run !== null) {
+                $run['start'] = now();
+                $retval = run_command($run['cmd']);
+                $run['end'] = now();
+            }
+            if (JUDGE_SCHEDULER_SOCKET !== '') {
+                scheduler_release($lease);
+            }
+            if ($run === null) {
+                return;
             }
         }
 
         $totalcases++;
-        logmsg(LOG_DEBUG, "Running testcase $tc[rank]...");
-        $testcasedir = $workdir . "/testcase" . sprintf('%03d', $tc['rank']);
-        $tcfile = fetchTestcase($row, $workdirpath, $tc['rank']);
-        if ($tcfile === NULL) {
-            // error while fetching testcase
-            return;
+        $testcasedir = $run['testcasedir'];
+
+        // what does the exitcode mean?
+        if (! isset($EXITCODES[$retval])) {
+            alert('error');
+            error("Unknown exitcode from $run[testcase_run] for s$row[submitid], " .
+                  "testcase $tc[rank]: $retval");
         }
+        $result = $EXITCODES[$retval];
 
-        // Copy program with all possible additional files to testcase
-        // dir. Use hardlinks to preserve space with big executables.
-        $programdir = $testcasedir . '/execdir';
-        system("mkdir -p '$programdir'", $retval);
-        if ($retval!=0) {
-            error("Could not create directory '$programdir'");
+        // Try to read metadata from file
+        $runtime = null;
+        $metadata = read_metadata($testcasedir . '/program.meta');
+        if (!isset($metadata['cache-reclaimed'])) {
+            $cache_reclaimed = false;
         }
 
-        system("cp -PRl '$workdir'/compile/* '$programdir'", $retval);
-        if ($retval!=0) {
-            error("Could not copy program to '$programdir'");
-        }
-
-        // do the actual test-run
-        $hardtimelimit = $row['maxruntime'] +
-                         overshoot_time($row['maxruntime'], $overshoot);
-
-        list($run_runpath, $error) =
-            fetch_executable($workdirpath, $row['run'], $row['run_md5sum'], $row['combined_run_compare']);
-        if (isset($error)) {
-            logmsg(LOG_ERR, "fetching executable failed for run script '" . $row['run'] . "':" . $error);
-            disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
-            return;
-        }
-
-        if ($row['combined_run_compare']) {
-            // set to empty string to signal the testcase_run script that the
-            // run script also acts as compare script
-            $compare_runpath = '';
-        } else {
-            list($compare_runpath, $error) = fetch_executable($workdirpath, $row['compare'], $row['compare_md5sum']);
-            if (isset($error)) {
-                logmsg(LOG_ERR, "fetching executable failed for compare script '" . $row['compare'] . "':" . $error);
-                disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
-                return;
-            }
-        }
-
-        system(LIBJUDGEDIR . "/testcase_run.sh $cpuset_opt $tcfile[input] $tcfile[output] " .
-               "$row[maxruntime]:$hardtimelimit '$testcasedir' " .
-               "'$run_runpath' '$compare_runpath' '$row[compare_args]'", $retval);
-
-        // what does the exitcode mean?
-        if (! isset($EXITCODES[$retval])) {
-            alert('error');
-            error("Unknown exitcode from testcase_run.sh for s$row[submitid], " .
-                  "testcase $tc[rank]: $retval");
-        }
-        $result = $EXITCODES[$retval];
-
-        // Try to read metadata from file
-        $runtime = null;
-        $metadata = read_metadata($testcasedir . '/program.meta');
-
         if (isset($metadata['time-used'])) {
             $runtime = @$metadata[$metadata['time-used']];
         }
+        if (CHROOT_IMAGE_HASH !== '') {
+            $metadata['chroot-image'] = CHROOT_IMAGE_HASH;
+        }
 
         if ($result === 'compare-error') {
+            testcase_cancel($inflight);
             logmsg(LOG_ERR, "comparing failed for compare script '" . $row['compare'] . "'");
             disable('problem', 'probid', $row['probid'], "compare script '" . $row['compare'] . "' crashed", $row['judgingid'], (string)$row['cid']);
             return;
         }
 
         $lastcase_correct = $result === 'correct';
+        metrics_send_run($row, $run, $result, $metadata);
+
+        // Higher ranked runs still in flight are not needed anymore;
+        // they are judged again if the domserver hands them out.
+        if (!$lastcase_correct && count($inflight) > 0) {
+            testcase_cancel($inflight);
+            $inflight = array();
+        }
 
         $new_judging_run = array(
-            'testcaseid' => urlencode((string)$tc['testcaseid']),
-            'runresult' => urlencode($result),
-            'runtime' => urlencode((string)$runtime),
-            'output_run'   => rest_encode_file($testcasedir . '/program.out', false),
-            'output_error' => rest_encode_file($testcasedir . '/program.err', $output_storage_limit),
-            'output_system' => rest_encode_file($testcasedir . '/system.out', $output_storage_limit),
-            'output_diff'  => rest_encode_file($testcasedir . '/feedback/judgemessage.txt', $output_storage_limit)
+            'run' => array(
+                'testcaseid' => (string)$tc['testcaseid'],
+                'runresult' => $result,
+                'runtime' => (string)$runtime,
+                'metadata' => json_encode((object)($metadata ?? array())),
+            ),
+            'files' => array(),
         );
+        $outputs = array(
+            'output_run'    => array('program.out', false),
+            'output_error'  => array('program.err', $output_storage_limit),
+            'output_system' => array('system.out', $output_storage_limit),
+            'output_diff'   => array('feedback/judgemessage.txt', $output_storage_limit),
+        );
+        foreach ($outputs as $field => list($file, $sizelimit)) {
+            $upload = "$testcasedir/upload.$field.gz";
+            $outstanding_data += rest_compress_file("$testcasedir/$file", $upload, $sizelimit);
+            $new_judging_run['files'][$field] = $upload;
+        }
         $unsent_judging_runs[] = $new_judging_run;
-        $outstanding_data += strlen(var_export($new_judging_run, TRUE));
 
         $now = now();
         if (!$lastcase_correct
@@ -980,6 +1418,11 @@ function judge(array $row)
     if (!empty($unsent_judging_runs)) {
         send_unsent_judging_runs($unsent_judging_runs, $myhost, $row['judgingid']);
     }
+    prefetch_stop();
+
+    if (isset($runguard_server)) {
+        stop_runguard_server($runguard_server, $runguard_pipes);
+    }
 
     // revoke readablity for domjudge-run user to this workdir
     chmod($workdir, 0700);
@@ -993,10 +1436,23 @@ function judge(array $row)
         }
     }
 
-    // Evict all contents of the workdir from the kernel fs cache
-    system(LIBJUDGEDIR . "/evict $workdir", $retval);
-    if ($retval!=0) {
-        warning("evict script exited with exitcode $retval");
+    // Evict all contents of the workdir from the kernel fs cache,
+    // except for the data that is shared between judgings
+    $evict_opts = (EVICT_ASYNC ? "--async --jobs=1 " : "");
+    if (EVICT_KEEP_HOT > 0) {
+        $evict_opts .= "--keep-hot=" . EVICT_KEEP_HOT . " --state=$workdirpath/evict.state ";
+    }
+    if (WORKDIR_TMPFS_SIZE !== '') {
+        $total = disk_total_space($workdir);
+        logmsg(LOG_DEBUG, "Workdir tmpfs used " . ($total - disk_free_space($workdir)) .
+               " of $total bytes, not evicting workdir");
+    } elseif ($cache_reclaimed) {
+        logmsg(LOG_DEBUG, "Page cache of all runs reclaimed via cgroups, not evicting workdir");
+    } else {
+        system(LIBJUDGEDIR . "/evict $evict_opts$workdir", $retval);
+        if ($retval!=0) {
+            warning("evict script exited with exitcode $retval");
+        }
     }
 
     // Sanity check: need to have had at least one testcase
@@ -1004,51 +1460,1295 @@ function judge(array $row)
         logmsg(LOG_WARNING, "No testcases judged for s$row[submitid]/j$row[judgingid]!");
     }
 
+    metrics_send(array(
+        "judging_seconds " . (now() - $judging_start) . " $labels",
+        "judgings_total 1 $labels",
+    ));
+
     // done!
     logmsg(LOG_NOTICE, "Judging s$row[submitid]/j$row[judgingid] finished");
 }
 
 /**
+ * Samples are sent to the judgemetrics exporter as lines 'NAME VALUE
+ * LABELS' in one datagram, see JUDGEHOST_METRICS_SOCKET. Names are
+ * given without the 'domjudge_' prefix. Sending is best effort: when
+ * the exporter is not running, the samples are dropped.
  */
-function fetchTestcase(array $row, $workdirpath, $rank): array
+$metrics_socket = null;
+
+function metrics_send(array $samples)
 {
-    // Get both in- and output files, only if we didn't have them already.
-    $tcfile = array();
-    $fetched = array();
-    $tc = $row['testcases'][$rank];
-    foreach (array('input', 'output') as $inout) {
-        $tcfile[$inout] = "$workdirpath/testcase/testcase.$row[probid].$rank." .
-            $tc['md5sum_' . $inout] . "." . substr($inout, 0, -3);
-
-        if (!file_exists($tcfile[$inout])) {
-            $content = request(sprintf('testcases/%s/file/%s', $tc['testcaseid'], $inout), 'GET', '', FALSE);
-            if ($content === NULL) {
-                $error = 'Download of ' . $inout . ' failed for case ' . $tc['testcaseid'] . ', check your problem integrity.';
-                logmsg(LOG_ERR, $error);
-                disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
-                return NULL;
+    global $metrics_socket;
+
+    if (JUDGEHOST_METRICS_SOCKET === '' || count($samples) == 0) {
+        return;
+    }
+    if ($metrics_socket === null) {
+        $metrics_socket = @stream_socket_client('udg://' . JUDGEHOST_METRICS_SOCKET, $errno, $errstr);
+        if ($metrics_socket === false) {
+            $metrics_socket = null;
+            logmsg(LOG_DEBUG, "Could not connect to metrics exporter: $errstr");
+            return;
+        }
+        stream_set_blocking($metrics_socket, false);
+    }
+    $data = '';
+    foreach ($samples as $sample) {
+        $data .= "domjudge_$sample\n";
+    }
+    if (@fwrite($metrics_socket, $data) === false) {
+        // Reconnect next time, the exporter may have been restarted.
+        fclose($metrics_socket);
+        $metrics_socket = null;
+    }
+}
+
+function metrics_labels(array $labels) : string
+{
+    $pairs = array();
+    foreach ($labels as $name => $value) {
+        $pairs[] = $name . '="' . preg_replace('/[^a-zA-Z0-9_.+:\/-]/', '_', (string)$value) . '"';
+    }
+    return implode(',', $pairs);
+}
+
+/**
+ * Send the metrics of a testcase run from its runguard metadata.
+ */
+function metrics_send_run(array $row, array $run, string $result, $metadata)
+{
+    $labels = metrics_labels(array('language' => $row['langid']));
+    $samples = array(
+        "runs_total 1 " . metrics_labels(array('language' => $row['langid'], 'result' => $result)),
+    );
+    $keys = array(
+        'wall-time'    => 'run_wall_seconds',
+        'cpu-time'     => 'run_cpu_seconds',
+        'memory-bytes' => 'run_memory_bytes',
+        'exec-latency' => 'run_exec_latency_seconds',
+    );
+    foreach ($keys as $key => $name) {
+        if (isset($metadata[$key]) && is_numeric($metadata[$key])) {
+            $samples[] = "$name $metadata[$key] $labels";
+        }
+    }
+    if (isset($run['start'], $run['end'], $metadata['wall-time'])) {
+        $overhead = max(0, $run['end'] - $run['start'] - (float)$metadata['wall-time']);
+        $samples[] = "run_overhead_seconds $overhead $labels";
+    }
+    foreach ((array)$metadata as $key => $value) {
+        if (strncmp($key, 'phase-', 6) === 0 && is_numeric($value)) {
+            $samples[] = "run_phase_seconds $value " . metrics_labels(array('phase' => substr($key, 6)));
+        }
+    }
+    metrics_send($samples);
+}
+
+/**
+ * Create the working directory of the judging in $row, store its
+ * sources in there and fetch the compile script. Returns the compile
+ * to run, or null when the language was disabled.
+ */
+function compile_setup(array $row)
+{
+    global $workdirpath;
+
+    // create workdir for judging
+    $workdir = "$workdirpath/c$row[cid]-s$row[submitid]-j$row[judgingid]";
+
+    // If a database gets reset without removing the judging
+    // directories, we might hit an old directory: rename it.
+    if (file_exists($workdir)) {
+        $oldworkdir = $workdir . '-old-' . getmypid() . '-' . strftime('%Y-%m-%d_%H:%M');
+        if (!rename($workdir, $oldworkdir)) {
+            error("Could not rename stale working directory to '$oldworkdir'");
+        }
+        @chmod($oldworkdir, 0700);
+        warning("Found stale working directory; renamed to '$oldworkdir'");
+    }
+
+    if (WORKDIR_TMPFS_SIZE !== '') {
+        mount_workdir_tmpfs($workdir);
+    }
+
+    system("mkdir -p '$workdir/compile'", $retval);
+    if ($retval != 0) {
+        error("Could not create '$workdir/compile'");
+    }
+
+    // Make sure the workdir is accessible for the domjudge-run user.
+    // Will be revoked again after this run finished.
+    chmod($workdir, 0755);
+
+    // Get the source code from the DB and store in local file(s)
+    $sources = request(sprintf('contests/%s/submissions/%s/source-code', $row['cid'], $row['submitid']), 'GET', '');
+    $sources = dj_json_decode($sources);
+    $files = array();
+    foreach ($sources as $source) {
+        $srcfile = "$workdir/compile/$source[filename]";
+        $files[] = "'$source[filename]'";
+        if (file_put_contents($srcfile, base64_decode($source['source'])) === false) {
+            error("Could not create $srcfile");
+        }
+    }
+    if (count($files)==0) {
+        error("No submission files could be downloaded.");
+    }
+
+    if (empty($row['compile_script'])) {
+        error("No compile script specified for language " . $row['langid'] . ".");
+    }
+
+    list($execrunpath, $error) = fetch_executable(
+        $row['compile_script'],
+        $row['compile_script_md5sum']
+    );
+    if (isset($error)) {
+        logmsg(LOG_ERR, "fetching executable failed for compile script '" . $row['compile_script'] . "':" . $error);
+        disable('language', 'langid', $row['langid'], $error, $row['judgingid'], (string)$row['cid']);
+        return null;
+    }
+
+    return array(
+        'row'         => $row,
+        'workdir'     => $workdir,
+        'files'       => $files,
+        'execrunpath' => $execrunpath,
+        'cache_key'   => COMPILE_CACHE ? compile_cache_key($row, $sources) : null,
+    );
+}
+
+/**
+ * Claim the next judging and start compiling it in the background
+ * while the testcases of the current one run, see COMPILE_AHEAD_CPUS.
+ * The compile runs on these cores at a lower priority, so that it does
+ * not disturb the timing of the testcases. judge() picks it up when it
+ * is handed this judging next.
+ */
+function compile_ahead_start()
+{
+    global $compile_ahead, $compileuser, $myhost, $exitsignalled;
+
+    if (COMPILE_AHEAD_CPUS === '' || $compile_ahead !== null || $exitsignalled) {
+        return;
+    }
+    $judging = request_next_judging(0);
+    if (is_null($judging) || empty($row = dj_json_decode($judging))) {
+        return;
+    }
+    logmsg(LOG_NOTICE, "Compiling submission s$row[submitid] ahead " .
+           "(t$row[teamid]/p$row[probid]/$row[langid]), id j$row[judgingid]...");
+
+    $compile = compile_setup($row);
+    if ($compile === null) {
+        return;
+    }
+    $compile['ahead'] = true;
+    $compile['cached'] = false;
+    if ($compile['cache_key'] !== null &&
+        ($retval = compile_cache_restore($compile['cache_key'], $compile['workdir'])) !== null) {
+        logmsg(LOG_INFO, "Using cached compile result $compile[cache_key]");
+        $compile['cached'] = true;
+        $compile['exitcode'] = $retval;
+        $compile_ahead = $compile;
+        return;
+    }
+
+    // The environment is still set up for the current judging.
+    $cmd = 'env' . ($row['entry_point'] === null ? ' -u ENTRY_POINT' : '') .
+        ' RUNUSER=' . escapeshellarg($compileuser) .
+        ' MEMLIMIT=' . (int)$row['memlimit'] .
+        ($row['entry_point'] !== null ? ' ENTRY_POINT=' . escapeshellarg($row['entry_point']) : '') .
+        ' nice -n 10 ' . LIBJUDGEDIR . '/compile.sh -n ' . escapeshellarg(COMPILE_AHEAD_CPUS) .
+        " '$compile[execrunpath]' '$compile[workdir]' " . implode(' ', $compile['files']);
+    $compile['process'] = testcase_start($cmd);
+    $compile_ahead = $compile;
+}
+
+/**
+ * Wait for the compile started by compile_ahead_start() to finish,
+ * driving pending testcase prefetches, and return its exitcode.
+ */
+function compile_ahead_wait(array &$compile) : int
+{
+    global $compileuser;
+
+    while (!isset($compile['exitcode'])) {
+        $status = proc_get_status($compile['process']);
+        if (!$status['running']) {
+            // The exitcode is only reported by the first call after
+            // the process has exited.
+            $compile['exitcode'] = $status['exitcode'];
+            proc_close($compile['process']);
+            check_user_processes($compileuser);
+        } elseif (!prefetch_progress(0.01)) {
+            usleep(10000);
+        }
+    }
+    return $compile['exitcode'];
+}
+
+/**
+ * Stop a compile started ahead, when its judging will not be judged
+ * by us anymore.
+ */
+function compile_ahead_abort()
+{
+    global $compile_ahead, $compileuser;
+
+    if ($compile_ahead === null) {
+        return;
+    }
+    if (!isset($compile_ahead['exitcode'])) {
+        $status = proc_get_status($compile_ahead['process']);
+        if ($status['running']) {
+            posix_kill(-$status['pid'], SIGTERM);
+        }
+        proc_close($compile_ahead['process']);
+        check_user_processes($compileuser);
+    }
+    chmod($compile_ahead['workdir'], 0700);
+    logmsg(LOG_INFO, "Aborted compiling j" . $compile_ahead['row']['judgingid'] . " ahead");
+    $compile_ahead = null;
+}
+
+/**
+ * Compile results are cached in COMPILE_CACHE_DIR, keyed by a hash of
+ * everything that determines the output of compile.sh: the sources,
+ * the compile script, the entry point and the limits the compile
+ * script runs with. The chroot is included by its identity, since
+ * compiled programs may depend on the runtime environment in it. Each
+ * entry holds a copy of the compile dir (hardlinked), compile.out,
+ * compile.meta and the exitcode of compile.sh.
+ */
+function compile_cache_key(array $row, array $sources) : string
+{
+    $srcmd5s = array();
+    foreach ($sources as $source) {
+        $srcmd5s[$source['filename']] = md5(base64_decode($source['source']));
+    }
+    ksort($srcmd5s);
+
+    $chroot = '';
+    if (CHROOT_IMAGE_HASH !== '') {
+        $chroot = 'image:' . CHROOT_IMAGE_HASH;
+    } elseif (USE_CHROOT && ($st = @stat(CHROOTDIR)) !== false) {
+        $chroot = CHROOTDIR . ":$st[ino]:$st[mtime]";
+    }
+
+    return md5(json_encode(array(
+        'sources'        => $srcmd5s,
+        'compile_script' => $row['compile_script_md5sum'],
+        'entry_point'    => $row['entry_point'],
+        'memlimit'       => (string)$row['memlimit'],
+        'script_limits'  => array(getenv('SCRIPTTIMELIMIT'), getenv('SCRIPTMEMLIMIT'),
+                                  getenv('SCRIPTFILELIMIT')),
+        'chroot'         => $chroot,
+    )));
+}
+
+function compile_cache_path(string $key) : string
+{
+    return COMPILE_CACHE_DIR . '/' . substr($key, 0, 2) . '/' . $key;
+}
+
+/**
+ * Restore a cached compile result into $workdir. Returns the exitcode
+ * of compile.sh, or null if the result is not cached.
+ */
+function compile_cache_restore(string $key, string $workdir)
+{
+    $dir = compile_cache_path($key);
+    if (!is_readable("$dir/exitcode")) {
+        return null;
+    }
+    $link = (WORKDIR_TMPFS_SIZE === '' ? 'l' : '');
+    system("rm -rf '$workdir/compile' && cp -PR$link '$dir/compile' '$workdir/compile'", $retval);
+    if ($retval!=0 ||
+        !copy("$dir/compile.out", "$workdir/compile.out") ||
+        !copy("$dir/compile.meta", "$workdir/compile.meta")) {
+        error("Could not restore cached compile result from '$dir'");
+    }
+    return (int)dj_file_get_contents("$dir/exitcode");
+}
+
+/**
+ * Store the compile result in $workdir with compile.sh exitcode
+ * $retval in the cache. Entries are created under a temporary name
+ * and renamed into place, so concurrent judgedaemons never see
+ * incomplete ones.
+ */
+function compile_cache_store(string $key, string $workdir, int $retval)
+{
+    $dir = compile_cache_path($key);
+    if (is_dir($dir)) {
+        return;
+    }
+    $tmpdir = "$dir.new." . getmypid();
+    if (!is_dir(dirname($dir)) && !@mkdir(dirname($dir), 0700) && !is_dir(dirname($dir))) {
+        error("Could not create " . dirname($dir));
+    }
+    $link = (WORKDIR_TMPFS_SIZE === '' ? 'l' : '');
+    system("rm -rf '$tmpdir' && mkdir '$tmpdir' && cp -PR$link '$workdir/compile' '$tmpdir/compile'", $res);
+    if ($res!=0 ||
+        !copy("$workdir/compile.out", "$tmpdir/compile.out") ||
+        !copy("$workdir/compile.meta", "$tmpdir/compile.meta") ||
+        file_put_contents("$tmpdir/exitcode", (string)$retval) === false) {
+        warning("Could not store compile result in '$tmpdir'");
+        system("rm -rf '$tmpdir'");
+        return;
+    }
+    // Another judgedaemon may have stored the same result meanwhile.
+    if (!@rename($tmpdir, $dir)) {
+        system("rm -rf '$tmpdir'");
+    }
+}
+
+/**
+ * Testcase files are kept in a content-addressed store shared by all
+ * judgedaemons (and endpoints) on this host, keyed by md5sum. An index
+ * records the size and modification time at which each file was last
+ * verified, and when it was last used. Files are only checksummed
+ * again when these no longer match, and the least recently used files
+ * are removed when the store exceeds TESTCASE_CACHE_SIZE.
+ *
+ * The index is a log of lines "<md5sum> <size> <mtime> <lastused>",
+ * where later lines override earlier ones; it is compacted when
+ * pruning. All access is serialized with a lock file.
+ *
+ * With TESTCASE_CACHE_COMPRESS, files are stored compressed with zstd
+ * as "<md5sum>.zst", still keyed by the md5sum of the uncompressed
+ * contents. The testcase runners decompress these while reading them.
+ */
+function testcase_cache_path(string $md5sum) : string
+{
+    return TESTCASE_CACHE_DIR . '/' . substr($md5sum, 0, 2) . '/' . $md5sum .
+        (TESTCASE_CACHE_COMPRESS > 0 ? '.zst' : '');
+}
+
+/**
+ * Return the md5sum of the (uncompressed) contents of a cached
+ * testcase file, or false when it cannot be read.
+ */
+function testcase_cache_md5(string $cachefile)
+{
+    if (TESTCASE_CACHE_COMPRESS <= 0) {
+        return md5_file($cachefile);
+    }
+    $process = proc_open('exec zstd -dcq -- ' . escapeshellarg($cachefile),
+                         array(1 => array('pipe', 'w')), $pipes);
+    if ($process === false) {
+        return false;
+    }
+    $ctx = hash_init('md5');
+    while (!feof($pipes[1]) && ($data = fread($pipes[1], 1 << 20)) !== false) {
+        hash_update($ctx, $data);
+    }
+    fclose($pipes[1]);
+    if (proc_close($process) !== 0) {
+        return false;
+    }
+    return hash_final($ctx);
+}
+
+/**
+ * Write $content to the new file $file, compressed with zstd when
+ * TESTCASE_CACHE_COMPRESS is set. Returns false on errors.
+ */
+function testcase_cache_write(string $file, string $content) : bool
+{
+    if (TESTCASE_CACHE_COMPRESS <= 0) {
+        return file_put_contents($file, $content) !== false;
+    }
+    $process = proc_open('exec zstd -q -' . (int)TESTCASE_CACHE_COMPRESS . ' -o ' .
+                         escapeshellarg($file), array(0 => array('pipe', 'r')), $pipes);
+    if ($process === false) {
+        return false;
+    }
+    for ($pos = 0; $pos < strlen($content); $pos += $written) {
+        $written = fwrite($pipes[0], substr($content, $pos, 1 << 20));
+        if ($written === false || $written === 0) {
+            break;
+        }
+    }
+    fclose($pipes[0]);
+    return proc_close($process) === 0 && $pos >= strlen($content);
+}
+
+function testcase_cache_lock()
+{
+    $lock = fopen(TESTCASE_CACHE_DIR . '/index.lock', 'c');
+    if ($lock === false || !flock($lock, LOCK_EX)) {
+        error("Could not lock testcase cache index");
+    }
+    return $lock;
+}
+
+function testcase_cache_unlock($lock)
+{
+    flock($lock, LOCK_UN);
+    fclose($lock);
+}
+
+/**
+ * Read the index, returns an array md5sum => [size, mtime, lastused]
+ * and sets $nlines to the number of lines read. Call with lock held.
+ */
+function testcase_cache_read_index(&$nlines = 0) : array
+{
+    $index = array();
+    $nlines = 0;
+    $lines = @file(TESTCASE_CACHE_DIR . '/index', FILE_IGNORE_NEW_LINES | FILE_SKIP_EMPTY_LINES);
+    if ($lines === false) {
+        return $index;
+    }
+    foreach ($lines as $line) {
+        $fields = explode(' ', $line);
+        if (count($fields) != 4) {
+            continue;
+        }
+        $index[$fields[0]] = array((int)$fields[1], (int)$fields[2], (int)$fields[3]);
+        $nlines++;
+    }
+    return $index;
+}
+
+/**
+ * Record in the index that the file with $md5sum was verified to
+ * have the given stat information and was just used.
+ */
+function testcase_cache_record(string $md5sum, array $stat)
+{
+    $line = sprintf("%s %d %d %d\n", $md5sum, $stat['size'], $stat['mtime'], time());
+    if (file_put_contents(TESTCASE_CACHE_DIR . '/index', $line, FILE_APPEND) === false) {
+        error("Could not write testcase cache index");
+    }
+}
+
+/**
+ * Compact the index and remove least recently used files until the
+ * total size is at most TESTCASE_CACHE_SIZE. Call with lock held.
+ */
+function testcase_cache_prune()
+{
+    global $testcase_cache_pinned;
+
+    $index = testcase_cache_read_index();
+    $total = 0;
+    foreach ($index as $md5sum => $entry) {
+        if (!file_exists(testcase_cache_path($md5sum))) {
+            unset($index[$md5sum]);
+            continue;
+        }
+        $total += $entry[0];
+    }
+
+    if (TESTCASE_CACHE_SIZE > 0 && $total > TESTCASE_CACHE_SIZE) {
+        uasort($index, function ($a, $b) {
+            return $a[2] <=> $b[2];
+        });
+        foreach ($index as $md5sum => $entry) {
+            if ($total <= TESTCASE_CACHE_SIZE) {
+                break;
             }
-            $content = base64_decode(dj_json_decode($content));
-            if (file_put_contents($tcfile[$inout] . ".new", $content) === false) {
-                error("Could not create $tcfile[$inout].new");
+            if (isset($testcase_cache_pinned[$md5sum])) {
+                continue;
             }
-            unset($content);
-            if (md5_file("$tcfile[$inout].new") === $tc['md5sum_' . $inout]) {
-                rename("$tcfile[$inout].new", $tcfile[$inout]);
-            } else {
-                error("File corrupted during download.");
+            if (@unlink(testcase_cache_path($md5sum))) {
+                logmsg(LOG_DEBUG, "Removed testcase file $md5sum from cache");
+                $total -= $entry[0];
+                unset($index[$md5sum]);
             }
-            $fetched[] = $inout;
-        }
-        // sanity check (NOTE: performance impact is negligible with 5
-        // testcases and total 3.3 MB of data)
-        if (md5_file($tcfile[$inout]) !== $tc['md5sum_' . $inout]) {
-            error("File corrupted: md5sum mismatch: " . $tcfile[$inout]);
         }
     }
+
+    $contents = '';
+    foreach ($index as $md5sum => $entry) {
+        $contents .= "$md5sum $entry[0] $entry[1] $entry[2]\n";
+    }
+    $indexfile = TESTCASE_CACHE_DIR . '/index';
+    if (file_put_contents("$indexfile.new", $contents) === false ||
+        !rename("$indexfile.new", $indexfile)) {
+        error("Could not write testcase cache index");
+    }
+}
+
+/**
+ * Return the path of the cached testcase file with $md5sum, if it is
+ * present and intact, or null otherwise. Call with lock held.
+ */
+function testcase_cache_lookup(string $md5sum, array $index)
+{
+    $cachefile = testcase_cache_path($md5sum);
+    $stat = @stat($cachefile);
+    if ($stat === false) {
+        return null;
+    }
+    if (!isset($index[$md5sum]) ||
+        $index[$md5sum][0] != $stat['size'] || $index[$md5sum][1] != $stat['mtime']) {
+        if (testcase_cache_md5($cachefile) !== $md5sum) {
+            warning("Testcase file $cachefile corrupted, fetching it again");
+            unlink($cachefile);
+            return null;
+        }
+    }
+    testcase_cache_record($md5sum, $stat);
+    return $cachefile;
+}
+
+/**
+ * Store a downloaded testcase file with $md5sum in the cache and
+ * return its path. The caller must have verified the contents.
+ */
+function testcase_cache_store(string $md5sum, string $content) : string
+{
+    $cachefile = testcase_cache_path($md5sum);
+    $newfile = "$cachefile.new." . getmypid();
+    if (!is_dir(dirname($cachefile)) && !@mkdir(dirname($cachefile), 0700) &&
+        !is_dir(dirname($cachefile))) {
+        error("Could not create directory " . dirname($cachefile));
+    }
+    if (!testcase_cache_write($newfile, $content)) {
+        @unlink($newfile);
+        error("Could not create $newfile");
+    }
+    // Testcase files are hardlinked into the testcase directories,
+    // make sure they cannot be modified there.
+    chmod($newfile, 0444);
+
+    $lock = testcase_cache_lock();
+    if (!rename($newfile, $cachefile)) {
+        error("Could not rename $newfile to $cachefile");
+    }
+    clearstatcache(true, $cachefile);
+    testcase_cache_record($md5sum, stat($cachefile));
+    testcase_cache_prune();
+    testcase_cache_unlock($lock);
+
+    return $cachefile;
+}
+
+/**
+ * Testcase files of a judging that are not cached yet are downloaded
+ * in the background with up to TESTCASE_PREFETCH parallel transfers,
+ * starting before the submission is compiled. Transfers make progress
+ * while we wait for compile and testcase runs to finish, see
+ * run_command(), so each run only has to wait for its own files.
+ */
+$prefetch = null;
+
+function prefetch_start(array $row)
+{
+    global $prefetch, $endpoints, $endpointID;
+
+    prefetch_stop();
+    if (TESTCASE_PREFETCH <= 0 || !function_exists('curl_multi_init')) {
+        return;
+    }
+
+    $queue = array();
+    foreach ($row['testcases'] as $tc) {
+        foreach (array('input', 'output') as $inout) {
+            $md5sum = $tc['md5sum_' . $inout];
+            if (!isset($queue[$md5sum]) && !file_exists(testcase_cache_path($md5sum))) {
+                $queue[$md5sum] = sprintf('testcases/%s/file/%s', $tc['testcaseid'], $inout);
+            }
+        }
+    }
+    if (count($queue) == 0) {
+        return;
+    }
+    logmsg(LOG_INFO, "Prefetching " . count($queue) . " testcase files for problem p$row[probid]");
+
+    // The multi handle is kept per endpoint, to reuse its connections
+    // for the next judging.
+    if (!isset($endpoints[$endpointID]['multi'])) {
+        $multi = curl_multi_init();
+        if (defined('CURLPIPE_MULTIPLEX')) {
+            curl_multi_setopt($multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        }
+        $endpoints[$endpointID]['multi'] = $multi;
+    }
+
+    $prefetch = array(
+        'multi'   => $endpoints[$endpointID]['multi'],
+        'queue'   => $queue,
+        'pending' => array_fill_keys(array_keys($queue), true),
+        'active'  => array(),
+        'url'     => $endpoints[$endpointID]['url'],
+        'user'    => $endpoints[$endpointID]['user'],
+        'pass'    => $endpoints[$endpointID]['pass'],
+    );
+    prefetch_progress(0);
+}
+
+/**
+ * Drive the prefetch transfers, waiting at most $timeout seconds for
+ * activity. Returns whether transfers are still pending.
+ */
+function prefetch_progress(float $timeout) : bool
+{
+    global $prefetch;
+
+    if ($prefetch === null) {
+        return false;
+    }
+
+    // Start new transfers up to the parallelism limit.
+    while (count($prefetch['active']) < TESTCASE_PREFETCH && count($prefetch['queue']) > 0) {
+        $md5sum = key($prefetch['queue']);
+        $url = array_shift($prefetch['queue']);
+        $ch = setup_curl_handle($prefetch['user'], $prefetch['pass']);
+        curl_setopt($ch, CURLOPT_URL, $prefetch['url'] . '/' . $url);
+        curl_multi_add_handle($prefetch['multi'], $ch);
+        $prefetch['active'][(int)$ch] = array($ch, $md5sum);
+    }
+
+    if ($timeout > 0) {
+        curl_multi_select($prefetch['multi'], $timeout);
+    }
+    do {
+        $status = curl_multi_exec($prefetch['multi'], $running);
+    } while ($status == CURLM_CALL_MULTI_PERFORM);
+
+    while (($info = curl_multi_info_read($prefetch['multi'])) !== false) {
+        $ch = $info['handle'];
+        list(, $md5sum) = $prefetch['active'][(int)$ch];
+        unset($prefetch['active'][(int)$ch]);
+        unset($prefetch['pending'][$md5sum]);
+
+        $httpcode = curl_getinfo($ch, CURLINFO_HTTP_CODE);
+        $content = curl_multi_getcontent($ch);
+        curl_multi_remove_handle($prefetch['multi'], $ch);
+        curl_close($ch);
+
+        // On errors, fetchTestcase() will download and report it.
+        if ($info['result'] !== CURLE_OK || $httpcode < 200 || $httpcode >= 300) {
+            logmsg(LOG_DEBUG, "Prefetching testcase file $md5sum failed");
+            continue;
+        }
+        $content = base64_decode(dj_json_decode($content));
+        if (md5($content) !== $md5sum) {
+            logmsg(LOG_DEBUG, "Prefetched testcase file $md5sum corrupted");
+            continue;
+        }
+        testcase_cache_store($md5sum, $content);
+    }
+
+    if (count($prefetch['pending']) == 0) {
+        prefetch_stop();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait until a pending prefetch of the file with $md5sum is done.
+ */
+function prefetch_wait(string $md5sum)
+{
+    global $prefetch;
+
+    while ($prefetch !== null && isset($prefetch['pending'][$md5sum])) {
+        prefetch_progress(0.1);
+    }
+}
+
+function prefetch_stop()
+{
+    global $prefetch;
+
+    if ($prefetch === null) {
+        return;
+    }
+    foreach ($prefetch['active'] as $active) {
+        curl_multi_remove_handle($prefetch['multi'], $active[0]);
+        curl_close($active[0]);
+    }
+    $prefetch = null;
+}
+
+/**
+ * Run a shell command like system() and return its exitcode, while
+ * driving pending testcase prefetches.
+ */
+function run_command(string $cmd) : int
+{
+    global $prefetch;
+
+    if ($prefetch === null) {
+        system($cmd, $retval);
+        return $retval;
+    }
+
+    $process = proc_open($cmd, array(), $pipes);
+    if ($process === false) {
+        error("Could not run '$cmd'");
+    }
+    while (prefetch_progress(0.01)) {
+        $status = proc_get_status($process);
+        if (!$status['running']) {
+            proc_close($process);
+            return $status['exitcode'];
+        }
+    }
+    return proc_close($process);
+}
+
+/**
+ * Order the testcases of a judging to run those most likely to fail
+ * per second of runtime first, see FAIL_FAST_TESTCASE_ORDER. The
+ * domserver sends the number of runs, failures and total runtime of
+ * each testcase over all valid judgings. Testcases without failures
+ * keep their rank order after the others. Keys are preserved.
+ */
+function testcase_order(array $testcases) : array
+{
+    if (!FAIL_FAST_TESTCASE_ORDER) {
+        return $testcases;
+    }
+
+    // With lazy evaluation, the first of several results that share
+    // the highest priority determines the verdict, so it could change
+    // when testcases are reordered.
+    if (FAIL_FAST_TESTCASE_ORDER !== 'always') {
+        $prios = dbconfig_get_rest('results_prio');
+        $max = max($prios);
+        if (count(array_keys($prios, $max)) > 1) {
+            logmsg(LOG_DEBUG, "Results share the highest priority, keeping testcase rank order");
+            return $testcases;
+        }
+    }
+
+    $score = array();
+    foreach ($testcases as $key => $tc) {
+        $failures = $tc['failures'] ?? 0;
+        $runtime = max((float)($tc['runtime'] ?? 0), 0.001 * max((int)($tc['runs'] ?? 0), 1));
+        $score[$key] = $failures / $runtime;
+    }
+    uksort($testcases, function ($a, $b) use ($score, $testcases) {
+        return [$score[$b], $testcases[$a]['rank']] <=> [$score[$a], $testcases[$b]['rank']];
+    });
+    return $testcases;
+}
+
+/**
+ * With JUDGE_SCHEDULER_SOCKET, the cores for compiling and running are
+ * leased from the judgesched scheduler of this host for each run. The
+ * connection is kept open, since it holds the leases: these are
+ * returned automatically when the judgedaemon exits.
+ */
+$judge_scheduler = null;
+
+/**
+ * Send a command to the judge scheduler and return its reply. While
+ * waiting, testcase downloads progress and signals are handled.
+ */
+function scheduler_request(string $command) : string
+{
+    global $judge_scheduler;
+
+    if ($judge_scheduler === null) {
+        $judge_scheduler = @stream_socket_client('unix://' . JUDGE_SCHEDULER_SOCKET, $errno, $errstr);
+        if ($judge_scheduler === false) {
+            $judge_scheduler = null;
+            error("Could not connect to judge scheduler at '" . JUDGE_SCHEDULER_SOCKET . "': $errstr");
+        }
+    }
+    if (fwrite($judge_scheduler, "$command\n") === false) {
+        error("Lost connection to judge scheduler");
+    }
+    while (true) {
+        $read = array($judge_scheduler);
+        $write = $except = null;
+        if (@stream_select($read, $write, $except, 0, 100000) > 0) {
+            break;
+        }
+        if (function_exists('pcntl_signal_dispatch')) {
+            pcntl_signal_dispatch();
+        }
+        prefetch_progress(0);
+    }
+    $reply = fgets($judge_scheduler);
+    if ($reply === false) {
+        error("Lost connection to judge scheduler");
+    }
+    $reply = rtrim($reply, "\n");
+    if (strncmp($reply, 'error ', 6) === 0) {
+        error("Judge scheduler: " . substr($reply, 6));
+    }
+    return $reply;
+}
+
+/**
+ * Lease up to $max cores from the judge scheduler and return their
+ * CPU numbers. When $wait is set this waits for at least one,
+ * otherwise it may return none.
+ */
+function scheduler_acquire(int $max, bool $wait) : array
+{
+    $reply = scheduler_request(($wait ? 'acquire ' : 'try ') . $max);
+    $cpus = explode(' ', $reply);
+    if (array_shift($cpus) !== 'cores' || ($wait && count($cpus) == 0)) {
+        error("Unexpected reply from judge scheduler: '$reply'");
+    }
+    return $cpus;
+}
+
+function scheduler_release(array $cpus)
+{
+    if (count($cpus) > 0) {
+        scheduler_request('release ' . implode(' ', $cpus));
+    }
+}
+
+/**
+ * Return the list of CPU cores to run testcases on in parallel, or an
+ * empty array when testcases are run sequentially.
+ */
+function testcase_parallel_cpus() : array
+{
+    // Cores are leased from the judge scheduler while running instead.
+    if (JUDGE_SCHEDULER_SOCKET !== '') {
+        return array();
+    }
+    if (PARALLEL_TESTCASE_CPUS === '' || !function_exists('posix_kill')) {
+        return array();
+    }
+    $cpus = array_map('trim', explode(',', PARALLEL_TESTCASE_CPUS));
+    if (count($cpus) < 2) {
+        return array();
+    }
+    return $cpus;
+}
+
+/**
+ * Return the run users '<runuser>-t<slot>' of the slots to run testcases
+ * on in parallel, indexed by slot, or an empty array when testcases are
+ * run sequentially. Concurrent runs each have their own user, so that
+ * they cannot interfere with each other and stray processes are still
+ * detected per run. With the judge scheduler, there is a slot for each
+ * such user that exists.
+ */
+function testcase_runusers() : array
+{
+    global $runuser;
+
+    $users = array();
+    if (JUDGE_SCHEDULER_SOCKET !== '') {
+        if (function_exists('posix_kill')) {
+            for ($slot = 0; posix_getpwnam("$runuser-t$slot"); $slot++) {
+                $users[$slot] = "$runuser-t$slot";
+            }
+        }
+        if (count($users) < 2) {
+            logmsg(LOG_WARNING, "Fewer than two run users $runuser-tN exist, " .
+                   "running testcases one at a time.");
+            return array();
+        }
+        return $users;
+    }
+    foreach (array_keys(testcase_parallel_cpus()) as $slot) {
+        $users[$slot] = "$runuser-t$slot";
+        if (! posix_getpwnam($users[$slot])) {
+            error("runuser $users[$slot] for parallel testcases does not exist.");
+        }
+    }
+    return $users;
+}
+
+/**
+ * Mount a tmpfs of WORKDIR_TMPFS_SIZE on the (new) working directory
+ * of a judging, owned by us. Testcase files cannot be hardlinked from
+ * the testcase cache into it, so testcase_run copies them instead.
+ */
+function mount_workdir_tmpfs(string $workdir)
+{
+    if (!is_dir($workdir) && !mkdir($workdir, 0700, true)) {
+        error("Could not create '$workdir'");
+    }
+    system('sudo -n ' . LIBJUDGEDIR . '/mount-workdir-tmpfs.sh ' .
+           escapeshellarg(WORKDIR_TMPFS_SIZE) . " '$workdir' < /dev/null", $retval);
+    if ($retval!=0) {
+        error("Could not mount tmpfs on '$workdir'");
+    }
+}
+
+/**
+ * Unmount all workdir tmpfs mounts below $workdirpath, except that of
+ * $keep, discarding their contents.
+ */
+function umount_workdir_tmpfs(string $workdirpath, string $keep = null)
+{
+    if (WORKDIR_TMPFS_SIZE === '' || ($mounts = @file('/proc/mounts')) === false) {
+        return;
+    }
+    // Unmount in reverse order, in case mounts are stacked.
+    foreach (array_reverse($mounts) as $line) {
+        $fields = explode(' ', $line);
+        if (count($fields) < 3 || $fields[0] !== 'domjudge-workdir' || $fields[2] !== 'tmpfs') {
+            continue;
+        }
+        $dir = stripcslashes($fields[1]);
+        if (strpos($dir, "$workdirpath/") !== 0 || $dir === $keep) {
+            continue;
+        }
+        system("sudo -n umount '$dir' < /dev/null", $retval);
+        if ($retval!=0) {
+            error("Could not unmount tmpfs on '$dir'");
+        }
+        logmsg(LOG_DEBUG, "Unmounted workdir tmpfs '$dir'");
+    }
+}
+
+/**
+ * Make the compile dir of a judging accessible to the run user, such
+ * that testcases can use it directly instead of copying it: runguard
+ * bind mounts it read-only for each run, in the private mount namespace
+ * of that run.
+ */
+function share_compile_dir(string $workdir)
+{
+    $dir = "$workdir/compile";
+    // compile.sh revoked access for others, restore it as for the
+    // per testcase execdir copies.
+    if (!chmod($dir, 0755)) {
+        error("Could not make '$dir' accessible");
+    }
+}
+
+/**
+ * Loop mount the chroot image CHROOTDIR.img read-only on CHROOTDIR,
+ * unless another judgedaemon on this host did so already, and return
+ * its SHA-256 hash. This is read from the '.sha256' file written next
+ * to the image by dj_make_chroot and checked against the image when
+ * mounting it. The image may change while it stays mounted, so the
+ * checked hash is recorded together with the loop device in
+ * JUDGEDIR/chroot-image.mounted for the next judgedaemons.
+ */
+function mount_chroot_image() : string
+{
+    // This fixed path is the only one allowed in etc/sudoers-domjudge.
+    $image = CHROOTDIR . '.img';
+    $record = JUDGEDIR . '/chroot-image.mounted';
+    if (!is_file($image) || ($imagepath = realpath($image)) === false) {
+        error("Chroot image '$image' not found");
+    }
+    if (!is_dir(CHROOTDIR) && !mkdir(CHROOTDIR, 0755, true)) {
+        error("Could not create '" . CHROOTDIR . "'");
+    }
+    $chrootdir = realpath(CHROOTDIR);
+
+    // Serialize with other judgedaemons starting on this host.
+    if (($lock = fopen("$image.sha256", 'r')) === false || !flock($lock, LOCK_EX)) {
+        error("Could not open and lock '$image.sha256'");
+    }
+
+    $device = chroot_image_device($chrootdir);
+    if ($device === null) {
+        $hash = strtok(stream_get_contents($lock), " \n");
+        if (!preg_match('/^[0-9a-f]{64}$/', (string)$hash)) {
+            error("Invalid SHA-256 hash in '$image.sha256'");
+        }
+        logmsg(LOG_INFO, "Checking chroot image '$image'");
+        if (hash_file('sha256', $image) !== $hash) {
+            error("Chroot image '$image' does not match '$image.sha256'");
+        }
+        system("sudo -n mount -o loop,ro,nodev,nosuid '$image' '" . CHROOTDIR . "' < /dev/null", $retval);
+        if ($retval!=0 || ($device = chroot_image_device($chrootdir)) === null) {
+            error("Could not mount chroot image '$image' on '$chrootdir'");
+        }
+        if (file_put_contents($record, "$hash $device\n") === false) {
+            error("Could not write '$record'");
+        }
+        logmsg(LOG_NOTICE, "Mounted chroot image '$image' ($hash) on '$chrootdir'");
+    } else {
+        $backing = @file_get_contents('/sys/block/' . basename($device) . '/loop/backing_file');
+        if ($backing === false || rtrim($backing, "\n") !== $imagepath) {
+            error("'$chrootdir' is mounted from '$device' instead of '$image', " .
+                  "unmount it to use the chroot image");
+        }
+        // Only trust the hash recorded when this mount was made.
+        list($hash, $recorded_device) = explode(' ', trim((string)@file_get_contents($record))) + array('', '');
+        if (!preg_match('/^[0-9a-f]{64}$/', $hash) || $recorded_device !== $device) {
+            error("No hash recorded in '$record' for the chroot image mounted " .
+                  "from '$device' on '$chrootdir', unmount it to check the image");
+        }
+        logmsg(LOG_INFO, "Using chroot image '$image' ($hash) mounted on '$chrootdir'");
+    }
+
+    flock($lock, LOCK_UN);
+    fclose($lock);
+
+    return $hash;
+}
+
+/**
+ * Return the (loop) device mounted on $chrootdir, or null if none.
+ */
+function chroot_image_device(string $chrootdir)
+{
+    $device = null;
+    foreach (@file('/proc/mounts') ?: array() as $line) {
+        $fields = explode(' ', $line);
+        if (count($fields) >= 2 && stripcslashes($fields[1]) === $chrootdir) {
+            $device = $fields[0];
+        }
+    }
+    return $device;
+}
+
+/**
+ * Prepare the testcase directory of testcase $tc and return an array
+ * with the testcase_run command and directory, or null on errors
+ * after which the problem has been disabled.
+ */
+function testcase_prepare(array $row, array $tc, string $workdir, string $workdirpath,
+                          string $cpuset_opt, $hardtimelimit, bool $compile_shared,
+                          $slot = null)
+{
+    global $testcase_runusers;
+
+    $testcasedir = $workdir . "/testcase" . sprintf('%03d', $tc['rank']);
+    $tcfile = fetchTestcase($row, $workdirpath, $tc['rank']);
+    if ($tcfile === null) {
+        // error while fetching testcase
+        return null;
+    }
+
+    // Make the program with all possible additional files available
+    // in the testcase dir. A shared compile dir is bind mounted
+    // read-only on an empty execdir by runguard, only for the run, see
+    // EXECDIR_BIND in testcase_run.sh. Otherwise copy it, using
+    // hardlinks to preserve space with big executables.
+    $programdir = $testcasedir . '/execdir';
+    if (!is_dir($testcasedir) && !mkdir($testcasedir, 0700, true)) {
+        error("Could not create directory '$testcasedir'");
+    }
+    if ($compile_shared) {
+        if (!mkdir($programdir, 0755)) {
+            error("Could not create directory '$programdir'");
+        }
+        putenv("EXECDIR_BIND=$workdir/compile");
+    } else {
+        putenv('EXECDIR_BIND');
+        system("mkdir -p '$programdir'", $retval);
+        if ($retval!=0) {
+            error("Could not create directory '$programdir'");
+        }
+
+        system("cp -PRl '$workdir'/compile/* '$programdir'", $retval);
+        if ($retval!=0) {
+            error("Could not copy program to '$programdir'");
+        }
+    }
+
+    list($run_runpath, $error) =
+        fetch_executable($row['run'], $row['run_md5sum'], $row['combined_run_compare']);
+    if (isset($error)) {
+        logmsg(LOG_ERR, "fetching executable failed for run script '" . $row['run'] . "':" . $error);
+        disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
+        return null;
+    }
+
+    if ($row['combined_run_compare']) {
+        // set to empty string to signal the testcase_run script that the
+        // run script also acts as compare script
+        $compare_runpath = '';
+    } else {
+        list($compare_runpath, $error) = fetch_executable($row['compare'], $row['compare_md5sum']);
+        if (isset($error)) {
+            logmsg(LOG_ERR, "fetching executable failed for compare script '" . $row['compare'] . "':" . $error);
+            disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
+            return null;
+        }
+    }
+
+    // Pass the expected output hash to let identical output skip
+    // the compare script.
+    if (SKIP_COMPARE_ON_HASH_MATCH && !$row['combined_run_compare']) {
+        putenv('TESTOUT_MD5=' . $row['testcases'][$tc['rank']]['md5sum_output']);
+    } else {
+        putenv('TESTOUT_MD5');
+    }
+    putenv('STREAM_COMPARE=' . (STREAM_COMPARE && $row['compare'] === 'compare' ? '1' : ''));
+    // The default compare script reads the testdata sequentially, so
+    // compressed testdata can be streamed to it; others may seek.
+    putenv('TESTDATA_STREAMABLE=' . ($row['compare'] === 'compare' ? '1' : ''));
+
+    // A run in parallel slot $slot runs as the run user of that slot.
+    // Tell testcase_run that files shared between testcases of this
+    // judging may be in use by concurrent runs.
+    $env = '';
+    if ($slot !== null) {
+        $env = 'env RUNUSER=' . escapeshellarg($testcase_runusers[$slot]) . ' TESTCASE_PARALLEL=1 ';
+    }
+
+    $testcase_run = NATIVE_TESTCASE_RUN ? 'testcase_run' : 'testcase_run.sh';
+    $cmd = $env . LIBJUDGEDIR . "/$testcase_run $cpuset_opt $tcfile[input] $tcfile[output] " .
+        "$row[maxruntime]:$hardtimelimit '$testcasedir' " .
+        "'$run_runpath' '$compare_runpath' '$row[compare_args]'";
+
+    return array('tc' => $tc, 'testcasedir' => $testcasedir,
+                 'testcase_run' => $testcase_run, 'cmd' => $cmd);
+}
+
+/**
+ * Start a testcase run in the background, in its own process group
+ * so that it can be cancelled as a whole.
+ */
+function testcase_start(string $cmd)
+{
+    $process = proc_open("exec setsid $cmd", array(), $pipes);
+    if ($process === false) {
+        error("Could not run '$cmd'");
+    }
+    return $process;
+}
+
+/**
+ * Check the runs in flight for having finished, waiting briefly. Returns
+ * whether the first (lowest ranked) run has finished; its exitcode is
+ * then stored in the run.
+ */
+function testcase_poll(array &$inflight) : bool
+{
+    foreach ($inflight as $i => $run) {
+        if (isset($run['exitcode'])) {
+            continue;
+        }
+        $status = proc_get_status($run['process']);
+        if (!$status['running']) {
+            // The exitcode is only reported by the first call after
+            // the process has exited.
+            $inflight[$i]['exitcode'] = $status['exitcode'];
+            $inflight[$i]['end'] = now();
+            proc_close($run['process']);
+            if (!empty($run['leased'])) {
+                scheduler_release(array($run['cpu']));
+            }
+        }
+    }
+    if (isset($inflight[0]['exitcode'])) {
+        return true;
+    }
+
+    if (!prefetch_progress(0.01)) {
+        usleep(10000);
+    }
+    return false;
+}
+
+/**
+ * Cancel the runs in flight and wait for them to terminate. Their
+ * testcase directories are moved away, since the testcases may be
+ * handed out again for this judging.
+ */
+function testcase_cancel(array $inflight)
+{
+    if (count($inflight) == 0) {
+        return;
+    }
+    foreach ($inflight as $run) {
+        if (!isset($run['exitcode'])) {
+            $status = proc_get_status($run['process']);
+            if ($status['running']) {
+                posix_kill(-$status['pid'], SIGTERM);
+            }
+        }
+    }
+    foreach ($inflight as $run) {
+        if (!isset($run['exitcode'])) {
+            proc_close($run['process']);
+            if (!empty($run['leased'])) {
+                scheduler_release(array($run['cpu']));
+            }
+        }
+        logmsg(LOG_DEBUG, "Cancelled testcase " . $run['tc']['rank']);
+        $olddir = $run['testcasedir'] . '-cancelled-' . getmypid() . '-' . uniqid();
+        if (!rename($run['testcasedir'], $olddir)) {
+            error("Could not rename cancelled testcase directory to '$olddir'");
+        }
+    }
+    check_runuser_processes();
+}
+
+/**
+ * Check that no processes are left running as the run users.
+ */
+function check_runuser_processes()
+{
+    global $runuser, $testcase_runusers;
+
+    check_user_processes($runuser);
+    foreach ($testcase_runusers as $user) {
+        check_user_processes($user);
+    }
+}
+
+/**
+ * Check that no processes are left running as $user.
+ */
+function check_user_processes(string $user)
+{
+    $output = array();
+    exec("ps -u '$user' -o pid= -o comm=", $output, $retval);
+    if (count($output) != 0) {
+        error("found processes still running as '$user', check manually:\n" .
+              implode("\n", $output));
+    }
+}
+
+/**
+ * Get the testcase input and output files of testcase $rank from the
+ * cache, downloading them if necessary. Returns an array with paths
+ * of the 'input' and 'output' files, or null on download errors.
+ */
+function fetchTestcase(array $row, $workdirpath, $rank)
+{
+    global $testcase_cache_pinned;
+
+    $tcfile = array();
+    $fetched = array();
+    $tc = $row['testcases'][$rank];
+    foreach (array('input', 'output') as $inout) {
+        $md5sum = $tc['md5sum_' . $inout];
+        $testcase_cache_pinned[$md5sum] = true;
+
+        // Let a prefetch of this file finish first.
+        prefetch_wait($md5sum);
+
+        $lock = testcase_cache_lock();
+        $tcfile[$inout] = testcase_cache_lookup($md5sum, testcase_cache_read_index());
+        testcase_cache_unlock($lock);
+        if ($tcfile[$inout] !== null) {
+            continue;
+        }
+
+        // Download without holding the lock; concurrent downloads of
+        // the same file by other judgedaemons are harmless.
+        $cachefile = testcase_cache_path($md5sum);
+        $content = request(sprintf('testcases/%s/file/%s', $tc['testcaseid'], $inout), 'GET', '', false);
+        if ($content === null) {
+            $error = 'Download of ' . $inout . ' failed for case ' . $tc['testcaseid'] . ', check your problem integrity.';
+            logmsg(LOG_ERR, $error);
+            disable('problem', 'probid', $row['probid'], $error, $row['judgingid'], (string)$row['cid']);
+            return null;
+        }
+        $content = base64_decode(dj_json_decode($content));
+        if (md5($content) !== $md5sum) {
+            error("File corrupted during download.");
+        }
+        testcase_cache_store($md5sum, $content);
+        unset($content);
+
+        $tcfile[$inout] = $cachefile;
+        $fetched[] = $inout;
+    }
     // Only log downloading input and/or output testdata once.
     if (count($fetched) > 0) {
-        logmsg(LOG_INFO, "Fetched new " . implode($fetched, ',') .
+        logmsg(LOG_INFO, "Fetched new " . implode(',', $fetched) .
             " testcase $rank for problem p$row[probid]");
     }
     return $tcfile;
@@ -0,0 +1,492 @@
+/*
+   judgemetrics -- export judging metrics of a host to Prometheus.
+
+   Part of the DOMjudge Programming Contest Jury System and licensed
+   under the GNU GPL. See README and COPYING for details.
+
+
+   Program specifications:
+
+   The judgedaemons on a host send samples of their compiles, testcase
+   runs and judgings to this exporter as datagrams on a Unix socket.
+   The samples are aggregated into histograms and counters, which are
+   served over HTTP at /metrics in the Prometheus text format.
+
+   Each datagram holds one or more lines of the form
+
+     NAME VALUE [LABELS]
+
+   where NAME is one of the metrics in the table below, VALUE a number
+   and LABELS the optional label pairs as in the Prometheus format,
+   e.g. 'language="cpp",phase="exec"'. For histograms VALUE is
+   observed, counters are incremented by it. Sending never blocks the
+   judgedaemon: samples are dropped when this exporter is not running.
+
+   All memory is allocated at startup: there is a fixed number of
+   series, each histogram of which has the same number of buckets.
+   Samples of new series beyond that are dropped and counted in
+   domjudge_metrics_dropped_total.
+ */
+
+/* For accept4() and open_memstream() */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "lib.error.h"
+#include "lib.misc.h"
+
+#define PROGRAM "judgemetrics"
+#define VERSION DOMJUDGE_VERSION "/" REVISION
+
+/* Maximum number of series (metric and label combinations). */
+#define MAX_SERIES 1024
+
+/* Maximum length of the labels of a series. */
+#define MAX_LABELS 128
+
+/* Number of histogram buckets, each twice the previous bound. */
+#define NBUCKETS 20
+
+/* Maximum size of a datagram and of a HTTP request. */
+#define MAX_MSG 4096
+
+/* Timeout in seconds for reading a HTTP request. */
+#define HTTP_TIMEOUT 2
+
+const char *progname;
+
+int be_verbose;
+int show_help;
+int show_version;
+
+char *socketpath;
+
+enum metric_type { COUNTER, HISTOGRAM };
+
+struct metric {
+	const char *name;
+	enum metric_type type;
+	double first_bound;  /* upper bound of the first bucket */
+	const char *help;
+};
+
+#define SECONDS 0.001
+#define BYTES   65536
+
+const struct metric metrics[] = {
+	{ "domjudge_compile_seconds", HISTOGRAM, SECONDS,
+	  "Wall time of compiles, by language." },
+	{ "domjudge_run_wall_seconds", HISTOGRAM, SECONDS,
+	  "Wall time of testcase runs, by language." },
+	{ "domjudge_run_cpu_seconds", HISTOGRAM, SECONDS,
+	  "CPU time of testcase runs, by language." },
+	{ "domjudge_run_memory_bytes", HISTOGRAM, BYTES,
+	  "Peak memory usage of testcase runs, by language." },
+	{ "domjudge_run_exec_latency_seconds", HISTOGRAM, SECONDS,
+	  "Time from the start of runguard until the exec of the program." },
+	{ "domjudge_run_phase_seconds", HISTOGRAM, SECONDS,
+	  "Time spent in each phase of runguard, see its --phase-times." },
+	{ "domjudge_run_overhead_seconds", HISTOGRAM, SECONDS,
+	  "Wall time of testcase runs outside of the program, by language." },
+	{ "domjudge_queue_wait_seconds", HISTOGRAM, SECONDS,
+	  "Time from submission until the start of its judging." },
+	{ "domjudge_judging_seconds", HISTOGRAM, SECONDS,
+	  "Wall time of judgings on this host, by language." },
+	{ "domjudge_runs_total", COUNTER, 0,
+	  "Number of testcase runs, by language and result." },
+	{ "domjudge_judgings_total", COUNTER, 0,
+	  "Number of judgings finished, by language." },
+};
+
+#define NMETRICS ((int)(sizeof(metrics)/sizeof(metrics[0])))
+
+struct series {
+	int metric;
+	char labels[MAX_LABELS];
+	unsigned long buckets[NBUCKETS];  /* not cumulative */
+	unsigned long count;
+	double sum;
+};
+
+struct series *series;
+int nseries;
+unsigned long dropped;
+
+volatile sig_atomic_t received_signal;
+
+struct option const long_opts[] = {
+	{"socket",  required_argument, NULL,          's'},
+	{"listen",  required_argument, NULL,          'l'},
+	{"verbose", no_argument,       NULL,          'v'},
+	{"help",    no_argument,       &show_help,    1 },
+	{"version", no_argument,       &show_version, 1 },
+	{ NULL,     0,                 NULL,          0 }
+};
+
+void usage()
+{
+	printf("\
+Usage: %s [OPTION]...\n\
+Aggregate metrics sent by the judgedaemons of this host and serve them\n\
+to Prometheus.\n\
+\n\
+  -s, --socket=FILE    receive samples on Unix datagram socket FILE (required)\n\
+  -l, --listen=[ADDR:]PORT  serve /metrics over HTTP on PORT (default: 9101)\n\
+  -v, --verbose        display some extra warnings and information\n\
+      --help           display this help and exit\n\
+      --version        output version information and exit\n\
+\n\
+Configure the judgedaemons with JUDGEHOST_METRICS_SOCKET.\n\
+\n", progname);
+	exit(0);
+}
+
+void terminate(int sig)
+{
+	received_signal = sig;
+}
+
+int find_metric(const char *name)
+{
+	int i;
+
+	for(i=0; i<NMETRICS; i++) {
+		if ( strcmp(metrics[i].name, name)==0 ) return i;
+	}
+	return -1;
+}
+
+/* Return the series of metric m with these labels, adding it if it
+ * does not exist yet, or NULL when there is no room. */
+struct series *find_series(int m, const char *labels)
+{
+	int i;
+
+	for(i=0; i<nseries; i++) {
+		if ( series[i].metric==m && strcmp(series[i].labels, labels)==0 ) {
+			return &series[i];
+		}
+	}
+	if ( nseries>=MAX_SERIES ) return NULL;
+
+	memset(&series[nseries], 0, sizeof(struct series));
+	series[nseries].metric = m;
+	strcpy(series[nseries].labels, labels);
+	return &series[nseries++];
+}
+
+/* Labels are copied verbatim into the output, so only accept the
+ * characters of simple label pairs. */
+int valid_labels(const char *labels)
+{
+	if ( strlen(labels)>=MAX_LABELS ) return 0;
+	return strspn(labels, "abcdefghijklmnopqrstuvwxyz"
+	              "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_=\",.+-:/ ")==strlen(labels);
+}
+
+void add_sample(char *line)
+{
+	struct series *s;
+	char *name, *value, *labels, *ptr, *end;
+	double v, bound;
+	int m, i;
+
+	name = strtok_r(line, " ", &ptr);
+	value = strtok_r(NULL, " ", &ptr);
+	if ( name==NULL || value==NULL ) return;
+	labels = ptr==NULL ? "" : ptr;
+
+	v = strtod(value, &end);
+	if ( *end!=0 || v<0 || (m = find_metric(name))<0 || !valid_labels(labels) ) {
+		logmsg(LOG_DEBUG, "ignoring invalid sample '%s %s %s'", name, value, labels);
+		return;
+	}
+
+	if ( (s = find_series(m, labels))==NULL ) {
+		dropped++;
+		return;
+	}
+	s->count++;
+	s->sum += v;
+	if ( metrics[m].type==HISTOGRAM ) {
+		bound = metrics[m].first_bound;
+		for(i=0; i<NBUCKETS && v>bound; i++) bound *= 2;
+		if ( i<NBUCKETS ) s->buckets[i]++;
+	}
+}
+
+void read_samples(int fd)
+{
+	char msg[MAX_MSG+1], *line, *ptr;
+	ssize_t len;
+
+	while ( (len = recv(fd, msg, MAX_MSG, MSG_DONTWAIT))>=0 ) {
+		msg[len] = 0;
+		for(line=strtok_r(msg, "\n", &ptr); line!=NULL; line=strtok_r(NULL, "\n", &ptr)) {
+			add_sample(line);
+		}
+	}
+	if ( errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR ) {
+		warning(errno, "receiving samples");
+	}
+}
+
+/* Return the labels of s in braces, or nothing without labels. */
+const char *braced(const struct series *s)
+{
+	static char buf[MAX_LABELS+2];
+
+	if ( s->labels[0]==0 ) return "";
+	snprintf(buf, sizeof(buf), "{%s}", s->labels);
+	return buf;
+}
+
+/* Write the metrics in the Prometheus text format to f. */
+void write_metrics(FILE *f)
+{
+	const struct metric *met;
+	unsigned long cum;
+	double bound;
+	const char *sep;
+	int m, i, j;
+
+	for(m=0; m<NMETRICS; m++) {
+		met = &metrics[m];
+		fprintf(f, "# HELP %s %s\n", met->name, met->help);
+		fprintf(f, "# TYPE %s %s\n", met->name,
+		        met->type==HISTOGRAM ? "histogram" : "counter");
+		for(i=0; i<nseries; i++) {
+			if ( series[i].metric!=m ) continue;
+			if ( met->type==COUNTER ) {
+				fprintf(f, "%s%s %.17g\n", met->name, braced(&series[i]), series[i].sum);
+				continue;
+			}
+			sep = series[i].labels[0]!=0 ? "," : "";
+			cum = 0;
+			bound = met->first_bound;
+			for(j=0; j<NBUCKETS; j++, bound*=2) {
+				cum += series[i].buckets[j];
+				fprintf(f, "%s_bucket{%s%sle=\"%g\"} %lu\n",
+				        met->name, series[i].labels, sep, bound, cum);
+			}
+			fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+			        met->name, series[i].labels, sep, series[i].count);
+			fprintf(f, "%s_sum%s %.17g\n", met->name, braced(&series[i]), series[i].sum);
+			fprintf(f, "%s_count%s %lu\n", met->name, braced(&series[i]), series[i].count);
+		}
+	}
+	fprintf(f, "# HELP domjudge_metrics_dropped_total Samples dropped for lack of series.\n");
+	fprintf(f, "# TYPE domjudge_metrics_dropped_total counter\n");
+	fprintf(f, "domjudge_metrics_dropped_total %lu\n", dropped);
+}
+
+void send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t res;
+
+	while ( len>0 ) {
+		res = write(fd, buf, len);
+		if ( res<0 ) {
+			if ( errno==EINTR ) continue;
+			logmsg(LOG_DEBUG, "cannot write HTTP response: %s", strerror(errno));
+			return;
+		}
+		buf += res;
+		len -= res;
+	}
+}
+
+/* Handle a single HTTP request on fd and close it. Requests are small
+ * and few, so these are handled synchronously with a timeout. */
+void serve_http(int fd)
+{
+	struct timeval tv;
+	char req[MAX_MSG+1], *body, *hdr;
+	size_t len = 0, bodylen;
+	ssize_t nread;
+	FILE *f;
+
+	tv.tv_sec = HTTP_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Only the request line is needed, but read the complete headers
+	 * so the client does not get a reset. */
+	req[0] = 0;
+	while ( len<MAX_MSG && strstr(req, "\r\n\r\n")==NULL && strstr(req, "\n\n")==NULL ) {
+		nread = read(fd, req+len, MAX_MSG-len);
+		if ( nread<0 && errno==EINTR ) continue;
+		if ( nread<=0 ) break;
+		len += nread;
+		req[len] = 0;
+	}
+
+	if ( strncmp(req, "GET /metrics ", 13)==0 || strncmp(req, "GET / ", 6)==0 ) {
+		if ( (f = open_memstream(&body, &bodylen))==NULL ) {
+			error(errno, "cannot allocate memory");
+		}
+		write_metrics(f);
+		fclose(f);
+		hdr = allocstr("HTTP/1.0 200 OK\r\n"
+		               "Content-Type: text/plain; version=0.0.4\r\n"
+		               "Content-Length: %zu\r\n\r\n", bodylen);
+		send_all(fd, hdr, strlen(hdr));
+		send_all(fd, body, bodylen);
+		free(hdr);
+		free(body);
+	} else {
+		hdr = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		send_all(fd, hdr, strlen(hdr));
+	}
+	close(fd);
+}
+
+int open_listener(const char *listen_str)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd = -1, one = 1, err;
+
+	if ( (host = strdup(listen_str))==NULL ) error(errno, "cannot allocate memory");
+	if ( (port = strrchr(host, ':'))!=NULL ) {
+		*port++ = 0;
+		/* Allow an IPv6 address in brackets. */
+		if ( host[0]=='[' && host[strlen(host)-1]==']' ) {
+			host[strlen(host)-1] = 0;
+			memmove(host, host+1, strlen(host));
+		}
+	} else {
+		port = host;
+		host = "";
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ( (err = getaddrinfo(*host!=0 ? host : NULL, port, &hints, &res))!=0 ) {
+		error(0, "invalid listen address `%s': %s", listen_str, gai_strerror(err));
+	}
+	for(ai=res; ai!=NULL; ai=ai->ai_next) {
+		if ( (fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0))<0 ) continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ( bind(fd, ai->ai_addr, ai->ai_addrlen)==0 && listen(fd, 16)==0 ) break;
+		close(fd);
+		fd = -1;
+	}
+	if ( fd<0 ) error(errno, "cannot listen on `%s'", listen_str);
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd fds[2];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	const char *listen_str = "9101";
+	int opt, sampfd, httpfd, fd;
+
+	progname = argv[0];
+
+	/* Parse command-line options */
+	be_verbose = show_help = show_version = 0;
+	opterr = 0;
+	while ( (opt = getopt_long(argc,argv,"+s:l:v",long_opts,(int *) 0))!=-1 ) {
+		switch ( opt ) {
+		case 0:   /* long-only option */
+			break;
+		case 's': /* socket option */
+			socketpath = optarg;
+			break;
+		case 'l': /* listen option */
+			listen_str = optarg;
+			break;
+		case 'v': /* verbose option */
+			be_verbose = 1;
+			verbose = LOG_DEBUG;
+			break;
+		case ':': /* getopt error */
+		case '?':
+			error(0, "unknown option or missing argument `%c'", optopt);
+			break;
+		default:
+			error(0, "getopt returned character code `%c' ??", (char)opt);
+		}
+	}
+
+	if ( show_help ) usage();
+	if ( show_version ) version(PROGRAM,VERSION);
+
+	if ( socketpath==NULL ) error(0, "no socket specified");
+	if ( strlen(socketpath)>=sizeof(addr.sun_path) ) {
+		error(0, "socket path too long: `%s'", socketpath);
+	}
+
+	if ( (series = calloc(MAX_SERIES, sizeof(struct series)))==NULL ) {
+		error(errno, "cannot allocate memory");
+	}
+
+	if ( (sampfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))<0 ) {
+		error(errno, "cannot create socket");
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketpath);
+	unlink(socketpath);
+	if ( bind(sampfd, (struct sockaddr *)&addr, sizeof(addr))!=0 ) {
+		error(errno, "cannot bind to `%s'", socketpath);
+	}
+	httpfd = open_listener(listen_str);
+	logmsg(LOG_NOTICE, "receiving samples on `%s', serving metrics on `%s'",
+	       socketpath, listen_str);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	fds[0].fd = sampfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = httpfd;
+	fds[1].events = POLLIN;
+	while ( !received_signal ) {
+		/* Buffered log messages are only flushed by later ones. */
+		logflush();
+		if ( poll(fds, 2, -1)<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno, "poll");
+		}
+		if ( fds[0].revents & POLLIN ) read_samples(sampfd);
+		if ( fds[1].revents & POLLIN ) {
+			if ( (fd = accept4(httpfd, NULL, NULL, SOCK_CLOEXEC))<0 ) {
+				if ( errno!=EINTR && errno!=EAGAIN ) warning(errno, "accept");
+				continue;
+			}
+			serve_http(fd);
+		}
+	}
+
+	logmsg(LOG_NOTICE, "received signal %d, exiting", received_signal);
+	unlink(socketpath);
+
+	return 0;
+}
@@ -0,0 +1,480 @@
+/*
+   judgesched -- hand out the judging CPU cores of a host on demand.
+
+   Part of the DOMjudge Programming Contest Jury System and licensed
+   under the GNU GPL. See README and COPYING for details.
+
+
+   Program specifications:
+
+   Instead of binding each judgedaemon to a fixed core, all judgedaemons
+   on a host connect to this scheduler on a Unix socket and lease a core
+   for each compile or testcase run, so that cores of daemons that wait
+   on the network (or have nothing to do) are used by the others, also
+   for running the testcases of one judging in parallel.
+
+   To keep the timing of runs reliable, at most one core per physical
+   core is handed out: the SMT siblings of the managed CPUs are never
+   leased, and should also not be used otherwise.
+
+   Clients send one command per line:
+
+     acquire N   wait until a core is free and lease up to N cores
+     try N       lease up to N cores that are free right now, such that
+                 waiting clients have precedence
+     release CPU...  return leased cores
+     status      report the number of cores, free cores, clients and
+                 waiting clients
+
+   Leases are answered with "cores CPU...", release with "ok" and
+   errors with "error MESSAGE". Waiting clients are served in order of
+   their requests. All cores leased by a client are returned when it
+   disconnects, so cores of crashed judgedaemons are not lost.
+ */
+
+/* For accept4() */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "lib.error.h"
+#include "lib.misc.h"
+
+#define PROGRAM "judgesched"
+#define VERSION DOMJUDGE_VERSION "/" REVISION
+
+/* Maximum number of CPUs and of simultaneous clients. */
+#define MAX_CPUS 1024
+#define MAX_CLIENTS 256
+
+/* Maximum length of a command line from a client. */
+#define MAX_LINE 256
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+const char *progname;
+
+int be_verbose;
+int show_help;
+int show_version;
+
+char *socketpath;
+
+/* The cores handed out, by their (lowest managed) CPU number, and the
+ * client that holds each, or -1 when free. */
+int ncores;
+int core_cpu[MAX_CPUS];
+int core_owner[MAX_CPUS];
+
+struct client {
+	int fd;
+	char buf[MAX_LINE];
+	size_t len;
+	int want;            /* number of cores waited for, or 0 */
+	unsigned long seq;   /* order of the wait request */
+};
+
+struct client clients[MAX_CLIENTS];
+int nclients;
+unsigned long wait_seq;
+
+volatile sig_atomic_t received_signal;
+
+struct option const long_opts[] = {
+	{"socket",  required_argument, NULL,          's'},
+	{"cpus",    required_argument, NULL,          'c'},
+	{"verbose", no_argument,       NULL,          'v'},
+	{"help",    no_argument,       &show_help,    1 },
+	{"version", no_argument,       &show_version, 1 },
+	{ NULL,     0,                 NULL,          0 }
+};
+
+void usage()
+{
+	printf("\
+Usage: %s [OPTION]...\n\
+Hand out the CPU cores of this host to judgedaemons on demand.\n\
+\n\
+  -s, --socket=FILE    listen on Unix socket FILE (required)\n\
+  -c, --cpus=LIST      manage the CPUs in LIST, e.g. `2-7,10' (default:\n\
+                         all online CPUs)\n\
+  -v, --verbose        display some extra warnings and information\n\
+      --help           display this help and exit\n\
+      --version        output version information and exit\n\
+\n\
+Of each physical core only one CPU is handed out, the SMT siblings are\n\
+kept idle. Configure the judgedaemons with JUDGE_SCHEDULER_SOCKET.\n\
+\n", progname);
+	exit(0);
+}
+
+void terminate(int sig)
+{
+	received_signal = sig;
+}
+
+/* Parse a Linux CPU list like "0-3,8" into mask. Returns 0 on success. */
+int parse_cpulist(const char *list, char *mask)
+{
+	const char *ptr = list;
+	char *end;
+	long lo, hi, i;
+
+	memset(mask, 0, MAX_CPUS);
+	while ( *ptr!=0 && *ptr!='\n' ) {
+		lo = hi = strtol(ptr, &end, 10);
+		if ( end==ptr ) return -1;
+		if ( *end=='-' ) {
+			ptr = end+1;
+			hi = strtol(ptr, &end, 10);
+			if ( end==ptr ) return -1;
+		}
+		if ( lo<0 || hi<lo || hi>=MAX_CPUS ) return -1;
+		for(i=lo; i<=hi; i++) mask[i] = 1;
+		ptr = end;
+		if ( *ptr==',' ) ptr++;
+		else if ( *ptr!=0 && *ptr!='\n' ) return -1;
+	}
+	return 0;
+}
+
+/* Read a CPU list from a sysfs file into mask. Returns 0 on success. */
+int read_cpulist(const char *path, char *mask)
+{
+	char line[4096];
+	FILE *f;
+	int res = -1;
+
+	if ( (f = fopen(path, "r"))==NULL ) return -1;
+	if ( fgets(line, sizeof(line), f)!=NULL ) res = parse_cpulist(line, mask);
+	fclose(f);
+	return res;
+}
+
+/* Select the CPUs to hand out: one per physical core among those
+ * in 'managed', which has the others marked as reserved. */
+void setup_cores(char *managed)
+{
+	char siblings[MAX_CPUS], path[256];
+	int cpu, sib;
+
+	ncores = 0;
+	for(cpu=0; cpu<MAX_CPUS; cpu++) {
+		if ( managed[cpu]!=1 ) continue;
+
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+		if ( read_cpulist(path, siblings)!=0 ) {
+			warning(errno, "cannot read SMT siblings of cpu %d", cpu);
+			memset(siblings, 0, sizeof(siblings));
+		}
+		for(sib=0; sib<MAX_CPUS; sib++) {
+			if ( !siblings[sib] || sib==cpu ) continue;
+			if ( managed[sib] ) {
+				managed[sib] = 2;
+				logmsg(LOG_DEBUG, "keeping cpu %d (SMT sibling of %d) idle", sib, cpu);
+			} else {
+				warning(0, "SMT sibling %d of cpu %d is not managed, "
+				        "so cannot be kept idle", sib, cpu);
+			}
+		}
+
+		core_cpu[ncores] = cpu;
+		core_owner[ncores] = -1;
+		ncores++;
+	}
+	if ( ncores==0 ) error(0, "no usable cpus");
+}
+
+void send_line(struct client *cl, const char *line)
+{
+	size_t len = strlen(line), pos = 0;
+	ssize_t res;
+
+	/* Replies are short and clients read them immediately, so a
+	 * blocking write suffices. */
+	while ( pos<len ) {
+		res = write(cl->fd, line+pos, len-pos);
+		if ( res<0 ) {
+			if ( errno==EINTR ) continue;
+			logmsg(LOG_DEBUG, "cannot write to client %d: %s", cl->fd, strerror(errno));
+			return;
+		}
+		pos += res;
+	}
+}
+
+int free_cores()
+{
+	int i, n = 0;
+
+	for(i=0; i<ncores; i++) if ( core_owner[i]<0 ) n++;
+	return n;
+}
+
+/* Lease up to 'want' free cores to client 'c' and reply with them. */
+void lease(int c, int want)
+{
+	char reply[MAX_CPUS*6+16];
+	size_t len;
+	int i;
+
+	len = sprintf(reply, "cores");
+	for(i=0; i<ncores && want>0; i++) {
+		if ( core_owner[i]>=0 ) continue;
+		core_owner[i] = c;
+		want--;
+		len += sprintf(reply+len, " %d", core_cpu[i]);
+		logmsg(LOG_DEBUG, "leased cpu %d to client %d", core_cpu[i], clients[c].fd);
+	}
+	strcpy(reply+len, "\n");
+	send_line(&clients[c], reply);
+}
+
+/* Serve waiting clients in order of their requests, while there are
+ * free cores. */
+void serve_waiting()
+{
+	int c, first;
+
+	while ( free_cores()>0 ) {
+		first = -1;
+		for(c=0; c<nclients; c++) {
+			if ( clients[c].want>0 &&
+			     (first<0 || clients[c].seq<clients[first].seq) ) first = c;
+		}
+		if ( first<0 ) return;
+		lease(first, clients[first].want);
+		clients[first].want = 0;
+	}
+}
+
+int nwaiting()
+{
+	int c, n = 0;
+
+	for(c=0; c<nclients; c++) if ( clients[c].want>0 ) n++;
+	return n;
+}
+
+void handle_command(int c, char *line)
+{
+	struct client *cl = &clients[c];
+	char reply[128], *cmd, *arg, *ptr, *end;
+	long n;
+	int i, released;
+
+	cmd = strtok_r(line, " \t", &ptr);
+	if ( cmd==NULL ) return;
+
+	if ( strcmp(cmd, "acquire")==0 || strcmp(cmd, "try")==0 ) {
+		arg = strtok_r(NULL, " \t", &ptr);
+		n = arg==NULL ? 1 : strtol(arg, &end, 10);
+		if ( (arg!=NULL && *end!=0) || n<1 ) {
+			send_line(cl, "error invalid number of cores\n");
+			return;
+		}
+		if ( cl->want>0 ) {
+			send_line(cl, "error already waiting\n");
+			return;
+		}
+		if ( nwaiting()==0 && free_cores()>0 ) {
+			lease(c, n);
+		} else if ( cmd[0]=='t' ) {
+			send_line(cl, "cores\n");
+		} else {
+			cl->want = n;
+			cl->seq = wait_seq++;
+		}
+	} else if ( strcmp(cmd, "release")==0 ) {
+		released = 0;
+		while ( (arg = strtok_r(NULL, " \t", &ptr))!=NULL ) {
+			n = strtol(arg, &end, 10);
+			for(i=0; i<ncores; i++) {
+				if ( *end==0 && core_cpu[i]==n && core_owner[i]==c ) {
+					core_owner[i] = -1;
+					released++;
+					logmsg(LOG_DEBUG, "client %d released cpu %ld", cl->fd, n);
+				}
+			}
+		}
+		send_line(cl, released>0 ? "ok\n" : "error no such leased cores\n");
+		serve_waiting();
+	} else if ( strcmp(cmd, "status")==0 ) {
+		snprintf(reply, sizeof(reply), "cores %d free %d clients %d waiting %d\n",
+		         ncores, free_cores(), nclients, nwaiting());
+		send_line(cl, reply);
+	} else {
+		send_line(cl, "error unknown command\n");
+	}
+}
+
+/* Remove client c, returning its cores. The last client takes its
+ * place, so its leases are renumbered. */
+void remove_client(int c)
+{
+	int i, last = nclients-1;
+
+	logmsg(LOG_DEBUG, "client %d disconnected", clients[c].fd);
+	close(clients[c].fd);
+	for(i=0; i<ncores; i++) {
+		if ( core_owner[i]==c ) core_owner[i] = -1;
+		else if ( core_owner[i]==last ) core_owner[i] = c;
+	}
+	clients[c] = clients[last];
+	nclients--;
+	serve_waiting();
+}
+
+/* Read from client c and handle complete lines. Returns -1 when the
+ * client is to be removed. */
+int read_client(int c)
+{
+	struct client *cl = &clients[c];
+	ssize_t nread;
+	char *nl;
+
+	nread = read(cl->fd, cl->buf+cl->len, sizeof(cl->buf)-1-cl->len);
+	if ( nread<0 && errno==EINTR ) return 0;
+	if ( nread<=0 ) return -1;
+	cl->len += nread;
+	cl->buf[cl->len] = 0;
+
+	while ( (nl = strchr(cl->buf, '\n'))!=NULL ) {
+		*nl = 0;
+		if ( nl>cl->buf && nl[-1]=='\r' ) nl[-1] = 0;
+		handle_command(c, cl->buf);
+		cl->len -= nl+1 - cl->buf;
+		memmove(cl->buf, nl+1, cl->len+1);
+	}
+	if ( cl->len>=sizeof(cl->buf)-1 ) {
+		warning(0, "line too long from client %d", cl->fd);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd fds[MAX_CLIENTS+1];
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	char managed[MAX_CPUS];
+	char *cpulist = NULL;
+	int opt, listenfd, fd, c, n;
+
+	progname = argv[0];
+
+	/* Parse command-line options */
+	be_verbose = show_help = show_version = 0;
+	opterr = 0;
+	while ( (opt = getopt_long(argc,argv,"+s:c:v",long_opts,(int *) 0))!=-1 ) {
+		switch ( opt ) {
+		case 0:   /* long-only option */
+			break;
+		case 's': /* socket option */
+			socketpath = optarg;
+			break;
+		case 'c': /* cpus option */
+			cpulist = optarg;
+			break;
+		case 'v': /* verbose option */
+			be_verbose = 1;
+			verbose = LOG_DEBUG;
+			break;
+		case ':': /* getopt error */
+		case '?':
+			error(0, "unknown option or missing argument `%c'", optopt);
+			break;
+		default:
+			error(0, "getopt returned character code `%c' ??", (char)opt);
+		}
+	}
+
+	if ( show_help ) usage();
+	if ( show_version ) version(PROGRAM,VERSION);
+
+	if ( socketpath==NULL ) error(0, "no socket specified");
+	if ( strlen(socketpath)>=sizeof(addr.sun_path) ) {
+		error(0, "socket path too long: `%s'", socketpath);
+	}
+
+	if ( cpulist!=NULL ) {
+		if ( parse_cpulist(cpulist, managed)!=0 ) {
+			error(0, "invalid cpu list: `%s'", cpulist);
+		}
+	} else if ( read_cpulist(SYSFS_CPU "/online", managed)!=0 ) {
+		error(errno, "cannot read online cpus");
+	}
+	setup_cores(managed);
+	logmsg(LOG_NOTICE, "handing out %d cores", ncores);
+
+	if ( (listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))<0 ) {
+		error(errno, "cannot create socket");
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketpath);
+	unlink(socketpath);
+	if ( bind(listenfd, (struct sockaddr *)&addr, sizeof(addr))!=0 ||
+	     listen(listenfd, 16)!=0 ) {
+		error(errno, "cannot listen on `%s'", socketpath);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	while ( !received_signal ) {
+		fds[0].fd = listenfd;
+		fds[0].events = nclients<MAX_CLIENTS ? POLLIN : 0;
+		for(c=0; c<nclients; c++) {
+			fds[c+1].fd = clients[c].fd;
+			fds[c+1].events = POLLIN;
+		}
+
+		/* Buffered log messages are only flushed by later ones. */
+		logflush();
+		if ( (n = poll(fds, nclients+1, -1))<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno, "poll");
+		}
+
+		/* Handle clients from the last, since removal moves the last
+		 * client into the removed slot. */
+		for(c=nclients-1; c>=0; c--) {
+			if ( fds[c+1].revents==0 ) continue;
+			if ( read_client(c)!=0 ) remove_client(c);
+		}
+
+		if ( fds[0].revents & POLLIN ) {
+			if ( (fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC))<0 ) {
+				if ( errno!=EINTR && errno!=EAGAIN ) warning(errno, "accept");
+				continue;
+			}
+			memset(&clients[nclients], 0, sizeof(clients[nclients]));
+			clients[nclients].fd = fd;
+			nclients++;
+			logmsg(LOG_DEBUG, "client %d connected", fd);
+		}
+	}
+
+	logmsg(LOG_NOTICE, "received signal %d, exiting", received_signal);
+	unlink(socketpath);
+
+	return 0;
+}
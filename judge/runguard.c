@@ -25,6 +25,14 @@
    has passed, followed by a SIGKILL after 'killdelay'. The program is
    considered to have finished when the main program thread exits. At
    that time any children still running are killed.
+
+   The watchdog is a single epoll() event loop over the command output
+   pipes, a pidfd for the command exit, timerfds for the hard wall
+   time limit and kill delay, and a signalfd for SIGTERM. With cgroups,
+   another timerfd checks the CPU time of the whole cgroup against the
+   hard CPU time limit, see cpuwatch_check(), and the memory events of
+   the cgroup are watched to abort on running out of memory, see
+   memwatch_check().
  */
 
 #include "config.h"
@@ -40,14 +48,24 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/param.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
-#include <sys/times.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mount.h>
 #include <errno.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -66,6 +84,29 @@
 #include <libcgroup.h>
 #include <sched.h>
 #include <sys/sysinfo.h>
+#include <linux/magic.h>
+#include <linux/perf_event.h>
+
+#include "lib.md5.h"
+
+/* Not all glibc versions provide this syscall number and no wrapper
+   before glibc 2.36, so call it directly. */
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/* Memfd sealing, in case fcntl.h from glibc < 2.27 lacks these. */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC       0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS  1033
+#define F_SEAL_SEAL  0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW  0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
 
 #define PROGRAM "runguard"
 #define VERSION DOMJUDGE_VERSION "/" REVISION
@@ -77,9 +118,88 @@
 #define PIPE_IN  1
 #define PIPE_OUT 0
 
+/* Filesystem magic of the cgroup v2 unified hierarchy, for older headers. */
+#ifndef CGROUP2_SUPER_MAGIC
+#define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
 #define BUF_SIZE 4*1024
 char buf[BUF_SIZE];
 
+/* Copy buffer for pump_pipes(): starts at BUF_SIZE, doubles while
+   reads fill it completely up to the pipe capacity, and halves again
+   when reads use less than a quarter of it. */
+char  *pumpbuf;
+size_t pumpbufsize;
+size_t pumpbufmax;
+unsigned long pump_iterations;
+
+/* Fallback for the pipe capacity maximum when it cannot be read. */
+#define PIPE_MAX_SIZE_PATH    "/proc/sys/fs/pipe-max-size"
+#define PIPE_MAX_SIZE_DEFAULT 1024*1024
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+/* Time in ms to wait for killed tasks to leave a cgroup. */
+#define CGROUP_KILL_TIMEOUT 10000
+
+/* Maximum size of a run request sent to a runguard server. */
+#define MAX_REQUEST_SIZE 64*1024
+#define MAX_POOL_SIZE    64
+
+/* Tags of the watchdog epoll events. Bits 1 and 2 are reserved for
+   the child stdout/stderr pipes, see pump_pipes(). */
+#define EVENT_CHILD     (1<<3)
+#define EVENT_SIGNAL    (1<<4)
+#define EVENT_WALLTIMER (1<<5)
+#define EVENT_KILLTIMER (1<<6)
+#define EVENT_SAMPLE    (1<<7)
+#define EVENT_STREAM    (1<<8)
+#define EVENT_CPUTIMER  (1<<9)
+#define EVENT_MEMORY    (1<<10)
+#define EVENT_MEMPRESS  (1<<11)
+#define EVENT_STREAMOUT (1<<12)
+
+/* Maximum size of command stdout buffered for a streaming validator
+   that does not keep up, before it is stopped. */
+#define STREAM_BUF_SIZE  (16*1024*1024)
+
+/* Minimum interval between checks of the cgroup CPU time. */
+#define CPUWATCH_MIN_INTERVAL 0.001
+
+/* PSI trigger on the cgroup memory.pressure file: a command whose
+   tasks are all stalled on memory for half of a second is thrashing
+   at its memory limit. */
+#define MEMWATCH_PSI_TRIGGER "full 500000 1000000"
+#define MAX_EVENTS 8
+
+/* Values returned by getopt_long for long-only options with argument. */
+#define OPT_SERVER  256
+#define OPT_CONNECT 257
+#define OPT_SAMPLE_INTERVAL 258
+#define OPT_PERF            259
+#define OPT_HANDOFF         260
+#define OPT_HASH_STDOUT     261
+#define OPT_POOL            262
+#define OPT_POOL_ROOT       263
+#define OPT_IO_MAX          264
+#define OPT_TIMING_PROFILE  265
+#define OPT_OUTMETA_JSON    266
+#define OPT_RECLAIM_CACHE   267
+#define OPT_CHROOT_MOUNTS   268
+#define OPT_PHASE_TIMES     269
+#define OPT_STREAM_COMPARE  270
+#define OPT_KILL_OUTPUT     271
+#define OPT_CGROUP_POOL     272
+#define OPT_BIND_RO         273
+#define OPT_SYSCALL_PROFILE 274
+#define OPT_STREAM_LIMITS   275
+#define OPT_STREAM_USER     276
+#define OPT_STREAM_ARG      277
+
 /* Types of time for writing to file. */
 #define WALL_TIME_TYPE 0
 #define CPU_TIME_TYPE  1
@@ -113,12 +233,145 @@ char  *rootdir;
 char  *stdoutfilename;
 char  *stderrfilename;
 char  *metafilename;
+char  *jsonmetafilename;
 char  *environment_variables;
+char  *serversocket;
+char  *handoffcmd;
+char  *streamcmd;
+char  *pool_root;
 FILE  *metafile;
 
+/* Metadata collected for --outmeta-json, written once at exit. */
+char **jsonmetakeys;
+char **jsonmetavalues;
+int    njsonmeta, jsonmetasize;
+
+/* Memfd capturing command stdout for the handoff command, or -1. */
+int    outputmemfd = -1;
+
+/* Running MD5 hash of the command stdout passed on (--hash-stdout). */
+int    hash_stdout;
+md5_ctx stdout_md5;
+
+/* Streaming output validator (--stream-compare): its arguments, user
+   and group, its process and cgroup v2 directory (empty when not used),
+   the non-blocking pipe to its stdin, or -1 when closed, the output it
+   did not accept yet, its resource limits and whether it reported a
+   wrong answer while the command was still running. */
+char **streamargs;
+int    nstreamargs;
+int    stream_uid = -1;
+int    stream_gid = -1;
+pid_t  stream_pid = -1;
+char   streamcgroupdir[PATH_MAX];
+int    streamfd = -1;
+char  *streambuf;
+size_t streambufpos, streambuflen;
+rlim_t stream_memsize  = RLIM_INFINITY;
+rlim_t stream_cputime  = RLIM_INFINITY;
+rlim_t stream_filesize = RLIM_INFINITY;
+int    early_verdict;
+
+/* CPU time watchdog: the cgroup CPU usage counter, the timer for the
+   next check and the number of CPUs the command can run on, which
+   bounds how fast it can use up the remaining CPU time. */
+int    cpuwatchfd = -1;
+int    cputimerfd = -1;
+int    cpuwatch_ncpus;
+
+/* Memory watchdog: the file signalling memory events (cgroup v2
+   memory.events, or a v1 eventfd OOM notifier), a PSI trigger on
+   memory stalls (v2 only), the counter files read at each event, and
+   the peaks and event counts seen. */
+int    memwatchfd = -1;
+int    mempressfd = -1;
+int    memeventsfd = -1;
+int    memstatfd = -1;
+int    memfailfd = -1;
+int    memory_limit_reached;
+int64_t mem_peak_anon, mem_peak_file;
+int64_t mem_oom_events, mem_oom_kills, mem_max_events;
+
+/* Resource usage sampling: interval in ms (0 to disable), the side
+   file next to the meta file, and the opened counter files. */
+int    sample_interval;
+char   samplefilename[PATH_MAX];
+FILE  *samplefile;
+int    samplefd[3];
+int64_t samplelast[4];
+
+/* Performance counters reported in the meta file with --perf. */
+struct perf_counter {
+	const char *key;
+	uint32_t type;
+	uint64_t config;
+	int exclude_kernel;
+};
+#define NPERF_COUNTERS 4
+const struct perf_counter perf_counters[NPERF_COUNTERS] = {
+	{ "perf-instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     1 },
+	{ "perf-cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       1 },
+	{ "perf-cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     1 },
+	{ "perf-context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 0 },
+};
+int use_perf;
+int perffd[NPERF_COUNTERS];
+int perf_syncpipe[2];
+
+/* Syscalls counted separately with --syscall-profile, using the
+   syscall tracepoints; all others are only included in the total. */
+#define TRACEFS_PATH     "/sys/kernel/tracing"
+#define TRACEFS_PATH_OLD "/sys/kernel/debug/tracing"
+#define NPROFILE_SYSCALLS 24
+const char *const profile_syscalls[NPROFILE_SYSCALLS] = {
+	"read", "write", "readv", "writev", "pread64", "pwrite64", "lseek",
+	"openat", "close", "newfstat", "newfstatat", "ioctl", "mmap",
+	"munmap", "mremap", "mprotect", "madvise", "brk", "futex",
+	"sched_yield", "nanosleep", "clock_nanosleep", "getrandom", "clone",
+};
+int syscall_profile;
+int profilefd[NPROFILE_SYSCALLS];
+int profilefd_total, profilefd_minflt, profilefd_majflt;
+
 char  cgroupname[255];
+char  cgroupdir[PATH_MAX];
+int   cgroupv2;
+
+/* Cgroups created in advance by the server (--cgroup-pool): the
+   sequence numbers of the ready ones (-1 when being refilled), and
+   the name of the one passed to a request handler, if any. */
+int   cgroup_pool_size;
+int   cgroup_pool_ready[MAX_POOL_SIZE];
+int   cgroup_pool_seq;
+char  pooled_cgroupname[255];
 const char *cpuset;
 
+/* Timing profile for a cpuset, see setup_timing_profile(). */
+#define SYSFS_CPU_PATH  "/sys/devices/system/cpu"
+#define SYSFS_NODE_PATH "/sys/devices/system/node"
+int   timing_profile;
+int   reserve_smt;
+int   reclaim_cache;
+cpu_set_t run_cpus;
+char  cgroup_cpus[1024];
+const char *cpuset_mems = "0";
+char  cpuset_mems_buf[256];
+char  cpu_governors[256];
+char  cpu_frequencies[256];
+
+/* Block I/O throttling with --io-max: the keys of the cgroup v2
+   io.max file and the corresponding cgroup v1 blkio files. */
+#define NIO_LIMITS 4
+const char *io_limit_keys[NIO_LIMITS] = { "rbps", "wbps", "riops", "wiops" };
+const char *io_limit_blkio_files[NIO_LIMITS] = {
+	"blkio.throttle.read_bps_device",  "blkio.throttle.write_bps_device",
+	"blkio.throttle.read_iops_device", "blkio.throttle.write_iops_device",
+};
+int64_t io_limits[NIO_LIMITS]; /* -1 when not limited */
+int     use_io_limits;
+int     use_blkio;
+char    io_device[32];
+
 /* Linux Out-Of-Memory adjustment for current process. */
 #define OOM_PATH_NEW "/proc/self/oom_score_adj"
 #define OOM_PATH_OLD "/proc/self/oom_adj"
@@ -129,6 +382,15 @@ char *rungroup;
 int runuid;
 int rungid;
 int use_root;
+int chroot_mounts;
+
+/* Files bind mounted read-only for COMMAND with --bind-ro, and whether
+   this process has a private mount namespace for these. */
+#define MAX_BIND_MOUNTS 8
+char *bind_src[MAX_BIND_MOUNTS];
+char *bind_dst[MAX_BIND_MOUNTS];
+int  nbind_mounts;
+int  private_mounts;
 int use_walltime;
 int use_cputime;
 int use_user;
@@ -136,6 +398,8 @@ int use_group;
 int redir_stdout;
 int redir_stderr;
 int limit_streamsize;
+int kill_output_limit;
+int output_limit_reached;
 int outputmeta;
 int outputtimetype;
 int no_coredump;
@@ -144,6 +408,20 @@ int be_verbose;
 int be_quiet;
 int show_help;
 int show_version;
+int server_mode;
+int client_mode;
+int in_request;
+int pool_size;
+
+/* Child parked by a pre-forked request handler, see park_child(). */
+pid_t parked_pid = -1;
+int   parked_fd  = -1;
+int   parked_chroot_mounts;
+double exec_latency;
+
+/* In the child before exec(), errors are also reported to the
+   watchdog on this file descriptor, see wait_for_exec(). */
+int    execnotifyfd = -1;
 
 double walltimelimit[2], cputimelimit[2]; /* in seconds, soft and hard limits */
 int walllimit_reached, cpulimit_reached; /* 1=soft, 2=hard, 3=both limits reached */
@@ -158,13 +436,24 @@ pid_t child_pid = -1;
 static volatile sig_atomic_t received_SIGCHLD = 0;
 static volatile sig_atomic_t received_signal = -1;
 
+int killtimerfd = -1;
+
 FILE *child_stdout;
 FILE *child_stderr;
 int child_pipefd[3][2];
 int child_redirfd[3];
 
-struct timeval progstarttime, starttime, endtime;
-struct tms startticks, endticks;
+/* All times are measured with CLOCK_MONOTONIC, the command wall time
+   from its exec() until waitpid() reports its exit. */
+struct timespec progstarttime, starttime, endtime;
+struct rusage childusage;
+
+/* End times of the phases of runguard itself, see mark_phase(). */
+#define MAX_PHASES 16
+int   phase_times;
+int   nphases;
+const char *phase_name[MAX_PHASES];
+struct timespec phase_end[MAX_PHASES];
 
 struct option const long_opts[] = {
 	{"root",       required_argument, NULL,         'r'},
@@ -185,6 +474,28 @@ struct option const long_opts[] = {
 	{"outmeta",    required_argument, NULL,         'M'},
 	{"verbose",    no_argument,       NULL,         'v'},
 	{"quiet",      no_argument,       NULL,         'q'},
+	{"server",     required_argument, NULL,         OPT_SERVER},
+	{"connect",    required_argument, NULL,         OPT_CONNECT},
+	{"sample-interval",required_argument,NULL,      OPT_SAMPLE_INTERVAL},
+	{"perf",       no_argument,       NULL,         OPT_PERF},
+	{"handoff",    required_argument, NULL,         OPT_HANDOFF},
+	{"hash-stdout",no_argument,       NULL,         OPT_HASH_STDOUT},
+	{"pool",       required_argument, NULL,         OPT_POOL},
+	{"pool-root",  required_argument, NULL,         OPT_POOL_ROOT},
+	{"io-max",     required_argument, NULL,         OPT_IO_MAX},
+	{"timing-profile",optional_argument,NULL,       OPT_TIMING_PROFILE},
+	{"outmeta-json",required_argument,NULL,         OPT_OUTMETA_JSON},
+	{"reclaim-cache",no_argument,     NULL,         OPT_RECLAIM_CACHE},
+	{"chroot-mounts",no_argument,     NULL,         OPT_CHROOT_MOUNTS},
+	{"phase-times",no_argument,       NULL,         OPT_PHASE_TIMES},
+	{"stream-compare",required_argument,NULL,       OPT_STREAM_COMPARE},
+	{"stream-limits",required_argument,NULL,        OPT_STREAM_LIMITS},
+	{"stream-user",  required_argument,NULL,        OPT_STREAM_USER},
+	{"stream-arg",   required_argument,NULL,        OPT_STREAM_ARG},
+	{"kill-on-output-limit",no_argument,NULL,       OPT_KILL_OUTPUT},
+	{"cgroup-pool",required_argument, NULL,         OPT_CGROUP_POOL},
+	{"bind-ro",    required_argument, NULL,         OPT_BIND_RO},
+	{"syscall-profile",no_argument,   NULL,         OPT_SYSCALL_PROFILE},
 	{"help",       no_argument,       &show_help,    1 },
 	{"version",    no_argument,       &show_version, 1 },
 	{ NULL,        0,                 NULL,          0 }
@@ -194,6 +505,8 @@ void warning(   const char *, ...) __attribute__((format (printf, 1, 2)));
 void verbose(   const char *, ...) __attribute__((format (printf, 1, 2)));
 void error(int, const char *, ...) __attribute__((format (printf, 2, 3)));
 void write_meta(const char*, const char *, ...) __attribute__((format (printf, 2, 3)));
+void write_json_meta();
+int64_t read_counter(int fd, const char *key);
 
 void warning(const char *format, ...)
 {
@@ -209,17 +522,27 @@ void warning(const char *format, ...)
 	va_end(ap);
 }
 
+/* Return the time in seconds elapsed from 'start' to 'end'. */
+double timediff(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)*1E-9;
+}
+
+double timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec*1E-6;
+}
+
 void verbose(const char *format, ...)
 {
 	va_list ap;
 	va_start(ap,format);
-	struct timeval currtime;
+	struct timespec currtime;
 	double runtime;
 
 	if ( ! be_quiet && be_verbose ) {
-		gettimeofday(&currtime,NULL);
-		runtime = (currtime.tv_sec  - progstarttime.tv_sec ) +
-		          (currtime.tv_usec - progstarttime.tv_usec)*1E-6;
+		clock_gettime(CLOCK_MONOTONIC,&currtime);
+		runtime = timediff(&progstarttime,&currtime);
 		fprintf(stderr,"%s [%d @ %10.6lf]: verbose: ",progname,getpid(),runtime);
 		vfprintf(stderr,format,ap);
 		fprintf(stderr,"\n");
@@ -281,10 +604,14 @@ void error(int errnum, const char *format, ...)
 	fprintf(stderr,"%s\nTry `%s --help' for more information.\n",errstr,progname);
 	va_end(ap);
 
+	if ( execnotifyfd>=0 && write(execnotifyfd,errstr,strlen(errstr))<0 ) {
+		fprintf(stderr,"\nError reporting error to watchdog.\n");
+	}
 	write_meta("internal-error","%s",errstr);
 	if ( outputmeta && metafile != NULL && fclose(metafile)!=0 ) {
 		fprintf(stderr,"\nError writing to metafile '%s'.\n",metafilename);
 	}
+	write_json_meta();
 
 	/* Make sure that all children are killed before terminating */
 	if ( child_pid > 0) {
@@ -307,25 +634,139 @@ void error(int errnum, const char *format, ...)
 	exit(exit_failure);
 }
 
+/* Store a metadata key and (allocated) value for the JSON metadata. */
+void add_json_meta(const char *key, char *value)
+{
+	if ( njsonmeta==jsonmetasize ) {
+		jsonmetasize = ( jsonmetasize>0 ? 2*jsonmetasize : 64 );
+		jsonmetakeys   = (char **) realloc(jsonmetakeys,  jsonmetasize*sizeof(char *));
+		jsonmetavalues = (char **) realloc(jsonmetavalues,jsonmetasize*sizeof(char *));
+		if ( jsonmetakeys==NULL || jsonmetavalues==NULL ) abort();
+	}
+	if ( (jsonmetakeys[njsonmeta] = strdup(key))==NULL ) abort();
+	jsonmetavalues[njsonmeta++] = value;
+}
+
 void write_meta(const char *key, const char *format, ...)
 {
 	va_list ap;
+	char *value;
 
-	if ( !outputmeta ) return;
+	if ( !outputmeta && jsonmetafilename==NULL ) return;
 
 	va_start(ap,format);
+	if ( vasprintf(&value,format,ap)<0 ) abort();
+	va_end(ap);
 
-	if ( fprintf(metafile,"%s: ",key)<=0 ) {
+	if ( outputmeta && fprintf(metafile,"%s: %s\n",key,value)<0 ) {
 		error(0,"cannot write to file `%s'",metafilename);
 	}
-	if ( vfprintf(metafile,format,ap)<0 ) {
-		error(0,"cannot write to file `%s'(vfprintf)",metafilename);
+
+	if ( jsonmetafilename!=NULL ) {
+		add_json_meta(key,value);
+	} else {
+		free(value);
 	}
-	if ( fprintf(metafile,"\n")<=0 ) {
-		error(0,"cannot write to file `%s'",metafilename);
+}
+
+/* Return whether 'str' is a number in JSON syntax, such that it can be
+   written unquoted. */
+int is_json_number(const char *str)
+{
+	const char *ptr = str;
+
+	if ( *ptr=='-' ) ptr++;
+	if ( !isdigit((unsigned char)*ptr) ) return 0;
+	if ( *ptr=='0' && isdigit((unsigned char)ptr[1]) ) return 0;
+	while ( isdigit((unsigned char)*ptr) ) ptr++;
+	if ( *ptr=='.' ) {
+		if ( !isdigit((unsigned char)*++ptr) ) return 0;
+		while ( isdigit((unsigned char)*ptr) ) ptr++;
+	}
+	if ( *ptr=='e' || *ptr=='E' ) {
+		ptr++;
+		if ( *ptr=='+' || *ptr=='-' ) ptr++;
+		if ( !isdigit((unsigned char)*ptr) ) return 0;
+		while ( isdigit((unsigned char)*ptr) ) ptr++;
 	}
 
-	va_end(ap);
+	return *ptr==0;
+}
+
+void fprint_json_value(FILE *fp, const char *str)
+{
+	if ( is_json_number(str) ) {
+		fputs(str,fp);
+		return;
+	}
+
+	fputc('"',fp);
+	for(; *str!=0; str++) {
+		switch ( *str ) {
+		case '"':  fputs("\\\"",fp); break;
+		case '\\': fputs("\\\\",fp); break;
+		case '\n': fputs("\\n",fp); break;
+		case '\t': fputs("\\t",fp); break;
+		default:
+			if ( (unsigned char)*str<0x20 ) {
+				fprintf(fp,"\\u%04x",(unsigned char)*str);
+			} else {
+				fputc(*str,fp);
+			}
+		}
+	}
+	fputc('"',fp);
+}
+
+/* Write all metadata as a single JSON object to the --outmeta-json
+ * file. It is written to a temporary file first and then renamed, so
+ * readers never see a partial object. Keys written more than once
+ * (e.g. internal-error) get an array of all their values.
+ */
+void write_json_meta()
+{
+	static int written = 0;
+	char tmpname[PATH_MAX];
+	FILE *fp;
+	int i, j, n, first;
+
+	if ( jsonmetafilename==NULL || written ) return;
+	written = 1;
+
+	if ( snprintf(tmpname,PATH_MAX,"%s.tmp",jsonmetafilename)>=PATH_MAX ) {
+		error(0,"filename `%s' too long",jsonmetafilename);
+	}
+	if ( (fp = fopen(tmpname,"w"))==NULL ) error(errno,"cannot open `%s'",tmpname);
+
+	fputc('{',fp);
+	first = 1;
+	for(i=0; i<njsonmeta; i++) {
+		/* Skip keys already written with an earlier occurrence. */
+		for(j=0; j<i; j++) if ( strcmp(jsonmetakeys[i],jsonmetakeys[j])==0 ) break;
+		if ( j<i ) continue;
+
+		for(n=0, j=i; j<njsonmeta; j++) n += ( strcmp(jsonmetakeys[i],jsonmetakeys[j])==0 );
+
+		fprintf(fp,"%s\"%s\":",first ? "" : ",",jsonmetakeys[i]);
+		first = 0;
+		if ( n==1 ) {
+			fprint_json_value(fp,jsonmetavalues[i]);
+			continue;
+		}
+		fputc('[',fp);
+		for(j=i; j<njsonmeta; j++) {
+			if ( strcmp(jsonmetakeys[i],jsonmetakeys[j])!=0 ) continue;
+			if ( j>i ) fputc(',',fp);
+			fprint_json_value(fp,jsonmetavalues[j]);
+		}
+		fputc(']',fp);
+	}
+	fputs("}\n",fp);
+
+	if ( ferror(fp) || fclose(fp)!=0 ) error(errno,"cannot write to file `%s'",tmpname);
+	if ( rename(tmpname,jsonmetafilename)!=0 ) {
+		error(errno,"cannot rename `%s' to `%s'",tmpname,jsonmetafilename);
+	}
 }
 
 void version(const char *prog, const char *vers)
@@ -362,10 +803,47 @@ Run COMMAND with restrictions.\n\
   -s, --streamsize=SIZE  truncate COMMAND stdout/stderr streams at SIZE kB\n\
   -E, --environment      preserve environment variables (default only PATH)\n\
   -V, --variable         add additonal environment variables (in form KEY=VALUE;KEY2=VALUE2)\n\
-  -M, --outmeta=FILE     write metadata (runtime, exitcode, etc.) to FILE\n");
+  -M, --outmeta=FILE     write metadata (runtime, exitcode, etc.) to FILE\n\
+      --outmeta-json=FILE  write metadata as a single JSON object to FILE\n");
 	printf("\
   -v, --verbose          display some extra warnings and information\n\
   -q, --quiet            suppress all warnings and verbose output\n\
+      --server=SOCKET    run as server handling requests on SOCKET\n\
+      --connect=SOCKET   send this run as request to server on SOCKET\n\
+      --sample-interval=MS  record resource usage every MS milliseconds\n\
+                         to file OUTMETA.samples\n\
+      --perf             report hardware performance counters in OUTMETA\n\
+      --syscall-profile  report syscall and page fault counts in OUTMETA\n\
+      --handoff=CMD      capture COMMAND stdout in memory and afterwards\n\
+                         execute shell command CMD with it as stdin\n\
+      --hash-stdout      write MD5 hash of (truncated) COMMAND stdout to OUTMETA\n\
+      --pool=N           in server mode, keep N children ready to run COMMAND\n\
+      --pool-root=ROOT   change root of pool children to ROOT\n\
+      --cgroup-pool=N    in server mode, keep N cgroups created in advance\n\
+      --io-max=LIMITS    throttle block I/O of COMMAND, see below\n\
+      --timing-profile[=smt]  place memory of COMMAND on the NUMA nodes\n\
+                         of the cpuset and report CPU frequencies; with\n\
+                         `smt' also reserve the SMT siblings of the cpuset\n\
+      --reclaim-cache    reclaim the page cache charged to the cgroup of\n\
+                         COMMAND after it finished\n\
+      --chroot-mounts    bind mount the pre-built chroot tree read-only\n\
+                         into ROOT, visible only to COMMAND\n\
+      --bind-ro=SRC:DST  bind mount file or directory SRC read-only on\n\
+                         DST in the current directory, visible only to\n\
+                         COMMAND; can be given multiple times\n\
+      --phase-times      write the time spent in each phase of runguard\n\
+                         itself to OUTMETA as `phase-*' keys\n\
+      --stream-compare=PROG  pass COMMAND stdout also to program PROG\n\
+                         while it runs, and abort COMMAND when PROG exits\n\
+                         with exitcode 43 (wrong answer)\n\
+      --stream-arg=ARG   pass argument ARG to the `stream-compare' PROG;\n\
+                         can be given multiple times\n\
+      --stream-user=USER run the `stream-compare' PROG as user USER\n\
+      --stream-limits=MEM,TIME,FILE  limit the `stream-compare' PROG to\n\
+                         MEM kB memory, TIME seconds CPU time and FILE kB\n\
+                         file size\n\
+      --kill-on-output-limit  kill COMMAND as soon as it writes more to\n\
+                         stdout than the `streamsize' limit\n\
       --help             display this help and exit\n\
       --version          output version information and exit\n");
 	printf("\n\
@@ -378,16 +856,84 @@ The COMMAND path is relative to the changed ROOT directory if specified.\n\
 TIME may be specified as a float; two floats separated by `:' are treated\n\
 as soft and hard limits. The runtime written to file is that of the last\n\
 of wall/cpu time options set, and defaults to CPU time when neither is set.\n\
+With cgroups, the hard CPU time limit applies to the total CPU time of all\n\
+processes of COMMAND, which are killed within milliseconds of reaching it.\n\
 When run setuid without the `user' option, the user ID is set to the\n\
-real user ID.\n");
+real user ID.\n\
+In server mode, the privileged setup is performed only once and each\n\
+request is run with the options given to the server as defaults. The\n\
+`user' and `group' can only be set on the server, which stops when its\n\
+standard input is closed. The server SOCKET must be within the directory\n\
+`" CHROOT_PREFIX "' and only replaces an existing socket.\n\
+A `bind-ro' SRC must be within that directory as well, and DST is a file\n\
+name in the current directory, which must be within ROOT if given.\n\
+Each line of the samples file contains the time since start (ms), cgroup\n\
+memory usage (bytes) and CPU time (us), and the bytes read and written by\n\
+the main COMMAND process; unavailable values are reported as -1.\n\
+With `handoff', the (possibly truncated) COMMAND stdout is kept in a sealed\n\
+memfd instead of a file; runguard is replaced by CMD, which runs as the\n\
+invoking (sudo) user and whose exitcode is returned.\n\
+Pool children are forked, placed in ROOT and switched to the run user in\n\
+advance; a request only uses one if its `root' matches `pool-root'.\n\
+Pooled cgroups (cgroup v2 only) are passed to a request by the server;\n\
+the request deletes its cgroup after it has sent its reply.\n\
+LIMITS is a comma separated list of io.max style limits `rbps', `wbps',\n\
+`riops' and `wiops' (e.g. \"rbps=1048576,wiops=100\") on the block device\n\
+of the (ROOT) directory. The block I/O done by COMMAND is reported in\n\
+OUTMETA when cgroups are used and the io (v2) or blkio (v1) controller\n\
+is available.\n\
+Reserved SMT siblings are added to the cgroup cpuset, so no other work is\n\
+scheduled there, but COMMAND is only allowed to run on the cpuset itself.\n\
+With `reclaim-cache', the reclaimed bytes are reported in OUTMETA if the\n\
+kernel supports this (cgroup v2 memory.reclaim or v1 memory.force_empty).\n\
+Each `phase-NAME' time is measured from the end of the previous phase, or\n\
+the start of runguard (the request in server mode) for the first.\n\
+The `stream-compare' PROG is executed directly with the `stream-arg'\n\
+arguments. When run as root it requires a `stream-user', which must be a\n\
+valid user other than `user', and runs with that user's primary group;\n\
+with cgroup v2 it gets its own cgroup. When it aborts COMMAND,\n\
+`early-verdict: wrong-answer' is written to OUTMETA. It is killed when\n\
+COMMAND has finished. Output of COMMAND that PROG does not read right away\n\
+is buffered up to 16 MB; beyond that PROG is stopped, and COMMAND\n\
+continues without it.\n\
+With `kill-on-output-limit', `output-result: output-limit' is written to\n\
+OUTMETA when COMMAND was killed for it; stderr beyond the limit is still\n\
+discarded until COMMAND exits.\n\
+With cgroups and `memsize', COMMAND is killed as soon as it runs out of\n\
+memory, or (cgroup v2 with PSI) stalls on memory for half of a second,\n\
+and `memory-result: memory-limit' is written to OUTMETA. The anonymous\n\
+and page cache peaks written are those seen at memory events.\n");
 	exit(0);
 }
 
-void output_exit_time(int exitcode, double cpudiff)
+/* Record the end of phase 'name' of runguard, when requested. */
+void mark_phase(const char *name)
+{
+	if ( !phase_times || nphases>=MAX_PHASES ) return;
+
+	if ( clock_gettime(CLOCK_MONOTONIC,&phase_end[nphases])!=0 ) {
+		error(errno,"getting time");
+	}
+	phase_name[nphases++] = name;
+}
+
+void output_phase_times()
+{
+	const struct timespec *prev = &progstarttime;
+	char key[64];
+	int i;
+
+	for(i=0; i<nphases; i++) {
+		snprintf(key,sizeof(key),"phase-%s",phase_name[i]);
+		write_meta(key,"%.6f",timediff(prev,&phase_end[i]));
+		prev = &phase_end[i];
+	}
+}
+
+void output_exit_time(int exitcode, double cpudiff, double userdiff, double sysdiff)
 {
-	double walldiff, userdiff, sysdiff;
+	double walldiff;
 	int timelimit_reached = 0;
-	unsigned long ticks_per_second = sysconf(_SC_CLK_TCK);
 
 	verbose("command exited with exitcode %d",exitcode);
 	write_meta("exitcode","%d",exitcode);
@@ -396,11 +942,7 @@ void output_exit_time(int exitcode, double cpudiff)
 		write_meta("signal", "%d", received_signal);
 	}
 
-	walldiff = (endtime.tv_sec  - starttime.tv_sec ) +
-	           (endtime.tv_usec - starttime.tv_usec)*1E-6;
-
-	userdiff = (double)(endticks.tms_cutime - startticks.tms_cutime) / ticks_per_second;
-	sysdiff  = (double)(endticks.tms_cstime - startticks.tms_cstime) / ticks_per_second;
+	walldiff = timediff(&starttime,&endtime);
 
 	write_meta("wall-time","%.3f", walldiff);
 	write_meta("user-time","%.3f", userdiff);
@@ -447,11 +989,367 @@ void output_exit_time(int exitcode, double cpudiff)
  */
 int use_cgroup()
 {
-	return use_cputime || memsize!=RLIM_INFINITY ||
+	return use_cputime || memsize!=RLIM_INFINITY || use_io_limits ||
 	    ( cpuset!=NULL && strlen(cpuset)>0 );
 }
 
-void output_cgroup_stats(double *cputime)
+/* Returns whether CGROUP_ROOT is mounted as a cgroup v2 unified
+ * hierarchy. In that case we do not use libcgroup, but directly write
+ * to the cgroup interface files, see the cgroup2_* functions below.
+ */
+int is_cgroup_v2()
+{
+	struct statfs fs;
+
+	if ( statfs(CGROUP_ROOT,&fs)!=0 ) error(errno,"cannot stat `%s'",CGROUP_ROOT);
+
+	return fs.f_type==CGROUP2_SUPER_MAGIC;
+}
+
+void cgroup2_write(const char *, const char *, ...) __attribute__((format (printf, 2, 3)));
+void cgroup2_write_in(const char *, const char *, const char *, ...)
+	__attribute__((format (printf, 3, 4)));
+
+/* Write a value to interface file 'file' of cgroup v2 directory 'dir'.
+ * Note that the kernel reports invalid values on write, so check the
+ * result of fclose() which flushes the data.
+ */
+void cgroup2_vwrite(const char *dir, const char *file, const char *format, va_list ap)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path,PATH_MAX,"%s%s",dir,file);
+	if ( (fp = fopen(path,"w"))==NULL ) error(errno,"cannot open cgroup file `%s'",path);
+
+	if ( vfprintf(fp,format,ap)<0 ) error(errno,"cannot write cgroup file `%s'",path);
+
+	if ( fclose(fp)!=0 ) error(errno,"cannot write cgroup file `%s'",path);
+}
+
+void cgroup2_write_in(const char *dir, const char *file, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap,format);
+	cgroup2_vwrite(dir,file,format,ap);
+	va_end(ap);
+}
+
+/* Write a value to interface file 'file' of our cgroup v2 directory. */
+void cgroup2_write(const char *file, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap,format);
+	cgroup2_vwrite(cgroupdir,file,format,ap);
+	va_end(ap);
+}
+
+/* Read an integer value from interface file 'file' of our cgroup v2
+ * directory. When 'key' is not NULL, the file is parsed as flat keyed
+ * "key value" lines (e.g. cpu.stat) and the value of 'key' returned.
+ */
+int64_t cgroup2_read_int64(const char *file, const char *key)
+{
+	char path[PATH_MAX];
+	char name[64];
+	int64_t value;
+	FILE *fp;
+	int found = 0;
+
+	snprintf(path,PATH_MAX,"%s%s",cgroupdir,file);
+	if ( (fp = fopen(path,"r"))==NULL ) error(errno,"cannot open cgroup file `%s'",path);
+
+	if ( key==NULL ) {
+		found = ( fscanf(fp,"%" SCNd64,&value)==1 );
+	} else {
+		while ( fscanf(fp,"%63s %" SCNd64,name,&value)==2 ) {
+			if ( strcmp(name,key)==0 ) {
+				found = 1;
+				break;
+			}
+		}
+	}
+	if ( fclose(fp)!=0 ) error(errno,"closing cgroup file `%s'",path);
+	if ( !found ) error(0,"cannot read value %s from cgroup file `%s'",key ? key : "",path);
+
+	return value;
+}
+
+/* Open cgroup file 'file' for reading; returns -1 on failure. */
+int cgroup2_open(const char *file)
+{
+	char path[PATH_MAX];
+
+	if ( snprintf(path,PATH_MAX,"%s%s",cgroupdir,file)>=PATH_MAX ) return -1;
+	return open(path,O_RDONLY | O_CLOEXEC);
+}
+
+void write_io_meta(const int64_t *stats)
+{
+	verbose("block I/O: %" PRId64 " bytes read, %" PRId64 " bytes written",
+	        stats[0],stats[1]);
+	write_meta("io-read-bytes", "%" PRId64,stats[0]);
+	write_meta("io-write-bytes","%" PRId64,stats[1]);
+	write_meta("io-read-ops",   "%" PRId64,stats[2]);
+	write_meta("io-write-ops",  "%" PRId64,stats[3]);
+}
+
+/* Determine the block device of the directory the command runs in as
+ * "major:minor" in 'io_device'. The io controller only accepts whole
+ * disks, so a partition is replaced by its parent disk. Returns 0 when
+ * the directory does not reside on a block device (e.g. tmpfs).
+ */
+int find_io_device()
+{
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned int devmajor, devminor;
+	FILE *fp;
+
+	if ( stat(use_root ? rootdir : ".",&st)!=0 ) error(errno,"cannot stat run directory");
+	if ( major(st.st_dev)==0 ) return 0;
+
+	devmajor = major(st.st_dev);
+	devminor = minor(st.st_dev);
+	snprintf(path,PATH_MAX,"/sys/dev/block/%u:%u/partition",devmajor,devminor);
+	if ( access(path,F_OK)==0 ) {
+		snprintf(path,PATH_MAX,"/sys/dev/block/%u:%u/../dev",devmajor,devminor);
+		if ( (fp = fopen(path,"r"))==NULL ) error(errno,"cannot open `%s'",path);
+		if ( fscanf(fp,"%u:%u",&devmajor,&devminor)!=2 ) {
+			error(0,"cannot read device from `%s'",path);
+		}
+		if ( fclose(fp)!=0 ) error(errno,"closing file `%s'",path);
+	}
+	snprintf(io_device,sizeof(io_device),"%u:%u",devmajor,devminor);
+
+	return 1;
+}
+
+/* Sum the I/O statistics of all devices in io.stat, whose lines
+ * consist of a device followed by key=value fields. The file is only
+ * present when the io controller is enabled for our cgroup.
+ */
+void cgroup2_output_io_stats()
+{
+	char field[64];
+	int64_t stats[NIO_LIMITS] = { 0, 0, 0, 0 };
+	int64_t value;
+	FILE *fp;
+	int fd;
+
+	if ( (fd = cgroup2_open("io.stat"))<0 ) {
+		if ( errno!=ENOENT ) error(errno,"cannot open cgroup file `io.stat'");
+		verbose("io controller not enabled, no block I/O statistics");
+		return;
+	}
+	if ( (fp = fdopen(fd,"r"))==NULL ) error(errno,"cannot open cgroup file `io.stat'");
+
+	while ( fscanf(fp,"%63s",field)==1 ) {
+		if ( sscanf(field,"rbytes=%" SCNd64,&value)==1 ) stats[0] += value;
+		if ( sscanf(field,"wbytes=%" SCNd64,&value)==1 ) stats[1] += value;
+		if ( sscanf(field,"rios=%"   SCNd64,&value)==1 ) stats[2] += value;
+		if ( sscanf(field,"wios=%"   SCNd64,&value)==1 ) stats[3] += value;
+	}
+	if ( fclose(fp)!=0 ) error(errno,"closing cgroup file `io.stat'");
+
+	write_io_meta(stats);
+}
+
+void cgroup2_output_stats(double *cputime, double *usertime, double *systime)
+{
+	int64_t max_usage, cpu_time_usec;
+
+	max_usage = cgroup2_read_int64("memory.peak",NULL);
+
+	verbose("total memory used: %" PRId64 " kB", max_usage/1024);
+	write_meta("memory-bytes","%" PRId64, max_usage);
+
+	/* These include processes not waited for by the command. */
+	cpu_time_usec = cgroup2_read_int64("cpu.stat","usage_usec");
+	*cputime  = (double) cpu_time_usec / 1.e6;
+	*usertime = (double) cgroup2_read_int64("cpu.stat","user_usec") / 1.e6;
+	*systime  = (double) cgroup2_read_int64("cpu.stat","system_usec") / 1.e6;
+
+	cgroup2_output_io_stats();
+}
+
+/* Set 'name' (of size 255) to that of pooled cgroup 'seq', with the
+   trailing slash that cgroup names have here. */
+void cgroup_pool_name(char *name, int seq)
+{
+	snprintf(name,255,"/domjudge/dj_pool_%d_%d/",(int)getpid(),seq);
+}
+
+/* Create the missing ready cgroups of the server pool. The pool is
+   disabled when this fails, e.g. when the parent cgroup is missing. */
+void cgroup_pool_fill()
+{
+	char name[255], path[PATH_MAX];
+	int slot;
+
+	for(slot=0; slot<cgroup_pool_size; slot++) {
+		if ( cgroup_pool_ready[slot]>=0 ) continue;
+		cgroup_pool_name(name,cgroup_pool_seq);
+		snprintf(path,PATH_MAX,"%s%s",CGROUP_ROOT,name);
+		if ( mkdir(path,0755)!=0 ) {
+			warning("cannot create pooled cgroup `%s': %s, disabling cgroup pool",
+			        path,strerror(errno));
+			cgroup_pool_size = 0;
+			return;
+		}
+		cgroup_pool_ready[slot] = cgroup_pool_seq++;
+	}
+}
+
+/* Take a ready cgroup from the server pool for the next request and
+   set 'pooled_cgroupname' to it, or leave it empty if none is ready. */
+void cgroup_pool_take()
+{
+	int slot;
+
+	pooled_cgroupname[0] = 0;
+	for(slot=0; slot<cgroup_pool_size; slot++) {
+		if ( cgroup_pool_ready[slot]>=0 ) {
+			cgroup_pool_name(pooled_cgroupname,cgroup_pool_ready[slot]);
+			cgroup_pool_ready[slot] = -1;
+			return;
+		}
+	}
+}
+
+/* Remove the ready cgroups of the server pool when it stops. */
+void cgroup_pool_delete()
+{
+	char name[255], path[PATH_MAX];
+	int slot;
+
+	for(slot=0; slot<cgroup_pool_size; slot++) {
+		if ( cgroup_pool_ready[slot]<0 ) continue;
+		cgroup_pool_name(name,cgroup_pool_ready[slot]);
+		snprintf(path,PATH_MAX,"%s%s",CGROUP_ROOT,name);
+		if ( rmdir(path)!=0 ) warning("cannot delete pooled cgroup `%s': %s",path,strerror(errno));
+	}
+}
+
+void cgroup2_create()
+{
+	int i;
+
+	/* The memory and cpuset controllers must have been enabled in
+	   the subtree_control of the parent cgroup, see create_cgroups.
+	   A pooled cgroup has been created by the server already. */
+	if ( pooled_cgroupname[0]==0 && mkdir(cgroupdir,0755)!=0 ) {
+		error(errno,"creating cgroup `%s'",cgroupdir);
+	}
+
+	/* Limit ram use and disable swap, so that memory.peak measures
+	   the same as memory.memsw.max_usage_in_bytes under cgroup v1. */
+	if ( memsize!=RLIM_INFINITY ) {
+		cgroup2_write("memory.max","%" PRId64,memsize);
+	}
+	cgroup2_write("memory.swap.max","0");
+
+	if ( cpuset!=NULL && strlen(cpuset)>0 ) {
+		cgroup2_write("cpuset.cpus","%s",reserve_smt ? cgroup_cpus : cpuset);
+		if ( timing_profile ) cgroup2_write("cpuset.mems","%s",cpuset_mems);
+	} else {
+		verbose("cpuset undefined");
+	}
+
+	if ( use_io_limits ) {
+		if ( !find_io_device() ) {
+			warning("run directory not on a block device, not limiting I/O");
+		} else {
+			for(i=0; i<NIO_LIMITS; i++) {
+				if ( io_limits[i]<0 ) continue;
+				cgroup2_write("io.max","%s %s=%" PRId64,io_device,
+				              io_limit_keys[i],io_limits[i]);
+			}
+		}
+	}
+
+	verbose("created cgroup '%s'",cgroupdir);
+}
+
+void cgroup2_attach(pid_t pid)
+{
+	cgroup2_write("cgroup.procs","%d",(int)pid);
+}
+
+/* Kill all tasks in cgroup v2 directory 'dir'. */
+void cgroup2_kill(const char *dir)
+{
+	char path[PATH_MAX];
+	struct pollfd pfd;
+	int64_t populated;
+	int ret;
+
+	/* Kill all remaining tasks with a single write, and wait for the
+	   kernel to report the cgroup as no longer populated: it signals
+	   changes of cgroup.events with POLLPRI. Open it first, so that
+	   the change cannot be missed. */
+	snprintf(path,PATH_MAX,"%scgroup.events",dir);
+	if ( (pfd.fd = open(path,O_RDONLY | O_CLOEXEC))<0 ) {
+		error(errno,"cannot open cgroup file `%s'",path);
+	}
+	pfd.events = POLLPRI;
+	cgroup2_write_in(dir,"cgroup.kill","1");
+
+	while ( (populated = read_counter(pfd.fd,"populated"))!=0 ) {
+		if ( populated<0 ) error(0,"cannot read populated from `%s'",path);
+		if ( (ret = poll(&pfd,1,CGROUP_KILL_TIMEOUT))<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno,"waiting for cgroup `%s' to empty",dir);
+		}
+		if ( ret==0 ) {
+			error(0,"cgroup `%s' still populated after %d ms",dir,CGROUP_KILL_TIMEOUT);
+		}
+	}
+	if ( close(pfd.fd)!=0 ) error(errno,"closing cgroup file `%s'",path);
+}
+
+void cgroup2_delete()
+{
+	/* Deleting may wait for the kernel to offline the memory cgroup,
+	   so a pooled cgroup is deleted after replying, see run_command(). */
+	if ( pooled_cgroupname[0]!=0 ) return;
+
+	if ( rmdir(cgroupdir)!=0 ) error(errno,"deleting cgroup `%s'",cgroupdir);
+
+	verbose("deleted cgroup '%s'",cgroupdir);
+}
+
+/* Sum the "Read" and "Write" lines over all devices of cgroup v1
+   blkio statistics file 'file' into 'stats'. */
+void blkio_read_stats(const char *file, int64_t *stats)
+{
+	char path[PATH_MAX];
+	char line[256], op[16];
+	char *mountpoint;
+	int64_t value;
+	FILE *fp;
+	int ret;
+
+	if ( (ret = cgroup_get_subsys_mount_point("blkio",&mountpoint))!=0 ) {
+		error(ret,"getting blkio cgroup mount point");
+	}
+	snprintf(path,PATH_MAX,"%s%s%s",mountpoint,cgroupname,file);
+	free(mountpoint);
+
+	if ( (fp = fopen(path,"r"))==NULL ) error(errno,"cannot open cgroup file `%s'",path);
+	while ( fgets(line,sizeof(line),fp)!=NULL ) {
+		if ( sscanf(line,"%*s %15s %" SCNd64,op,&value)!=2 ) continue;
+		if ( strcmp(op,"Read")==0  ) stats[0] += value;
+		if ( strcmp(op,"Write")==0 ) stats[1] += value;
+	}
+	if ( fclose(fp)!=0 ) error(errno,"closing cgroup file `%s'",path);
+}
+
+/* Report cgroup statistics; the CPU times are only overwritten when
+   the cgroup provides them. */
+void output_cgroup_stats(double *cputime, double *usertime, double *systime)
 {
 	int ret;
 	int64_t max_usage, cpu_time_int;
@@ -460,6 +1358,11 @@ void output_cgroup_stats(double *cputime)
 
 	if ( !use_cgroup() ) return;
 
+	if ( cgroupv2 ) {
+		cgroup2_output_stats(cputime,usertime,systime);
+		return;
+	}
+
 	if ( (cg = cgroup_new_cgroup(cgroupname))==NULL ) error(0,"cgroup_new_cgroup");
 	if ((ret = cgroup_get_cgroup(cg)) != 0) error(ret,"get cgroup information");
 
@@ -477,6 +1380,14 @@ void output_cgroup_stats(double *cputime)
 	*cputime = (double) cpu_time_int / 1.e9;
 
 	cgroup_free(&cg);
+
+	if ( use_blkio ) {
+		int64_t stats[NIO_LIMITS] = { 0, 0, 0, 0 };
+
+		blkio_read_stats("blkio.throttle.io_service_bytes",stats);
+		blkio_read_stats("blkio.throttle.io_serviced",stats+2);
+		write_io_meta(stats);
+	}
 }
 
 /* Temporary shorthand define for error handling. */
@@ -486,12 +1397,19 @@ void output_cgroup_stats(double *cputime)
 
 void cgroup_create()
 {
-	int ret;
+	int ret, i;
+	char *mountpoint;
+	char str[64];
 	struct cgroup *cg;
 	struct cgroup_controller *cg_controller;
 
 	if ( !use_cgroup() ) return;
 
+	if ( cgroupv2 ) {
+		cgroup2_create();
+		return;
+	}
+
 	cg = cgroup_new_cgroup(cgroupname);
 	if (!cg) error(0,"cgroup_new_cgroup");
 
@@ -514,8 +1432,8 @@ void cgroup_create()
 		/* To make a cpuset exclusive, some additional setup outside of domjudge is
 		   required, so for now, we will leave this commented out. */
 		/* cgroup_add_value_int64(cg_controller, "cpuset.cpu_exclusive", 1); */
-		cgroup_add_value(string, "cpuset.mems", "0");
-		cgroup_add_value(string, "cpuset.cpus", cpuset);
+		cgroup_add_value(string, "cpuset.mems", cpuset_mems);
+		cgroup_add_value(string, "cpuset.cpus", reserve_smt ? cgroup_cpus : cpuset);
 	} else {
 		verbose("cpuset undefined");
 	}
@@ -524,6 +1442,26 @@ void cgroup_create()
 		error(0,"cgroup_add_controller cpuacct");
 	}
 
+	/* Block I/O accounting and throttling is optional, depending on
+	   whether the blkio controller is mounted. */
+	if ( (ret = cgroup_get_subsys_mount_point("blkio",&mountpoint))==0 ) free(mountpoint);
+	use_blkio = ( ret==0 );
+	if ( use_io_limits && !use_blkio ) error(0,"blkio cgroup needed for option `io-max'");
+	if ( use_blkio ) {
+		if ( (cg_controller = cgroup_add_controller(cg, "blkio"))==NULL ) {
+			error(0,"cgroup_add_controller blkio");
+		}
+		if ( use_io_limits && !find_io_device() ) {
+			warning("run directory not on a block device, not limiting I/O");
+		} else if ( use_io_limits ) {
+			for(i=0; i<NIO_LIMITS; i++) {
+				if ( io_limits[i]<0 ) continue;
+				snprintf(str,sizeof(str),"%s %" PRId64,io_device,io_limits[i]);
+				cgroup_add_value(string, io_limit_blkio_files[i], str);
+			}
+		}
+	}
+
 	/* Perform the actual creation of the cgroup */
 	if ( (ret = cgroup_create_cgroup(cg, 1))!=0 ) error(ret,"creating cgroup");
 
@@ -533,50 +1471,159 @@ void cgroup_create()
 
 #undef cgroup_setval
 
-void cgroup_attach()
+/* Put process 'pid' in our cgroup. */
+void cgroup_attach(pid_t pid)
 {
 	int ret;
 	struct cgroup *cg;
 
 	if ( !use_cgroup() ) return;
 
+	if ( cgroupv2 ) {
+		cgroup2_attach(pid);
+		return;
+	}
+
 	cg = cgroup_new_cgroup(cgroupname);
 	if (!cg) error(0,"cgroup_new_cgroup");
 
 	if ( (ret = cgroup_get_cgroup(cg))!=0 ) error(ret,"get cgroup information");
 
 	/* Attach task to the cgroup */
-	if ( (ret = cgroup_attach_task(cg))!=0 ) error(ret,"attach task to cgroup");
+	if ( (ret = cgroup_attach_task_pid(cg,pid))!=0 ) error(ret,"attach task to cgroup");
 
 	cgroup_free(&cg);
 }
 
-void cgroup_kill()
+/* Read key 'key' from the flat keyed file 'path', or -1 if absent. */
+int64_t read_keyed_int64(const char *path, const char *key)
 {
-	int ret;
-	void *handle = NULL;
-	pid_t pid;
-
-	if ( !use_cgroup() ) return;
+	char name[64];
+	int64_t value;
+	FILE *fp;
 
-	/* kill any remaining tasks, and wait for them to be gone */
-	while(1) {
-		ret = cgroup_get_task_begin(cgroupname, "memory", &handle, &pid);
-		cgroup_get_task_end(&handle);
-		if (ret == ECGEOF) break;
-		kill(pid, SIGKILL);
+	if ( (fp = fopen(path,"r"))==NULL ) return -1;
+	while ( fscanf(fp,"%63s %" SCNd64,name,&value)==2 ) {
+		if ( strcmp(name,key)==0 ) {
+			fclose(fp);
+			return value;
+		}
 	}
+	fclose(fp);
+
+	return -1;
 }
 
-void cgroup_delete()
+/* Drop the page cache charged to our (already empty) cgroup, such
+ * that the files COMMAND used need not be evicted one by one. The
+ * file cache is read from memory.stat key 'cachekey' before and after
+ * writing 'value' to 'file', or the number of cached bytes if 'value'
+ * is NULL. Only reports the result when the kernel supports the
+ * operation, so that callers can fall back otherwise.
+ */
+void reclaim_cgroup_cache(const char *dir, const char *cachekey,
+                          const char *file, const char *value)
 {
-	int ret;
-	struct cgroup *cg;
+	char path[PATH_MAX], amount[32];
+	int64_t before, after;
+	int fd, ret;
+
+	snprintf(path,PATH_MAX,"%smemory.stat",dir);
+	if ( (before = read_keyed_int64(path,cachekey))<0 ) {
+		warning("cannot read page cache usage from `%s'",path);
+		return;
+	}
+	if ( value==NULL ) {
+		snprintf(amount,sizeof(amount),"%" PRId64,before);
+		value = amount;
+	}
 
-	if ( !use_cgroup() ) return;
+	snprintf(path,PATH_MAX,"%s%s",dir,file);
+	if ( (fd = open(path,O_WRONLY | O_CLOEXEC))<0 ) {
+		verbose("page cache reclaim not supported: cannot open `%s'",path);
+		return;
+	}
+	if ( before==0 ) {
+		close(fd);
+		write_meta("cache-reclaimed","0");
+		return;
+	}
+	ret = write(fd,value,strlen(value));
+	/* memory.reclaim reports EAGAIN when it reclaimed less than asked,
+	   which is expected for pages that are in use elsewhere. */
+	if ( ret<0 && errno!=EAGAIN ) {
+		warning("cannot reclaim page cache via `%s': %s",path,strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
 
-	cg = cgroup_new_cgroup(cgroupname);
-	if (!cg) error(0,"cgroup_new_cgroup");
+	snprintf(path,PATH_MAX,"%smemory.stat",dir);
+	if ( (after = read_keyed_int64(path,cachekey))<0 ) after = before;
+
+	verbose("reclaimed %" PRId64 " of %" PRId64 " bytes page cache",before-after,before);
+	write_meta("cache-reclaimed","%" PRId64,before-after);
+}
+
+void cgroup_reclaim_cache()
+{
+	char dir[PATH_MAX];
+	char *mountpoint;
+	int ret;
+
+	if ( !use_cgroup() || !reclaim_cache ) return;
+
+	if ( cgroupv2 ) {
+		reclaim_cgroup_cache(cgroupdir,"file","memory.reclaim",NULL);
+		return;
+	}
+
+	if ( (ret = cgroup_get_subsys_mount_point("memory",&mountpoint))!=0 ) {
+		error(ret,"getting memory cgroup mount point");
+	}
+	snprintf(dir,PATH_MAX,"%s%s",mountpoint,cgroupname);
+	free(mountpoint);
+
+	/* Without tasks, force_empty reclaims all pages of the cgroup. */
+	reclaim_cgroup_cache(dir,"cache","memory.force_empty","0");
+}
+
+void cgroup_kill()
+{
+	int ret;
+	void *handle = NULL;
+	pid_t pid;
+
+	if ( !use_cgroup() ) return;
+
+	if ( cgroupv2 ) {
+		cgroup2_kill(cgroupdir);
+		return;
+	}
+
+	/* kill any remaining tasks, and wait for them to be gone */
+	while(1) {
+		ret = cgroup_get_task_begin(cgroupname, "memory", &handle, &pid);
+		cgroup_get_task_end(&handle);
+		if (ret == ECGEOF) break;
+		kill(pid, SIGKILL);
+	}
+}
+
+void cgroup_delete()
+{
+	int ret;
+	struct cgroup *cg;
+
+	if ( !use_cgroup() ) return;
+
+	if ( cgroupv2 ) {
+		cgroup2_delete();
+		return;
+	}
+
+	cg = cgroup_new_cgroup(cgroupname);
+	if (!cg) error(0,"cgroup_new_cgroup");
 
 	if ( cgroup_add_controller(cg, "cpuacct")==NULL ) error(0,"cgroup_add_controller cpuacct");
 	if ( cgroup_add_controller(cg, "memory")==NULL ) error(0,"cgroup_add_controller cpuacct");
@@ -584,6 +1631,9 @@ void cgroup_delete()
 	if ( cpuset!=NULL && strlen(cpuset)>0 ) {
 		if ( cgroup_add_controller(cg, "cpuset")==NULL ) error(0,"cgroup_add_controller cpuacct");
 	}
+	if ( use_blkio ) {
+		if ( cgroup_add_controller(cg, "blkio")==NULL ) error(0,"cgroup_add_controller blkio");
+	}
 	/* Clean up our cgroup */
 	ret = cgroup_delete_cgroup_ext(cg, CGFLAG_DELETE_IGNORE_MIGRATION | CGFLAG_DELETE_RECURSIVE);
 	if ( ret!=0 ) error(ret,"deleting cgroup");
@@ -593,26 +1643,717 @@ void cgroup_delete()
 	verbose("deleted cgroup '%s'",cgroupname);
 }
 
-void terminate(int sig)
+/* Parse a kernel CPU (or node) list such as "0,2-3" into 'set'.
+   Returns 0 if the list is malformed. */
+int parse_cpulist(const char *list, cpu_set_t *set)
 {
-	struct sigaction sigact;
+	const char *ptr = list;
+	char *end;
+	long first, last, i;
+
+	CPU_ZERO(set);
+	while ( *ptr!='\0' && *ptr!='\n' ) {
+		first = last = strtol(ptr,&end,10);
+		if ( end==ptr ) return 0;
+		if ( *end=='-' ) {
+			ptr = end+1;
+			last = strtol(ptr,&end,10);
+			if ( end==ptr ) return 0;
+		}
+		if ( first<0 || last<first || last>=CPU_SETSIZE ) return 0;
+		for(i=first; i<=last; i++) CPU_SET(i,set);
+		ptr = end;
+		if ( *ptr==',' ) ptr++;
+	}
+
+	return 1;
+}
+
+/* Format 'set' as a comma separated list in 'str' of size 'len'. */
+void format_cpulist(const cpu_set_t *set, char *str, size_t len)
+{
+	size_t pos = 0;
+	int i;
+
+	str[0] = 0;
+	for(i=0; i<CPU_SETSIZE && pos<len; i++) {
+		if ( CPU_ISSET(i,set) ) {
+			pos += snprintf(str+pos,len-pos,"%s%d",pos>0 ? "," : "",i);
+		}
+	}
+	if ( pos>=len ) error(0,"CPU list too long");
+}
+
+/* Read the first line of sysfs file 'path' into 'str' of size 'len',
+   without trailing newline. Returns 0 if the file cannot be read. */
+int read_sysfs(const char *path, char *str, size_t len)
+{
+	FILE *fp;
+	int ok;
+
+	if ( (fp = fopen(path,"r"))==NULL ) return 0;
+	ok = ( fgets(str,len,fp)!=NULL );
+	fclose(fp);
+	if ( ok ) str[strcspn(str,"\n")] = 0;
 
-	/* Reset signal handlers to default */
-	sigact.sa_handler = SIG_DFL;
-	sigact.sa_flags = 0;
-	if ( sigemptyset(&sigact.sa_mask)!=0 ) {
-		warning("could not initialize signal mask");
+	return ok;
+}
+
+/* Derive the cgroup cpuset for a timing profile from the cpuset
+ * option: the NUMA nodes of its CPUs become the memory nodes, and with
+ * `smt' all SMT siblings of its CPUs are added to the cgroup, while the
+ * command itself is restricted to the cpuset by set_affinity(). Also
+ * record the frequency governor and current frequency of its CPUs.
+ */
+void setup_timing_profile()
+{
+	cpu_set_t cgroupset, online, nodes, nodecpus;
+	char path[PATH_MAX], str[1024];
+	size_t govlen, freqlen;
+	int cpu, node;
+
+	cpuset_mems = "0";
+	if ( !timing_profile ) return;
+	if ( cpuset==NULL || strlen(cpuset)==0 ) error(0,"a timing profile requires a cpuset");
+	if ( !parse_cpulist(cpuset,&run_cpus) ) error(0,"invalid cpuset `%s'",cpuset);
+
+	cgroupset = run_cpus;
+	CPU_ZERO(&nodes);
+	cpu_governors[0] = cpu_frequencies[0] = 0;
+	govlen = freqlen = 0;
+	for(cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if ( !CPU_ISSET(cpu,&run_cpus) ) continue;
+
+		if ( reserve_smt ) {
+			snprintf(path,PATH_MAX,SYSFS_CPU_PATH "/cpu%d/topology/thread_siblings_list",cpu);
+			if ( read_sysfs(path,str,sizeof(str)) && parse_cpulist(str,&nodecpus) ) {
+				CPU_OR(&cgroupset,&cgroupset,&nodecpus);
+			} else {
+				warning("cannot determine SMT siblings of CPU %d",cpu);
+			}
+		}
+
+		/* Frequency scaling is often not available in virtual machines. */
+		snprintf(path,PATH_MAX,SYSFS_CPU_PATH "/cpu%d/cpufreq/scaling_governor",cpu);
+		if ( read_sysfs(path,str,sizeof(str)) && govlen<sizeof(cpu_governors) ) {
+			govlen += snprintf(cpu_governors+govlen,sizeof(cpu_governors)-govlen,
+			                   "%s%s",govlen>0 ? "," : "",str);
+		}
+		snprintf(path,PATH_MAX,SYSFS_CPU_PATH "/cpu%d/cpufreq/scaling_cur_freq",cpu);
+		if ( read_sysfs(path,str,sizeof(str)) && freqlen<sizeof(cpu_frequencies) ) {
+			freqlen += snprintf(cpu_frequencies+freqlen,sizeof(cpu_frequencies)-freqlen,
+			                    "%s%s",freqlen>0 ? "," : "",str);
+		}
+	}
+
+	/* Find the NUMA nodes of the CPUs; without NUMA support, all
+	   memory is on node 0. */
+	if ( !read_sysfs(SYSFS_NODE_PATH "/online",str,sizeof(str)) ||
+	     !parse_cpulist(str,&online) ) {
+		CPU_ZERO(&online);
 	}
-	if ( sigaction(SIGTERM,&sigact,NULL)!=0 ) {
-		warning("could not restore signal handler");
+	for(node=0; node<CPU_SETSIZE; node++) {
+		if ( !CPU_ISSET(node,&online) ) continue;
+		snprintf(path,PATH_MAX,SYSFS_NODE_PATH "/node%d/cpulist",node);
+		if ( !read_sysfs(path,str,sizeof(str)) ||
+		     !parse_cpulist(str,&nodecpus) ) {
+			error(0,"cannot read CPUs of NUMA node %d",node);
+		}
+		CPU_AND(&nodecpus,&nodecpus,&run_cpus);
+		if ( CPU_COUNT(&nodecpus)>0 ) CPU_SET(node,&nodes);
+	}
+	if ( CPU_COUNT(&nodes)>0 ) {
+		format_cpulist(&nodes,cpuset_mems_buf,sizeof(cpuset_mems_buf));
+		cpuset_mems = cpuset_mems_buf;
 	}
-	if ( sigaction(SIGALRM,&sigact,NULL)!=0 ) {
-		warning("could not restore signal handler");
+	verbose("using memory nodes %s for cpuset %s",cpuset_mems,cpuset);
+
+	if ( reserve_smt ) {
+		format_cpulist(&cgroupset,cgroup_cpus,sizeof(cgroup_cpus));
+		verbose("reserving SMT siblings, cgroup cpuset %s",cgroup_cpus);
 	}
+}
+
+/* Restrict process 'pid', or ourselves when 0, to the cpuset when SMT
+   siblings are reserved in the cgroup. */
+void set_affinity(pid_t pid)
+{
+	if ( !reserve_smt ) return;
+
+	if ( sched_setaffinity(pid,sizeof(run_cpus),&run_cpus)!=0 ) {
+		error(errno,"setting CPU affinity");
+	}
+}
+
+void output_timing_profile()
+{
+	if ( !timing_profile ) return;
+
+	write_meta("cpuset-mems","%s",cpuset_mems);
+	if ( reserve_smt ) write_meta("cpuset-reserved","%s",cgroup_cpus);
+	if ( cpu_governors[0]!=0 ) write_meta("cpu-governor","%s",cpu_governors);
+	if ( cpu_frequencies[0]!=0 ) write_meta("cpu-frequency-khz","%s",cpu_frequencies);
+}
+
+/* Attach a performance counter to the forked, not yet executed
+   command. It is inherited by all its descendants and only starts
+   counting at exec(), so runguard's own setup is not included.
+   Returns -1 when the counter is not supported by the host (e.g.
+   hardware counters inside virtual machines). */
+int perf_counter_open(const char *name, uint32_t type, uint64_t config, int exclude_kernel)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr,0,sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.type           = type;
+	attr.config         = config;
+	attr.disabled       = 1;
+	attr.enable_on_exec = 1;
+	attr.inherit        = 1;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv     = 1;
+	attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd = syscall(SYS_perf_event_open, &attr, child_pid, -1, -1,
+	             PERF_FLAG_FD_CLOEXEC);
+	if ( fd<0 ) {
+		verbose("performance counter %s not available: %s",
+		        name, strerror(errno));
+	}
+	return fd;
+}
+
+/* Read and close the counter 'fd', or return -1 when not available. */
+double perf_counter_read(const char *name, int fd)
+{
+	uint64_t data[3]; /* value, time enabled, time running */
+	double value;
+
+	if ( fd<0 ) return -1;
+
+	if ( read(fd,data,sizeof(data))!=sizeof(data) ) {
+		error(errno,"reading performance counter %s",name);
+	}
+	if ( close(fd)!=0 ) error(errno,"closing performance counter");
+
+	/* Scale the value when the counter was multiplexed. */
+	value = data[0];
+	if ( data[2]>0 && data[2]<data[1] ) value *= (double)data[1] / data[2];
+
+	verbose("%s: %.0f",name,value);
+	return value;
+}
+
+void perf_open()
+{
+	int i;
+
+	for(i=0; i<NPERF_COUNTERS; i++) {
+		perffd[i] = perf_counter_open(perf_counters[i].key, perf_counters[i].type,
+		                              perf_counters[i].config,
+		                              perf_counters[i].exclude_kernel);
+	}
+}
+
+void output_perf_stats()
+{
+	double value;
+	int i;
+
+	for(i=0; i<NPERF_COUNTERS; i++) {
+		value = perf_counter_read(perf_counters[i].key, perffd[i]);
+		perffd[i] = -1;
+		if ( value>=0 ) write_meta(perf_counters[i].key,"%.0f",value);
+	}
+}
+
+/* Return the id of tracepoint 'event' from the tracefs, or -1 when
+   it is not available. */
+long tracepoint_id(const char *event)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	long id = -1;
+
+	snprintf(path,PATH_MAX,"%s/events/%s/id",TRACEFS_PATH,event);
+	if ( (fp = fopen(path,"r"))==NULL ) {
+		snprintf(path,PATH_MAX,"%s/events/%s/id",TRACEFS_PATH_OLD,event);
+		if ( (fp = fopen(path,"r"))==NULL ) return -1;
+	}
+	if ( fscanf(fp,"%ld",&id)!=1 ) id = -1;
+	fclose(fp);
+
+	return id;
+}
+
+/* Attach counters of syscalls and page faults to the forked command,
+   as perf_open() does. These count tracepoint and software events in
+   the kernel, so unlike ptrace they don't slow down the command. */
+void syscall_profile_open()
+{
+	char event[64];
+	long id;
+	int i;
+
+	profilefd_total = -1;
+	if ( (id = tracepoint_id("raw_syscalls/sys_enter"))>=0 ) {
+		profilefd_total = perf_counter_open("syscalls",PERF_TYPE_TRACEPOINT,id,0);
+	} else {
+		verbose("syscall tracepoints not available in %s",TRACEFS_PATH);
+	}
+	for(i=0; i<NPROFILE_SYSCALLS; i++) {
+		profilefd[i] = -1;
+		if ( profilefd_total<0 ) continue;
+		snprintf(event,sizeof(event),"syscalls/sys_enter_%s",profile_syscalls[i]);
+		if ( (id = tracepoint_id(event))>=0 ) {
+			profilefd[i] = perf_counter_open(event,PERF_TYPE_TRACEPOINT,id,0);
+		}
+	}
+	profilefd_minflt = perf_counter_open("page-faults-minor",PERF_TYPE_SOFTWARE,
+	                                     PERF_COUNT_SW_PAGE_FAULTS_MIN,0);
+	profilefd_majflt = perf_counter_open("page-faults-major",PERF_TYPE_SOFTWARE,
+	                                     PERF_COUNT_SW_PAGE_FAULTS_MAJ,0);
+}
+
+/* Write the syscall total, the separately counted syscalls that were
+   used as "name:count ..." in decreasing order, and the page faults. */
+void output_syscall_profile()
+{
+	double total, value, counts[NPROFILE_SYSCALLS], other;
+	char profile[NPROFILE_SYSCALLS*32+32];
+	size_t len = 0;
+	int i, j, best;
+
+	total = perf_counter_read("syscalls",profilefd_total);
+	other = total;
+	for(i=0; i<NPROFILE_SYSCALLS; i++) {
+		counts[i] = perf_counter_read(profile_syscalls[i],profilefd[i]);
+		profilefd[i] = -1;
+		if ( counts[i]>0 ) other -= counts[i];
+	}
+	profilefd_total = -1;
+
+	if ( total>=0 ) {
+		write_meta("syscalls","%.0f",total);
+		profile[0] = 0;
+		for(j=0; j<NPROFILE_SYSCALLS; j++) {
+			best = -1;
+			for(i=0; i<NPROFILE_SYSCALLS; i++) {
+				if ( counts[i]>0 && (best<0 || counts[i]>counts[best]) ) best = i;
+			}
+			if ( best<0 ) break;
+			len += snprintf(profile+len,sizeof(profile)-len,"%s%s:%.0f",
+			                len>0 ? " " : "",profile_syscalls[best],counts[best]);
+			counts[best] = 0;
+		}
+		if ( other>0 ) {
+			snprintf(profile+len,sizeof(profile)-len,"%sother:%.0f",
+			         len>0 ? " " : "",other);
+		}
+		write_meta("syscall-profile","%s",profile);
+	}
+
+	if ( (value = perf_counter_read("page-faults-minor",profilefd_minflt))>=0 ) {
+		write_meta("page-faults-minor","%.0f",value);
+	}
+	if ( (value = perf_counter_read("page-faults-major",profilefd_majflt))>=0 ) {
+		write_meta("page-faults-major","%.0f",value);
+	}
+	profilefd_minflt = profilefd_majflt = -1;
+}
+
+/* Read the value of 'key' from counter file 'fd', or the first number
+   when 'key' is NULL. Lines are of the form "key value" or "key: value".
+   Returns -1 when the value is not available. */
+int64_t read_counter(int fd, const char *key)
+{
+	char data[1024];
+	ssize_t len;
+	size_t keylen;
+	char *ptr;
+
+	if ( fd<0 ) return -1;
+	if ( (len = pread(fd,data,sizeof(data)-1,0))<=0 ) return -1;
+	data[len] = 0;
+
+	if ( key==NULL ) return strtoll(data,NULL,10);
+
+	keylen = strlen(key);
+	for(ptr=data; ptr!=NULL && *ptr!=0; ptr=strchr(ptr,'\n')) {
+		if ( *ptr=='\n' ) ptr++;
+		if ( strncmp(ptr,key,keylen)==0 && (ptr[keylen]==' ' || ptr[keylen]==':') ) {
+			return strtoll(ptr+keylen+1,NULL,10);
+		}
+	}
+
+	return -1;
+}
+
+/* Open the CPU usage counter of the cgroup, or return -1. */
+int cgroup_cpu_open()
+{
+	char path[PATH_MAX];
+	char *mountpoint;
+	int ret, fd;
+
+	if ( !use_cgroup() ) return -1;
+	if ( cgroupv2 ) return cgroup2_open("cpu.stat");
+
+	if ( (ret = cgroup_get_subsys_mount_point("cpuacct",&mountpoint))!=0 ) {
+		error(ret,"getting cpuacct cgroup mount point");
+	}
+	snprintf(path,PATH_MAX,"%s%scpuacct.usage",mountpoint,cgroupname);
+	fd = open(path,O_RDONLY | O_CLOEXEC);
+	free(mountpoint);
+
+	return fd;
+}
+
+/* Read the cgroup CPU usage in microseconds from the counter opened
+   by cgroup_cpu_open(), or return -1. */
+int64_t cgroup_cpu_read(int fd)
+{
+	int64_t usage;
+
+	if ( cgroupv2 ) return read_counter(fd,"usage_usec");
+
+	if ( (usage = read_counter(fd,NULL))>=0 ) usage /= 1000;
+	return usage;
+}
+
+/* Set timerfd 'fd' to expire once after 'seconds' (at least 1 ns). */
+void set_timer(int fd, double seconds)
+{
+	struct itimerspec its;
+	double tmpd;
+
+	memset(&its,0,sizeof(its));
+	its.it_value.tv_sec  = (time_t) seconds;
+	its.it_value.tv_nsec = (long)(modf(seconds,&tmpd) * 1E9);
+	/* An all-zero it_value would disarm the timer. */
+	if ( its.it_value.tv_sec==0 && its.it_value.tv_nsec==0 ) {
+		its.it_value.tv_nsec = 1;
+	}
+	if ( timerfd_settime(fd,0,&its,NULL)!=0 ) error(errno,"setting timer");
+}
+
+/* Kill all processes of the command right away: with cgroup v2 with a
+   single write, otherwise its process group. Any processes that
+   escaped the latter are killed by cgroup_kill() afterwards. */
+void kill_command()
+{
+	if ( use_cgroup() && cgroupv2 ) {
+		cgroup2_write("cgroup.kill","1");
+	} else if ( kill(-child_pid,SIGKILL)!=0 && errno!=ESRCH ) {
+		error(errno,"sending SIGKILL to command");
+	}
+}
+
+/* Kill the command when the cgroup has used up its hard CPU time
+   limit. Otherwise check again when it could have at the earliest:
+   when running on all its CPUs. */
+void cpuwatch_check()
+{
+	int64_t usage;
+	double remaining;
+
+	if ( (usage = cgroup_cpu_read(cpuwatchfd))<0 ) return;
+	remaining = cputimelimit[1] - usage/1E6;
+
+	if ( remaining<=0 ) {
+		if ( cpulimit_reached & hard_timelimit ) return;
+		cpulimit_reached |= hard_timelimit;
+		warning("timelimit exceeded (hard cpu time): aborting command");
+		kill_command();
+		return;
+	}
+
+	set_timer(cputimerfd, max(remaining/cpuwatch_ncpus, CPUWATCH_MIN_INTERVAL));
+}
+
+/* Start watching the CPU time of the cgroup, if it can be read.
+   RLIMIT_CPU is rounded up to whole seconds and applies per process,
+   so a multithreaded or forking command could otherwise use several
+   times its hard limit. Returns the timerfd to watch or -1. */
+int cpuwatch_start()
+{
+	cpu_set_t cpus;
+
+	cputimerfd = -1;
+	if ( !use_cputime || (cpuwatchfd = cgroup_cpu_open())<0 ) return -1;
+
+	cpuwatch_ncpus = get_nprocs();
+	if ( sched_getaffinity(child_pid,sizeof(cpus),&cpus)==0 ) {
+		cpuwatch_ncpus = CPU_COUNT(&cpus);
+	}
+
+	if ( (cputimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC))<0 ) {
+		error(errno,"creating cpu time timer");
+	}
+	verbose("watching cgroup cpu time on %d cpus",cpuwatch_ncpus);
+	cpuwatch_check();
+
+	return cputimerfd;
+}
+
+void cpuwatch_stop()
+{
+	if ( cputimerfd>=0 && close(cputimerfd)!=0 ) error(errno,"closing cpu time timer");
+	if ( cpuwatchfd>=0 && close(cpuwatchfd)!=0 ) error(errno,"closing cgroup cpu counter");
+	cputimerfd = cpuwatchfd = -1;
+}
+
+/* Open file 'file' of the cgroup v1 memory controller with 'flags',
+   or return -1. */
+int cgroup1_memory_open(const char *file, int flags)
+{
+	char path[PATH_MAX];
+	char *mountpoint;
+	int ret, fd;
+
+	if ( (ret = cgroup_get_subsys_mount_point("memory",&mountpoint))!=0 ) {
+		error(ret,"getting memory cgroup mount point");
+	}
+	snprintf(path,PATH_MAX,"%s%s%s",mountpoint,cgroupname,file);
+	fd = open(path,flags | O_CLOEXEC);
+	free(mountpoint);
+
+	return fd;
+}
+
+/* Update the memory peaks and event counts from the cgroup. Anonymous
+   and page cache memory are only known at the moments this is called,
+   so their peaks are those seen at memory events and at the end. */
+void memwatch_update()
+{
+	int64_t anon, file, val;
+
+	if ( cgroupv2 ) {
+		anon = read_counter(memstatfd,"anon");
+		file = read_counter(memstatfd,"file");
+		if ( (val = read_counter(memeventsfd,"oom"))>=0 ) mem_oom_events = val;
+		if ( (val = read_counter(memeventsfd,"oom_kill"))>=0 ) mem_oom_kills = val;
+		if ( (val = read_counter(memeventsfd,"max"))>=0 ) mem_max_events = val;
+	} else {
+		anon = read_counter(memstatfd,"rss");
+		file = read_counter(memstatfd,"cache");
+		if ( (val = read_counter(memeventsfd,"oom_kill"))>=0 ) mem_oom_kills = val;
+		if ( (val = read_counter(memfailfd,NULL))>=0 ) mem_max_events = val;
+	}
+	if ( anon>mem_peak_anon ) mem_peak_anon = anon;
+	if ( file>mem_peak_file ) mem_peak_file = file;
+}
+
+/* Kill the command when it ran out of memory: the OOM killer may
+   otherwise kill just one of its processes, and a thrashing command
+   would run until the time limit. */
+void memwatch_abort(const char *reason)
+{
+	if ( memory_limit_reached ) return;
+	memory_limit_reached = 1;
+	warning("memory limit exceeded (%s): aborting command",reason);
+	kill_command();
+}
+
+/* Handle a memory event of the cgroup with 'tag' EVENT_MEMORY or
+   EVENT_MEMPRESS. Reading memory.events rearms its notification. */
+void memwatch_check(uint32_t tag)
+{
+	uint64_t count;
+
+	if ( !cgroupv2 && read(memwatchfd,&count,sizeof(count))==sizeof(count) ) {
+		mem_oom_events += count;
+	}
+	memwatch_update();
+
+	if ( tag==EVENT_MEMPRESS ) {
+		memwatch_abort("thrashing");
+	} else if ( mem_oom_events>0 || mem_oom_kills>0 ) {
+		memwatch_abort("out of memory");
+	}
+}
+
+/* Start watching the memory events of the cgroup when it has a memory
+   limit. With cgroup v2 memory.events signals changes with EPOLLPRI;
+   with v1 an eventfd is registered for OOM notifications. Returns the
+   fd to watch for EVENT_MEMORY or -1; 'mempressfd' is set when a PSI
+   trigger could be added as well. */
+int memwatch_start()
+{
+	char path[PATH_MAX], str[64];
+	int ctlfd;
+
+	memwatchfd = mempressfd = memeventsfd = memstatfd = memfailfd = -1;
+	memory_limit_reached = 0;
+	mem_peak_anon = mem_peak_file = 0;
+	mem_oom_events = mem_oom_kills = mem_max_events = 0;
+	if ( !use_cgroup() || memsize==RLIM_INFINITY ) return -1;
+
+	if ( cgroupv2 ) {
+		memstatfd = cgroup2_open("memory.stat");
+		if ( (memeventsfd = cgroup2_open("memory.events"))<0 ) {
+			error(errno,"opening cgroup file `memory.events'");
+		}
+		memwatchfd = memeventsfd;
+
+		/* PSI may be unavailable or disabled in the kernel. */
+		if ( snprintf(path,PATH_MAX,"%smemory.pressure",cgroupdir)<PATH_MAX ) {
+			mempressfd = open(path,O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		}
+		if ( mempressfd>=0 &&
+		     write(mempressfd,MEMWATCH_PSI_TRIGGER,strlen(MEMWATCH_PSI_TRIGGER)+1)<0 ) {
+			verbose("cannot add memory pressure trigger: %s",strerror(errno));
+			close(mempressfd);
+			mempressfd = -1;
+		}
+	} else {
+		memstatfd = cgroup1_memory_open("memory.stat",O_RDONLY);
+		memfailfd = cgroup1_memory_open("memory.memsw.failcnt",O_RDONLY);
+		if ( (memeventsfd = cgroup1_memory_open("memory.oom_control",O_RDONLY))<0 ) {
+			error(errno,"opening cgroup file `memory.oom_control'");
+		}
+		if ( (memwatchfd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC))<0 ) {
+			error(errno,"creating memory event fd");
+		}
+		if ( (ctlfd = cgroup1_memory_open("cgroup.event_control",O_WRONLY))<0 ) {
+			error(errno,"opening cgroup file `cgroup.event_control'");
+		}
+		snprintf(str,sizeof(str),"%d %d",memwatchfd,memeventsfd);
+		if ( write(ctlfd,str,strlen(str))<0 ) error(errno,"registering OOM notifier");
+		if ( close(ctlfd)!=0 ) error(errno,"closing cgroup file `cgroup.event_control'");
+	}
+	verbose("watching cgroup memory events%s",mempressfd>=0 ? " and pressure" : "");
+
+	return memwatchfd;
+}
+
+/* Take the final memory counts, which also tells whether the command
+   was OOM killed just before it exited, and report these. */
+void memwatch_stop()
+{
+	if ( memeventsfd<0 ) return;
+
+	memwatch_update();
+	if ( mem_oom_events>0 || mem_oom_kills>0 ) memory_limit_reached = 1;
+
+	write_meta("memory-result","%s",memory_limit_reached ? "memory-limit" : "");
+	write_meta("memory-anon-bytes","%" PRId64,mem_peak_anon);
+	write_meta("memory-file-bytes","%" PRId64,mem_peak_file);
+	write_meta("memory-oom-events","%" PRId64,mem_oom_events);
+	write_meta("memory-oom-kills","%" PRId64,mem_oom_kills);
+	write_meta("memory-max-events","%" PRId64,mem_max_events);
+
+	if ( (memwatchfd!=memeventsfd && close(memwatchfd)!=0) ||
+	     (mempressfd>=0 && close(mempressfd)!=0) ||
+	     (memstatfd>=0 && close(memstatfd)!=0) ||
+	     (memfailfd>=0 && close(memfailfd)!=0) ||
+	     close(memeventsfd)!=0 ) {
+		error(errno,"closing cgroup memory files");
+	}
+	memwatchfd = mempressfd = memeventsfd = memstatfd = memfailfd = -1;
+}
+
+/* Set the samples filename next to the meta file. This must be called
+   while 'metafilename' is still the one requested for this run. */
+void init_sampling()
+{
+	if ( sample_interval==0 ) return;
+
+	if ( metafilename==NULL ) error(0,"option `sample-interval' requires `outmeta'");
+	snprintf(samplefilename,PATH_MAX,"%s.samples",metafilename);
+}
+
+/* Open the samples file and counter files for the running command.
+   Memory and CPU are taken from the cgroup when used, I/O from the
+   main command process only, since there may be no I/O controller. */
+void sample_open()
+{
+	char path[PATH_MAX];
+	int i;
+
+	for(i=0; i<3; i++) samplefd[i] = -1;
+	for(i=0; i<4; i++) samplelast[i] = -1;
+
+	if ( use_cgroup() && cgroupv2 ) {
+		samplefd[0] = cgroup2_open("memory.current");
+	} else if ( use_cgroup() ) {
+		samplefd[0] = cgroup1_memory_open("memory.memsw.usage_in_bytes",O_RDONLY);
+	}
+	samplefd[1] = cgroup_cpu_open();
+	if ( use_cgroup() && (samplefd[0]<0 || samplefd[1]<0) ) {
+		warning("cannot open cgroup counters for sampling: %s",strerror(errno));
+	}
+
+	snprintf(path,PATH_MAX,"/proc/%d/io",child_pid);
+	if ( (samplefd[2] = open(path,O_RDONLY | O_CLOEXEC))<0 ) {
+		warning("cannot open `%s' for sampling: %s",path,strerror(errno));
+	}
+
+	if ( (samplefile = fopen(samplefilename,"w"))==NULL ) {
+		error(errno,"cannot open `%s'",samplefilename);
+	}
+	verbose("sampling resource usage every %d ms",sample_interval);
+}
+
+/* Write one line with the current counter values. Counters that
+   cannot be read anymore (e.g. after the command exited) repeat
+   their last known value, since they are all cumulative or final. */
+void sample_write()
+{
+	struct timespec now;
+	int64_t value[4];
+	int i;
+
+	if ( clock_gettime(CLOCK_MONOTONIC,&now)!=0 ) error(errno,"getting time");
+
+	value[0] = read_counter(samplefd[0],NULL);
+	value[1] = cgroup_cpu_read(samplefd[1]);
+	value[2] = read_counter(samplefd[2],"rchar");
+	value[3] = read_counter(samplefd[2],"wchar");
+
+	for(i=0; i<4; i++) {
+		if ( value[i]<0 ) value[i] = samplelast[i];
+		samplelast[i] = value[i];
+	}
+
+	fprintf(samplefile,"%ld %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+	        (long)(timediff(&starttime,&now)*1000),
+	        value[0], value[1], value[2], value[3]);
+}
+
+/* Write a final sample and close all sampling files. */
+void sample_close()
+{
+	int i;
+
+	sample_write();
+
+	for(i=0; i<3; i++) {
+		if ( samplefd[i]>=0 && close(samplefd[i])!=0 ) {
+			error(errno,"closing sampling counter file");
+		}
+	}
+	if ( fclose(samplefile)!=0 ) error(errno,"closing file `%s'",samplefilename);
+	samplefile = NULL;
+}
+
+/* Start killing the command: send SIGTERM now and arm the kill delay
+   timer, after which the watchdog loop sends SIGKILL. Called at most
+   once per run from the watchdog event loop, not as signal handler. */
+void terminate(int sig)
+{
+	struct itimerspec its;
+
+	if ( received_signal!=-1 ) return;
 
 	if ( sig==SIGALRM ) {
 		walllimit_reached |= hard_timelimit;
 		warning("timelimit exceeded (hard wall time): aborting command");
+	} else if ( early_verdict ) {
+		warning("output validator reported wrong answer: aborting command");
 	} else {
 		warning("received signal %d: aborting command",sig);
 	}
@@ -626,17 +2367,11 @@ void terminate(int sig)
 		error(errno,"sending SIGTERM to command");
 	}
 
-	/* Prefer nanosleep over sleep because of higher resolution and
-	   it does not interfere with signals. */
-	nanosleep(&killdelay,NULL);
-
-	verbose("sending SIGKILL");
-	if ( kill(-child_pid,SIGKILL)!=0 && errno!=ESRCH ) {
-		error(errno,"sending SIGKILL to command");
+	memset(&its,0,sizeof(its));
+	its.it_value = killdelay;
+	if ( timerfd_settime(killtimerfd,0,&its,NULL)!=0 ) {
+		error(errno,"setting kill delay timer");
 	}
-
-	/* Wait another while to make sure the process is killed by now. */
-	nanosleep(&killdelay,NULL);
 }
 
 static void child_handler(int sig)
@@ -668,11 +2403,40 @@ int groupid(char *name)
 	return (int) grp->gr_gid;
 }
 
+/* Check that 'uid' is in the list of valid uid's. When the user was
+   given as a username string 'name' (otherwise NULL), then '*' matches
+   an arbitrary length string of valid POSIX username characters
+   [A-Za-z0-9._-]. This check must be done before chroot for
+   /etc/passwd lookup. */
+int valid_user(int uid, const char *name)
+{
+	char *valid_users;
+	char *ptr;
+	int   ret;
+
+	valid_users = strdup(VALID_USERS);
+	for(ptr=strtok(valid_users,","); ptr!=NULL; ptr=strtok(NULL,",")) {
+		if ( uid==userid(ptr) ) break;
+		if ( name!=NULL ) {
+			ret = fnmatch(ptr,name,0);
+			if ( ret==0 ) break;
+			if ( ret!=FNM_NOMATCH ) {
+				error(0,"matching username `%s' against `%s'",name,ptr);
+			}
+		}
+	}
+	ret = ( ptr!=NULL && uid>0 );
+	free(valid_users);
+
+	return ret;
+}
+
 long read_optarg_int(const char *desc, long minval, long maxval)
 {
 	long arg;
 	char *ptr;
 
+	errno = 0;
 	arg = strtol(optarg,&ptr,10);
 	if ( errno || *ptr!='\0' || arg<minval || arg>maxval ) {
 		error(errno,"invalid %s specified: `%s'",desc,optarg);
@@ -690,6 +2454,7 @@ void read_optarg_time(const char *desc, double *times)
 	/* Check for soft:hard limit separator and cut string. */
 	if ( (sep=strchr(optcopy,':'))!=NULL ) *sep = 0;
 
+	errno = 0;
 	times[0] = strtod(optcopy,&ptr);
 	if ( errno || *ptr!='\0' || !finite(times[0]) || times[0]<=0 ) {
 		error(errno,"invalid %s specified: `%s'",desc,optarg);
@@ -712,15 +2477,55 @@ void read_optarg_time(const char *desc, double *times)
 	free(optcopy);
 }
 
-void setrestrictions()
+/* Parse comma separated io.max style KEY=VALUE limits, see
+   io_limit_keys, into io_limits. */
+void read_optarg_io_max()
 {
-	char *path;
-	char  cwd[PATH_MAX+1];
-	gid_t aux_groups[10];
+	char *optcopy, *ptr, *val, *end;
+	int i;
 
-	struct rlimit lim;
+	if ( (optcopy=strdup(optarg))==NULL ) error(0,"strdup() failed");
+
+	for(ptr=strtok(optcopy,","); ptr!=NULL; ptr=strtok(NULL,",")) {
+		if ( (val=strchr(ptr,'='))==NULL ) error(0,"invalid I/O limit `%s'",ptr);
+		*val++ = 0;
+		for(i=0; i<NIO_LIMITS; i++) if ( strcmp(ptr,io_limit_keys[i])==0 ) break;
+		if ( i==NIO_LIMITS ) error(0,"unknown I/O limit `%s'",ptr);
+
+		errno = 0;
+		io_limits[i] = strtoll(val,&end,10);
+		if ( errno || *end!='\0' || end==val || io_limits[i]<=0 ) {
+			error(errno,"invalid I/O limit %s specified: `%s'",ptr,val);
+		}
+		use_io_limits = 1;
+	}
+
+	free(optcopy);
+}
+
+/* Parse the --stream-limits argument `MEM,TIME,FILE' in kB, seconds
+   and kB, like the memsize, cputime and filesize options. */
+void read_optarg_stream_limits()
+{
+	long mem, cpu, file;
+	int n = 0;
+
+	if ( sscanf(optarg,"%ld,%ld,%ld%n",&mem,&cpu,&file,&n)!=3 ||
+	     optarg[n]!='\0' || mem<1 || cpu<1 || file<1 ||
+	     mem>LONG_MAX/1024 || file>LONG_MAX/1024 ) {
+		error(0,"invalid stream compare limits specified: `%s'",optarg);
+	}
+	stream_memsize  = (rlim_t) mem * 1024;
+	stream_cputime  = (rlim_t) cpu;
+	stream_filesize = (rlim_t) file * 1024;
+}
+
+/* Clear the environment to prevent all kinds of security holes,
+   except for PATH, and set the requested additional variables. */
+void set_environment()
+{
+	char *path;
 
-	/* Clear environment to prevent all kinds of security holes, save PATH */
 	if ( !preserve_environment ) {
 		path = getenv("PATH");
 		environ[0] = NULL;
@@ -737,13 +2542,18 @@ void setrestrictions()
 			token = strtok(NULL, ";");
 		}
 	}
+}
 
-	/* Set resource limits: must be root to raise hard limits.
-	   Note that limits can thus be raised from the systems defaults! */
+/* Set resource limits of process 'pid', or ourselves when 0: must be
+   root to raise hard limits. Note that limits can thus be raised from
+   the systems defaults! */
+void set_rlimits(pid_t pid)
+{
+	struct rlimit lim;
 
 	/* First define shorthand macro function */
 #define setlim(type) \
-	if ( setrlimit(RLIMIT_ ## type, &lim)!=0 ) { \
+	if ( prlimit(pid, RLIMIT_ ## type, &lim, NULL)!=0 ) { \
 		if ( errno==EPERM ) { \
 			warning("no permission to set resource RLIMIT_" #type); \
 		} else { \
@@ -758,7 +2568,9 @@ void setrestrictions()
 		   higher: at the soft limit the kernel will send SIGXCPU at
 		   the hard limit a SIGKILL. The SIGXCPU can be caught, but is
 		   not by default and gives us a reliable way to detect if the
-		   CPU-time limit was reached. */
+		   CPU-time limit was reached. With cgroups, the watchdog
+		   enforces the exact limit on all processes together, see
+		   cpuwatch_start(). */
 		rlim_t cputime_limit = (rlim_t)ceil(cputimelimit[1]);
 		verbose("setting hard CPU-time limit to %d(+1) seconds",(int)cputime_limit);
 		lim.rlim_cur = cputime_limit;
@@ -792,95 +2604,622 @@ void setrestrictions()
 	if ( no_coredump ) {
 		verbose("disabling core dumps");
 		lim.rlim_cur = lim.rlim_max = 0;
-		if ( setrlimit(RLIMIT_CORE,&lim)!=0 ) error(errno,"disabling core dumps");
+		if ( prlimit(pid,RLIMIT_CORE,&lim,NULL)!=0 ) error(errno,"disabling core dumps");
 	}
+}
 
-	/* Put the child process in the cgroup */
-	cgroup_attach();
+/* Bind mount a file or directory read-only onto 'target' in the
+ * current directory. */
+void mount_readonly(const char *source, const char *target, unsigned long flags)
+{
+	if ( mount(source,target,NULL,MS_BIND|flags,NULL)!=0 ) {
+		error(errno,"cannot bind mount `%s' on `%s'",source,target);
+	}
+	/* Read-only must be set separately from the bind mount. */
+	if ( mount(NULL,target,NULL,MS_REMOUNT|MS_BIND|MS_RDONLY|flags,NULL)!=0 ) {
+		error(errno,"cannot remount `%s' read-only",target);
+	}
+}
 
-	/* Run the command in a separate process group so that the command
-	   and all its children can be killed off with one signal. */
-	if ( setsid()==-1 ) error(errno,"setsid failed");
+/* Return whether the existing 'path' canonically is directory 'dir'
+ * or lies below it. Both are canonicalized, so symlinks and `..' in
+ * either cannot be used to escape.
+ */
+int path_within(const char *path, const char *dir)
+{
+	char rpath[PATH_MAX], rdir[PATH_MAX];
+	size_t len;
 
-	/* Set root-directory and change directory to there. */
-	if ( use_root ) {
-		/* Small security issue: when running setuid-root, people can find
-		   out which directories exist from error message. */
-		if ( chdir(rootdir)!=0 ) error(errno,"cannot chdir to `%s'",rootdir);
+	if ( realpath(path,rpath)==NULL ) error(errno,"cannot canonicalize path `%s'",path);
+	if ( realpath(dir,rdir)==NULL ) error(errno,"cannot canonicalize path `%s'",dir);
 
-		/* Get absolute pathname of rootdir, by reading it. */
-		if ( getcwd(cwd,PATH_MAX)==NULL ) error(errno,"cannot get directory");
-		if ( cwd[strlen(cwd)-1]!='/' ) strcat(cwd,"/");
+	len = strlen(rdir);
+	if ( strcmp(rdir,"/")==0 ) return 1;
+	return strncmp(rpath,rdir,len)==0 && (rpath[len]=='/' || rpath[len]==0);
+}
 
-		/* Canonicalize CHROOT_PREFIX. */
-		if ( (path = (char *) malloc(PATH_MAX+1))==NULL ) {
-			error(errno,"allocating memory");
+/* Move this process into a private mount namespace, once. */
+void private_mount_namespace()
+{
+	if ( private_mounts ) return;
+
+	if ( unshare(CLONE_NEWNS)!=0 ) error(errno,"cannot create mount namespace");
+	/* Prevent our mounts from propagating to the parent namespace. */
+	if ( mount(NULL,"/",NULL,MS_REC|MS_PRIVATE,NULL)!=0 ) {
+		error(errno,"cannot make mounts private");
+	}
+	private_mounts = 1;
+}
+
+/* Bind mount the --bind-ro files in the current directory, before
+ * changing root. This gives COMMAND access to e.g. testdata on another
+ * filesystem without copying it: a missing DST is created as an empty
+ * file to mount on. A directory is mounted on an existing (empty)
+ * directory DST.
+ *
+ * We run as root, so the current directory must lie within the ROOT
+ * that is changed to and within CHROOT_PREFIX, and each SRC within
+ * CHROOT_PREFIX: it is opened without following a final symlink and
+ * mounted from that file descriptor, such that it cannot be swapped.
+ */
+void mount_binds()
+{
+	char srcpath[64];
+	struct stat st;
+	int i, fd, srcfd;
+
+	if ( nbind_mounts==0 ) return;
+
+	if ( !path_within(".",CHROOT_PREFIX) || (use_root && !path_within(".",rootdir)) ) {
+		error(0,"bind mount targets must be within `%s' and the root directory",
+		      CHROOT_PREFIX);
+	}
+
+	private_mount_namespace();
+	for(i=0; i<nbind_mounts; i++) {
+		if ( (srcfd = open(bind_src[i],O_PATH|O_NOFOLLOW|O_CLOEXEC))<0 ) {
+			error(errno,"cannot open `%s'",bind_src[i]);
+		}
+		if ( fstat(srcfd,&st)!=0 ) error(errno,"cannot stat `%s'",bind_src[i]);
+		if ( !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) ) {
+			error(0,"bind mount source `%s' must be a file or directory",bind_src[i]);
+		}
+		snprintf(srcpath,sizeof(srcpath),"/proc/self/fd/%d",srcfd);
+		if ( !path_within(srcpath,CHROOT_PREFIX) ) {
+			error(0,"bind mount source `%s' must be within `%s'",bind_src[i],CHROOT_PREFIX);
 		}
-		if ( realpath(CHROOT_PREFIX,path)==NULL ) {
-			error(errno,"cannot canonicalize path '%s'",CHROOT_PREFIX);
+
+		if ( lstat(bind_dst[i],&st)!=0 || !S_ISDIR(st.st_mode) ) {
+			if ( (fd = open(bind_dst[i],O_RDONLY|O_CREAT|O_NOFOLLOW|O_CLOEXEC,0444))<0 ) {
+				error(errno,"cannot create `%s'",bind_dst[i]);
+			}
+			if ( close(fd)!=0 ) error(errno,"closing `%s'",bind_dst[i]);
+		}
+		mount_readonly(srcpath,bind_dst[i],MS_NOSUID);
+		if ( close(srcfd)!=0 ) error(errno,"closing `%s'",bind_src[i]);
+		verbose("mounted `%s' read-only on `%s'",bind_src[i],bind_dst[i]);
+	}
+}
+
+/* Set up the chroot environment extras of chroot-startstop.sh in the
+ * current (root) directory, inside a private mount namespace of this
+ * process. The mounts are thus only visible to the command and vanish
+ * together with it, without any unmounting or host mount table churn.
+ */
+void mount_chroot()
+{
+	const char *subdirs[] = { "etc", "usr", "lib", "lib64", "bin", NULL };
+	const char *devices[] = { "random", "urandom", NULL };
+	char source[PATH_MAX], target[PATH_MAX], link[PATH_MAX];
+	struct stat st;
+	ssize_t len;
+	int i, fd;
+
+	private_mount_namespace();
+
+	for(i=0; subdirs[i]!=NULL; i++) {
+		snprintf(source,PATH_MAX,"%s/%s",CHROOT_ORIGINAL,subdirs[i]);
+		if ( lstat(source,&st)!=0 ) continue;
+
+		/* Some dirs may be links to others, e.g. /lib64 -> /lib.
+		   Preserve those; bind mount the others. */
+		if ( S_ISLNK(st.st_mode) ) {
+			if ( (len = readlink(source,link,PATH_MAX-1))<0 ) {
+				error(errno,"cannot read link `%s'",source);
+			}
+			link[len] = 0;
+			if ( symlink(link,subdirs[i])!=0 && errno!=EEXIST ) {
+				error(errno,"cannot create link `%s'",subdirs[i]);
+			}
+		} else if ( S_ISDIR(st.st_mode) ) {
+			if ( mkdir(subdirs[i],0755)!=0 && errno!=EEXIST ) {
+				error(errno,"cannot create directory `%s'",subdirs[i]);
+			}
+			mount_readonly(source,subdirs[i],MS_REC);
 		}
+	}
+
+	/* The proc filesystem is needed by Java for /proc/self/stat. */
+	if ( mkdir("proc",0755)!=0 && errno!=EEXIST ) {
+		error(errno,"cannot create directory `proc'");
+	}
+	if ( mount("/proc","proc",NULL,MS_BIND|MS_REC,NULL)!=0 ) {
+		error(errno,"cannot bind mount `/proc'");
+	}
 
-		/* Check that we are within prescribed path. */
-		if ( strncmp(cwd,path,strlen(path))!=0 ) {
-			error(0,"invalid root: must be within `%s'",path);
+	/* Make /dev/random and /dev/urandom available as random source. */
+	if ( mkdir("dev",0711)!=0 && errno!=EEXIST ) {
+		error(errno,"cannot create directory `dev'");
+	}
+	for(i=0; devices[i]!=NULL; i++) {
+		snprintf(source,PATH_MAX,"/dev/%s",devices[i]);
+		snprintf(target,PATH_MAX,"dev/%s",devices[i]);
+		if ( (fd = open(target,O_RDONLY|O_CREAT|O_NOFOLLOW,0444))<0 ) {
+			error(errno,"cannot create `%s'",target);
 		}
-		free(path);
+		if ( close(fd)!=0 ) error(errno,"closing `%s'",target);
+		mount_readonly(source,target,MS_NOSUID);
+	}
+
+	verbose("mounted chroot tree `%s'",CHROOT_ORIGINAL);
+}
+
+/* Set root-directory and change directory to there. */
+void set_root()
+{
+	char  cwd[PATH_MAX+1];
 
-		if ( chroot(".")!=0 ) error(errno,"cannot change root to `%s'",cwd);
-		/* Just to make sure and satisfy Coverity scan: */
-		if ( chdir("/")!=0 ) error(errno,"cannot chdir to `/' in chroot");
-		verbose("using root-directory `%s'",cwd);
+	if ( !use_root ) return;
+
+	/* Small security issue: when running setuid-root, people can find
+	   out which directories exist from error message. */
+	if ( chdir(rootdir)!=0 ) error(errno,"cannot chdir to `%s'",rootdir);
+
+	/* Get absolute pathname of rootdir, by reading it. */
+	if ( getcwd(cwd,PATH_MAX)==NULL ) error(errno,"cannot get directory");
+
+	/* Check that we are within prescribed path. */
+	if ( !path_within(".",CHROOT_PREFIX) ) {
+		error(0,"invalid root: must be within `%s'",CHROOT_PREFIX);
 	}
 
+	if ( chroot_mounts ) mount_chroot();
+
+	if ( chroot(".")!=0 ) error(errno,"cannot change root to `%s'",cwd);
+	/* Just to make sure and satisfy Coverity scan: */
+	if ( chdir("/")!=0 ) error(errno,"cannot chdir to `/' in chroot");
+	verbose("using root-directory `%s'",cwd);
+}
+
+/* Drop root privileges to the run user and group. */
+void set_user()
+{
+	gid_t aux_groups[10];
+
 	/* Set group-id (must be root for this, so before setting user). */
 	if ( use_group ) {
 		if ( setgid(rungid) ) error(errno,"cannot set group ID to `%d'",rungid);
 		aux_groups[0] = rungid;
 		if ( setgroups(1, aux_groups) ) error(errno,"cannot clear auxiliary groups");
 
-		verbose("using group ID `%d'",rungid);
+		verbose("using group ID `%d'",rungid);
+	}
+	/* Set user-id (must be root for this). */
+	if ( use_user ) {
+		if ( setuid(runuid) ) error(errno,"cannot set user ID to `%d'",runuid);
+		verbose("using user ID `%d' for command",runuid);
+	} else {
+		/* Permanently reset effective uid to real uid, to prevent
+		   child command from having root privileges.
+		   Note that this means that the child runs as the same user
+		   as the watchdog process and can thus manipulate it, e.g. by
+		   sending SIGSTOP/SIGCONT! */
+		if ( setuid(getuid()) ) error(errno,"cannot reset real user ID");
+		verbose("reset user ID to `%d' for command",getuid());
+	}
+	if ( geteuid()==0 || getuid()==0 ) {
+		error(0,"root privileges not dropped. Do not run judgedaemon as root.");
+	}
+}
+
+/* Permanently drop root privileges to user 'uid' and group 'gid' for
+ * running 'what', and clear the auxiliary groups.
+ */
+void drop_privileges(uid_t uid, gid_t gid, const char *what)
+{
+	if ( uid==0 ) error(0,"refusing to run %s as root",what);
+
+	if ( setgid(gid)!=0 ) error(errno,"setting group ID for %s",what);
+	if ( setgroups(1, &gid)!=0 ) error(errno,"clearing auxiliary groups for %s",what);
+	if ( setuid(uid)!=0 ) error(errno,"setting user ID for %s",what);
+}
+
+/* Permanently drop root privileges to the user and group that invoked
+ * us via sudo, and clear the auxiliary groups. It is an error if these
+ * are not known: we must never run 'what' as root.
+ */
+void drop_to_sudo_user(const char *what)
+{
+	char *ptr;
+	gid_t gid;
+	uid_t uid;
+
+	if ( (ptr = getenv("SUDO_UID"))==NULL || *ptr==0 ) {
+		error(0,"SUDO_UID not set, refusing to run %s as root",what);
+	}
+	uid = (uid_t) strtol(ptr,NULL,10);
+	if ( (ptr = getenv("SUDO_GID"))==NULL || *ptr==0 ) {
+		error(0,"SUDO_GID not set, refusing to run %s as root",what);
+	}
+	gid = (gid_t) strtol(ptr,NULL,10);
+
+	drop_privileges(uid,gid,what);
+}
+
+void setrestrictions()
+{
+	set_environment();
+	set_rlimits(0);
+
+	/* Put the child process in the cgroup */
+	cgroup_attach(getpid());
+	set_affinity(0);
+
+	/* Run the command in a separate process group so that the command
+	   and all its children can be killed off with one signal. */
+	if ( setsid()==-1 ) error(errno,"setsid failed");
+
+	mount_binds();
+	set_root();
+	set_user();
+}
+
+/* Register file descriptor 'fd' for epoll 'events' with 'tag'. */
+void add_event_mask(int epollfd, int fd, uint32_t events, uint32_t tag)
+{
+	struct epoll_event ev;
+
+	memset(&ev,0,sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = tag;
+	if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev)!=0 ) {
+		error(errno,"adding fd %d to epoll",fd);
+	}
+}
+
+/* Register file descriptor 'fd' for input events with 'tag'. */
+void add_event(int epollfd, int fd, uint32_t tag)
+{
+	add_event_mask(epollfd, fd, EPOLLIN, tag);
+}
+
+/* Enlarge the capacity of pipe 'fd' to the system maximum. When the
+   per-user limit on pipe buffers is hit, retry with halved sizes.
+   Returns the resulting pipe capacity. */
+size_t set_pipe_size(int fd)
+{
+	static long maxsize = -1;
+	long size;
+	int ret;
+	FILE *fp;
+
+	if ( maxsize<0 ) {
+		maxsize = PIPE_MAX_SIZE_DEFAULT;
+		if ( (fp = fopen(PIPE_MAX_SIZE_PATH,"r"))!=NULL ) {
+			if ( fscanf(fp,"%ld",&maxsize)!=1 ) maxsize = PIPE_MAX_SIZE_DEFAULT;
+			fclose(fp);
+		}
+	}
+
+	for(size=maxsize; size>BUF_SIZE; size/=2) {
+		if ( (ret = fcntl(fd,F_SETPIPE_SZ,size))>=0 ) return ret;
+		if ( errno!=EPERM ) break;
+	}
+
+	if ( (ret = fcntl(fd,F_GETPIPE_SZ))<0 ) error(errno,"getting pipe size");
+	return ret;
+}
+
+/* Resize the pump buffer to 'size' bytes. */
+void resize_pumpbuf(size_t size)
+{
+	char *newbuf;
+
+	if ( (newbuf = (char *) realloc(pumpbuf,size))==NULL ) {
+		/* Keep using the current buffer if we cannot grow. */
+		if ( pumpbuf!=NULL ) return;
+		error(errno,"allocating pump buffer");
+	}
+	pumpbuf = newbuf;
+	pumpbufsize = size;
+}
+
+/* Limit the streaming validator like the compare script is limited.
+   When it is not in a cgroup, its memory is limited as address space. */
+void set_stream_rlimits()
+{
+	struct rlimit lim;
+
+	if ( stream_memsize!=RLIM_INFINITY && streamcgroupdir[0]==0 ) {
+		lim.rlim_cur = lim.rlim_max = stream_memsize;
+		if ( setrlimit(RLIMIT_AS,&lim)!=0 ) error(errno,"setting stream compare memory limit");
+	}
+	if ( stream_cputime!=RLIM_INFINITY ) {
+		lim.rlim_cur = stream_cputime;
+		lim.rlim_max = stream_cputime+1;
+		if ( setrlimit(RLIMIT_CPU,&lim)!=0 ) error(errno,"setting stream compare CPU-time limit");
+	}
+	if ( stream_filesize!=RLIM_INFINITY ) {
+		lim.rlim_cur = lim.rlim_max = stream_filesize;
+		if ( setrlimit(RLIMIT_FSIZE,&lim)!=0 ) error(errno,"setting stream compare filesize limit");
+	}
+	lim.rlim_cur = lim.rlim_max = 0;
+	if ( setrlimit(RLIMIT_CORE,&lim)!=0 ) error(errno,"disabling stream compare core dumps");
+}
+
+/* Create a cgroup v2 for the streaming validator next to that of the
+   command, limiting its memory like set_stream_rlimits() does. */
+void stream_cgroup_create()
+{
+	snprintf(streamcgroupdir,PATH_MAX,"%s/domjudge/dj_stream_%d_%d/",
+	         CGROUP_ROOT,getpid(),(int)time(NULL));
+	if ( mkdir(streamcgroupdir,0755)!=0 ) {
+		error(errno,"creating cgroup `%s'",streamcgroupdir);
+	}
+	if ( stream_memsize!=RLIM_INFINITY ) {
+		cgroup2_write_in(streamcgroupdir,"memory.max","%" PRId64,(int64_t)stream_memsize);
+	}
+	cgroup2_write_in(streamcgroupdir,"memory.swap.max","0");
+	verbose("created cgroup '%s'",streamcgroupdir);
+}
+
+/* Start the streaming output validator: program 'streamcmd' with
+   arguments 'streamargs' and a pipe to its stdin, run as the stream
+   user in its own process group and, with cgroup v2, its own cgroup.
+   Returns a pidfd for it, or -1 if not supported. */
+int stream_start()
+{
+	int pipefd[2];
+	int i, pidfd, flags;
+	sigset_t emptymask;
+	char **args;
+
+	if ( getuid()==0 || geteuid()==0 ) {
+		if ( stream_uid<0 ) {
+			error(0,"option `stream-compare' requires `stream-user' when run as root");
+		}
+		if ( use_user && stream_uid==runuid ) {
+			error(0,"stream compare user must differ from the command user");
+		}
+		if ( cgroupv2 ) stream_cgroup_create();
+	}
+
+	if ( pipe2(pipefd,O_CLOEXEC)!=0 ) error(errno,"creating stream compare pipe");
+	set_pipe_size(pipefd[1]);
+
+	switch ( stream_pid = fork() ) {
+	case -1:
+		error(errno,"cannot fork stream compare command");
+	case 0:
+		/* Join the cgroup before executing anything that can fork. */
+		if ( streamcgroupdir[0]!=0 ) {
+			cgroup2_write_in(streamcgroupdir,"cgroup.procs","%d",(int)getpid());
+		}
+		if ( setpgid(0,0)!=0 ) error(errno,"setting stream compare process group");
+		if ( dup2(pipefd[0],STDIN_FILENO)<0 ||
+		     dup2(STDERR_FILENO,STDOUT_FILENO)<0 ) {
+			error(errno,"redirecting stream compare stdio");
+		}
+		for(i=1; i<=2; i++) {
+			if ( child_pipefd[i][PIPE_OUT]>=0 ) close(child_pipefd[i][PIPE_OUT]);
+		}
+		set_stream_rlimits();
+		if ( stream_uid>=0 ) {
+			drop_privileges(stream_uid,stream_gid,"stream compare command");
+		}
+		if ( signal(SIGPIPE,SIG_DFL)==SIG_ERR ) error(errno,"resetting SIGPIPE");
+		if ( sigemptyset(&emptymask)!=0 ||
+		     sigprocmask(SIG_SETMASK, &emptymask, NULL)!=0 ) {
+			error(errno,"unmasking signals");
+		}
+		if ( (args = (char **) malloc((nstreamargs+2)*sizeof(char *)))==NULL ) {
+			error(errno,"allocating memory");
+		}
+		args[0] = streamcmd;
+		for(i=0; i<nstreamargs; i++) args[i+1] = streamargs[i];
+		args[nstreamargs+1] = NULL;
+		verbose("executing stream compare command `%s'",streamcmd);
+		execv(streamcmd,args);
+		error(errno,"cannot start stream compare command `%s'",streamcmd);
+	}
+
+	/* Also attach it from here, so that it is in the cgroup when it
+	   has to be stopped before it got to that itself. */
+	if ( streamcgroupdir[0]!=0 ) {
+		cgroup2_write_in(streamcgroupdir,"cgroup.procs","%d",(int)stream_pid);
+	}
+
+	if ( close(pipefd[0])!=0 ) error(errno,"closing stream compare pipe");
+	streamfd = pipefd[1];
+
+	/* Never block the watchdog on the validator: what it does not
+	   accept is buffered and passed on when it is writable again. */
+	if ( (flags = fcntl(streamfd, F_GETFL))==-1 ) error(errno,"fcntl, getting flags");
+	if ( fcntl(streamfd, F_SETFL, flags | O_NONBLOCK)==-1 ) {
+		error(errno,"fcntl, setting flags");
+	}
+	if ( streambuf==NULL && (streambuf = (char *) malloc(STREAM_BUF_SIZE))==NULL ) {
+		error(errno,"allocating stream compare buffer");
+	}
+	streambufpos = streambuflen = 0;
+
+	pidfd = syscall(SYS_pidfd_open, stream_pid, 0);
+	if ( pidfd<0 && errno!=ENOSYS ) error(errno,"opening pidfd for stream compare");
+	return pidfd;
+}
+
+/* Close the pipe to the streaming validator, dropping buffered data. */
+void stream_close()
+{
+	if ( streamfd<0 ) return;
+	if ( close(streamfd)!=0 ) error(errno,"closing stream compare pipe");
+	streamfd = -1;
+	streambufpos = streambuflen = 0;
+}
+
+/* Stop the streaming validator after the command has finished, its
+   verdict is not needed anymore, or when it does not keep up. */
+void stream_stop()
+{
+	stream_close();
+	if ( streamcgroupdir[0]!=0 ) {
+		/* This also kills what it left behind when it exited. */
+		cgroup2_kill(streamcgroupdir);
+	} else if ( stream_pid>=0 && kill(-stream_pid,SIGKILL)!=0 && errno!=ESRCH ) {
+		error(errno,"killing stream compare");
+	}
+	if ( stream_pid>=0 && waitpid(stream_pid,NULL,0)<0 ) {
+		error(errno,"waiting on stream compare");
+	}
+	stream_pid = -1;
+
+	if ( streamcgroupdir[0]!=0 ) {
+		if ( rmdir(streamcgroupdir)!=0 ) error(errno,"deleting cgroup `%s'",streamcgroupdir);
+		verbose("deleted cgroup '%s'",streamcgroupdir);
+		streamcgroupdir[0] = 0;
+	}
+}
+
+/* Write up to 'len' bytes to the streaming validator without blocking.
+   Returns the number of bytes written. When it has exited, stop
+   passing data; its exit is handled separately. */
+size_t stream_send(const char *data, size_t len)
+{
+	ssize_t nwritten;
+	size_t done = 0;
+
+	while ( done<len ) {
+		nwritten = write(streamfd, data+done, len-done);
+		if ( nwritten<0 ) {
+			if ( errno==EINTR ) continue;
+			if ( errno==EAGAIN || errno==EWOULDBLOCK ) break;
+			if ( errno!=EPIPE ) error(errno,"writing to stream compare");
+			verbose("stream compare closed its input");
+			stream_close();
+			return len;
+		}
+		done += nwritten;
+	}
+	return done;
+}
+
+/* Pass buffered command stdout on to the streaming validator, called
+   when its pipe becomes writable again. */
+void stream_flush()
+{
+	size_t n;
+
+	if ( streamfd<0 || streambuflen==0 ) return;
+	n = stream_send(streambuf+streambufpos, streambuflen);
+	if ( streamfd<0 ) return;
+	streambufpos += n;
+	streambuflen -= n;
+}
+
+/* Pass 'len' bytes of command stdout to the streaming validator, after
+   what is still buffered. When more than STREAM_BUF_SIZE bytes are
+   pending, it does not keep up: stop it and leave the verdict to the
+   compare script run afterwards. */
+void stream_write(const char *data, size_t len)
+{
+	size_t n;
+
+	if ( streamfd<0 ) return;
+	if ( streambuflen==0 ) {
+		n = stream_send(data, len);
+		if ( streamfd<0 ) return;
+		data += n;
+		len -= n;
+		streambufpos = 0;
+	}
+	if ( len==0 ) return;
+
+	if ( streambuflen+len>STREAM_BUF_SIZE ) {
+		warning("stream compare buffer of %d bytes full, stopping it",STREAM_BUF_SIZE);
+		stream_stop();
+		return;
 	}
-	/* Set user-id (must be root for this). */
-	if ( use_user ) {
-		if ( setuid(runuid) ) error(errno,"cannot set user ID to `%d'",runuid);
-		verbose("using user ID `%d' for command",runuid);
-	} else {
-		/* Permanently reset effective uid to real uid, to prevent
-		   child command from having root privileges.
-		   Note that this means that the child runs as the same user
-		   as the watchdog process and can thus manipulate it, e.g. by
-		   sending SIGSTOP/SIGCONT! */
-		if ( setuid(getuid()) ) error(errno,"cannot reset real user ID");
-		verbose("reset user ID to `%d' for command",getuid());
+	if ( streambufpos+streambuflen+len>STREAM_BUF_SIZE ) {
+		memmove(streambuf, streambuf+streambufpos, streambuflen);
+		streambufpos = 0;
 	}
-	if ( geteuid()==0 || getuid()==0 ) {
-		error(0,"root privileges not dropped. Do not run judgedaemon as root.");
+	memcpy(streambuf+streambufpos+streambuflen, data, len);
+	streambuflen += len;
+}
+
+/* Check without blocking whether the streaming validator has exited
+   and abort the command if it reported a wrong answer. */
+void stream_check(int child_exited)
+{
+	int status;
+	pid_t pid;
+
+	if ( stream_pid<0 ) return;
+	if ( (pid = waitpid(stream_pid, &status, WNOHANG))<0 ) {
+		error(errno,"waiting on stream compare");
+	}
+	if ( pid!=stream_pid ) return;
+
+	stream_pid = -1;
+	stream_close();
+	if ( WIFEXITED(status) && WEXITSTATUS(status)==43 ) {
+		if ( !child_exited ) {
+			early_verdict = 1;
+			terminate(SIGTERM);
+		}
+	} else if ( !WIFEXITED(status) || WEXITSTATUS(status)!=42 ) {
+		warning("stream compare command exited with status %d",status);
 	}
 }
 
-void pump_pipes(fd_set readfds, size_t data_read[], size_t data_passed[])
+/* Pass on data from the child pipes selected by bitmask 'fds' (bit i
+   set for child fd i). */
+void pump_pipes(int fds, size_t data_read[], size_t data_passed[])
 {
 	ssize_t nread, nwritten;
 	size_t to_read, to_write;
-	int i;
+	int i, splicing;
 
 	/* Check to see if data is available and pass it on */
 	for(i=1; i<=2; i++) {
-		if ( child_pipefd[i][PIPE_OUT] != -1 &&
-		     FD_ISSET(child_pipefd[i][PIPE_OUT],&readfds) ) {
+		if ( child_pipefd[i][PIPE_OUT] != -1 && (fds & (1<<i)) ) {
+
+			pump_iterations++;
 
 			if (limit_streamsize && data_passed[i] == streamsize) {
 				/* Throw away data if we're at the output limit, but
 				   still count how much data we consumed  */
-				nread = read(child_pipefd[i][PIPE_OUT], buf, BUF_SIZE);
+				nread = read(child_pipefd[i][PIPE_OUT], pumpbuf, pumpbufsize);
+
+				/* Or stop a command flooding stdout right away. */
+				if ( nread>0 && kill_output_limit && i==STDOUT_FILENO &&
+				     !output_limit_reached ) {
+					output_limit_reached = 1;
+					warning("output limit exceeded: aborting command");
+					kill_command();
+				}
 			} else {
-				/* Otherwise copy the output to a file */
-				to_read = BUF_SIZE;
+				/* Otherwise copy the output to a file. Splice does
+				   not need our buffer, so move a full pipe at once,
+				   unless we need to see the data to hash it. */
+				splicing = use_splice && !((hash_stdout || streamfd>=0) &&
+				                           i==STDOUT_FILENO);
+				to_read = splicing ? pumpbufmax : pumpbufsize;
 				if (limit_streamsize) {
-					to_read = min(BUF_SIZE, streamsize-data_passed[i]);
+					to_read = min(to_read, streamsize-data_passed[i]);
 				}
 
-				if ( use_splice ) {
+				if ( splicing ) {
 					nread = splice(child_pipefd[i][PIPE_OUT], NULL,
 					               child_redirfd[i], NULL,
 					               to_read, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
@@ -892,11 +3231,17 @@ void pump_pipes(fd_set readfds, size_t data_read[], size_t data_passed[])
 						errno = EAGAIN;
 					}
 				} else {
-					nread = read(child_pipefd[i][PIPE_OUT], buf, to_read);
+					nread = read(child_pipefd[i][PIPE_OUT], pumpbuf, to_read);
 					if ( nread>0 ) {
+						if ( hash_stdout && i==STDOUT_FILENO ) {
+							md5_update(&stdout_md5, pumpbuf, nread);
+						}
+						if ( streamfd>=0 && i==STDOUT_FILENO ) {
+							stream_write(pumpbuf, nread);
+						}
 						to_write = nread;
 						while ( to_write>0 ) {
-							nwritten = write(child_redirfd[i], buf, to_write);
+							nwritten = write(child_redirfd[i], pumpbuf+(nread-to_write), to_write);
 							if ( nwritten==-1 ) {
 								nread = -1;
 								break;
@@ -926,48 +3271,25 @@ void pump_pipes(fd_set readfds, size_t data_read[], size_t data_passed[])
 				continue;
 			}
 			data_read[i] += nread;
+
+			/* Adapt the buffer size to the rate of output. */
+			if ( (size_t)nread==pumpbufsize && pumpbufsize<pumpbufmax ) {
+				resize_pumpbuf(min(2*pumpbufsize,pumpbufmax));
+			} else if ( (size_t)nread<pumpbufsize/4 && pumpbufsize>BUF_SIZE ) {
+				resize_pumpbuf(pumpbufsize/2);
+			}
 		}
 	}
 
 }
 
-int main(int argc, char **argv)
+void parse_options(int argc, char **argv)
 {
-	sigset_t sigmask, emptymask;
-	fd_set readfds;
-	pid_t pid;
-	int   i, r, nfds;
-	int   ret;
-	FILE *fp;
-	char *oom_path;
-	int   status;
-	int   exitcode;
-	char *valid_users;
+	int   opt;
 	char *ptr;
+	struct passwd *pwd;
 	regex_t userregex;
-	int   opt;
-	double tmpd;
-	size_t data_read[3];
-	size_t data_passed[3];
-	size_t total_data;
-	char str[256];
-
-	struct itimerval itimer;
-	struct sigaction sigact;
-
-	progname = argv[0];
-
-	if ( gettimeofday(&progstarttime,NULL) ) error(errno,"getting time");
 
-	/* Parse command-line options */
-	use_root = use_walltime = use_cputime = use_user = no_coredump = 0;
-	outputmeta = walllimit_reached = cpulimit_reached = 0;
-	outputtimetype = CPU_TIME_TYPE;
-	preserve_environment = 0;
-	memsize = filesize = nproc = RLIM_INFINITY;
-	redir_stdout = redir_stderr = limit_streamsize = 0;
-	be_verbose = be_quiet = 0;
-	show_help = show_version = 0;
 	opterr = 0;
 	while ( (opt = getopt_long(argc,argv,"+r:u:g:t:C:m:f:p:P:co:e:s:EV:M:vq",long_opts,(int *) 0))!=-1 ) {
 		switch ( opt ) {
@@ -980,7 +3302,9 @@ int main(int argc, char **argv)
 			strcpy(rootdir,optarg);
 			break;
 		case 'u': /* user option: uid or string */
+			if ( in_request ) error(0,"option `user' not allowed in server request");
 			use_user = 1;
+			errno = 0;
 			runuid = strtol(optarg,&ptr,10);
 			runuser = strdup(optarg);
 			if ( errno || *ptr!='\0' ) {
@@ -995,7 +3319,9 @@ int main(int argc, char **argv)
 			if ( runuid<0 ) error(0,"invalid username or ID specified: `%s'",optarg);
 			break;
 		case 'g': /* group option: gid or string */
+			if ( in_request ) error(0,"option `group' not allowed in server request");
 			use_group = 1;
+			errno = 0;
 			rungid = strtol(optarg,&ptr,10);
 			rungroup = strdup(optarg);
 			if ( errno || *ptr!='\0' ) rungid = groupid(optarg);
@@ -1066,12 +3392,123 @@ int main(int argc, char **argv)
 			outputmeta = 1;
 			metafilename = strdup(optarg);
 			break;
+		case OPT_OUTMETA_JSON: /* JSON outputmeta option */
+			jsonmetafilename = strdup(optarg);
+			break;
 		case 'v': /* verbose option */
 			be_verbose = 1;
 			break;
 		case 'q': /* quiet option */
 			be_quiet = 1;
 			break;
+		case OPT_SERVER: /* server option */
+			if ( in_request ) error(0,"option `server' not allowed in server request");
+			server_mode = 1;
+			serversocket = strdup(optarg);
+			break;
+		case OPT_HANDOFF: /* handoff command option */
+			if ( in_request ) error(0,"option `handoff' not allowed in server request");
+			handoffcmd = strdup(optarg);
+			break;
+		case OPT_POOL: /* pool size option */
+			if ( in_request ) error(0,"option `pool' not allowed in server request");
+			pool_size = (int) read_optarg_int("pool size",0,MAX_POOL_SIZE);
+			break;
+		case OPT_BIND_RO: /* read-only bind mount option */
+			if ( nbind_mounts>=MAX_BIND_MOUNTS ) {
+				error(0,"too many `bind-ro' options, at most %d allowed",MAX_BIND_MOUNTS);
+			}
+			if ( (ptr = strrchr(optarg,':'))==NULL || ptr==optarg || ptr[1]==0 ) {
+				error(0,"invalid bind mount `%s', expected SRC:DST",optarg);
+			}
+			/* DST is created by us as root, so keep it in the run directory. */
+			if ( strchr(ptr+1,'/')!=NULL || strcmp(ptr+1,".")==0 || strcmp(ptr+1,"..")==0 ) {
+				error(0,"bind mount target `%s' must be a file name",ptr+1);
+			}
+			bind_src[nbind_mounts] = strndup(optarg,ptr-optarg);
+			bind_dst[nbind_mounts] = strdup(ptr+1);
+			nbind_mounts++;
+			break;
+		case OPT_CGROUP_POOL: /* cgroup pool size option */
+			if ( in_request ) error(0,"option `cgroup-pool' not allowed in server request");
+			cgroup_pool_size = (int) read_optarg_int("cgroup pool size",0,MAX_POOL_SIZE);
+			break;
+		case OPT_POOL_ROOT: /* pool root option */
+			if ( in_request ) error(0,"option `pool-root' not allowed in server request");
+			pool_root = optarg;
+			break;
+		case OPT_RECLAIM_CACHE: /* reclaim cache option */
+			reclaim_cache = 1;
+			break;
+		case OPT_CHROOT_MOUNTS: /* chroot mounts option */
+			chroot_mounts = 1;
+			break;
+		case OPT_KILL_OUTPUT: /* kill on output limit option */
+			kill_output_limit = 1;
+			break;
+		case OPT_STREAM_COMPARE: /* stream compare command option */
+			streamcmd = strdup(optarg);
+			break;
+		case OPT_STREAM_ARG: /* stream compare argument option */
+			streamargs = (char **) realloc(streamargs,(nstreamargs+2)*sizeof(char *));
+			if ( streamargs==NULL ) error(errno,"allocating memory");
+			streamargs[nstreamargs++] = strdup(optarg);
+			streamargs[nstreamargs] = NULL;
+			break;
+		case OPT_STREAM_USER: /* stream compare user option: uid or string */
+			errno = 0;
+			stream_uid = strtol(optarg,&ptr,10);
+			if ( errno || *ptr!='\0' ) {
+				stream_uid = userid(optarg);
+				ptr = optarg;
+			} else {
+				ptr = NULL;
+			}
+			if ( stream_uid<0 || !valid_user(stream_uid,ptr) ) {
+				error(0,"illegal stream compare user specified: `%s'",optarg);
+			}
+			errno = 0;
+			if ( (pwd = getpwuid(stream_uid))==NULL ) {
+				error(errno,"cannot find stream compare user `%s'",optarg);
+			}
+			stream_gid = (int) pwd->pw_gid;
+			break;
+		case OPT_STREAM_LIMITS: /* stream compare limits option */
+			read_optarg_stream_limits();
+			break;
+		case OPT_PHASE_TIMES: /* phase times option */
+			phase_times = 1;
+			break;
+		case OPT_TIMING_PROFILE: /* timing profile option */
+			timing_profile = 1;
+			reserve_smt = 0;
+			if ( optarg!=NULL ) {
+				if ( strcmp(optarg,"smt")!=0 ) {
+					error(0,"invalid timing profile specified: `%s'",optarg);
+				}
+				reserve_smt = 1;
+			}
+			break;
+		case OPT_IO_MAX: /* block I/O limits option */
+			read_optarg_io_max();
+			break;
+		case OPT_HASH_STDOUT: /* hash stdout option */
+			hash_stdout = 1;
+			break;
+		case OPT_PERF: /* performance counters option */
+			use_perf = 1;
+			break;
+		case OPT_SYSCALL_PROFILE: /* syscall profile option */
+			syscall_profile = 1;
+			break;
+		case OPT_SAMPLE_INTERVAL: /* sample interval option */
+			sample_interval = (int) read_optarg_int("sample interval",1,INT_MAX);
+			break;
+		case OPT_CONNECT: /* connect option: ignored when handling the request */
+			if ( in_request ) break;
+			client_mode = 1;
+			serversocket = strdup(optarg);
+			break;
 		case ':': /* getopt error */
 		case '?':
 			error(0,"unknown option or missing argument `%c'",optopt);
@@ -1081,71 +3518,382 @@ int main(int argc, char **argv)
 		}
 	}
 
-	verbose("starting in verbose mode, PID = %d", getpid());
+}
 
-	/* Make sure that we change from group root if we change to an
-	   unprivileged user to prevent unintended permissions. */
-	if ( use_user && !use_group ) {
-		verbose("using unprivileged user `%s' also as group",runuser);
-		use_group = 1;
-		rungroup = strdup(runuser);
-		rungid = groupid(rungroup);
-		if ( rungid<0 ) error(0,"invalid groupname or ID specified: `%s'",rungroup);
+void check_user()
+{
+	if ( use_user && !valid_user(runuid,runuser) ) {
+		error(0,"illegal user specified: %d",runuid);
 	}
+}
 
-	if ( show_help ) usage();
-	if ( show_version ) version(PROGRAM,VERSION);
+/* Perform the privileged setup that does not depend on the command to
+ * run. In server mode this is done only once for all requests.
+ */
+void setup_supervisor()
+{
+	FILE *fp;
+	char *oom_path;
+	int   ret;
 
-	if ( argc<=optind ) error(0,"no command specified");
+	/* Make libcgroup ready for use, unless we can directly use the
+	 * cgroup v2 unified hierarchy. */
+	mark_phase("startup");
+	cgroupv2 = ( server_mode || use_cgroup() ) && is_cgroup_v2();
+	if ( !cgroupv2 ) {
+		ret = cgroup_init();
+		if ( ret!=0 ) {
+			error(0,"libcgroup initialization failed: %s(%d)\n", cgroup_strerror(ret), ret);
+		}
+	}
+	mark_phase("cgroup-init");
+	unshare(CLONE_FILES|CLONE_FS|CLONE_NEWIPC|CLONE_NEWNET|CLONE_NEWNS|CLONE_NEWUTS|CLONE_SYSVSEM);
+	mark_phase("unshare");
 
-	/* Command to be executed */
-	cmdname = argv[optind];
-	cmdargs = argv+optind;
+	/* Check if any Linux Out-Of-Memory killer adjustments have to
+	 * be made. The oom_adj or oom_score_adj is inherited by child
+	 * processes, and at least older versions of sshd seemed to set
+	 * it, leading to processes getting a timelimit instead of memory
+	 * exceeded, when running via SSH. */
+	fp = NULL;
+	if ( !fp && (fp = fopen(OOM_PATH_NEW,"r+")) ) oom_path = strdup(OOM_PATH_NEW);
+	if ( !fp && (fp = fopen(OOM_PATH_OLD,"r+")) ) oom_path = strdup(OOM_PATH_OLD);
+	if ( fp!=NULL ) {
+		if ( fscanf(fp,"%d",&ret)!=1 ) error(errno,"cannot read from `%s'",oom_path);
+		if ( ret<0 ) {
+			verbose("resetting `%s' from %d to %d",oom_path,ret,OOM_RESET_VALUE);
+			rewind(fp);
+			if ( fprintf(fp,"%d\n",OOM_RESET_VALUE)<=0 ) {
+				error(errno,"cannot write to `%s'",oom_path);
+			}
+		}
+		if ( fclose(fp)!=0 ) error(errno,"closing file `%s'",oom_path);
+	}
+}
 
-	if ( outputmeta && (metafile = fopen(metafilename,"w"))==NULL ) {
-		error(errno,"cannot open `%s'",metafilename);
+/* Send a message over socket 'sockfd': a 32-bit length header,
+ * together with the 'nfds' (at most 3) file descriptors 'fds',
+ * followed by 'len' bytes of 'data'. 'peer' is used in error messages.
+ */
+void send_message(int sockfd, const char *data, uint32_t len,
+                  const int *fds, int nfds, const char *peer)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(3*sizeof(int))];
+
+	memset(&msg,0,sizeof(msg));
+	memset(cbuf,0,sizeof(cbuf));
+	iov[0].iov_base = &len;
+	iov[0].iov_len  = sizeof(len);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len  = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(nfds*sizeof(int));
+	memcpy(CMSG_DATA(cmsg),fds,nfds*sizeof(int));
+
+	if ( sendmsg(sockfd,&msg,MSG_NOSIGNAL)!=(ssize_t)(sizeof(len)+len) ) {
+		error(errno,"sending message to %s",peer);
+	}
+}
+
+/* Receive a message sent by send_message() from socket 'sockfd' with
+ * exactly 'nfds' file descriptors, which are stored in 'fds'. Returns
+ * the data, which must be NUL-terminated, in allocated memory and sets
+ * 'len', or returns NULL if the peer closed the connection instead.
+ */
+char *receive_message(int sockfd, uint32_t *len, int *fds, int nfds, const char *peer)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(3*sizeof(int))];
+	ssize_t nread;
+	size_t pos;
+	char *data;
+
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = len;
+	iov.iov_len  = sizeof(*len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		nread = recvmsg(sockfd,&msg,MSG_CMSG_CLOEXEC);
+	} while ( nread<0 && errno==EINTR );
+	if ( nread==0 ) return NULL;
+	if ( nread!=sizeof(*len) ) error(errno,"receiving message header from %s",peer);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if ( cmsg==NULL || cmsg->cmsg_level!=SOL_SOCKET ||
+	     cmsg->cmsg_type!=SCM_RIGHTS || cmsg->cmsg_len!=CMSG_LEN(nfds*sizeof(int)) ) {
+		error(0,"message from %s does not contain %d file descriptors",peer,nfds);
 	}
+	memcpy(fds,CMSG_DATA(cmsg),nfds*sizeof(int));
+
+	if ( *len==0 || *len>MAX_REQUEST_SIZE ) error(0,"invalid message size %u",*len);
+	if ( (data = (char *) malloc(*len))==NULL ) error(errno,"allocating memory");
+	for(pos=0; pos<*len; pos+=nread) {
+		nread = read(sockfd,data+pos,*len-pos);
+		if ( nread<0 && errno==EINTR ) {
+			nread = 0;
+			continue;
+		}
+		if ( nread<=0 ) error(errno,"receiving message from %s",peer);
+	}
+	if ( data[*len-1]!=0 ) error(0,"malformed message from %s",peer);
 
-	/* Check that new uid is in list of valid uid's. When the new user
-	   was given as a username string, then '*' matches an arbitrary
-	   length string of valid POSIX username characters [A-Za-z0-9._-].
-	   This check must be done before chroot for /etc/passwd lookup. */
-	if ( use_user ) {
-		valid_users = strdup(VALID_USERS);
-		for(ptr=strtok(valid_users,","); ptr!=NULL; ptr=strtok(NULL,",")) {
-			if ( runuid==userid(ptr) ) break;
-			if ( runuser!=NULL ) {
-				ret = fnmatch(ptr,runuser,0);
-				if ( ret==0 ) break;
-				if ( ret!=FNM_NOMATCH ) {
-					error(0,"matching username `%s' against `%s'",runuser,ptr);
-				}
-			}
+	return data;
+}
+
+/* Split the NUL-separated strings in 'data' of 'len' bytes into a NULL
+ * terminated array and set 'nstr' to the number of strings.
+ */
+char **split_message(char *data, uint32_t len, int *nstr)
+{
+	char **strs;
+	uint32_t pos;
+	int i;
+
+	*nstr = 0;
+	for(pos=0; pos<len; pos++) if ( data[pos]==0 ) (*nstr)++;
+	if ( (strs = (char **) malloc((*nstr+1)*sizeof(char *)))==NULL ) {
+		error(errno,"allocating memory");
+	}
+	for(i=0; i<*nstr; i++) {
+		strs[i] = data;
+		data += strlen(data) + 1;
+	}
+	strs[*nstr] = NULL;
+
+	return strs;
+}
+
+/* Replace stdin/stdout/stderr by the file descriptors 'fds'. */
+void redirect_stdio(int fds[3])
+{
+	int i;
+
+	for(i=0; i<=2; i++) {
+		if ( fds[i]==i ) continue;
+		if ( dup2(fds[i],i)<0 ) error(errno,"redirecting fd %d",i);
+		if ( close(fds[i])!=0 ) error(errno,"closing fd %d",fds[i]);
+	}
+}
+
+/* Wait in a parked child for the command to execute, sent by
+ * unpark_child() as a message with the stdio file descriptors and the
+ * preserve environment flag, extra environment variables, working
+ * directory and command arguments as NUL-separated strings.
+ */
+void run_parked(int fd)
+{
+	int fds[3];
+	uint32_t len;
+	char *msg;
+	char **strs;
+	int nstr;
+
+	if ( (msg = receive_message(fd,&len,fds,3,"request handler"))==NULL ) exit(0);
+	execnotifyfd = fd;
+	strs = split_message(msg,len,&nstr);
+	if ( nstr<4 ) error(0,"malformed command message");
+
+	preserve_environment = ( strs[0][0]=='1' );
+	environment_variables = ( strs[1][0]!=0 ? strs[1] : NULL );
+
+	redirect_stdio(fds);
+	if ( !use_root && chdir(strs[2])!=0 ) error(errno,"cannot chdir to `%s'",strs[2]);
+	set_environment();
+
+	/* The handler sees EOF on 'fd' (close-on-exec) once we exec. */
+	execvp(strs[3],strs+3);
+	error(errno,"cannot start `%s'",strs[3]);
+}
+
+/* Fork a child that already performs the request independent part of
+ * setrestrictions(): start a new session, change root to the pool root
+ * and drop to the run user. It then waits for its command in
+ * run_parked(), so that a run only needs to send it there.
+ */
+void park_child()
+{
+	int sv[2];
+
+	if ( socketpair(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0,sv)!=0 ) {
+		error(errno,"creating socket pair");
+	}
+
+	switch ( parked_pid = fork() ) {
+	case -1: /* error */
+		error(errno,"cannot fork pool child");
+	case  0: /* parked child */
+		if ( close(sv[0])!=0 ) error(errno,"closing socket");
+		if ( setsid()==-1 ) error(errno,"setsid failed");
+		use_root = ( pool_root!=NULL );
+		rootdir  = pool_root;
+		set_root();
+		set_user();
+		run_parked(sv[1]);
+	default:
+		if ( close(sv[1])!=0 ) error(errno,"closing socket");
+		parked_fd = sv[0];
+		parked_chroot_mounts = chroot_mounts;
+	}
+}
+
+/* Check whether the parked child was set up for the root directory of
+ * this run. */
+int parked_child_usable()
+{
+	char path[PATH_MAX], poolpath[PATH_MAX];
+
+	if ( nbind_mounts>0 ) return 0;
+	if ( !use_root ) return pool_root==NULL;
+	if ( pool_root==NULL ) return 0;
+	if ( chroot_mounts!=parked_chroot_mounts ) return 0;
+	if ( realpath(rootdir,path)==NULL || realpath(pool_root,poolpath)==NULL ) return 0;
+
+	return strcmp(path,poolpath)==0;
+}
+
+void discard_parked_child()
+{
+	verbose("parked child not usable for this run, forking a new one");
+	if ( kill(parked_pid,SIGKILL)!=0 ) error(errno,"killing parked child");
+	if ( waitpid(parked_pid,NULL,0)<0 ) error(errno,"waiting on parked child");
+	if ( close(parked_fd)!=0 ) error(errno,"closing socket");
+	parked_pid = parked_fd = -1;
+}
+
+/* Apply the request specific restrictions to the parked child from
+ * the outside and send it the command to execute.
+ */
+void unpark_child()
+{
+	int fds[3];
+	char *msg, *ptr;
+	char cwd_request[PATH_MAX];
+	size_t len;
+	int i;
+
+	if ( getcwd(cwd_request,PATH_MAX)==NULL ) error(errno,"cannot get directory");
+
+	set_rlimits(child_pid);
+	cgroup_attach(child_pid);
+	set_affinity(child_pid);
+
+	len = 2 + 1;
+	len += ( environment_variables!=NULL ? strlen(environment_variables) : 0 ) + 1;
+	len += strlen(cwd_request) + 1;
+	for(i=0; cmdargs[i]!=NULL; i++) len += strlen(cmdargs[i]) + 1;
+	if ( len>MAX_REQUEST_SIZE ) error(0,"command too large: %zu bytes",len);
+
+	if ( (msg = (char *) malloc(len))==NULL ) error(errno,"allocating memory");
+	ptr = stpcpy(msg,preserve_environment ? "1" : "0") + 1;
+	ptr = stpcpy(ptr,environment_variables!=NULL ? environment_variables : "") + 1;
+	ptr = stpcpy(ptr,cwd_request) + 1;
+	for(i=0; cmdargs[i]!=NULL; i++) ptr = stpcpy(ptr,cmdargs[i]) + 1;
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = child_pipefd[STDOUT_FILENO][PIPE_IN];
+	fds[2] = child_pipefd[STDERR_FILENO][PIPE_IN];
+	send_message(parked_fd,msg,(uint32_t)(ptr-msg),fds,3,"parked child");
+	free(msg);
+
+	verbose("started parked child %d",(int)child_pid);
+}
+
+/* Block until child command has called exec(), detected by EOF on
+ * close-on-exec file descriptor 'fd'. This is the start time of the
+ * command; also record the latency since the start of this (request
+ * to) runguard. If the child failed instead, it sent us its error: a
+ * forked child wrote it to the metafile already, a parked one did not.
+ */
+void wait_for_exec(int fd, int parked)
+{
+	ssize_t nread;
+	size_t len = 0;
+
+	do {
+		nread = read(fd,buf+len,BUF_SIZE-1-len);
+		if ( nread>0 ) len += nread;
+	} while ( (nread<0 && errno==EINTR) || (nread>0 && len<BUF_SIZE-1) );
+	if ( nread<0 ) error(errno,"waiting for command to start");
+	if ( close(fd)!=0 ) error(errno,"closing exec notification fd");
+
+	if ( len>0 ) {
+		buf[len] = 0;
+		if ( parked ) {
+			write_meta("internal-error","%s",buf);
+		} else if ( jsonmetafilename!=NULL ) {
+			add_json_meta("internal-error",strdup(buf));
 		}
-		if ( ptr==NULL || runuid<=0 ) error(0,"illegal user specified: %d",runuid);
 	}
 
-	/* Setup pipes connecting to child stdout/err streams (ignore stdin). */
+	if ( clock_gettime(CLOCK_MONOTONIC,&starttime)!=0 ) error(errno,"getting time");
+	exec_latency = timediff(&progstarttime,&starttime);
+}
+
+/* Run the command with restrictions applied and watch it until it
+ * exits. Returns the exitcode of the command.
+ */
+int run_command()
+{
+	sigset_t sigmask, emptymask;
+	pid_t pid;
+	int   i, r, n, nevents;
+	int   ret;
+	int   status;
+	int   exitcode;
+	int   child_exited;
+	int   epollfd, pidfd, sigfd, walltimerfd, sampletimerfd, streampidfd;
+	int   cputimer;
+	int   execpipe[2];
+	char *ptr;
+	size_t data_read[3];
+	size_t data_passed[3];
+	size_t total_data;
+	char str[256];
+	double cputime, usertime, systime;
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	uint64_t expirations;
+
+	struct itimerspec its;
+	struct epoll_event events[MAX_EVENTS];
+	struct signalfd_siginfo siginfo;
+
+	/* Setup pipes connecting to child stdout/err streams (ignore stdin),
+	   as large as allowed to reduce the number of copy iterations. */
+	pumpbufmax = BUF_SIZE;
 	for(i=1; i<=2; i++) {
 		if ( pipe(child_pipefd[i])!=0 ) error(errno,"creating pipe for fd %d",i);
+		pumpbufmax = max(pumpbufmax,set_pipe_size(child_pipefd[i][PIPE_OUT]));
 	}
+	verbose("using pipes of %zu bytes",pumpbufmax);
+	pump_iterations = 0;
+	resize_pumpbuf(BUF_SIZE);
+	if ( hash_stdout ) md5_init(&stdout_md5);
 
 	if ( sigemptyset(&emptymask)!=0 ) error(errno,"creating empty signal mask");
 
-	/* unmask all signals, except SIGCHLD: detected in pselect() below */
+	/* Block SIGTERM and SIGCHLD: the watchdog receives these through
+	   a signalfd, the child unblocks them again before exec. Do this
+	   before fork() so that no SIGTERM can get lost in between. */
 	sigmask = emptymask;
-	if ( sigaddset(&sigmask, SIGCHLD)!=0 ) error(errno,"setting signal mask");
+	if ( sigaddset(&sigmask, SIGTERM)!=0 ||
+	     sigaddset(&sigmask, SIGCHLD)!=0 ) error(errno,"setting signal mask");
 	if ( sigprocmask(SIG_SETMASK, &sigmask, NULL)!=0 ) {
-		error(errno,"unmasking signals");
-	}
-
-	/* Construct signal handler for SIGCHLD detection in pselect(). */
-	received_SIGCHLD = 0;
-	sigact.sa_handler = child_handler;
-	sigact.sa_flags   = 0;
-	sigact.sa_mask    = emptymask;
-	if ( sigaction(SIGCHLD,&sigact,NULL)!=0 ) {
-		error(errno,"installing signal handler");
+		error(errno,"masking signals");
 	}
 
 	if ( cpuset!=NULL && strlen(cpuset)>0 ) {
@@ -1154,50 +3902,53 @@ int main(int argc, char **argv)
 		if ( *ptr == '\0' ) {
 			/* check if we have enough cores available */
 			int nprocs = get_nprocs_conf();
-			if ( ret < 0 || ret >= nprocs ) {
-				error(0, "processor ID %d given as cpuset, but only %d cores configured",
-				      ret, nprocs);
-			}
-		}
-	}
-	/* Make libcgroup ready for use */
-	ret = cgroup_init();
-	if ( ret!=0 ) {
-		error(0,"libcgroup initialization failed: %s(%d)\n", cgroup_strerror(ret), ret);
-	}
-	/* Define the cgroup name that we will use and make sure it will
-	 * be unique. Note: group names must have slashes!
-	 */
-	snprintf(cgroupname, 255, "/domjudge/dj_cgroup_%d_%d/", getpid(), (int)time(NULL));
-
-	cgroup_create();
-
-	unshare(CLONE_FILES|CLONE_FS|CLONE_NEWIPC|CLONE_NEWNET|CLONE_NEWNS|CLONE_NEWUTS|CLONE_SYSVSEM);
-
-	/* Check if any Linux Out-Of-Memory killer adjustments have to
-	 * be made. The oom_adj or oom_score_adj is inherited by child
-	 * processes, and at least older versions of sshd seemed to set
-	 * it, leading to processes getting a timelimit instead of memory
-	 * exceeded, when running via SSH. */
-	fp = NULL;
-	if ( !fp && (fp = fopen(OOM_PATH_NEW,"r+")) ) oom_path = strdup(OOM_PATH_NEW);
-	if ( !fp && (fp = fopen(OOM_PATH_OLD,"r+")) ) oom_path = strdup(OOM_PATH_OLD);
-	if ( fp!=NULL ) {
-		if ( fscanf(fp,"%d",&ret)!=1 ) error(errno,"cannot read from `%s'",oom_path);
-		if ( ret<0 ) {
-			verbose("resetting `%s' from %d to %d",oom_path,ret,OOM_RESET_VALUE);
-			rewind(fp);
-			if ( fprintf(fp,"%d\n",OOM_RESET_VALUE)<=0 ) {
-				error(errno,"cannot write to `%s'",oom_path);
+			if ( ret < 0 || ret >= nprocs ) {
+				error(0, "processor ID %d given as cpuset, but only %d cores configured",
+				      ret, nprocs);
 			}
 		}
-		if ( fclose(fp)!=0 ) error(errno,"closing file `%s'",oom_path);
+	}
+	setup_timing_profile();
+	/* Define the cgroup name that we will use and make sure it will
+	 * be unique. Note: group names must have slashes!
+	 */
+	if ( pooled_cgroupname[0]!=0 ) {
+		strcpy(cgroupname, pooled_cgroupname);
+	} else {
+		snprintf(cgroupname, 255, "/domjudge/dj_cgroup_%d_%d/", getpid(), (int)time(NULL));
+	}
+	snprintf(cgroupdir, PATH_MAX, "%s%s", CGROUP_ROOT, cgroupname);
+	mark_phase("prepare");
+
+	cgroup_create();
+	mark_phase("cgroup-create");
+
+	if ( parked_pid>0 && !parked_child_usable() ) discard_parked_child();
+
+	/* The command waits for the perf counters to be attached by
+	   reading until EOF from this pipe. A parked child instead waits
+	   for its command until these are attached. */
+	if ( (use_perf || syscall_profile) && parked_pid<0 && pipe(perf_syncpipe)!=0 ) {
+		error(errno,"creating perf sync pipe");
+	}
+
+	/* The read end of this pipe sees EOF once the command is executed. */
+	if ( parked_pid<0 && pipe2(execpipe,O_CLOEXEC)!=0 ) {
+		error(errno,"creating exec notification pipe");
 	}
 
-	switch ( child_pid = fork() ) {
+	switch ( child_pid = ( parked_pid>0 ? parked_pid : fork() ) ) {
 	case -1: /* error */
 		error(errno,"cannot fork");
 	case  0: /* run controlled command */
+		if ( close(execpipe[0])!=0 ) error(errno,"closing exec notification pipe");
+		execnotifyfd = execpipe[1];
+		jsonmetafilename = NULL;
+
+		if ( sigprocmask(SIG_SETMASK, &emptymask, NULL)!=0 ) {
+			error(errno,"unmasking signals");
+		}
+
 		/* Apply all restrictions for child process. */
 		setrestrictions();
 		verbose("setrestrictions() done");
@@ -1216,11 +3967,36 @@ int main(int argc, char **argv)
 		}
 		verbose("pipes closed in child");
 
+		if ( use_perf || syscall_profile ) {
+			if ( close(perf_syncpipe[1])!=0 ) error(errno,"closing perf sync pipe");
+			if ( read(perf_syncpipe[0],buf,1)<0 ) error(errno,"waiting for perf counters");
+			if ( close(perf_syncpipe[0])!=0 ) error(errno,"closing perf sync pipe");
+		}
+
 		/* And execute child command. */
 		execvp(cmdname,cmdargs);
 		error(errno,"cannot start `%s'",cmdname);
 
 	default: /* become watchdog */
+		mark_phase("fork");
+		if ( parked_pid>0 ) {
+			if ( use_perf ) perf_open();
+			if ( syscall_profile ) syscall_profile_open();
+			unpark_child();
+			execpipe[0] = parked_fd;
+		} else {
+			if ( use_perf || syscall_profile ) {
+				if ( close(perf_syncpipe[0])!=0 ) error(errno,"closing perf sync pipe");
+				if ( use_perf ) perf_open();
+				if ( syscall_profile ) syscall_profile_open();
+				if ( close(perf_syncpipe[1])!=0 ) error(errno,"closing perf sync pipe");
+			}
+			if ( close(execpipe[1])!=0 ) error(errno,"closing exec notification pipe");
+		}
+		wait_for_exec(execpipe[0],parked_pid>0);
+		/* This includes setrestrictions() in the child. */
+		mark_phase("exec");
+
 		/* Shed privileges, only if not using a separate child uid,
 		   because in that case we may need root privileges to kill
 		   the child process. Do not use Linux specific setresuid()
@@ -1230,8 +4006,6 @@ int main(int argc, char **argv)
 			verbose("watchdog using user ID `%d'",getuid());
 		}
 
-		if ( gettimeofday(&starttime,NULL) ) error(errno,"getting time");
-
 		/* Close unused file descriptors */
 		for(i=1; i<=2; i++) {
 			if ( close(child_pipefd[i][PIPE_IN])!=0 ) {
@@ -1245,6 +4019,12 @@ int main(int argc, char **argv)
 			data_read[i] = data_passed[i] = 0; /* Reset data counters */
 		}
 		data_read[0] = 0;
+		if ( handoffcmd!=NULL ) {
+			outputmemfd = syscall(SYS_memfd_create, "runguard-stdout",
+			                      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+			if ( outputmemfd<0 ) error(errno,"creating memfd for stdout");
+			child_redirfd[STDOUT_FILENO] = outputmemfd;
+		}
 		if ( redir_stdout ) {
 			child_redirfd[STDOUT_FILENO] = creat(stdoutfilename, S_IRUSR | S_IWUSR);
 			if ( child_redirfd[STDOUT_FILENO]<0 ) {
@@ -1259,86 +4039,204 @@ int main(int argc, char **argv)
 		}
 		verbose("redirection done in parent");
 
-		if ( sigemptyset(&emptymask)!=0 ) error(errno,"creating empty signal mask");
+		/* Writes to an exited stream compare command must not kill
+		   us; the command itself was forked before this. */
+		streampidfd = -1;
+		early_verdict = 0;
+		output_limit_reached = 0;
+		if ( streamcmd!=NULL ) {
+			if ( signal(SIGPIPE,SIG_IGN)==SIG_ERR ) error(errno,"ignoring SIGPIPE");
+			streampidfd = stream_start();
+		}
+
+		if ( (epollfd = epoll_create1(EPOLL_CLOEXEC))<0 ) {
+			error(errno,"creating epoll instance");
+		}
+
+		/* Watch the child output pipes; their bit in pump_pipes()
+		   is used as event tag. */
+		for(i=1; i<=2; i++) {
+			add_event(epollfd, child_pipefd[i][PIPE_OUT], 1<<i);
+		}
 
-		/* Construct one-time signal handler to terminate() for TERM
-		   and ALRM signals. */
-		sigmask = emptymask;
-		if ( sigaddset(&sigmask,SIGALRM)!=0 ||
-		     sigaddset(&sigmask,SIGTERM)!=0 ) error(errno,"setting signal mask");
+		/* Detect child exit via a pidfd. Kernels before 5.3 don't
+		   have these: fall back to SIGCHLD from the signalfd. */
+		pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+		if ( pidfd>=0 ) {
+			add_event(epollfd, pidfd, EVENT_CHILD);
+		} else if ( errno!=ENOSYS ) {
+			error(errno,"opening pidfd for command");
+		} else {
+			verbose("pidfd_open not supported, using SIGCHLD");
+		}
 
-		sigact.sa_handler = terminate;
-		sigact.sa_flags   = SA_RESETHAND | SA_RESTART;
-		sigact.sa_mask    = sigmask;
+		if ( (sigfd = signalfd(-1, &sigmask, SFD_CLOEXEC))<0 ) {
+			error(errno,"creating signalfd");
+		}
+		add_event(epollfd, sigfd, EVENT_SIGNAL);
 
-		/* Kill child command when we receive SIGTERM */
-		if ( sigaction(SIGTERM,&sigact,NULL)!=0 ) {
-			error(errno,"installing signal handler");
+		if ( (killtimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC))<0 ) {
+			error(errno,"creating kill delay timer");
 		}
+		add_event(epollfd, killtimerfd, EVENT_KILLTIMER);
 
+		walltimerfd = -1;
 		if ( use_walltime ) {
-			/* Kill child when we receive SIGALRM */
-			if ( sigaction(SIGALRM,&sigact,NULL)!=0 ) {
-				error(errno,"installing signal handler");
+			if ( (walltimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC))<0 ) {
+				error(errno,"creating wall time timer");
 			}
+			set_timer(walltimerfd, walltimelimit[1]);
+			add_event(epollfd, walltimerfd, EVENT_WALLTIMER);
+			verbose("setting hard wall-time limit to %.3f seconds",walltimelimit[1]);
+		}
 
-			/* Trigger SIGALRM via setitimer:  */
-			itimer.it_interval.tv_sec  = 0;
-			itimer.it_interval.tv_usec = 0;
-			itimer.it_value.tv_sec  = (int) walltimelimit[1];
-			itimer.it_value.tv_usec = (int)(modf(walltimelimit[1],&tmpd) * 1E6);
+		sampletimerfd = -1;
+		if ( sample_interval>0 ) {
+			sample_open();
+			sample_write();
 
-			if ( setitimer(ITIMER_REAL,&itimer,NULL)!=0 ) {
-				error(errno,"setting timer");
+			if ( (sampletimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC))<0 ) {
+				error(errno,"creating sampling timer");
 			}
-			verbose("setting hard wall-time limit to %.3f seconds",walltimelimit[1]);
+			its.it_value.tv_sec  = sample_interval / 1000;
+			its.it_value.tv_nsec = (sample_interval % 1000) * 1000000L;
+			its.it_interval = its.it_value;
+			if ( timerfd_settime(sampletimerfd,0,&its,NULL)!=0 ) {
+				error(errno,"setting sampling timer");
+			}
+			add_event(epollfd, sampletimerfd, EVENT_SAMPLE);
 		}
 
-		if ( times(&startticks)==(clock_t) -1 ) {
-			error(errno,"getting start clock ticks");
+		/* Without a pidfd, SIGCHLD tells us the validator exited. */
+		if ( streampidfd>=0 ) add_event(epollfd, streampidfd, EVENT_STREAM);
+		/* Edge triggered: buffered output is pending whenever the
+		   pipe fills up, so this fires only when we have data left. */
+		if ( streamfd>=0 ) add_event_mask(epollfd, streamfd, EPOLLOUT | EPOLLET, EVENT_STREAMOUT);
+
+		if ( (cputimer = cpuwatch_start())>=0 ) {
+			add_event(epollfd, cputimer, EVENT_CPUTIMER);
+		}
+
+		/* Kernfs files like memory.events and PSI triggers signal
+		   with EPOLLPRI; the v1 OOM notifier is an eventfd. */
+		if ( memwatch_start()>=0 ) {
+			add_event_mask(epollfd, memwatchfd, cgroupv2 ? EPOLLPRI : EPOLLIN, EVENT_MEMORY);
+			if ( mempressfd>=0 ) add_event_mask(epollfd, mempressfd, EPOLLPRI, EVENT_MEMPRESS);
 		}
 
 		/* Wait for child data or exit.
 		   Initialize status here to quelch clang++ warning about
-		   uninitialized value; it is set by the wait() call. */
+		   uninitialized value; it is set by the waitpid() call. */
 		status = 0;
 		/* We start using splice() to copy data from child to parent
 		   I/O file descriptors. If that fails (not all I/O
 		   source - dest combinations support it), then we revert to
 		   using read()/write(). */
 		use_splice = 1;
-		while ( 1 ) {
-
-			FD_ZERO(&readfds);
-			nfds = -1;
-			for(i=1; i<=2; i++) {
-				if ( child_pipefd[i][PIPE_OUT]>=0 ) {
-					FD_SET(child_pipefd[i][PIPE_OUT],&readfds);
-					nfds = max(nfds,child_pipefd[i][PIPE_OUT]);
-				}
+		child_exited = 0;
+		while ( !child_exited ) {
+
+			nevents = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+			if ( nevents<0 ) {
+				if ( errno==EINTR ) continue;
+				error(errno,"waiting for events");
 			}
 
-			r = pselect(nfds+1, &readfds, NULL, NULL, NULL, &emptymask);
-			if ( r==-1 && errno!=EINTR ) error(errno,"waiting for child data");
+			for(n=0; n<nevents; n++) {
+				switch ( events[n].data.u32 ) {
+				case EVENT_CHILD:
+					break;
+
+				case EVENT_SIGNAL:
+					r = read(sigfd, &siginfo, sizeof(siginfo));
+					if ( r!=sizeof(siginfo) ) error(errno,"reading signalfd");
+					if ( siginfo.ssi_signo==SIGTERM ) terminate(SIGTERM);
+					break;
+
+				case EVENT_WALLTIMER:
+					if ( read(walltimerfd, &expirations, sizeof(expirations))<0 ) {
+						error(errno,"reading wall time timer");
+					}
+					terminate(SIGALRM);
+					break;
+
+				case EVENT_KILLTIMER:
+					if ( read(killtimerfd, &expirations, sizeof(expirations))<0 ) {
+						error(errno,"reading kill delay timer");
+					}
+					verbose("sending SIGKILL");
+					if ( kill(-child_pid,SIGKILL)!=0 && errno!=ESRCH ) {
+						error(errno,"sending SIGKILL to command");
+					}
+					break;
+
+				case EVENT_SAMPLE:
+					if ( read(sampletimerfd, &expirations, sizeof(expirations))<0 ) {
+						error(errno,"reading sampling timer");
+					}
+					sample_write();
+					break;
+
+				case EVENT_STREAM:
+					/* Stays readable after the exit, which
+					   stream_check() handles below. */
+					if ( epoll_ctl(epollfd, EPOLL_CTL_DEL, streampidfd, NULL)!=0 ) {
+						error(errno,"removing stream compare pidfd");
+					}
+					break;
+
+				case EVENT_STREAMOUT:
+					stream_flush();
+					break;
+
+				case EVENT_CPUTIMER:
+					if ( read(cputimer, &expirations, sizeof(expirations))<0 ) {
+						error(errno,"reading cpu time timer");
+					}
+					cpuwatch_check();
+					break;
+
+				case EVENT_MEMORY:
+				case EVENT_MEMPRESS:
+					memwatch_check(events[n].data.u32);
+					break;
+
+				default:
+					pump_pipes(events[n].data.u32, data_read, data_passed);
+				}
+			}
 
-			if ( received_SIGCHLD || received_signal == SIGALRM ) {
-				if ( (pid = wait(&status))<0 ) error(errno,"waiting on child");
-				if ( pid==child_pid ) break;
+			/* Both the pidfd and SIGCHLD only tell us that the child
+			   may have exited, check without blocking. The resource
+			   usage includes all its waited-for descendants. */
+			if ( (pid = wait4(child_pid, &status, WNOHANG, &childusage))<0 ) {
+				error(errno,"waiting on child");
+			}
+			if ( pid==child_pid ) {
+				if ( clock_gettime(CLOCK_MONOTONIC,&endtime)!=0 ) {
+					error(errno,"getting time");
+				}
+				child_exited = 1;
 			}
+			stream_check(child_exited);
+		}
 
-			pump_pipes(readfds, data_read, data_passed);
+		/* The validator verdict is not needed anymore, so do not
+		   pass it the remaining data. */
+		if ( streamcmd!=NULL ) {
+			stream_stop();
+			if ( signal(SIGPIPE,SIG_DFL)==SIG_ERR ) error(errno,"resetting SIGPIPE");
 		}
 
-		/* Reset pipe filedescriptors to use blocking I/O. */
-		FD_ZERO(&readfds);
+		/* Drain the remaining pipe data without blocking: processes
+		   left behind by the command may still hold the pipes open. */
 		for(i=1; i<=2; i++) {
 			if ( child_pipefd[i][PIPE_OUT]>=0 ) {
-				FD_SET(child_pipefd[i][PIPE_OUT],&readfds);
 				r = fcntl(child_pipefd[i][PIPE_OUT], F_GETFL);
 				if (r == -1) {
 					error(errno, "fcntl, getting flags");
 				}
-				r = fcntl(child_pipefd[i][PIPE_OUT], F_SETFL, r ^ O_NONBLOCK);
+				r = fcntl(child_pipefd[i][PIPE_OUT], F_SETFL, r | O_NONBLOCK);
 				if (r == -1) {
 					error(errno, "fcntl, setting flags");
 				}
@@ -1346,22 +4244,30 @@ int main(int argc, char **argv)
 		}
 
 		do {
-			total_data = data_passed[1] + data_passed[2];
-			pump_pipes(readfds, data_read, data_passed);
-		} while ( data_passed[1] + data_passed[2] > total_data );
+			total_data = data_read[1] + data_read[2];
+			pump_pipes((1<<1) | (1<<2), data_read, data_passed);
+		} while ( data_read[1] + data_read[2] > total_data );
+		mark_phase("pump");
+
+		if ( close(epollfd)!=0 || close(sigfd)!=0 || close(killtimerfd)!=0 ||
+		     (pidfd>=0 && close(pidfd)!=0) ||
+		     (walltimerfd>=0 && close(walltimerfd)!=0) ||
+		     (sampletimerfd>=0 && close(sampletimerfd)!=0) ||
+		     (streampidfd>=0 && close(streampidfd)!=0) ) {
+			error(errno,"closing event file descriptors");
+		}
+		killtimerfd = -1;
+		cpuwatch_stop();
+
+		if ( sample_interval>0 ) sample_close();
 
-		/* Close the output files */
+		/* Close the output files, but keep the memfd for handoff. */
 		for(i=1; i<=2; i++) {
+			if ( child_redirfd[i]==outputmemfd ) continue;
 			ret = close(child_redirfd[i]);
 			if( ret!=0 ) error(errno,"closing output fd %d", i);
 		}
 
-		if ( times(&endticks)==(clock_t) -1 ) {
-			error(errno,"getting end clock ticks");
-		}
-
-		if ( gettimeofday(&endtime,NULL) ) error(errno,"getting time");
-
 		/* Test whether command has finished abnormally */
 		exitcode = 0;
 		if ( ! WIFEXITED(status) ) {
@@ -1384,15 +4290,33 @@ int main(int argc, char **argv)
 			exitcode = WEXITSTATUS(status);
 		}
 
-		double cputime;
-		output_cgroup_stats(&cputime);
+		/* Without cgroup, CPU time is that of the command and its
+		   waited-for descendants. */
+		usertime = timeval_seconds(&childusage.ru_utime);
+		systime  = timeval_seconds(&childusage.ru_stime);
+		cputime  = usertime + systime;
+		mark_phase("close");
+		output_cgroup_stats(&cputime,&usertime,&systime);
+		memwatch_stop();
+		mark_phase("cgroup-stats");
 		cgroup_kill();
+		mark_phase("cgroup-kill");
+		if ( reclaim_cache ) {
+			cgroup_reclaim_cache();
+			mark_phase("reclaim-cache");
+		}
 		cgroup_delete();
+		mark_phase("cgroup-delete");
+		if ( use_perf ) output_perf_stats();
+		if ( syscall_profile ) output_syscall_profile();
 
 		/* Drop root before writing to output file(s). */
 		if ( setuid(getuid())!=0 ) error(errno,"dropping root privileges");
 
-		output_exit_time(exitcode, cputime);
+		output_exit_time(exitcode, cputime, usertime, systime);
+		write_meta("exec-latency","%.6f",exec_latency);
+		output_timing_profile();
+		output_phase_times();
 
 		/* Check if the output stream was truncated. */
 		if ( limit_streamsize ) {
@@ -1406,15 +4330,33 @@ int main(int argc, char **argv)
 				ptr = stpcpy(ptr,"stderr");
 			}
 			write_meta("output-truncated","%s",str);
+			if ( kill_output_limit ) {
+				write_meta("output-result","%s",
+				           output_limit_reached ? "output-limit" : "");
+			}
 		}
 
 		write_meta("stdin-bytes", "%zu",data_read[0]);
 		write_meta("stdout-bytes","%zu",data_read[1]);
 		write_meta("stderr-bytes","%zu",data_read[2]);
+		write_meta("pump-iterations","%lu",pump_iterations);
+		if ( hash_stdout ) {
+			md5_final(&stdout_md5, digest);
+			write_meta("stdout-md5","%s",md5_hex(digest, str));
+		}
+		if ( early_verdict ) write_meta("early-verdict","wrong-answer");
 
 		if ( outputmeta && fclose(metafile)!=0 ) {
 			error(errno,"closing file `%s'",metafilename);
 		}
+		write_json_meta();
+
+		/* The client has its reply, so delete a pooled cgroup now;
+		   it is empty, also when the command did not use it. */
+		if ( pooled_cgroupname[0]!=0 ) {
+			if ( rmdir(cgroupdir)!=0 ) warning("cannot delete cgroup `%s': %s",cgroupdir,strerror(errno));
+			verbose("deleted cgroup '%s'",cgroupdir);
+		}
 
 		/* Return the exitstatus of the command */
 		return exitcode;
@@ -1423,3 +4365,531 @@ int main(int argc, char **argv)
 	/* This should never be reached */
 	error(0,"unexpected end of program");
 }
+
+/* Find the value of 'key' in metadata formatted as "key: value" lines.
+ * Returns a pointer into 'meta' or NULL if the key is not present.
+ */
+char *find_meta(char *meta, const char *key)
+{
+	char *ptr;
+	size_t keylen = strlen(key);
+
+	for(ptr=meta; ptr!=NULL && *ptr!=0; ptr=strchr(ptr,'\n')) {
+		if ( *ptr=='\n' ) ptr++;
+		if ( strncmp(ptr,key,keylen)==0 && strncmp(ptr+keylen,": ",2)==0 ) {
+			return ptr+keylen+2;
+		}
+	}
+
+	return NULL;
+}
+
+/* Handle a single run request on connection 'connfd' in a process
+ * forked from the server. The request is a message (see send_message())
+ * with the client stdin/stdout/stderr file descriptors and the
+ * NUL-separated client working directory and runguard arguments. The
+ * metadata is sent back over the connection, see run_client().
+ */
+void serve_request(int connfd)
+{
+	int fds[3];
+	uint32_t len;
+	char *request, *cwd;
+	char **args;
+	int nargs;
+
+	if ( clock_gettime(CLOCK_MONOTONIC,&progstarttime)!=0 ) error(errno,"getting time");
+	nphases = 0;
+
+	/* Report all errors back to the client from now on. */
+	if ( (metafile = fdopen(connfd,"w"))==NULL ) error(errno,"opening connection");
+	metafilename = serversocket;
+	outputmeta = 1;
+
+	if ( (request = receive_message(connfd,&len,fds,3,"client"))==NULL ) {
+		error(0,"connection closed without request");
+	}
+
+	/* Replace the working directory by our own name as argv[0] for
+	   option parsing. */
+	args = split_message(request,len,&nargs);
+	cwd = args[0];
+	args[0] = progname;
+
+	/* Use the client stdio streams as our own, such that they are
+	   inherited by the command. */
+	redirect_stdio(fds);
+	if ( chdir(cwd)!=0 ) error(errno,"cannot chdir to `%s'",cwd);
+
+	/* Options passed to the server are kept as defaults. */
+	in_request = 1;
+	optind = 0;
+	metafilename = NULL;
+	parse_options(nargs,args);
+	init_sampling();
+	metafilename = serversocket;
+	outputmeta = 1;
+	/* The client writes the JSON metadata from our reply. */
+	jsonmetafilename = NULL;
+
+	if ( nargs<=optind ) error(0,"no command specified");
+
+	cmdname = args[optind];
+	cmdargs = args+optind;
+
+	exit(run_command());
+}
+
+/* Pre-forked request handler: park a child, then wait for the server
+ * to pass us a connection and pooled cgroup, or EOF on 'ctlfd' when it
+ * stops.
+ */
+void run_pool_handler(int ctlfd)
+{
+	int connfd;
+	uint32_t len;
+	char *msg;
+
+	park_child();
+
+	if ( (msg = receive_message(ctlfd,&len,&connfd,1,"server"))==NULL ) {
+		if ( kill(parked_pid,SIGKILL)!=0 ) error(errno,"killing parked child");
+		if ( waitpid(parked_pid,NULL,0)<0 ) error(errno,"waiting on parked child");
+		exit(0);
+	}
+	/* The message is the name of a pooled cgroup, or empty. */
+	if ( len==0 || msg[len-1]!=0 || len>sizeof(pooled_cgroupname) ) {
+		error(0,"invalid message from server");
+	}
+	strcpy(pooled_cgroupname,msg);
+	free(msg);
+	if ( close(ctlfd)!=0 ) error(errno,"closing socket");
+
+	serve_request(connfd);
+}
+
+/* Replace runguard by the handoff command, with the sealed stdout of
+ * the command as its stdin. Privileges are dropped to the user that
+ * invoked us via sudo, if any.
+ */
+void run_handoff()
+{
+	sigset_t emptymask;
+
+	/* The meta file has been closed already. */
+	outputmeta = 0;
+
+	if ( fcntl(outputmemfd, F_ADD_SEALS,
+	           F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)!=0 ) {
+		error(errno,"sealing stdout memfd");
+	}
+	if ( lseek(outputmemfd,0,SEEK_SET)!=0 ) error(errno,"rewinding stdout memfd");
+	if ( dup2(outputmemfd,STDIN_FILENO)<0 ) error(errno,"redirecting handoff stdin");
+	if ( close(outputmemfd)!=0 ) error(errno,"closing stdout memfd");
+
+	if ( getuid()==0 ) drop_to_sudo_user("handoff command");
+
+	/* Do not pass on the signals blocked by the watchdog. */
+	if ( sigemptyset(&emptymask)!=0 ) error(errno,"creating empty signal mask");
+	if ( sigprocmask(SIG_SETMASK, &emptymask, NULL)!=0 ) {
+		error(errno,"unmasking signals");
+	}
+
+	verbose("executing handoff command `%s'",handoffcmd);
+	execl("/bin/sh","sh","-c",handoffcmd,(char *) NULL);
+	error(errno,"cannot start handoff command `%s'",handoffcmd);
+}
+
+/* Fork a pre-forked request handler, see run_pool_handler(), for
+ * pool slot 'slot' and store its control socket in 'ctlfds'.
+ */
+pid_t fork_pool_handler(int listenfd, int ctlfds[], int slot)
+{
+	int sv[2];
+	int i;
+	pid_t pid;
+
+	if ( socketpair(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0,sv)!=0 ) {
+		error(errno,"creating socket pair");
+	}
+
+	switch ( pid = fork() ) {
+	case -1: /* error */
+		error(errno,"cannot fork pool handler");
+	case  0: /* wait for a request */
+		close(listenfd);
+		close(sv[0]);
+		for(i=0; i<pool_size; i++) if ( i!=slot && ctlfds[i]>=0 ) close(ctlfds[i]);
+		run_pool_handler(sv[1]);
+	default:
+		if ( close(sv[1])!=0 ) error(errno,"closing socket");
+		ctlfds[slot] = sv[0];
+	}
+
+	return pid;
+}
+
+/* Listen on the server socket and pass each request to an idle handler
+ * from the pool, or fork a new handler if none is available. The server
+ * stops when its stdin is closed, such that the (unprivileged) process
+ * that started it can stop it by closing the pipe.
+ */
+void run_server()
+{
+	struct sockaddr_un addr;
+	struct pollfd pfds[2];
+	struct sigaction sigact;
+	int listenfd, connfd;
+	pid_t pool_pids[MAX_POOL_SIZE]; /* >0: idle, -1: to start, 0: disabled */
+	int   pool_ctlfds[MAX_POOL_SIZE];
+	int   i;
+	pid_t pid;
+	mode_t oldmask;
+	uid_t owner;
+	char *ptr, *dir;
+	const char *name;
+	char  dirpath[64];
+	struct stat st;
+	int   dirfd;
+	char c;
+
+	/* We run as root, so only touch the socket within the judging
+	   directories, through its checked parent directory: a path
+	   component swapped for a symlink then cannot redirect us. */
+	if ( (ptr = strrchr(serversocket,'/'))==NULL ) {
+		dir = strdup(".");
+		name = serversocket;
+	} else {
+		dir = strndup(serversocket,ptr==serversocket ? 1 : ptr-serversocket);
+		name = ptr+1;
+	}
+	if ( dir==NULL ) error(errno,"allocating memory");
+	if ( *name==0 || strcmp(name,".")==0 || strcmp(name,"..")==0 ) {
+		error(0,"invalid socket path `%s'",serversocket);
+	}
+	if ( (dirfd = open(dir,O_PATH|O_DIRECTORY|O_CLOEXEC))<0 ) {
+		error(errno,"cannot open directory `%s'",dir);
+	}
+	snprintf(dirpath,sizeof(dirpath),"/proc/self/fd/%d",dirfd);
+	if ( !path_within(dirpath,CHROOT_PREFIX) ) {
+		error(0,"invalid socket path `%s': must be within `%s'",serversocket,CHROOT_PREFIX);
+	}
+	free(dir);
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if ( snprintf(addr.sun_path,sizeof(addr.sun_path),"%s/%s",dirpath,name)>=
+	     (int)sizeof(addr.sun_path) ) {
+		error(0,"socket path `%s' too long",serversocket);
+	}
+
+	/* Remove a stale socket left behind by a previous server, but
+	   nothing else. */
+	if ( fstatat(dirfd,name,&st,AT_SYMLINK_NOFOLLOW)==0 ) {
+		if ( !S_ISSOCK(st.st_mode) ) {
+			error(0,"refusing to replace `%s': not a socket",serversocket);
+		}
+		if ( unlinkat(dirfd,name,0)!=0 && errno!=ENOENT ) {
+			error(errno,"removing stale socket `%s'",serversocket);
+		}
+	} else if ( errno!=ENOENT ) {
+		error(errno,"cannot stat `%s'",serversocket);
+	}
+
+	if ( (listenfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))<0 ) {
+		error(errno,"creating socket");
+	}
+	oldmask = umask(S_IRWXG | S_IRWXO);
+	if ( bind(listenfd,(struct sockaddr *)&addr,sizeof(addr))!=0 ) {
+		error(errno,"binding socket `%s'",serversocket);
+	}
+	umask(oldmask);
+
+	/* Only the user that started us (typically via sudo) may connect. */
+	owner = getuid();
+	if ( (ptr = getenv("SUDO_UID"))!=NULL ) owner = (uid_t) strtol(ptr,NULL,10);
+	if ( fchownat(dirfd,name,owner,(gid_t) -1,AT_SYMLINK_NOFOLLOW)!=0 ) {
+		error(errno,"changing owner of socket `%s'",serversocket);
+	}
+
+	if ( listen(listenfd,16)!=0 ) error(errno,"listening on socket `%s'",serversocket);
+	verbose("listening for requests on `%s'",serversocket);
+
+	/* Let poll() return on exit of a request handler. */
+	sigact.sa_handler = child_handler;
+	sigact.sa_flags   = 0;
+	if ( sigemptyset(&sigact.sa_mask)!=0 ) error(errno,"creating empty signal mask");
+	if ( sigaction(SIGCHLD,&sigact,NULL)!=0 ) error(errno,"installing signal handler");
+
+	pfds[0].fd = listenfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLIN;
+
+	for(i=0; i<pool_size; i++) {
+		pool_pids[i] = -1;
+		pool_ctlfds[i] = -1;
+	}
+	if ( cgroup_pool_size>0 && !cgroupv2 ) {
+		warning("cgroup pool requires cgroup v2, not using it");
+		cgroup_pool_size = 0;
+	}
+	for(i=0; i<cgroup_pool_size; i++) cgroup_pool_ready[i] = -1;
+
+	while ( 1 ) {
+		/* Reap finished request handlers. An idle pool handler should
+		   not exit, so do not restart it to prevent a fork loop. */
+		while ( (pid = waitpid(-1,NULL,WNOHANG))>0 ) {
+			for(i=0; i<pool_size; i++) {
+				if ( pool_pids[i]==pid ) {
+					warning("idle pool handler %d exited, disabling it",(int)pid);
+					pool_pids[i] = 0;
+					if ( close(pool_ctlfds[i])!=0 ) error(errno,"closing socket");
+					pool_ctlfds[i] = -1;
+				}
+			}
+		}
+
+		/* Refill the pools with cgroups and handlers ready for the
+		   next requests. */
+		cgroup_pool_fill();
+		for(i=0; i<pool_size; i++) {
+			if ( pool_pids[i]<0 ) {
+				pool_pids[i] = fork_pool_handler(listenfd,pool_ctlfds,i);
+				verbose("started pool handler %d",(int)pool_pids[i]);
+			}
+		}
+
+		if ( poll(pfds,2,-1)<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno,"waiting for requests");
+		}
+
+		if ( pfds[1].revents ) {
+			if ( read(STDIN_FILENO,&c,1)<=0 ) break;
+		}
+
+		if ( pfds[0].revents & POLLIN ) {
+			if ( (connfd = accept4(listenfd,NULL,NULL,SOCK_CLOEXEC))<0 ) {
+				if ( errno==EINTR || errno==ECONNABORTED ) continue;
+				error(errno,"accepting connection");
+			}
+			cgroup_pool_take();
+			for(i=0; i<pool_size; i++) if ( pool_pids[i]>0 ) break;
+			if ( i<pool_size ) {
+				/* Pass the connection and pooled cgroup. */
+				send_message(pool_ctlfds[i],pooled_cgroupname,
+				             (uint32_t)strlen(pooled_cgroupname)+1,&connfd,1,"pool handler");
+				if ( close(pool_ctlfds[i])!=0 ) error(errno,"closing socket");
+				if ( close(connfd)!=0 ) error(errno,"closing connection");
+				pool_pids[i] = -1;
+				pool_ctlfds[i] = -1;
+				continue;
+			}
+			switch ( fork() ) {
+			case -1: /* error */
+				error(errno,"cannot fork request handler");
+			case  0: /* handle request */
+				close(listenfd);
+				serve_request(connfd);
+			default:
+				if ( close(connfd)!=0 ) error(errno,"closing connection");
+			}
+		}
+	}
+
+	verbose("stdin closed, stopping server");
+	/* Idle pool handlers stop on EOF of their control socket. */
+	for(i=0; i<pool_size; i++) {
+		if ( pool_pids[i]<=0 ) continue;
+		if ( close(pool_ctlfds[i])!=0 ) error(errno,"closing socket");
+		while ( waitpid(pool_pids[i],NULL,0)<0 ) {
+			if ( errno!=EINTR ) error(errno,"waiting on pool handler");
+		}
+	}
+	cgroup_pool_delete();
+	if ( close(listenfd)!=0 ) error(errno,"closing socket");
+	if ( unlinkat(dirfd,name,0)!=0 ) error(errno,"removing socket `%s'",serversocket);
+	if ( close(dirfd)!=0 ) error(errno,"closing directory `%s'",serversocket);
+
+	exit(0);
+}
+
+/* Send our arguments as a run request to a runguard server, see
+ * serve_request(), and wait for the resulting metadata. Returns the
+ * exitcode of the command.
+ */
+int run_client(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char cwd[PATH_MAX];
+	char *request, *reply, *ptr;
+	size_t reqlen, replylen, replysize;
+	ssize_t nread;
+	int sockfd, i;
+
+	if ( getcwd(cwd,PATH_MAX)==NULL ) error(errno,"cannot get directory");
+
+	/* Serialize working directory and all arguments. */
+	reqlen = strlen(cwd) + 1;
+	for(i=1; i<argc; i++) reqlen += strlen(argv[i]) + 1;
+	if ( reqlen>MAX_REQUEST_SIZE ) error(0,"request too large: %zu bytes",reqlen);
+
+	if ( (request = (char *) malloc(reqlen))==NULL ) error(errno,"allocating memory");
+	ptr = stpcpy(request,cwd) + 1;
+	for(i=1; i<argc; i++) ptr = stpcpy(ptr,argv[i]) + 1;
+
+	if ( strlen(serversocket)>=sizeof(addr.sun_path) ) {
+		error(0,"socket path `%s' too long",serversocket);
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,serversocket);
+
+	if ( (sockfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0))<0 ) {
+		error(errno,"creating socket");
+	}
+	if ( connect(sockfd,(struct sockaddr *)&addr,sizeof(addr))!=0 ) {
+		error(errno,"connecting to `%s'",serversocket);
+	}
+
+	send_message(sockfd,request,(uint32_t)reqlen,fds,3,serversocket);
+	free(request);
+
+	/* Read metadata until the server closes the connection. */
+	replylen = 0;
+	replysize = BUF_SIZE;
+	if ( (reply = (char *) malloc(replysize+1))==NULL ) error(errno,"allocating memory");
+	while ( (nread = read(sockfd,reply+replylen,replysize-replylen))!=0 ) {
+		if ( nread<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno,"receiving reply from `%s'",serversocket);
+		}
+		replylen += nread;
+		if ( replylen==replysize ) {
+			replysize *= 2;
+			if ( (reply = (char *) realloc(reply,replysize+1))==NULL ) {
+				error(errno,"allocating memory");
+			}
+		}
+	}
+	reply[replylen] = 0;
+	if ( close(sockfd)!=0 ) error(errno,"closing socket");
+
+	if ( outputmeta && fwrite(reply,1,replylen,metafile)!=replylen ) {
+		error(errno,"cannot write to file `%s'",metafilename);
+	}
+
+	/* Collect the "key: value" lines for the JSON metadata. */
+	if ( jsonmetafilename!=NULL ) {
+		char *line, *sep, *saveptr;
+
+		if ( (ptr = strdup(reply))==NULL ) error(errno,"allocating memory");
+		for(line=strtok_r(ptr,"\n",&saveptr); line!=NULL; line=strtok_r(NULL,"\n",&saveptr)) {
+			if ( (sep = strstr(line,": "))==NULL ) continue;
+			*sep = 0;
+			add_json_meta(line,strdup(sep+2));
+		}
+		free(ptr);
+	}
+
+	if ( (ptr = find_meta(reply,"exitcode"))==NULL ) {
+		/* The server already informed the user via our stderr. */
+		if ( find_meta(reply,"internal-error")==NULL ) {
+			error(0,"no exitcode received from `%s'",serversocket);
+		}
+		if ( outputmeta && fclose(metafile)!=0 ) {
+			fprintf(stderr,"\nError writing to metafile '%s'.\n",metafilename);
+		}
+		write_json_meta();
+		exit(exit_failure);
+	}
+
+	if ( outputmeta && fclose(metafile)!=0 ) {
+		error(errno,"closing file `%s'",metafilename);
+	}
+	write_json_meta();
+
+	return (int) strtol(ptr,NULL,10);
+}
+
+int main(int argc, char **argv)
+{
+	int exitcode, i;
+
+	progname = argv[0];
+
+	if ( clock_gettime(CLOCK_MONOTONIC,&progstarttime)!=0 ) error(errno,"getting time");
+
+	/* Parse command-line options */
+	use_root = use_walltime = use_cputime = use_user = no_coredump = 0;
+	chroot_mounts = 0;
+	outputmeta = walllimit_reached = cpulimit_reached = 0;
+	outputtimetype = CPU_TIME_TYPE;
+	preserve_environment = 0;
+	memsize = filesize = nproc = RLIM_INFINITY;
+	redir_stdout = redir_stderr = limit_streamsize = 0;
+	be_verbose = be_quiet = 0;
+	show_help = show_version = 0;
+	server_mode = client_mode = in_request = pool_size = 0;
+	use_io_limits = 0;
+	for(i=0; i<NIO_LIMITS; i++) io_limits[i] = -1;
+	parse_options(argc,argv);
+
+	verbose("starting in verbose mode, PID = %d", getpid());
+
+	/* Make sure that we change from group root if we change to an
+	   unprivileged user to prevent unintended permissions. */
+	if ( use_user && !use_group ) {
+		verbose("using unprivileged user `%s' also as group",runuser);
+		use_group = 1;
+		rungroup = strdup(runuser);
+		rungid = groupid(rungroup);
+		if ( rungid<0 ) error(0,"invalid groupname or ID specified: `%s'",rungroup);
+	}
+
+	if ( show_help ) usage();
+	if ( show_version ) version(PROGRAM,VERSION);
+
+	if ( (pool_size>0 || pool_root!=NULL) && !server_mode ) {
+		error(0,"options `pool' and `pool-root' require server mode");
+	}
+
+	if ( server_mode ) {
+		if ( outputmeta || jsonmetafilename!=NULL ) {
+			outputmeta = 0;
+			jsonmetafilename = NULL;
+			error(0,"options `outmeta' and `outmeta-json' not allowed in server mode");
+		}
+		if ( argc>optind ) error(0,"no command allowed in server mode");
+		check_user();
+		setup_supervisor();
+		run_server();
+	}
+
+	if ( argc<=optind ) error(0,"no command specified");
+
+	/* Command to be executed */
+	cmdname = argv[optind];
+	cmdargs = argv+optind;
+
+	if ( outputmeta && (metafile = fopen(metafilename,"w"))==NULL ) {
+		error(errno,"cannot open `%s'",metafilename);
+	}
+
+	if ( client_mode ) return run_client(argc,argv);
+
+	if ( handoffcmd!=NULL && redir_stdout ) {
+		error(0,"options `handoff' and `stdout' are mutually exclusive");
+	}
+
+	init_sampling();
+	check_user();
+	setup_supervisor();
+
+	exitcode = run_command();
+	if ( handoffcmd!=NULL ) run_handoff();
+
+	return exitcode;
+}
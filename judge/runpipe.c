@@ -1,5 +1,5 @@
 /*
-   runpipe -- run two commands with stdin/stdout bi-directionally connected.
+   runpipe -- run commands with their stdin/stdout connected in a pipeline.
 
    Idea based on the program dpipe from the Virtual Distributed
    Ethernet package.
@@ -10,18 +10,51 @@
 
    Program specifications:
 
-   This program will run two specified commands and connect their
-   stdin/stdout to eachother.
+   This program will run two or more specified commands and connect
+   their file descriptors to eachother. By default the commands are
+   connected in a ring: the stdout of each command is connected to
+   the stdin of the next, and that of the last to the stdin of the
+   first. With two commands this means they are bi-directionally
+   connected. A different topology can be declared with --connect.
 
-   When this program is sent a SIGTERM, this signal is passed to both
-   programs. This program will return when both programs are finished
+   When this program is sent a SIGTERM, this signal is passed to all
+   programs. This program will return when all programs are finished
    and reports back the exit code of the first program.
+
+   For each command the exit code, wall and cpu time and number of
+   bytes read and written are written to the metadata file as soon as
+   it exits. The exit code of the first program is also written as
+   `exitcode' when it exits before all other commands.
+
+   In relay mode the commands are not connected directly, but all data
+   passes through this program. This allows counting the bytes and
+   messages (reads) per connection, writing a timestamped transcript,
+   and measuring for each command its response time: the time from
+   delivering data to it until it next writes data itself. This shows
+   how the wall time of an interactive run is divided over the
+   programs. Response times are also summarized in a histogram with
+   buckets <10us, <100us, <1ms, <10ms, <100ms, <1s and >=1s.
+
+   With an idle timeout set (which implies relay mode), a run is
+   aborted when no data has been relayed for that time and none of
+   the processes started by this program is running or has used cpu
+   time since: then all commands must be blocked on empty or full
+   pipes (or sleeping), i.e. the interaction is deadlocked. This is
+   recorded as `idle-detected' in the metadata and all commands are
+   sent a SIGTERM, so that the caller does not have to wait for the
+   wall time limit.
  */
 
+/* For pipe2 and F_DUPFD_CLOEXEC */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -31,6 +64,10 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <time.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
 
 #define PROGRAM "runpipe"
 #define VERSION DOMJUDGE_VERSION "/" REVISION
@@ -46,15 +83,69 @@ int be_verbose;
 int show_help;
 int show_version;
 
-#define MAX_CMDS 2
+#define MAX_CMDS 32
+
+/* Highest file descriptor number that can be connected in a command. */
+#define MAX_FD 64
+
+#define MAX_CONNS (2*MAX_CMDS)
+
+/* Relay buffer size per connection, and the maximum number of bytes
+   of each message included in the transcript. */
+#define RELAY_BUFSIZE 65536
+#define TRANSCRIPT_MAXDATA 256
+
+/* Number of response time histogram buckets, from <10us upwards. */
+#define NRESPONSE_HIST 7
 
 int ncmds;
 char  *cmd_name[MAX_CMDS];
 int    cmd_nargs[MAX_CMDS];
 char **cmd_args[MAX_CMDS];
 pid_t  cmd_pid[MAX_CMDS];
-int    cmd_fds[MAX_CMDS][3];
 int    cmd_exit[MAX_CMDS];
+struct timespec cmd_start[MAX_CMDS];
+struct timespec cmd_end[MAX_CMDS];
+int    nexited;
+
+/* Connections between commands: the file descriptor conn_srcfd of
+   command conn_src writes into a pipe that is read by conn_dst on
+   file descriptor conn_dstfd. Command indices are zero-based. */
+int nconns;
+int conn_src[MAX_CONNS], conn_srcfd[MAX_CONNS];
+int conn_dst[MAX_CONNS], conn_dstfd[MAX_CONNS];
+int conn_pipe[MAX_CONNS][2];
+char *connectspec;
+
+/* In relay mode conn_pipe is read by this program and the data
+   written to conn_relay, of which conn_dst reads the other end. */
+int relay;
+int conn_relay[MAX_CONNS][2];
+char  *conn_buf[MAX_CONNS];
+size_t conn_buflen[MAX_CONNS], conn_bufpos[MAX_CONNS];
+long long conn_bytes[MAX_CONNS], conn_msgs[MAX_CONNS];
+
+int    cmd_waiting[MAX_CMDS];
+struct timespec cmd_delivered[MAX_CMDS];
+long   cmd_responses[MAX_CMDS];
+double cmd_response_total[MAX_CMDS], cmd_response_max[MAX_CMDS];
+long   cmd_response_hist[MAX_CMDS][NRESPONSE_HIST];
+
+struct timespec progstarttime;
+int sigchld_pipe[2];
+
+char *transcriptfilename;
+FILE *transcriptfile;
+
+long pipesize;
+
+/* Idle detection: timeout in milliseconds (0 disables it), the time
+   data was last relayed, when to next check for idleness and the cpu
+   time of all descendants at the previous check, if valid. */
+long idle_timeout;
+struct timespec last_progress, next_idle_check;
+int idle_baseline_valid;
+unsigned long long idle_baseline_ticks;
 
 int outputmeta;
 char *metafilename;
@@ -65,21 +156,41 @@ struct option const long_opts[] = {
 	{"help",    no_argument,       &show_help,    1 },
 	{"version", no_argument,       &show_version, 1 },
 	{"outmeta", required_argument, NULL,         'M'},
+	{"connect", required_argument, NULL,         'c'},
+	{"relay",   no_argument,       NULL,         'r'},
+	{"transcript", required_argument, NULL,      'T'},
+	{"pipe-size", required_argument, NULL,       'p'},
+	{"idle-timeout", required_argument, NULL,    'i'},
 	{ NULL,     0,                 NULL,          0 }
 };
 
 void usage()
 {
 	printf("\
-Usage: %s [OPTION]... COMMAND1 [ARGS...] = COMMAND2 [ARGS...]\n\
-Run two commands with stdin/stdout bi-directionally connected.\n\
+Usage: %s [OPTION]... COMMAND1 [ARGS...] = COMMAND2 [ARGS...] [= ...]\n\
+Run commands with their stdin/stdout connected in a pipeline.\n\
 \n\
-  -M, --outmeta=FILE   write metadata (runtime, exitcode, etc.) of first program to FILE\n\
+  -c, --connect=EDGES  connect commands as specified by EDGES, a comma\n\
+                         separated list of `I[:FD]>J[:FD]', see below\n\
+  -M, --outmeta=FILE   write metadata (runtime, exitcode, etc.) of all programs to FILE\n\
+  -r, --relay          relay all data through %s and write interaction\n\
+                         statistics to the metadata file\n\
+  -T, --transcript=FILE  write a timestamped transcript of all relayed data\n\
+                         to FILE, implies --relay\n\
+  -p, --pipe-size=SIZE set the capacity of all pipes to SIZE bytes\n\
+  -i, --idle-timeout=MS  abort when all commands are blocked without any\n\
+                         data relayed for MS milliseconds, implies --relay\n\
   -v, --verbose        display some extra warnings and information\n\
       --help           display this help and exit\n\
       --version        output version information and exit\n\
 \n\
-Arguments starting with a `=' must be escaped by prepending an extra `='.\n", progname);
+Arguments starting with a `=' must be escaped by prepending an extra `='.\n\
+\n\
+An edge `I:FD>J:FD' connects file descriptor FD of command I to file\n\
+descriptor FD of command J; commands are numbered from 1 and FD defaults\n\
+to 1 (stdout) for the first and 0 (stdin) for the second command. Without\n\
+this option commands are connected in a ring `1>2,2>3,...,N>1'. A file\n\
+descriptor not connected is inherited from %s.\n", progname, progname, progname);
 	exit(0);
 }
 
@@ -113,7 +224,7 @@ void write_meta(const char *key, const char *format, ...)
 	if ( vfprintf(metafile,format,ap)<0 ) {
 		error(0,"cannot write to file `%s'(vfprintf)",metafilename);
 	}
-	if ( fprintf(metafile,"\n")<=0 ) {
+	if ( fprintf(metafile,"\n")<=0 || fflush(metafile)!=0 ) {
 		error(0,"cannot write to file `%s'",metafilename);
 	}
 
@@ -140,19 +251,607 @@ void terminate(int sig)
 	if ( kill(0,SIGTERM)!=0 ) error(errno,"sending SIGTERM");
 }
 
-void set_fd_close_exec(int fd, int value)
+
+/* Parse the topology specification `I[:FD]>J[:FD],...' into the
+   conn_* arrays. */
+void parse_connections(char *spec)
 {
-	long  fdflags;
+	char *edge, *ptr, *saveptr;
+	long cmd, fd;
+	int i, end;
 
-	fdflags = fcntl(fd, F_GETFD);
-	if ( fdflags==-1 ) error(errno,"reading filedescriptor flags");
-	if ( value ) {
-		fdflags = fdflags | FD_CLOEXEC;
+	nconns = 0;
+	for(edge=strtok_r(spec,",",&saveptr); edge!=NULL;
+	    edge=strtok_r(NULL,",",&saveptr)) {
+		if ( nconns>=MAX_CONNS ) {
+			error(0,"too many connections specified: > %d", MAX_CONNS);
+		}
+		ptr = edge;
+		for(end=0; end<2; end++) {
+			errno = 0;
+			cmd = strtol(ptr,&ptr,10);
+			if ( errno!=0 || cmd<1 || cmd>ncmds ) {
+				error(0,"invalid command number in connection `%s'",edge);
+			}
+			fd = 1-end;
+			if ( *ptr==':' ) {
+				fd = strtol(ptr+1,&ptr,10);
+				if ( errno!=0 || fd<0 || fd>MAX_FD ) {
+					error(0,"invalid file descriptor in connection `%s'",edge);
+				}
+			}
+			if ( end==0 ) {
+				if ( *ptr++!='>' ) error(0,"invalid connection `%s'",edge);
+				conn_src[nconns] = cmd-1;
+				conn_srcfd[nconns] = fd;
+			} else {
+				if ( *ptr!='\0' ) error(0,"invalid connection `%s'",edge);
+				conn_dst[nconns] = cmd-1;
+				conn_dstfd[nconns] = fd;
+			}
+		}
+		nconns++;
+	}
+	if ( nconns==0 ) error(0,"no connections specified");
+
+	/* Each file descriptor of a command can only be connected once. */
+	for(i=0; i<nconns; i++) {
+		for(end=0; end<nconns; end++) {
+			if ( (end>i && conn_src[i]==conn_src[end] &&
+			      conn_srcfd[i]==conn_srcfd[end]) ||
+			     (conn_src[i]==conn_dst[end] && conn_srcfd[i]==conn_dstfd[end]) ) {
+				error(0,"file descriptor %d of command #%d connected twice",
+				      conn_srcfd[i],conn_src[i]+1);
+			}
+			if ( end>i && conn_dst[i]==conn_dst[end] &&
+			     conn_dstfd[i]==conn_dstfd[end] ) {
+				error(0,"file descriptor %d of command #%d connected twice",
+				      conn_dstfd[i],conn_dst[i]+1);
+			}
+		}
+	}
+}
+
+long readoptarg(const char *desc, long minval, long maxval)
+{
+	long arg;
+	char *ptr;
+
+	errno = 0;
+	arg = strtol(optarg,&ptr,10);
+	if ( errno || *ptr!='\0' || arg<minval || arg>maxval ) {
+		error(errno,"invalid argument specified for %s: `%s'",desc,optarg);
+	}
+
+	return arg;
+}
+
+void set_pipe_size(int fd)
+{
+	if ( fcntl(fd,F_SETPIPE_SZ,(int)pipesize)<0 ) {
+		error(errno,"cannot set pipe size to %ld bytes",pipesize);
+	}
+}
+
+double timediff(struct timespec start, struct timespec end)
+{
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1E-9;
+}
+
+/* Start command #cmd with its ends of all pipes connected to the
+   declared file descriptors. All pipe fds are close-on-exec, so the
+   command does not inherit any other pipe ends. */
+pid_t start_command(int cmd)
+{
+	pid_t pid;
+	char **argv;
+	int tmpfd[MAX_CONNS], targetfd[MAX_CONNS];
+	int i, n;
+
+	if ( (argv=(char **) malloc((cmd_nargs[cmd]+2)*sizeof(char *)))==NULL ) {
+		error(errno,"cannot allocate memory");
+	}
+	argv[0] = cmd_name[cmd];
+	for(i=0; i<cmd_nargs[cmd]; i++) argv[i+1] = cmd_args[cmd][i];
+	argv[cmd_nargs[cmd]+1] = NULL;
+
+	switch ( pid = fork() ) {
+	case -1: /* error */
+		error(errno,"failed to fork command #%d",cmd+1);
+
+	case  0: /* child process */
+		/* First move all pipe ends out of the way, so that connecting
+		   one to its target does not clobber another before use. */
+		n = 0;
+		for(i=0; i<nconns; i++) {
+			if ( conn_src[i]==cmd ) {
+				tmpfd[n] = fcntl(conn_pipe[i][1],F_DUPFD_CLOEXEC,MAX_FD+1);
+				targetfd[n++] = conn_srcfd[i];
+			}
+			if ( conn_dst[i]==cmd ) {
+				tmpfd[n] = fcntl(relay ? conn_relay[i][0] : conn_pipe[i][0],
+				                 F_DUPFD_CLOEXEC,MAX_FD+1);
+				targetfd[n++] = conn_dstfd[i];
+			}
+		}
+		for(i=0; i<n; i++) {
+			if ( tmpfd[i]<0 ) {
+				warning(errno,"duplicating pipe for command #%d",cmd+1);
+				_exit(exit_failure);
+			}
+		}
+		/* SIGPIPE is ignored by us in relay mode, restore the default. */
+		if ( relay && signal(SIGPIPE,SIG_DFL)==SIG_ERR ) {
+			warning(errno,"restoring SIGPIPE handler");
+			_exit(exit_failure);
+		}
+		for(i=0; i<n; i++) {
+			if ( dup2(tmpfd[i],targetfd[i])<0 ) {
+				warning(errno,"connecting fd %d of command #%d",targetfd[i],cmd+1);
+				_exit(exit_failure);
+			}
+		}
+
+		execvp(cmd_name[cmd],argv);
+		warning(errno,"cannot execute `%s'",cmd_name[cmd]);
+		_exit(exit_failure);
+
+	default: /* parent process */
+		free(argv);
+	}
+
+	return pid;
+}
+
+/* Read the total number of bytes read and written by the (exited but
+   not yet reaped) process pid, including its reaped children, since
+   commands are typically wrapped by runguard. */
+int read_io_bytes(pid_t pid, long long *rbytes, long long *wbytes)
+{
+	char filename[64], line[256];
+	FILE *file;
+	int found = 0;
+
+	snprintf(filename,sizeof(filename),"/proc/%d/io",(int)pid);
+	if ( (file = fopen(filename,"r"))==NULL ) return 0;
+
+	while ( fgets(line,sizeof(line),file)!=NULL ) {
+		if ( sscanf(line,"rchar: %lld",rbytes)==1 ) found |= 1;
+		if ( sscanf(line,"wchar: %lld",wbytes)==1 ) found |= 2;
+	}
+	fclose(file);
+
+	return found==3;
+}
+
+/* Wait for a command to exit and write its metadata. A child is
+   first waited for without reaping it, so that its I/O statistics can
+   still be read from /proc. Returns 0 if there is no (exited, when
+   options contains WNOHANG) child, 1 otherwise. */
+int reap_command(int options)
+{
+	siginfo_t info;
+	struct rusage childusage;
+	pid_t pid;
+	int   status, exitcode, i;
+	long long rbytes, wbytes;
+	char  key[32];
+
+	do {
+		info.si_pid = 0;
+		if ( waitid(P_ALL, 0, &info, WEXITED | WNOWAIT | options)!=0 ) {
+			/* No more child processes, we're done. */
+			if ( errno==ECHILD ) return 0;
+			if ( errno!=EINTR ) error(errno,"waiting for children");
+		} else if ( info.si_pid==0 ) {
+			return 0;
+		}
+	} while ( info.si_pid==0 );
+	pid = info.si_pid;
+
+	for(i=0; i<ncmds; i++) if ( cmd_pid[i]==pid ) break;
+	if ( i>=ncmds ) error(0, "waited for unknown child");
+
+	clock_gettime(CLOCK_MONOTONIC,&cmd_end[i]);
+	if ( !read_io_bytes(pid,&rbytes,&wbytes) ) rbytes = wbytes = -1;
+
+	if ( wait4(pid, &status, 0, &childusage)!=pid ) {
+		error(errno,"waiting for command #%d",i+1);
+	}
+	cmd_exit[i] = status;
+	nexited++;
+	verb("command #%d, pid %d has exited (with status %d)",i+1,pid,status);
+
+	if ( WIFEXITED(status) ) {
+		exitcode = WEXITSTATUS(status);
+	} else if ( WIFSIGNALED(status) ) {
+		exitcode = 128+WTERMSIG(status);
 	} else {
-		fdflags = fdflags & ~FD_CLOEXEC;
+		exitcode = -1;
+	}
+
+	/* If the first command exits before all others, then also
+	   report its exitcode as the exitcode of the pipeline. */
+	if ( i==0 && nexited==1 && WIFEXITED(status) ) {
+		write_meta("exitcode","%d",exitcode);
+	}
+	if ( nexited==1 ) write_meta("first-exited","%d",i+1);
+	snprintf(key,sizeof(key),"cmd%d-exitcode",i+1);
+	write_meta(key,"%d",exitcode);
+	snprintf(key,sizeof(key),"cmd%d-wall-time",i+1);
+	write_meta(key,"%.3f",timediff(cmd_start[i],cmd_end[i]));
+	snprintf(key,sizeof(key),"cmd%d-cpu-time",i+1);
+	write_meta(key,"%.3f",
+	           childusage.ru_utime.tv_sec + childusage.ru_utime.tv_usec*1E-6 +
+	           childusage.ru_stime.tv_sec + childusage.ru_stime.tv_usec*1E-6);
+	if ( rbytes>=0 ) {
+		snprintf(key,sizeof(key),"cmd%d-read-bytes",i+1);
+		write_meta(key,"%lld",rbytes);
+		snprintf(key,sizeof(key),"cmd%d-write-bytes",i+1);
+		write_meta(key,"%lld",wbytes);
+	}
+
+	return 1;
+}
+
+void sigchld_handler(int sig)
+{
+	int saved_errno = errno;
+
+	/* Wake up the relay loop; if the pipe is full it is awake anyway. */
+	if ( write(sigchld_pipe[1],"",1)<0 ) {};
+
+	errno = saved_errno;
+}
+
+void record_response(int cmd, double t)
+{
+	double limit = 1E-5;
+	int b = 0;
+
+	cmd_responses[cmd]++;
+	cmd_response_total[cmd] += t;
+	if ( t>cmd_response_max[cmd] ) cmd_response_max[cmd] = t;
+
+	while ( b<NRESPONSE_HIST-1 && t>=limit ) {
+		b++;
+		limit *= 10;
 	}
-	if ( fcntl(fd, F_SETFD, fdflags)!=0 ) {
-		error(errno,"setting filedescriptor flags");
+	cmd_response_hist[cmd][b]++;
+}
+
+/* Write a transcript line of data relayed on connection conn, with
+   non-printable characters escaped. */
+void write_transcript(int conn, struct timespec now, const char *data, size_t len)
+{
+	size_t i;
+
+	if ( transcriptfile==NULL ) return;
+
+	fprintf(transcriptfile,"%.6f %d:%d>%d:%d %zu ",timediff(progstarttime,now),
+	        conn_src[conn]+1,conn_srcfd[conn],conn_dst[conn]+1,conn_dstfd[conn],len);
+	for(i=0; i<len && i<TRANSCRIPT_MAXDATA; i++) {
+		if ( data[i]=='\\' ) {
+			fputs("\\\\",transcriptfile);
+		} else if ( data[i]=='\n' ) {
+			fputs("\\n",transcriptfile);
+		} else if ( isprint((unsigned char)data[i]) ) {
+			fputc(data[i],transcriptfile);
+		} else {
+			fprintf(transcriptfile,"\\x%02x",(unsigned char)data[i]);
+		}
+	}
+	if ( len>TRANSCRIPT_MAXDATA ) fputs("...",transcriptfile);
+	if ( fputc('\n',transcriptfile)==EOF ) {
+		error(errno,"cannot write to file `%s'",transcriptfilename);
+	}
+}
+
+/* Record that data was relayed at time now and reset idle detection. */
+void set_progress(struct timespec now)
+{
+	last_progress = now;
+	idle_baseline_valid = 0;
+	next_idle_check = now;
+	next_idle_check.tv_sec  += idle_timeout / 1000;
+	next_idle_check.tv_nsec += (idle_timeout % 1000) * 1000000;
+	if ( next_idle_check.tv_nsec>=1000000000 ) {
+		next_idle_check.tv_sec++;
+		next_idle_check.tv_nsec -= 1000000000;
+	}
+}
+
+/* Scan /proc for all descendants of this program, sum their cpu time
+   (including that of their reaped children) in clock ticks and return
+   the number of them currently running, or -1 on error. */
+int sample_descendants(unsigned long long *ticks)
+{
+	DIR *dir;
+	struct dirent *entry;
+	FILE *file;
+	char filename[64], line[1024], *ptr, state;
+	pid_t *pids = NULL, *ppids = NULL, pid, ppid;
+	char *states = NULL, *marked = NULL;
+	unsigned long long *proc_ticks = NULL, t[4];
+	int nprocs = 0, maxprocs = 0, nrunning = 0, changed, i, j;
+
+	if ( (dir = opendir("/proc"))==NULL ) return -1;
+
+	while ( (entry = readdir(dir))!=NULL ) {
+		if ( (pid = atoi(entry->d_name))<=0 ) continue;
+		snprintf(filename,sizeof(filename),"/proc/%d/stat",(int)pid);
+		/* Processes may exit while we scan, ignore these. */
+		if ( (file = fopen(filename,"r"))==NULL ) continue;
+		ptr = fgets(line,sizeof(line),file);
+		fclose(file);
+		if ( ptr==NULL || (ptr = strrchr(line,')'))==NULL ) continue;
+
+		/* Fields after the command name: state, ppid, and utime,
+		   stime, cutime, cstime as the 12th-15th field after it. */
+		if ( sscanf(ptr+1," %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+		            &state,&ppid,&t[0],&t[1],&t[2],&t[3])!=6 ) continue;
+
+		if ( nprocs>=maxprocs ) {
+			maxprocs = 2*maxprocs + 64;
+			pids       = realloc(pids,      maxprocs*sizeof(pid_t));
+			ppids      = realloc(ppids,     maxprocs*sizeof(pid_t));
+			states     = realloc(states,    maxprocs);
+			proc_ticks = realloc(proc_ticks,maxprocs*sizeof(unsigned long long));
+			if ( pids==NULL || ppids==NULL || states==NULL || proc_ticks==NULL ) {
+				error(errno,"cannot allocate memory");
+			}
+		}
+		pids[nprocs] = pid;
+		ppids[nprocs] = ppid;
+		states[nprocs] = state;
+		proc_ticks[nprocs] = t[0] + t[1] + t[2] + t[3];
+		nprocs++;
+	}
+	closedir(dir);
+
+	/* Mark descendants by repeatedly marking children of marked ones. */
+	if ( (marked = calloc(nprocs+1,1))==NULL ) error(errno,"cannot allocate memory");
+	do {
+		changed = 0;
+		for(i=0; i<nprocs; i++) {
+			if ( marked[i] ) continue;
+			if ( ppids[i]==getpid() ) {
+				marked[i] = changed = 1;
+			} else {
+				for(j=0; j<nprocs; j++) {
+					if ( marked[j] && pids[j]==ppids[i] ) {
+						marked[i] = changed = 1;
+						break;
+					}
+				}
+			}
+		}
+	} while ( changed );
+
+	*ticks = 0;
+	for(i=0; i<nprocs; i++) {
+		if ( !marked[i] ) continue;
+		*ticks += proc_ticks[i];
+		if ( states[i]=='R' || states[i]=='D' ) nrunning++;
+	}
+
+	free(pids);
+	free(ppids);
+	free(states);
+	free(proc_ticks);
+	free(marked);
+
+	return nrunning;
+}
+
+/* Check whether all commands are idle when no data was relayed for
+   idle_timeout milliseconds. The first check only records a baseline
+   of the cpu time used, the next one a tenth of the timeout later
+   concludes that the run is idle if no cpu time was used since. */
+void check_idle()
+{
+	struct timespec now;
+	unsigned long long ticks;
+	long delay;
+	int i, nrunning;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+
+	if ( (nrunning = sample_descendants(&ticks))<0 ) {
+		warning(errno,"cannot scan processes, disabling idle detection");
+		idle_timeout = 0;
+		return;
+	}
+
+	if ( nrunning==0 && idle_baseline_valid && ticks==idle_baseline_ticks ) {
+		write_meta("idle-detected","%.3f",timediff(last_progress,now));
+		warning(0,"all commands idle for %.3f seconds: aborting",
+		        timediff(last_progress,now));
+		for(i=0; i<ncmds; i++) {
+			if ( cmd_exit[i]==-1 && kill(cmd_pid[i],SIGTERM)!=0 && errno!=ESRCH ) {
+				error(errno,"sending SIGTERM to command #%d",i+1);
+			}
+		}
+		idle_timeout = 0;
+		return;
+	}
+
+	idle_baseline_valid = ( nrunning==0 );
+	idle_baseline_ticks = ticks;
+
+	delay = idle_timeout/10 > 10 ? idle_timeout/10 : 10;
+	next_idle_check = now;
+	next_idle_check.tv_sec  += delay / 1000;
+	next_idle_check.tv_nsec += (delay % 1000) * 1000000;
+	if ( next_idle_check.tv_nsec>=1000000000 ) {
+		next_idle_check.tv_sec++;
+		next_idle_check.tv_nsec -= 1000000000;
+	}
+}
+
+void relay_close(int *fd)
+{
+	if ( *fd>=0 && close(*fd)!=0 ) error(errno,"closing relay pipe");
+	*fd = -1;
+}
+
+/* Try to write buffered data of connection conn to its destination. */
+void relay_write(int conn)
+{
+	struct timespec now;
+	ssize_t n;
+	int dst = conn_dst[conn];
+
+	if ( conn_relay[conn][1]<0 ) {
+		conn_buflen[conn] = conn_bufpos[conn] = 0;
+		return;
+	}
+
+	n = write(conn_relay[conn][1],conn_buf[conn]+conn_bufpos[conn],
+	          conn_buflen[conn]-conn_bufpos[conn]);
+	if ( n<0 ) {
+		if ( errno==EAGAIN || errno==EINTR ) return;
+		if ( errno!=EPIPE ) error(errno,"relaying data to command #%d",dst+1);
+
+		/* The destination has gone: also close the source side, so
+		   that the writer sees a broken pipe as without relay. */
+		verb("command #%d closed fd %d",dst+1,conn_dstfd[conn]);
+		relay_close(&conn_relay[conn][1]);
+		relay_close(&conn_pipe[conn][0]);
+		conn_buflen[conn] = conn_bufpos[conn] = 0;
+		return;
+	}
+
+	conn_bufpos[conn] += n;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	set_progress(now);
+	if ( conn_bufpos[conn]==conn_buflen[conn] ) {
+		conn_buflen[conn] = conn_bufpos[conn] = 0;
+		cmd_delivered[dst] = now;
+		cmd_waiting[dst] = 1;
+		if ( conn_pipe[conn][0]<0 ) relay_close(&conn_relay[conn][1]);
+	}
+}
+
+/* Read data from the source of connection conn and try to relay it. */
+void relay_read(int conn)
+{
+	struct timespec now;
+	ssize_t n;
+	int src = conn_src[conn];
+
+	n = read(conn_pipe[conn][0],conn_buf[conn],RELAY_BUFSIZE);
+	if ( n<0 ) {
+		if ( errno==EAGAIN || errno==EINTR ) return;
+		error(errno,"relaying data from command #%d",src+1);
+	}
+	if ( n==0 ) {
+		verb("command #%d closed fd %d",src+1,conn_srcfd[conn]);
+		relay_close(&conn_pipe[conn][0]);
+		relay_close(&conn_relay[conn][1]);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	set_progress(now);
+	conn_bytes[conn] += n;
+	conn_msgs[conn]++;
+	conn_buflen[conn] = n;
+	conn_bufpos[conn] = 0;
+
+	if ( cmd_waiting[src] ) {
+		record_response(src,timediff(cmd_delivered[src],now));
+		cmd_waiting[src] = 0;
+	}
+	write_transcript(conn,now,conn_buf[conn],n);
+
+	relay_write(conn);
+}
+
+/* Relay data between the commands until all have exited. */
+void relay_data()
+{
+	struct pollfd pfd[MAX_CONNS+1];
+	int pconn[MAX_CONNS+1];
+	struct timespec now;
+	char buf[64];
+	int i, n, timeout;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	set_progress(now);
+
+	while ( nexited<ncmds ) {
+		n = 0;
+		pfd[n].fd = sigchld_pipe[0];
+		pfd[n].events = POLLIN;
+		pconn[n++] = -1;
+		for(i=0; i<nconns; i++) {
+			if ( conn_buflen[i]>0 ) {
+				pfd[n].fd = conn_relay[i][1];
+				pfd[n].events = POLLOUT;
+			} else if ( conn_pipe[i][0]>=0 ) {
+				pfd[n].fd = conn_pipe[i][0];
+				pfd[n].events = POLLIN;
+			} else {
+				continue;
+			}
+			pconn[n++] = i;
+		}
+
+		timeout = -1;
+		if ( idle_timeout>0 ) {
+			clock_gettime(CLOCK_MONOTONIC,&now);
+			timeout = (int) (timediff(now,next_idle_check)*1000 + 1);
+			if ( timeout<=0 ) {
+				check_idle();
+				continue;
+			}
+		}
+
+		if ( poll(pfd,n,timeout)<0 ) {
+			if ( errno==EINTR ) continue;
+			error(errno,"polling relay pipes");
+		}
+
+		for(i=0; i<n; i++) {
+			if ( pfd[i].revents==0 ) continue;
+			if ( pconn[i]<0 ) {
+				while ( read(sigchld_pipe[0],buf,sizeof(buf))>0 ) {};
+				while ( nexited<ncmds && reap_command(WNOHANG) ) {};
+			} else if ( pfd[i].events==POLLOUT ) {
+				relay_write(pconn[i]);
+			} else {
+				relay_read(pconn[i]);
+			}
+		}
+	}
+}
+
+void write_relay_meta()
+{
+	char key[32], hist[NRESPONSE_HIST*21];
+	int i, b, len;
+
+	for(i=0; i<nconns; i++) {
+		snprintf(key,sizeof(key),"conn%d-bytes",i+1);
+		write_meta(key,"%lld",conn_bytes[i]);
+		snprintf(key,sizeof(key),"conn%d-messages",i+1);
+		write_meta(key,"%lld",conn_msgs[i]);
+	}
+	for(i=0; i<ncmds; i++) {
+		snprintf(key,sizeof(key),"cmd%d-responses",i+1);
+		write_meta(key,"%ld",cmd_responses[i]);
+		snprintf(key,sizeof(key),"cmd%d-response-time",i+1);
+		write_meta(key,"%.6f",cmd_response_total[i]);
+		snprintf(key,sizeof(key),"cmd%d-response-max",i+1);
+		write_meta(key,"%.6f",cmd_response_max[i]);
+		len = 0;
+		for(b=0; b<NRESPONSE_HIST; b++) {
+			len += snprintf(hist+len,sizeof(hist)-len,"%s%ld",
+			                (b>0 ? " " : ""),cmd_response_hist[i][b]);
+		}
+		snprintf(key,sizeof(key),"cmd%d-response-histogram",i+1);
+		write_meta(key,"%s",hist);
 	}
 }
 
@@ -160,26 +859,43 @@ int main(int argc, char **argv)
 {
 	struct sigaction sigact;
 	sigset_t sigmask;
-	pid_t pid;
 	int   status;
 	int   exitcode, myexitcode;
 	int   opt;
 	char *arg;
 	int   i, newcmd, argsize = 0;
-	int   pipe_fd[MAX_CMDS][2];
 
 	progname = argv[0];
+	clock_gettime(CLOCK_MONOTONIC,&progstarttime);
 
 	/* Parse command-line options */
 	be_verbose = show_help = show_version = 0;
+	connectspec = NULL;
 	opterr = 0;
-	while ( (opt = getopt_long(argc,argv,"+M:v",long_opts,(int *) 0))!=-1 ) {
+	while ( (opt = getopt_long(argc,argv,"+c:i:M:p:rT:v",long_opts,(int *) 0))!=-1 ) {
 		switch ( opt ) {
 		case 0:   /* long-only option */
 			break;
 		case 'v': /* verbose option */
 			be_verbose = 1;
 			break;
+		case 'c': /* connect option */
+			connectspec = strdup(optarg);
+			break;
+		case 'r': /* relay option */
+			relay = 1;
+			break;
+		case 'T': /* transcript option */
+			relay = 1;
+			transcriptfilename = strdup(optarg);
+			break;
+		case 'p': /* pipe-size option */
+			pipesize = readoptarg("pipe size",1,INT_MAX);
+			break;
+		case 'i': /* idle-timeout option */
+			relay = 1;
+			idle_timeout = readoptarg("idle timeout",1,INT_MAX);
+			break;
 		case 'M': /* outputmeta option */
 			outputmeta = 1;
 			metafilename = strdup(optarg);
@@ -236,8 +952,29 @@ int main(int argc, char **argv)
 	}
 	ncmds++;
 	if ( newcmd ) error(0,"empty command #%d specified", ncmds);
-	if ( ncmds!=2 ) {
-		error(0,"%d commands specified, 2 required", ncmds);
+	if ( ncmds<2 ) {
+		error(0,"%d commands specified, at least 2 required", ncmds);
+	}
+
+	/* Parse the topology, or default to a ring of all commands. */
+	if ( connectspec!=NULL ) {
+		parse_connections(connectspec);
+	} else {
+		nconns = ncmds;
+		for(i=0; i<ncmds; i++) {
+			conn_src[i] = i;
+			conn_srcfd[i] = STDOUT_FILENO;
+			conn_dst[i] = (i+1) % ncmds;
+			conn_dstfd[i] = STDIN_FILENO;
+		}
+	}
+
+	if ( outputmeta && (metafile = fopen(metafilename,"w"))==NULL ) {
+		error(errno,"cannot open `%s'",metafilename);
+	}
+	if ( transcriptfilename!=NULL &&
+	     (transcriptfile = fopen(transcriptfilename,"w"))==NULL ) {
+		error(errno,"cannot open `%s'",transcriptfilename);
 	}
 
 	/* Install TERM signal handler */
@@ -254,67 +991,79 @@ int main(int argc, char **argv)
 		error(errno,"installing signal handler");
 	}
 
-	/* Create pipes and by default close all file descriptors when
-	   executing a forked subcommand, required ones are reset below. */
-	for(i=0; i<ncmds; i++) {
-		if ( pipe(pipe_fd[i])!=0 ) error(errno,"creating pipes");
-		set_fd_close_exec(pipe_fd[i][0], 1);
-		set_fd_close_exec(pipe_fd[i][1], 1);
+	/* In relay mode we wait for children in the poll loop, woken up
+	   by a SIGCHLD handler via a self-pipe, and handle pipes to exited
+	   commands via EPIPE. */
+	if ( relay ) {
+		if ( pipe2(sigchld_pipe,O_CLOEXEC | O_NONBLOCK)!=0 ) {
+			error(errno,"creating signal pipe");
+		}
+		sigact.sa_handler = sigchld_handler;
+		sigact.sa_flags   = SA_RESTART | SA_NOCLDSTOP;
+		if ( sigemptyset(&sigact.sa_mask)!=0 ) error(errno,"creating signal mask");
+		if ( sigaction(SIGCHLD,&sigact,NULL)!=0 ) {
+			error(errno,"installing signal handler");
+		}
+		if ( signal(SIGPIPE,SIG_IGN)==SIG_ERR ) error(errno,"ignoring SIGPIPE");
+	}
+
+	/* Create pipes that by default are closed when executing a forked
+	   subcommand, the required ends are duplicated in each command. */
+	for(i=0; i<nconns; i++) {
+		if ( pipe2(conn_pipe[i],O_CLOEXEC)!=0 ) error(errno,"creating pipes");
+		if ( relay ) {
+			if ( pipe2(conn_relay[i],O_CLOEXEC)!=0 ) error(errno,"creating pipes");
+			if ( fcntl(conn_relay[i][1],F_SETFL,O_NONBLOCK)!=0 ) {
+				error(errno,"setting relay pipe non-blocking");
+			}
+			if ( (conn_buf[i] = malloc(RELAY_BUFSIZE))==NULL ) {
+				error(errno,"cannot allocate memory");
+			}
+		}
+		if ( pipesize>0 ) {
+			set_pipe_size(conn_pipe[i][0]);
+			if ( relay ) set_pipe_size(conn_relay[i][0]);
+			if ( i==0 ) write_meta("pipe-size","%d",fcntl(conn_pipe[i][0],F_GETPIPE_SZ));
+		}
+		verb("connecting fd %d of #%d to fd %d of #%d",
+		     conn_srcfd[i],conn_src[i]+1,conn_dstfd[i],conn_dst[i]+1);
 	}
 
 	/* Execute commands as subprocesses and connect pipes as required. */
 	for(i=0; i<ncmds; i++) {
-		cmd_fds[i][0] = pipe_fd[i][0];
-		cmd_fds[i][1] = pipe_fd[1-i][1];
-		cmd_fds[i][2] = FDREDIR_NONE;
-		set_fd_close_exec(pipe_fd[i][0], 0);
-		set_fd_close_exec(pipe_fd[1-i][1], 1);
-
 		cmd_exit[i] = -1;
-		cmd_pid[i] = execute(cmd_name[i], (const char **)cmd_args[i],
-		                     cmd_nargs[i], cmd_fds[i], 0);
-		if ( cmd_pid[i]==-1 ) error(errno,"failed to execute command #%d",i+1);
+		clock_gettime(CLOCK_MONOTONIC,&cmd_start[i]);
+		cmd_pid[i] = start_command(i);
 		verb("started #%d, pid %d: %s",i+1,cmd_pid[i],cmd_name[i]);
 	}
 
-	/* Wait for running child commands and check exit status. */
-	do {
-		pid = waitpid(-1, &status, WNOHANG);
-		if ( pid==0 ) pid = waitpid(-1, &status, 0);
-
-		if ( pid<0 ) {
-			/* No more child processes, we're done. */
-			if ( errno==ECHILD ) break;
-			error(errno,"waiting for children");
-		}
-
-		for(i=0; i<ncmds; i++) if ( cmd_pid[i]==pid ) {
-			if (i == 0 && cmd_exit[1] == -1) {
-				/* If the second command hasn't finished yet, then write out metadata. */
-				if ( WIFEXITED(status) ) {
-					exitcode = WEXITSTATUS(status);
-					if ( outputmeta && (metafile = fopen(metafilename,"w"))==NULL ) {
-						error(errno,"cannot open `%s'",metafilename);
-					}
-					write_meta("exitcode","%d",exitcode);
-					/* TODO: add more meta data like run time. */
-					if ( outputmeta && fclose(metafile)!=0 ) {
-						error(errno,"closing file `%s'",metafilename);
-					}
-				}
-			}
-			warning(0, "command #%d, pid %d has exited (with status %d)",i+1,pid,status);
-			break;
+	/* Close our copies of the command ends of the pipes, so that each
+	   command sees EOF once the other end of its pipe exits. */
+	for(i=0; i<nconns; i++) {
+		if ( close(conn_pipe[i][1])!=0 ) error(errno,"closing pipes");
+		if ( relay ) {
+			if ( close(conn_relay[i][0])!=0 ) error(errno,"closing pipes");
+		} else {
+			if ( close(conn_pipe[i][0])!=0 ) error(errno,"closing pipes");
 		}
-		if ( i>=ncmds ) error(0, "waited for unknown child");
+	}
 
-		cmd_exit[i] = status;
-		verb("command #%d, pid %d has exited (with status %d)",i+1,pid,status);
+	/* Wait for running child commands and check exit status, while
+	   relaying data between them in relay mode. */
+	nexited = 0;
+	if ( relay ) {
+		relay_data();
+		write_relay_meta();
+	} else {
+		while ( nexited<ncmds && reap_command(0) ) {};
+	}
 
-		if ( close(cmd_fds[i][0])!=0 || close(cmd_fds[i][1])!=0 ) {
-			error(errno,"closing command #%d FD's",i+1);
-		}
-	} while ( 1 );
+	if ( outputmeta && fclose(metafile)!=0 ) {
+		error(errno,"closing file `%s'",metafilename);
+	}
+	if ( transcriptfile!=NULL && fclose(transcriptfile)!=0 ) {
+		error(errno,"closing file `%s'",transcriptfilename);
+	}
 
 	/* Check exit status of commands and report back the exit code of the first. */
 	myexitcode = exitcode = 0;
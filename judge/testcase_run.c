@@ -0,0 +1,1236 @@
+/*
+   testcase_run -- run and compare a submission on a single testcase.
+
+   Part of the DOMjudge Programming Contest Jury System and licensed
+   under the GNU GPL. See README and COPYING for details.
+
+
+   Program specifications:
+
+   This is a native implementation of testcase_run.sh: it takes the
+   same arguments and environment variables, creates the same files in
+   the workdir and exits with the same exitcodes, taken from the E_*
+   environment variables set by the judgedaemon. See that script for
+   a description of its usage.
+
+   Instead of spawning helper programs for each step, the testing
+   environment is set up with system calls: testdata is hardlinked
+   into the workdir (or bind mounted by runguard when that is not
+   possible), and the metadata files written by runguard are parsed
+   in memory.
+   Only the run script with runguard, the compare script under
+   runguard, and the privileged commands to create /dev/null and to
+   take ownership of the feedback files are executed as subprocesses,
+   plus zstd (or cat) to feed testdata into fifos and setfacl to grant
+   the run user or streaming compare user access when the workdir is
+   restricted.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include "lib.error.h"
+#include "lib.misc.h"
+
+#define PROGRAM "testcase_run"
+
+#define GAINROOT "sudo"
+#define PROGRAM_PATH "execdir/program"
+
+/* Exitcode reported for internal errors, like testcase_run.sh does. */
+#define EXIT_INTERNAL 127
+
+const char *progname;
+
+char *testin, *testout, *timelimit, *workdir;
+char *run_script, *compare_script, *compare_args;
+char *cpuset;
+char *prefix;
+int  combined_run_compare;
+int  use_chroot;
+int  runguard_server;
+
+/* Set when other testcases of this judging may run concurrently as
+ * other users and share the files under "..", see TESTCASE_PARALLEL
+ * in testcase_run.sh. */
+int  parallel;
+
+/* Set once the workdir is known, to enable cleaning up on exit. */
+int  cleanup_workdir = 0;
+
+/* Processes decompressing testdata into fifos, see stream_file(). */
+#define MAX_STREAMS 5
+pid_t stream_pids[MAX_STREAMS];
+int  nstreams = 0;
+
+/* Argument list to build commands with. */
+struct cmdargs {
+	const char **args;
+	int nargs, size;
+};
+
+void cleanup(void);
+static int runcheck(struct cmdargs *cmd, int fd_in, int fd_out, int fd_err, int err2out);
+
+/* Log an error, clean up and exit; this is the equivalent of the
+ * error trap in testcase_run.sh.
+ */
+static void fail(int errnum, const char *mesg, ...)
+	__attribute__((format (printf, 2, 3), noreturn));
+static void fail(int errnum, const char *mesg, ...)
+{
+	va_list ap;
+
+	cleanup();
+
+	va_start(ap, mesg);
+	errno = errnum;
+	vlogerror(errnum, mesg, ap);
+	va_end(ap);
+
+	exit(EXIT_INTERNAL);
+}
+
+/* Return environment variable 'name', or the empty string if unset. */
+static const char *getenv_str(const char *name)
+{
+	const char *str = getenv(name);
+
+	return str==NULL ? "" : str;
+}
+
+/* Return the exitcode defined by environment variable 'name',
+ * defaulting to 1 like the '${E_...:-1}' expansions in the script.
+ */
+static int exitcode_env(const char *name)
+{
+	const char *str = getenv(name);
+
+	if ( str==NULL || *str==0 ) return 1;
+	return atoi(str);
+}
+
+static void cleanexit(int exitcode) __attribute__((noreturn));
+static void cleanexit(int exitcode)
+{
+	cleanup();
+
+	logmsg(LOG_DEBUG, "exiting with status '%d'", exitcode);
+	exit(exitcode);
+}
+
+static void add_arg(struct cmdargs *cmd, const char *arg)
+{
+	if ( cmd->nargs>=cmd->size ) {
+		cmd->size = cmd->size==0 ? 32 : 2*cmd->size;
+		cmd->args = (const char **) realloc(cmd->args, cmd->size*sizeof(char *));
+		if ( cmd->args==NULL ) fail(errno, "allocating argument list");
+	}
+	cmd->args[cmd->nargs++] = arg;
+}
+
+static void add_argf(struct cmdargs *cmd, const char *fmt, ...)
+	__attribute__((format (printf, 2, 3)));
+static void add_argf(struct cmdargs *cmd, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	add_arg(cmd, vallocstr(fmt, ap));
+	va_end(ap);
+}
+
+/* Read a complete file into a NUL-terminated, allocated string.
+ * Returns NULL if the file cannot be read.
+ */
+static char *read_file(const char *path)
+{
+	FILE *f;
+	char *data;
+	size_t len, size, n;
+
+	if ( (f = fopen(path, "r"))==NULL ) return NULL;
+
+	len = 0;
+	size = 4096;
+	if ( (data = (char *) malloc(size))==NULL ) fail(errno, "allocating memory");
+	while ( (n = fread(data+len, 1, size-len-1, f))>0 ) {
+		len += n;
+		if ( len+1>=size ) {
+			size *= 2;
+			if ( (data = (char *) realloc(data, size))==NULL ) {
+				fail(errno, "allocating memory");
+			}
+		}
+	}
+	data[len] = 0;
+	fclose(f);
+
+	return data;
+}
+
+/* Return the value of 'key' in a runguard metadata file, read into
+ * 'meta', as allocated string or NULL if not present.
+ */
+static char *meta_value(const char *meta, const char *key)
+{
+	const char *line, *end;
+	size_t keylen = strlen(key);
+	char *value;
+
+	if ( meta==NULL ) return NULL;
+
+	for(line=meta; *line!=0; line=end+1) {
+		end = strchr(line, '\n');
+		if ( end==NULL ) end = line+strlen(line);
+		if ( strncmp(line, key, keylen)==0 &&
+		     line[keylen]==':' && line[keylen+1]==' ' ) {
+			line += keylen+2;
+			if ( (value = (char *) malloc(end-line+1))==NULL ) {
+				fail(errno, "allocating memory");
+			}
+			memcpy(value, line, end-line);
+			value[end-line] = 0;
+			return value;
+		}
+		if ( *end==0 ) break;
+	}
+
+	return NULL;
+}
+
+/* Check whether the metadata value of 'key' contains 'str'. */
+static int meta_contains(const char *meta, const char *key, const char *str)
+{
+	char *value = meta_value(meta, key);
+	int res;
+
+	res = ( value!=NULL && strstr(value, str)!=NULL );
+	free(value);
+
+	return res;
+}
+
+/* Check whether the comma separated list value of 'key' contains 'item'. */
+static int meta_list_contains(const char *meta, const char *key, const char *item)
+{
+	char *value = meta_value(meta, key);
+	char *tok, *saveptr;
+	int res = 0;
+
+	if ( value==NULL ) return 0;
+	for(tok=strtok_r(value, ",", &saveptr); tok!=NULL;
+	    tok=strtok_r(NULL, ",", &saveptr)) {
+		if ( strcmp(tok, item)==0 ) res = 1;
+	}
+	free(value);
+
+	return res;
+}
+
+static long file_size(const char *path)
+{
+	struct stat st;
+
+	if ( stat(path, &st)!=0 || !S_ISREG(st.st_mode) ) return 0;
+	return st.st_size;
+}
+
+static void touch(const char *path)
+{
+	int fd;
+
+	if ( (fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666))<0 ) {
+		fail(errno, "cannot create '%s'", path);
+	}
+	close(fd);
+}
+
+/* Create directory 'path' with 'mode' if it does not exist yet. */
+static void make_dir(const char *path, mode_t mode)
+{
+	if ( mkdir(path, mode)==0 ) {
+		if ( chmod(path, mode)!=0 ) fail(errno, "cannot chmod '%s'", path);
+	} else if ( errno!=EEXIST ) {
+		fail(errno, "cannot create directory '%s'", path);
+	}
+}
+
+/* Append a formatted message to system.out. */
+static void system_out(const char *fmt, ...) __attribute__((format (printf, 1, 2)));
+static void system_out(const char *fmt, ...)
+{
+	FILE *f;
+	va_list ap;
+
+	if ( (f = fopen("system.out", "a"))==NULL ) return;
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fclose(f);
+}
+
+/* Append string 'str' to file 'dst'. */
+static void append_str(const char *dst, const char *str)
+{
+	FILE *f;
+
+	if ( (f = fopen(dst, "a"))==NULL ) return;
+	fputs(str, f);
+	fclose(f);
+}
+
+/* Append the contents of file 'src' to file 'dst'. */
+static void append_file(const char *dst, const char *src)
+{
+	char *data;
+
+	if ( (data = read_file(src))==NULL ) return;
+	append_str(dst, data);
+	free(data);
+}
+
+/* Copy all data from 'in' to 'out', sharing the data blocks by a
+ * reflink where the filesystem supports it.
+ */
+static int copy_data(int in, int out)
+{
+	char buf[65536];
+	ssize_t nread, nwritten, pos;
+
+#ifdef FICLONE
+	if ( ioctl(out, FICLONE, in)==0 ) return 0;
+#endif
+	while ( (nread = read(in, buf, sizeof(buf)))!=0 ) {
+		if ( nread<0 ) {
+			if ( errno==EINTR ) continue;
+			return -1;
+		}
+		for(pos=0; pos<nread; pos+=nwritten) {
+			nwritten = write(out, buf+pos, nread-pos);
+			if ( nwritten<0 ) {
+				if ( errno==EINTR ) { nwritten = 0; continue; }
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Copy 'src' to 'dst' like 'cp -pL', adding permission bits 'addmode'
+ * as a subsequent 'chmod' would. Returns 0 on success, -1 on errors.
+ */
+static int copy_file(const char *src, const char *dst, mode_t addmode)
+{
+	int in, out, res;
+	struct stat st;
+	struct timespec times[2];
+
+	if ( (in = open(src, O_RDONLY | O_CLOEXEC))<0 ) return -1;
+	if ( fstat(in, &st)!=0 ||
+	     (out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	                 st.st_mode & 07777))<0 ) {
+		close(in);
+		return -1;
+	}
+
+	res = copy_data(in, out);
+	if ( res==0 ) res = fchmod(out, (st.st_mode & 07777) | addmode);
+	if ( res==0 ) {
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		res = futimens(out, times);
+	}
+
+	close(in);
+	if ( close(out)!=0 ) res = -1;
+
+	return res;
+}
+
+/* Whether testdata file 'path' is zstd compressed, see
+ * TESTCASE_CACHE_COMPRESS in the judgehost configuration. */
+static int is_compressed(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len>4 && strcmp(path+len-4, ".zst")==0;
+}
+
+/* Decompress testdata file 'src' into a new fifo 'dst' with mode
+ * 'mode' in the background, or copy it when it is not compressed. The
+ * writer blocks until the fifo is opened, and is killed on cleanup
+ * when it was not read completely.
+ */
+static void stream_file(const char *src, const char *dst, mode_t mode)
+{
+	pid_t pid;
+	int fd;
+
+	if ( nstreams>=MAX_STREAMS ) fail(0, "too many testdata streams");
+	if ( unlink(dst)!=0 && errno!=ENOENT ) fail(errno, "cannot remove '%s'", dst);
+	if ( mkfifo(dst, mode)!=0 || chmod(dst, mode)!=0 ) {
+		fail(errno, "cannot create fifo '%s'", dst);
+	}
+
+	switch ( (pid = fork()) ) {
+	case -1:
+		fail(errno, "cannot fork");
+	case 0:
+		if ( (fd = open(dst, O_WRONLY))<0 ) _exit(EXIT_INTERNAL);
+		if ( dup2(fd, STDOUT_FILENO)<0 ) _exit(EXIT_INTERNAL);
+		close(fd);
+		if ( (fd = open("/dev/null", O_WRONLY))>=0 ) dup2(fd, STDERR_FILENO);
+		if ( is_compressed(src) ) {
+			execlp("zstd", "zstd", "-dcq", "--", src, (char *)NULL);
+		} else {
+			execlp("cat", "cat", "--", src, (char *)NULL);
+		}
+		_exit(EXIT_INTERNAL);
+	}
+	stream_pids[nstreams++] = pid;
+}
+
+/* Decompress testdata file 'src' into a regular file 'dst', for
+ * readers that may seek in or map it. */
+static void unpack_file(const char *src, const char *dst)
+{
+	struct cmdargs cmd;
+	int fd_out, status;
+
+	if ( unlink(dst)!=0 && errno!=ENOENT ) fail(errno, "cannot remove '%s'", dst);
+	if ( (fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))<0 ) {
+		fail(errno, "cannot create '%s'", dst);
+	}
+	memset(&cmd, 0, sizeof(cmd));
+	add_arg(&cmd, "zstd");
+	add_arg(&cmd, "-dcq");
+	add_arg(&cmd, "--");
+	add_arg(&cmd, src);
+	status = runcheck(&cmd, FDREDIR_NONE, fd_out, FDREDIR_NONE, 0);
+	free(cmd.args);
+	if ( close(fd_out)!=0 || status!=0 ) fail(errno, "cannot decompress '%s'", src);
+	if ( chmod(dst, 0644)!=0 ) fail(errno, "cannot chmod '%s'", dst);
+}
+
+/* Make testdata file 'src' available as 'dst' in the workdir for the
+ * runguard command 'cmd': these are only read, so a hardlink suffices,
+ * otherwise runguard bind mounts it read-only, so it is never copied.
+ * Compressed testdata is streamed into a fifo when TESTDATA_STREAMABLE
+ * is set, and decompressed otherwise.
+ */
+static void link_file(const char *src, const char *dst, struct cmdargs *cmd)
+{
+	if ( is_compressed(src) ) {
+		if ( *getenv_str("TESTDATA_STREAMABLE")!=0 ) {
+			stream_file(src, dst, 0644);
+		} else {
+			unpack_file(src, dst);
+		}
+		return;
+	}
+	if ( unlink(dst)!=0 && errno!=ENOENT ) fail(errno, "cannot remove '%s'", dst);
+	if ( link(src, dst)==0 ) return;
+
+	logmsg(LOG_DEBUG, "cannot link '%s': %s, bind mounting instead", src, strerror(errno));
+	add_argf(cmd, "--bind-ro=%s:%s", src, dst);
+}
+
+/* Run a command, with stdin/stdout/stderr redirected to the given
+ * file descriptors (or inherited with FDREDIR_NONE), and return its
+ * exitcode; the equivalent of the 'runcheck' shell function.
+ */
+static int runcheck(struct cmdargs *cmd, int fd_in, int fd_out, int fd_err, int err2out)
+{
+	int stdio_fd[3];
+	int i, status;
+	pid_t pid;
+	char *cmdline, *tmp;
+
+	if ( loglevel>=LOG_DEBUG || verbose>=LOG_DEBUG ) {
+		cmdline = allocstr("%s", cmd->args[0]);
+		for(i=1; i<cmd->nargs; i++) {
+			tmp = allocstr("%s %s", cmdline, cmd->args[i]);
+			free(cmdline);
+			cmdline = tmp;
+		}
+		logmsg(LOG_DEBUG, "runcheck: %s", cmdline);
+		free(cmdline);
+	}
+
+	stdio_fd[0] = fd_in;
+	stdio_fd[1] = fd_out;
+	stdio_fd[2] = fd_err;
+
+	pid = execute(cmd->args[0], cmd->args+1, cmd->nargs-1, stdio_fd, err2out);
+	if ( pid<0 ) {
+		/* Like the shell reports a command that cannot be executed. */
+		warning(errno, "cannot execute '%s'", cmd->args[0]);
+		return 127;
+	}
+
+	while ( waitpid(pid, &status, 0)<0 ) {
+		if ( errno!=EINTR ) fail(errno, "waiting for '%s'", cmd->args[0]);
+	}
+
+	if ( WIFSIGNALED(status) ) return 128+WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/* Grant user 'user' the access 'perms' to 'path' with an ACL. */
+static void grant_access(const char *user, const char *perms, const char *path)
+{
+	struct cmdargs cmd;
+	int status;
+
+	memset(&cmd, 0, sizeof(cmd));
+	add_arg(&cmd, "setfacl");
+	add_arg(&cmd, "-m");
+	add_argf(&cmd, "u:%s:%s", user, perms);
+	add_arg(&cmd, path);
+	status = runcheck(&cmd, FDREDIR_NONE, FDREDIR_NONE, FDREDIR_NONE, 0);
+	free(cmd.args);
+	if ( status!=0 ) fail(0, "cannot make '%s' accessible for '%s'", path, user);
+}
+
+/* Make the workdir accessible for RUNUSER only: concurrent testcases
+ * of this judging run as other users, which must not be able to read
+ * its testdata and output. */
+static void restrict_workdir(void)
+{
+	struct stat st;
+
+	if ( stat(".", &st)!=0 || chmod(".", st.st_mode & 07700)!=0 ) {
+		fail(errno, "cannot restrict access to '%s'", workdir);
+	}
+	grant_access(getenv_str("RUNUSER"), "x", ".");
+}
+
+/* Run a privileged command, which must succeed. */
+static int gainroot_status(const char *cmd, const char *arg1, const char *arg2,
+                           const char *arg3, const char *arg4)
+{
+	const char *args[6];
+	int nargs = 0, stdio_fd[3] = { FDREDIR_NONE, FDREDIR_NONE, FDREDIR_NONE };
+
+	args[nargs++] = "-n";
+	args[nargs++] = cmd;
+	if ( arg1!=NULL ) args[nargs++] = arg1;
+	if ( arg2!=NULL ) args[nargs++] = arg2;
+	if ( arg3!=NULL ) args[nargs++] = arg3;
+	if ( arg4!=NULL ) args[nargs++] = arg4;
+
+	return execute(GAINROOT, args, nargs, stdio_fd, 0);
+}
+
+static void gainroot(const char *cmd, const char *arg1, const char *arg2,
+                     const char *arg3, const char *arg4)
+{
+	int res;
+
+	if ( (res = gainroot_status(cmd, arg1, arg2, arg3, arg4))!=0 ) {
+		fail(res<0 ? errno : 0, "'%s %s' failed with exitcode %d", GAINROOT, cmd, res);
+	}
+}
+
+/* Add the runguard command: send runs to a runguard server for this
+ * judging if one is running, otherwise start a new privileged runguard
+ * for each run.
+ */
+static void add_runguard(struct cmdargs *cmd)
+{
+	const char *socket = getenv("RUNGUARD_SOCKET");
+	struct stat st;
+
+	if ( socket!=NULL && *socket!=0 && stat(socket, &st)==0 && S_ISSOCK(st.st_mode) ) {
+		add_argf(cmd, "%s/runguard", getenv_str("DJ_BINDIR"));
+		add_argf(cmd, "--connect=%s", socket);
+		runguard_server = 1;
+	} else {
+		add_arg(cmd, GAINROOT);
+		add_arg(cmd, "-n");
+		add_argf(cmd, "%s/runguard", getenv_str("DJ_BINDIR"));
+		runguard_server = 0;
+	}
+}
+
+static void add_cpuset_opts(struct cmdargs *cmd)
+{
+	const char *profile = getenv_str("TIMING_PROFILE");
+
+	if ( cpuset==NULL ) return;
+
+	add_arg(cmd, "-P");
+	add_arg(cmd, cpuset);
+	if ( strcmp(profile, "smt")==0 ) {
+		add_arg(cmd, "--timing-profile=smt");
+	} else if ( *profile!=0 ) {
+		add_arg(cmd, "--timing-profile");
+	}
+}
+
+/* The runguard server already has the user and group set. */
+static void add_user_opts(struct cmdargs *cmd)
+{
+	if ( runguard_server ) return;
+
+	add_argf(cmd, "--user=%s", getenv_str("RUNUSER"));
+	add_argf(cmd, "--group=%s", getenv_str("RUNGROUP"));
+}
+
+/* Return a 'ps'-like list of processes with effective user 'uid', or
+ * NULL if there are none.
+ */
+static char *running_processes(uid_t uid)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char path[300], *status, *comm, *line, *list, *tmp;
+	unsigned long ruid, euid;
+
+	if ( (dir = opendir("/proc"))==NULL ) return NULL;
+
+	list = NULL;
+	while ( (entry = readdir(dir))!=NULL ) {
+		if ( strspn(entry->d_name, "0123456789")!=strlen(entry->d_name) ) continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/status", entry->d_name);
+		if ( (status = read_file(path))==NULL ) continue;
+		line = strstr(status, "\nUid:");
+		if ( line==NULL || sscanf(line, "\nUid: %lu %lu", &ruid, &euid)!=2 ||
+		     euid!=(unsigned long) uid ) {
+			free(status);
+			continue;
+		}
+		free(status);
+
+		snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+		if ( (comm = read_file(path))==NULL ) continue;
+		stripendline(comm);
+
+		tmp = allocstr("%s%s%5s %s", list==NULL ? "" : list,
+		               list==NULL ? "" : "\n", entry->d_name, comm);
+		free(list);
+		free(comm);
+		list = tmp;
+	}
+	closedir(dir);
+
+	return list;
+}
+
+/* Remove group/other write permissions, like 'chmod -R go-w'. */
+static int remove_write_perm(const char *path, const struct stat *sb,
+                             int typeflag, struct FTW *ftwbuf)
+{
+	(void) ftwbuf;
+
+	if ( typeflag!=FTW_SL && chmod(path, (sb->st_mode & 07777) & ~022)!=0 ) {
+		fail(errno, "cannot chmod '%s'", path);
+	}
+
+	return 0;
+}
+
+void cleanup(void)
+{
+	struct stat st;
+	int i;
+
+	if ( cleanup_workdir ) {
+		cleanup_workdir = 0;
+
+		/* Remove some copied files to save disk space. This assumes
+		 * that if bin is bind-mounted from the chroot, then it is
+		 * read-only so the removal of bin/sh will fail. */
+		if ( !parallel ) {
+			unlink("../dev/null");
+			unlink("../bin/sh");
+			unlink("../dj-bin/runpipe");
+		}
+
+		/* Stop decompressing testdata that was not read completely. */
+		if ( nstreams>0 ) {
+			for(i=0; i<nstreams; i++) {
+				kill(stream_pids[i], SIGTERM);
+				waitpid(stream_pids[i], NULL, 0);
+			}
+			nstreams = 0;
+			unlink("program.in");
+			unlink("stream.in");
+			unlink("stream.out");
+		}
+
+		/* Replace testdata by symlinks to reduce disk usage */
+		if ( lstat("testdata.in", &st)==0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) ) {
+			unlink("testdata.in");
+			if ( symlink(testin, "testdata.in")!=0 ) {
+				warning(errno, "cannot symlink '%s'", testin);
+			}
+		}
+		if ( lstat("testdata.out", &st)==0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) ) {
+			unlink("testdata.out");
+			if ( symlink(testout, "testdata.out")!=0 ) {
+				warning(errno, "cannot symlink '%s'", testout);
+			}
+		}
+
+		/* Remove access to workdir for next runs */
+		if ( stat(".", &st)==0 ) chmod(".", st.st_mode & 07700);
+	}
+
+	/* Copy runguard and program stderr to system output. The display
+	 * is truncated to normal size in the jury web interface. */
+	if ( file_size("runguard.err")>0 ) {
+		system_out("********** runguard stderr follows **********\n");
+		append_file("system.out", "runguard.err");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct cmdargs runcmd, cmpcmd;
+	struct stat st;
+	struct passwd *pw;
+	char hostname[256], cwd[PATH_MAX];
+	char *logfile, *str, *ptr, *output, *tmp;
+	char *program_meta, *compare_meta;
+	char *program_md5, *program_cputime, *program_walltime, *program_exit;
+	char *program_stdout, *memory_bytes, *resourceinfo;
+	const char *run_juryprog, *base;
+	int opt, exitcode, fd_in, fd_out, fd_err;
+
+	progname = argv[0];
+	if ( (base = strrchr(progname, '/'))!=NULL ) progname = base+1;
+
+	/* Do argument parsing */
+	cpuset = NULL;
+	while ( (opt = getopt(argc, argv, "+n:"))!=-1 ) {
+		switch ( opt ) {
+		case 'n': cpuset = optarg; break;
+		case ':':
+		case '?': break;
+		}
+	}
+
+	if ( gethostname(hostname, sizeof(hostname))!=0 ) strcpy(hostname, "localhost");
+	hostname[sizeof(hostname)-1] = 0;
+	if ( (ptr = strchr(hostname, '.'))!=NULL ) *ptr = 0;
+
+	if ( cpuset!=NULL ) {
+		logfile = allocstr("%s/judge.%s-%s.log", getenv_str("DJ_LOGDIR"), hostname, cpuset);
+	} else {
+		logfile = allocstr("%s/judge.%s.log", getenv_str("DJ_LOGDIR"), hostname);
+	}
+	stdlog = fopen(logfile, "a");
+
+	/* Logging */
+	loglevel = LOG_DEBUG;
+	if ( *getenv_str("DEBUG")!=0 ) {
+		verbose = LOG_DEBUG;
+		setenv("VERBOSE", "7", 1);
+		logmsg(LOG_NOTICE, "debugging enabled, DEBUG='%s'", getenv_str("DEBUG"));
+	} else {
+		verbose = LOG_ERR;
+		setenv("VERBOSE", "3", 1);
+	}
+
+	logmsg(LOG_INFO, "starting '%s', PID = %d", argv[0], (int) getpid());
+
+	if ( argc-optind<4 ) fail(0, "not enough arguments. See script-code for usage.");
+	testin    = argv[optind];
+	testout   = argv[optind+1];
+	timelimit = argv[optind+2];
+	workdir   = argv[optind+3];
+	run_script     = argc-optind>4 ? argv[optind+4] : "";
+	compare_script = argc-optind>5 ? argv[optind+5] : "";
+	compare_args   = argc-optind>6 ? argv[optind+6] : "";
+	logmsg(LOG_DEBUG, "arguments: '%s' '%s' '%s' '%s'", testin, testout, timelimit, workdir);
+	logmsg(LOG_DEBUG, "optionals: '%s' '%s' '%s'", run_script, compare_script, compare_args);
+
+	/* optional runjury program */
+	run_juryprog = allocstr("%sjury", run_script);
+	logmsg(LOG_DEBUG, "run_juryprog: '%s'", run_juryprog);
+
+	if ( access(testin, R_OK)!=0 ) fail(0, "test-input not found: %s", testin);
+	if ( access(testout, R_OK)!=0 ) fail(0, "test-output not found: %s", testout);
+	if ( stat(workdir, &st)!=0 || !S_ISDIR(st.st_mode) ||
+	     access(workdir, W_OK | X_OK)!=0 ) {
+		fail(0, "Workdir not found or not writable: %s", workdir);
+	}
+	combined_run_compare = ( *compare_script==0 );
+	parallel = ( *getenv_str("TESTCASE_PARALLEL")!=0 );
+	setenv("COMBINED_RUN_COMPARE", combined_run_compare ? "1" : "0", 1);
+
+	if ( *getenv_str("EXECDIR_BIND")!=0 ) {
+		str = allocstr("%s/program", getenv_str("EXECDIR_BIND"));
+	} else {
+		str = allocstr("%s/%s", workdir, PROGRAM_PATH);
+	}
+	if ( access(str, X_OK)!=0 ) fail(0, "submission program not found or not executable");
+	free(str);
+	if ( *run_script==0 || access(run_script, X_OK)!=0 ) {
+		fail(0, "run script not found or not executable: %s", run_script);
+	}
+	str = allocstr("%s/runguard", getenv_str("DJ_BINDIR"));
+	if ( access(str, X_OK)!=0 ) fail(0, "runguard not found or not executable: %s", str);
+	free(str);
+	if ( !combined_run_compare && access(compare_script, X_OK)!=0 ) {
+		fail(0, "compare script not found or not executable: %s", compare_script);
+	}
+
+	if ( chdir(workdir)!=0 ) fail(errno, "cannot chdir to '%s'", workdir);
+	cleanup_workdir = 1;
+	if ( getcwd(cwd, sizeof(cwd))==NULL ) fail(errno, "cannot get current directory");
+
+	/* Check whether we're going to run in a chroot environment */
+	str = (char *) getenv_str("USE_CHROOT");
+	use_chroot = ( *str!=0 && strcmp(str, "0")!=0 );
+	if ( use_chroot ) {
+		base = strrchr(cwd, '/');
+		prefix = allocstr("/%s", base==NULL ? cwd : base+1);
+	} else {
+		prefix = cwd;
+	}
+
+	/* Make testing/execute dir accessible for RUNUSER; a shared
+	 * compile dir mounted on execdir was already made accessible by
+	 * the judgedaemon. */
+	if ( parallel ) {
+		restrict_workdir();
+	} else if ( stat(".", &st)!=0 || chmod(".", (st.st_mode & 07777) | 0111)!=0 ) {
+		fail(errno, "cannot make '%s' accessible", workdir);
+	}
+	if ( stat("execdir", &st)!=0 || chmod("execdir", (st.st_mode & 07777) | 0111)!=0 ) {
+		fail(errno, "cannot make '%s' accessible", workdir);
+	}
+
+	/* Create files which are expected to exist */
+	touch("system.out");
+	touch("program.out");
+	touch("program.err");
+	touch("program.meta");
+	touch("runguard.err");
+	touch("compare.meta");
+	touch("compare.err");
+
+	logmsg(LOG_INFO, "setting up testing (chroot) environment");
+
+	make_dir("../bin", 0711);
+	make_dir("../dj-bin", 0711);
+	make_dir("../dev", 0711);
+
+	/* Copy the run-script and a statically compiled shell */
+	if ( copy_file(run_script, "run", 0555)!=0 ) {
+		fail(errno, "cannot copy run script '%s'", run_script);
+	}
+	if ( access("../bin/sh", X_OK)!=0 ) {
+		str = allocstr("%s/sh-static", getenv_str("DJ_LIBJUDGEDIR"));
+		if ( copy_file(str, "../bin/sh", 0555)!=0 ) {
+			logmsg(LOG_DEBUG, "cannot copy static shell: %s", strerror(errno));
+		}
+		free(str);
+	}
+	/* If using a custom runjury script, copy additional support
+	 * programs if required */
+	if ( access(run_juryprog, X_OK)==0 ) {
+		if ( copy_file(run_juryprog, "runjury", 0555)!=0 ) {
+			fail(errno, "cannot copy runjury support programs");
+		}
+		if ( !parallel || access("../dj-bin/runpipe", X_OK)!=0 ) {
+			/* Rename into place: a concurrent run may be executing it. */
+			str = allocstr("%s/runpipe", getenv_str("DJ_BINDIR"));
+			tmp = allocstr("../dj-bin/runpipe.%d", (int)getpid());
+			if ( copy_file(str, tmp, 0555)!=0 ||
+			     rename(tmp, "../dj-bin/runpipe")!=0 ) {
+				fail(errno, "cannot copy runjury support programs");
+			}
+			free(str);
+			free(tmp);
+		}
+	}
+
+	/* If we need to create a writable temp directory, do so */
+	if ( *getenv_str("CREATE_WRITABLE_TEMP_DIR")!=0 ) {
+		str = allocstr("%s/write_tmp", prefix);
+		setenv("TMPDIR", str, 1);
+		free(str);
+		make_dir("write_tmp", 0777);
+	}
+
+	/* We copy /dev/null: mknod (and the major/minor device numbers)
+	 * are not portable, while a fifo link has the problem that a cat
+	 * program must be run and killed. */
+	logmsg(LOG_DEBUG, "creating /dev/null character-special device");
+	if ( !parallel ) {
+		gainroot("cp", "-pR", "/dev/null", "../dev/null", NULL);
+	} else if ( stat("../dev/null", &st)!=0 || !S_ISCHR(st.st_mode) ) {
+		/* A concurrent run may have created it in the meantime. */
+		if ( gainroot_status("cp", "-pR", "/dev/null", "../dev/null", NULL)!=0 &&
+		     (stat("../dev/null", &st)!=0 || !S_ISCHR(st.st_mode)) ) {
+			fail(0, "cannot create '../dev/null'");
+		}
+	}
+
+	/* Run the solution program (within a restricted environment) */
+	logmsg(LOG_INFO, "running program (USE_CHROOT = %d)", use_chroot);
+
+	memset(&runcmd, 0, sizeof(runcmd));
+	add_arg(&runcmd, "./run");
+	/* The run script opens the testdata itself as the judgedaemon user
+	 * and passes it on as stdin, so it needs no copy in the workdir. */
+	exitcode = 0;
+	if ( combined_run_compare ) {
+		/* Combined run and compare scripts already now need the
+		 * feedback directory and perhaps access to the test answers. */
+		if ( mkdir("feedback", 0777)!=0 ) fail(errno, "cannot create directory 'feedback'");
+		/* The jury program may read the testdata in any way. */
+		if ( is_compressed(testin) ) {
+			unpack_file(testin, "testdata.in");
+			add_argf(&runcmd, "%s/testdata.in", cwd);
+		} else {
+			add_arg(&runcmd, testin);
+		}
+		if ( is_compressed(testout) ) {
+			unpack_file(testout, "testdata.out");
+			add_argf(&runcmd, "%s/testdata.out", cwd);
+		} else {
+			add_arg(&runcmd, testout);
+		}
+		add_arg(&runcmd, "program.out");
+		add_arg(&runcmd, "compare.meta");
+		add_arg(&runcmd, "feedback");
+	} else if ( is_compressed(testin) ) {
+		stream_file(testin, "program.in", 0600);
+		add_argf(&runcmd, "%s/program.in", cwd);
+		add_arg(&runcmd, "program.out");
+	} else {
+		add_arg(&runcmd, testin);
+		add_arg(&runcmd, "program.out");
+	}
+
+	add_runguard(&runcmd);
+	if ( *getenv_str("DEBUG")!=0 ) {
+		add_arg(&runcmd, "-v");
+		add_arg(&runcmd, "-V");
+		add_argf(&runcmd, "DEBUG=%s", getenv_str("DEBUG"));
+	}
+	if ( *getenv_str("TMPDIR")!=0 ) {
+		add_arg(&runcmd, "-V");
+		add_argf(&runcmd, "TMPDIR=%s", getenv_str("TMPDIR"));
+	}
+	add_cpuset_opts(&runcmd);
+	if ( use_chroot ) {
+		add_arg(&runcmd, "-r");
+		add_argf(&runcmd, "%s/..", cwd);
+		if ( *getenv_str("CHROOT_MOUNTS")!=0 ) add_arg(&runcmd, "--chroot-mounts");
+	}
+	add_argf(&runcmd, "--nproc=%s", getenv_str("PROCLIMIT"));
+	add_arg(&runcmd, "--no-core");
+	add_argf(&runcmd, "--streamsize=%s", getenv_str("FILELIMIT"));
+	add_user_opts(&runcmd);
+	if ( *getenv_str("EXECDIR_BIND")!=0 ) {
+		add_argf(&runcmd, "--bind-ro=%s:execdir", getenv_str("EXECDIR_BIND"));
+	}
+	add_argf(&runcmd, "--walltime=%s", timelimit);
+	add_argf(&runcmd, "--cputime=%s", timelimit);
+	add_argf(&runcmd, "--memsize=%s", getenv_str("MEMLIMIT"));
+	add_argf(&runcmd, "--filesize=%s", getenv_str("FILELIMIT"));
+	if ( *getenv_str("IOMAXLIMIT")!=0 ) {
+		add_argf(&runcmd, "--io-max=%s", getenv_str("IOMAXLIMIT"));
+	}
+	if ( *getenv_str("RECLAIM_CACHE")!=0 ) add_arg(&runcmd, "--reclaim-cache");
+	if ( *getenv_str("TESTOUT_MD5")!=0 ) add_arg(&runcmd, "--hash-stdout");
+	if ( *getenv_str("KILL_ON_OUTPUT_LIMIT")!=0 ) add_arg(&runcmd, "--kill-on-output-limit");
+	if ( *getenv_str("PHASE_TIMES")!=0 ) add_arg(&runcmd, "--phase-times");
+	if ( *getenv_str("SYSCALL_PROFILE")!=0 ) add_arg(&runcmd, "--syscall-profile");
+	if ( *getenv_str("STREAM_COMPARE")!=0 && !combined_run_compare ) {
+		/* The streaming compare runs outside the chroot as
+		 * STREAM_USER and gets the testdata through fifos, see
+		 * testcase_run.sh; it only aborts the program early. */
+		make_dir("feedback-stream", 0700);
+		stream_file(testin, "stream.in", 0600);
+		stream_file(testout, "stream.out", 0600);
+		grant_access(getenv_str("STREAM_USER"), "rwx", "feedback-stream");
+		grant_access(getenv_str("STREAM_USER"), "r", "stream.in");
+		grant_access(getenv_str("STREAM_USER"), "r", "stream.out");
+		if ( *getenv_str("TESTCASE_PARALLEL")!=0 ) {
+			grant_access(getenv_str("STREAM_USER"), "x", ".");
+		}
+		add_argf(&runcmd, "--stream-compare=%s", compare_script);
+		add_argf(&runcmd, "--stream-arg=%s/stream.in", cwd);
+		add_argf(&runcmd, "--stream-arg=%s/stream.out", cwd);
+		add_argf(&runcmd, "--stream-arg=%s/feedback-stream", cwd);
+		/* Split compare arguments on whitespace, as the shell does. */
+		tmp = strdup(compare_args);
+		for(str=strtok_r(tmp, " \t\n", &ptr); str!=NULL;
+		    str=strtok_r(NULL, " \t\n", &ptr)) {
+			add_argf(&runcmd, "--stream-arg=%s", str);
+		}
+		free(tmp);
+		add_arg(&runcmd, "--stream-arg=streaming");
+		add_argf(&runcmd, "--stream-user=%s", getenv_str("STREAM_USER"));
+		add_argf(&runcmd, "--stream-limits=%s,%s,%s", getenv_str("SCRIPTMEMLIMIT"),
+		         getenv_str("SCRIPTTIMELIMIT"), getenv_str("SCRIPTFILELIMIT"));
+	}
+	add_arg(&runcmd, "--stderr=program.err");
+	add_arg(&runcmd, "--outmeta=program.meta");
+	add_arg(&runcmd, "--outmeta-json=program.meta.json");
+	add_arg(&runcmd, "--");
+	add_argf(&runcmd, "%s/%s", prefix, PROGRAM_PATH);
+
+	if ( (fd_err = open("runguard.err", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))<0 ) {
+		fail(errno, "cannot open 'runguard.err'");
+	}
+	exitcode = runcheck(&runcmd, FDREDIR_NONE, FDREDIR_NONE, fd_err, 0);
+	close(fd_err);
+
+	/* Check for still running processes */
+	if ( (pw = getpwnam(getenv_str("RUNUSER")))!=NULL &&
+	     (output = running_processes(pw->pw_uid))!=NULL ) {
+		fail(0, "found processes still running as '%s', check manually:\n%s",
+		     getenv_str("RUNUSER"), output);
+	}
+
+	compare_meta = read_file("compare.meta");
+
+	/* runpipe aborts interactive runs where both sides block on each other. */
+	if ( combined_run_compare &&
+	     (str = meta_value(compare_meta, "idle-detected"))!=NULL ) {
+		system_out("Idleness limit exceeded: jury and program blocked on each other for %ss.\n", str);
+		cleanexit(exitcode_env("E_TIMELIMIT"));
+	}
+
+	if ( !combined_run_compare ) {
+		/* We first compare the output, so that even if the submission
+		 * gets a timelimit exceeded or runtime error verdict later, the
+		 * jury can still view the diff with what the submission produced. */
+		logmsg(LOG_INFO, "comparing output");
+
+		logmsg(LOG_DEBUG, "starting compare script '%s'", compare_script);
+
+		exitcode = 0;
+		/* Create dir for feedback files and make it writable for RUNUSER */
+		make_dir("feedback", 0777);
+
+		/* Output identical to the testcase output is always correct:
+		 * if we know the expected hash, skip the compare script then. */
+		program_meta = read_file("program.meta");
+		program_md5 = meta_value(program_meta, "stdout-md5");
+		free(program_meta);
+		if ( *getenv_str("TESTOUT_MD5")!=0 && program_md5!=NULL &&
+		     strcmp(program_md5, getenv_str("TESTOUT_MD5"))==0 ) {
+			logmsg(LOG_INFO, "output matches testcase output hash, skipping compare");
+			exitcode = 42;
+		} else {
+			memset(&cmpcmd, 0, sizeof(cmpcmd));
+			add_runguard(&cmpcmd);
+			if ( *getenv_str("DEBUG")!=0 ) add_arg(&cmpcmd, "-v");
+			add_cpuset_opts(&cmpcmd);
+			add_user_opts(&cmpcmd);
+			add_arg(&cmpcmd, "-m");
+			add_arg(&cmpcmd, getenv_str("SCRIPTMEMLIMIT"));
+			add_arg(&cmpcmd, "-t");
+			add_arg(&cmpcmd, getenv_str("SCRIPTTIMELIMIT"));
+			add_arg(&cmpcmd, "-c");
+			add_arg(&cmpcmd, "-f");
+			add_arg(&cmpcmd, getenv_str("SCRIPTFILELIMIT"));
+			add_arg(&cmpcmd, "-s");
+			add_arg(&cmpcmd, getenv_str("SCRIPTFILELIMIT"));
+			add_arg(&cmpcmd, "-M");
+			add_arg(&cmpcmd, "compare.meta");
+			/* Link testdata output, only after program has run */
+			link_file(testin, "testdata.in", &cmpcmd);
+			link_file(testout, "testdata.out", &cmpcmd);
+			add_arg(&cmpcmd, "--");
+			add_arg(&cmpcmd, compare_script);
+			add_arg(&cmpcmd, "testdata.in");
+			add_arg(&cmpcmd, "testdata.out");
+			add_arg(&cmpcmd, "feedback/");
+			/* Split compare arguments on whitespace, as the shell does. */
+			tmp = strdup(compare_args);
+			for(str=strtok_r(tmp, " \t\n", &ptr); str!=NULL;
+			    str=strtok_r(NULL, " \t\n", &ptr)) {
+				add_arg(&cmpcmd, str);
+			}
+
+			if ( (fd_in = open("program.out", O_RDONLY | O_CLOEXEC))<0 ||
+			     (fd_out = open("compare.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666))<0 ) {
+				fail(errno, "cannot open compare input/output files");
+			}
+			exitcode = runcheck(&cmpcmd, fd_in, fd_out, FDREDIR_NONE, 1);
+			close(fd_in);
+			close(fd_out);
+		}
+		free(program_md5);
+
+		free(compare_meta);
+		compare_meta = read_file("compare.meta");
+	}
+
+	/* Make sure that all feedback files are owned by the current
+	 * user/group, so that we can append content. */
+	if ( (pw = getpwuid(getuid()))==NULL ) fail(errno, "cannot determine current user");
+	str = allocstr("%s:", pw->pw_name);
+	tmp = allocstr("%s/feedback", workdir);
+	gainroot("chown", "-R", str, tmp, NULL);
+	free(str);
+	free(tmp);
+	if ( nftw("feedback", remove_write_perm, 16, FTW_PHYS)!=0 ) {
+		fail(errno, "cannot chmod 'feedback'");
+	}
+
+	/* Make sure that feedback file exists, since we assume this later. */
+	touch("feedback/judgemessage.txt");
+
+	/* Append output validator error messages */
+	if ( file_size("feedback/judgeerror.txt")>0 ) {
+		append_str("feedback/judgemessage.txt",
+		           "\n---------- output validator (error) messages ----------\n");
+		append_file("feedback/judgemessage.txt", "feedback/judgeerror.txt");
+	}
+
+	logmsg(LOG_DEBUG, "checking compare script exit-status: %d", exitcode);
+	if ( meta_contains(compare_meta, "time-result", "timelimit") ) {
+		str = read_file("compare.tmp");
+		logmsg(LOG_ERR, "Comparing aborted after %s seconds, compare script output:\n%s",
+		       getenv_str("SCRIPTTIMELIMIT"), str==NULL ? "" : str);
+		cleanexit(exitcode_env("E_COMPARE_ERROR"));
+	}
+	/* Append output validator stdin/stderr */
+	if ( file_size("compare.tmp")>0 ) {
+		append_str("feedback/judgemessage.txt",
+		           "\n---------- output validator stdout/stderr messages ----------\n");
+		append_file("feedback/judgemessage.txt", "compare.tmp");
+	}
+	if ( exitcode!=42 && exitcode!=43 ) {
+		str = read_file("feedback/judgemessage.txt");
+		logmsg(LOG_ERR, "Comparing failed with exitcode %d, compare script output:\n%s",
+		       exitcode, str==NULL ? "" : str);
+		cleanexit(exitcode_env("E_COMPARE_ERROR"));
+	}
+
+	/* Check for errors from running the program */
+	if ( (program_meta = read_file("program.meta"))==NULL ) {
+		fail(0, "'program.meta' not readable");
+	}
+	logmsg(LOG_DEBUG, "checking program run exit-status");
+	program_cputime  = meta_value(program_meta, "cpu-time");
+	program_walltime = meta_value(program_meta, "wall-time");
+	program_exit     = meta_value(program_meta, "exitcode");
+	program_stdout   = meta_value(program_meta, "stdout-bytes");
+	memory_bytes     = meta_value(program_meta, "memory-bytes");
+	resourceinfo = allocstr("runtime: %ss cpu, %ss wall\nmemory used: %s bytes",
+	                        program_cputime  ? program_cputime  : "",
+	                        program_walltime ? program_walltime : "",
+	                        memory_bytes     ? memory_bytes     : "");
+
+	/* With a runpipe relay, show how the time was divided between the
+	 * jury program (command 1) and the submission (command 2). */
+	if ( combined_run_compare &&
+	     (str = meta_value(compare_meta, "cmd1-response-time"))!=NULL ) {
+		char *jury_replies    = meta_value(compare_meta, "cmd1-responses");
+		char *program_time    = meta_value(compare_meta, "cmd2-response-time");
+		char *program_replies = meta_value(compare_meta, "cmd2-responses");
+
+		tmp = allocstr("%s\ninteraction: %ss jury in %s responses, %ss program in %s responses",
+		               resourceinfo, str,
+		               jury_replies    ? jury_replies    : "",
+		               program_time    ? program_time    : "",
+		               program_replies ? program_replies : "");
+		free(resourceinfo);
+		resourceinfo = tmp;
+	}
+
+	if ( program_exit==NULL ) program_exit = "";
+
+	if ( combined_run_compare &&
+	     (str = meta_value(compare_meta, "exitcode"))!=NULL && strcmp(str, "43")==0 ) {
+		/* For interactive problems with combined run/compare scripts,
+		 * a WA may override TLE and RTE. runpipe only writes
+		 * 'exitcode' to compare.meta if the validator exited first. */
+		if ( meta_contains(program_meta, "time-result", "timelimit") ) {
+			system_out("Timelimit exceeded, but validator exited first with WA.\n");
+		} else if ( strcmp(program_exit, "0")!=0 ) {
+			system_out("Non-zero exitcode %s, but validator exited first with WA.\n", program_exit);
+		}
+		system_out("%s\n", resourceinfo);
+		cleanexit(exitcode_env("E_WRONG_ANSWER"));
+	}
+
+	/* A program aborted because its output was already wrong gets a
+	 * WA, also when it would have hit the timelimit or crashed. */
+	if ( exitcode==43 && meta_contains(program_meta, "early-verdict", "wrong-answer") ) {
+		system_out("Wrong answer, program aborted early.\n%s\n", resourceinfo);
+		cleanexit(exitcode_env("E_WRONG_ANSWER"));
+	}
+
+	/* A program killed for exceeding the output limit gets that
+	 * verdict, not the runtime error that its abortion looks like. */
+	if ( meta_contains(program_meta, "output-result", "output-limit") ) {
+		system_out("Output limit exceeded: %s > %ld, program aborted.\n%s\n",
+		           program_stdout ? program_stdout : "",
+		           strtol(getenv_str("FILELIMIT"), NULL, 10)*1024, resourceinfo);
+		cleanexit(exitcode_env("E_OUTPUT_LIMIT"));
+	}
+
+	/* A program killed for running out of memory gets a memory limit
+	 * verdict when enabled, otherwise this is only noted. */
+	if ( meta_contains(program_meta, "memory-result", "memory-limit") ) {
+		if ( *getenv_str("MEMORY_LIMIT_VERDICT")!=0 ) {
+			system_out("Memory limit exceeded, program aborted.\n%s\n", resourceinfo);
+			cleanexit(exitcode_env("E_MEMORY_LIMIT"));
+		}
+		system_out("Memory limit exceeded.\n");
+	}
+
+	if ( meta_contains(program_meta, "time-result", "timelimit") ) {
+		system_out("Timelimit exceeded.\n%s\n", resourceinfo);
+		cleanexit(exitcode_env("E_TIMELIMIT"));
+	}
+	if ( strcmp(program_exit, "0")!=0 ) {
+		system_out("Non-zero exitcode %s\n%s\n", program_exit, resourceinfo);
+		cleanexit(exitcode_env("E_RUN_ERROR"));
+	}
+
+	if ( meta_list_contains(program_meta, "output-truncated", "stdout") ) {
+		system_out("Output limit exceeded: %s > %ld\n%s\n",
+		           program_stdout ? program_stdout : "",
+		           strtol(getenv_str("FILELIMIT"), NULL, 10)*1024, resourceinfo);
+		cleanexit(exitcode_env("E_OUTPUT_LIMIT"));
+	}
+
+	if ( exitcode==42 ) {
+		system_out("Correct!\n%s\n", resourceinfo);
+		cleanexit(exitcode_env("E_CORRECT"));
+	} else if ( exitcode==43 ) {
+		/* Special case detect no-output */
+		if ( file_size("program.out")==0 && !combined_run_compare ) {
+			system_out("Program produced no output.\n%s\n", resourceinfo);
+			cleanexit(exitcode_env("E_NO_OUTPUT"));
+		}
+		system_out("Wrong answer.\n%s\n", resourceinfo);
+		cleanexit(exitcode_env("E_WRONG_ANSWER"));
+	}
+
+	/* This should never be reached */
+	return exitcode_env("E_INTERNAL_ERROR");
+}
@@ -18,6 +18,35 @@
 #
 # Default run and compare scripts can be configured in the database.
 #
+# When the environment variable TESTOUT_MD5 contains the MD5 hash of
+# <testdata.out>, the compare script is skipped for identical output.
+#
+# When STREAM_COMPARE is set, the compare script is also run with the
+# extra argument 'streaming' on the program output while the program
+# runs, and the program is aborted as soon as the output is wrong. The
+# compare script must support this, like the default compare does. It
+# runs as the user STREAM_USER.
+#
+# Testdata files ending in '.zst' are zstd compressed, see
+# TESTCASE_CACHE_COMPRESS. These are decompressed into fifos for the
+# run script and, when TESTDATA_STREAMABLE is set because the compare
+# script reads them sequentially, for the compare script. Otherwise
+# the compare script (or combined run/compare script) gets decompressed
+# copies.
+#
+# When EXECDIR_BIND is set, it is the compile dir shared by all
+# testcases of the judging: runguard then bind mounts it read-only on
+# the empty <workdir>/execdir, only within the mount namespace of the
+# program run.
+#
+# When TESTCASE_PARALLEL is set, other testcases of the same judging may
+# run concurrently in sibling directories, each as its own RUNUSER. The
+# files shared with them under <workdir>/.. are then left in place, and
+# only RUNUSER may enter <workdir>; this uses setfacl.
+#
+# The program testcase_run (testcase_run.c) is a native implementation
+# of this script; keep both in sync.
+#
 # Exit automatically, whenever a simple command fails and trap it:
 set -e
 trap 'cleanup ; error' EXIT
@@ -28,14 +57,23 @@ cleanup ()
 	if [ "$WORKDIR" ]; then
 		# This assumes that if bin is bind-mounted from the chroot,
 		# then it is read-only so the removal of bin/sh will fail.
-		rm -f "$WORKDIR/../dev/null" "$WORKDIR/../bin/sh" "$WORKDIR/../dj-bin/runpipe" 2> /dev/null || true
+		if [ -z "$TESTCASE_PARALLEL" ]; then
+			rm -f "$WORKDIR/../dev/null" "$WORKDIR/../bin/sh" "$WORKDIR/../dj-bin/runpipe" 2> /dev/null || true
+		fi
+
+		# Stop decompressing testdata that was not read completely.
+		if [ -n "$STREAM_PIDS" ]; then
+			# shellcheck disable=SC2086
+			kill $STREAM_PIDS 2> /dev/null || true
+			rm -f "$WORKDIR/program.in" "$WORKDIR/stream.in" "$WORKDIR/stream.out"
+		fi
 
 		# Replace testdata by symlinks to reduce disk usage
-		if [ -f "$WORKDIR/testdata.in" ]; then
+		if [ -f "$WORKDIR/testdata.in" ] || [ -p "$WORKDIR/testdata.in" ]; then
 			rm -f "$WORKDIR/testdata.in"
 			ln -s "$TESTIN" "$WORKDIR/testdata.in"
 		fi
-		if [ -f "$WORKDIR/testdata.out" ]; then
+		if [ -f "$WORKDIR/testdata.out" ] || [ -p "$WORKDIR/testdata.out" ]; then
 			rm -f "$WORKDIR/testdata.out"
 			ln -s "$TESTOUT" "$WORKDIR/testdata.out"
 		fi
@@ -98,6 +136,10 @@ shift $((OPTIND-1))
 
 if [ -n "$CPUSET" ]; then
 	CPUSET_OPT="-P $CPUSET"
+	case "$TIMING_PROFILE" in
+		smt) CPUSET_OPT="$CPUSET_OPT --timing-profile=smt" ;;
+		?*)  CPUSET_OPT="$CPUSET_OPT --timing-profile" ;;
+	esac
 	LOGFILE="$DJ_LOGDIR/judge.$(hostname | cut -d . -f 1)-$CPUSET.log"
 else
 	LOGFILE="$DJ_LOGDIR/judge.$(hostname | cut -d . -f 1).log"
@@ -124,6 +166,17 @@ RUNGUARD="$DJ_BINDIR/runguard"
 RUNPIPE="$DJ_BINDIR/runpipe"
 PROGRAM="execdir/program"
 
+# Send runs to a runguard server for this judging if one is running,
+# otherwise start a new privileged runguard for each run. The server
+# already has the user and group set.
+if [ -n "$RUNGUARD_SOCKET" ] && [ -S "$RUNGUARD_SOCKET" ]; then
+	RUNGUARD_CMD="$RUNGUARD --connect=$RUNGUARD_SOCKET"
+	RUNGUARD_USER_OPTS=""
+else
+	RUNGUARD_CMD="$GAINROOT $RUNGUARD"
+	RUNGUARD_USER_OPTS="--user=$RUNUSER --group=$RUNGROUP"
+fi
+
 logmsg $LOG_INFO "starting '$0', PID = $$"
 
 [ $# -ge 4 ] || error "not enough arguments. See script-code for usage."
@@ -151,7 +204,7 @@ if [ -z "$COMPARE_SCRIPT" ]; then
 else
 	export COMBINED_RUN_COMPARE=0
 fi
-[ -x "$WORKDIR/$PROGRAM" ] || error "submission program not found or not executable"
+[ -x "${EXECDIR_BIND:-$WORKDIR/execdir}/program" ] || error "submission program not found or not executable"
 [ -x "$RUN_SCRIPT" ] || error "run script not found or not executable: $RUN_SCRIPT"
 [ -x "$RUNGUARD" ] || error "runguard not found or not executable: $RUNGUARD"
 if [ ! -x "$COMPARE_SCRIPT" ] && [ $COMBINED_RUN_COMPARE -eq 0 ]; then 
@@ -169,8 +222,17 @@ else
 	PREFIX="/$(basename "$PWD")"
 fi
 
-# Make testing/execute dir accessible for RUNUSER:
-chmod a+x "$WORKDIR" "$WORKDIR/execdir"
+# Make testing/execute dir accessible for RUNUSER; a shared compile dir
+# mounted on execdir was already made accessible by the judgedaemon.
+# Concurrent testcases run as other users, which must
+# not be able to read the testdata and output here.
+if [ -n "$TESTCASE_PARALLEL" ]; then
+	chmod go= "$WORKDIR"
+	setfacl -m "u:$RUNUSER:x" "$WORKDIR"
+else
+	chmod a+x "$WORKDIR"
+fi
+chmod a+x "$WORKDIR/execdir"
 
 # Create files which are expected to exist:
 touch system.out                 # Judging system output (info/debug/error)
@@ -180,8 +242,52 @@ touch compare.meta compare.err   # Compare runguard metadata and stderr
 
 logmsg $LOG_INFO "setting up testing (chroot) environment"
 
-# Copy the testdata input
-cp "$TESTIN" "$WORKDIR/testdata.in"
+# Link testdata file $1 from the testcase cache as $2 for the compare
+# script, or let runguard bind mount it read-only when on another
+# filesystem, so that it is never copied.
+COMPARE_BINDS=""
+link_testdata()
+{
+	rm -f "$2"
+	case "$1" in
+	*.zst)
+		if [ -n "$TESTDATA_STREAMABLE" ]; then
+			stream_testdata "$1" "$2" 0644
+		else
+			unpack_testdata "$1" "$2"
+		fi
+		return ;;
+	esac
+	if ! ln -f "$1" "$2" 2>/dev/null ; then
+		logmsg $LOG_DEBUG "cannot link '$1', bind mounting instead"
+		COMPARE_BINDS="$COMPARE_BINDS --bind-ro=$1:$2"
+	fi
+}
+
+# Decompress testdata file $1 into a regular file $2, for readers that
+# may seek in or map it.
+unpack_testdata()
+{
+	rm -f "$2"
+	zstd -dcq -- "$1" > "$2"
+	chmod 0644 "$2"
+}
+
+# Decompress testdata file $1 into a new fifo $2 with mode $3 in the
+# background, or copy it when it is not compressed. The writer blocks
+# until the fifo is opened, and is killed on cleanup when it was not
+# read completely.
+STREAM_PIDS=""
+stream_testdata()
+{
+	rm -f "$2"
+	mkfifo -m "$3" "$2"
+	case "$1" in
+	*.zst) zstd -dcq -- "$1" > "$2" 2> /dev/null & ;;
+	*)     cat -- "$1" > "$2" 2> /dev/null & ;;
+	esac
+	STREAM_PIDS="$STREAM_PIDS $!"
+}
 
 # shellcheck disable=SC2174
 mkdir -p -m 0711 ../bin ../dj-bin ../dev
@@ -196,8 +302,13 @@ fi
 # if required:
 if [ -x "$RUN_JURYPROG" ]; then
 	cp -p "$RUN_JURYPROG" ./runjury
-	cp -pL "$RUNPIPE"     ../dj-bin/runpipe
-	chmod a+rx runjury ../dj-bin/runpipe
+	chmod a+rx runjury
+	if [ -z "$TESTCASE_PARALLEL" ] || [ ! -x ../dj-bin/runpipe ]; then
+		# Rename into place: a concurrent run may be executing it.
+		cp -pL "$RUNPIPE" "../dj-bin/runpipe.$$"
+		chmod a+rx "../dj-bin/runpipe.$$"
+		mv -f "../dj-bin/runpipe.$$" ../dj-bin/runpipe
+	fi
 fi
 
 # If we need to create a writable temp directory, do so
@@ -211,20 +322,67 @@ fi
 # not portable, while a fifo link has the problem that a cat program
 # must be run and killed.
 logmsg $LOG_DEBUG "creating /dev/null character-special device"
-$GAINROOT cp -pR /dev/null ../dev/null
+if [ -z "$TESTCASE_PARALLEL" ] || [ ! -c ../dev/null ]; then
+	$GAINROOT cp -pR /dev/null ../dev/null || [ -c ../dev/null ]
+fi
 
 # Run the solution program (within a restricted environment):
 logmsg $LOG_INFO "running program (USE_CHROOT = ${USE_CHROOT:-0})"
 
+# The run script opens the testdata itself as the judgedaemon user and
+# passes it on as stdin, so it needs no copy in the workdir.
 if [ $COMBINED_RUN_COMPARE -eq 1 ]; then
 	# Combined run and compare scripts already now need the feedback
 	# directory and perhaps access to the test answers.
 	mkdir feedback
 	exitcode=0
-	cp "$TESTOUT" "$WORKDIR/testdata.out"
-	RUNARGS="testdata.in testdata.out program.out compare.meta feedback"
+	# The jury program may read the testdata in any way.
+	RUNIN="$TESTIN"
+	RUNOUT="$TESTOUT"
+	case "$TESTIN" in *.zst)
+		unpack_testdata "$TESTIN" testdata.in
+		RUNIN="$PWD/testdata.in"
+		;;
+	esac
+	case "$TESTOUT" in *.zst)
+		unpack_testdata "$TESTOUT" testdata.out
+		RUNOUT="$PWD/testdata.out"
+		;;
+	esac
+	RUNARGS="$RUNIN $RUNOUT program.out compare.meta feedback"
 else
-	RUNARGS="testdata.in program.out"
+	RUNIN="$TESTIN"
+	case "$TESTIN" in *.zst)
+		stream_testdata "$TESTIN" program.in 0600
+		RUNIN="$PWD/program.in"
+		;;
+	esac
+	RUNARGS="$RUNIN program.out"
+fi
+
+# The streaming compare runs outside the chroot as STREAM_USER, which
+# is neither RUNUSER nor the judgedaemon user, so that it cannot read
+# the testcase cache and the program cannot read the testdata from it.
+# It gets the testdata through fifos and its own feedback directory;
+# its verdict is only used to abort the program early. Its runguard
+# options are collected in the positional parameters, so that none of
+# its arguments is evaluated by a shell.
+set --
+if [ -n "$STREAM_COMPARE" ] && [ $COMBINED_RUN_COMPARE -eq 0 ]; then
+	mkdir -m 0700 feedback-stream
+	stream_testdata "$TESTIN" stream.in 0600
+	stream_testdata "$TESTOUT" stream.out 0600
+	setfacl -m "u:$STREAM_USER:rwx" feedback-stream
+	setfacl -m "u:$STREAM_USER:r" stream.in stream.out
+	if [ -n "$TESTCASE_PARALLEL" ]; then
+		setfacl -m "u:$STREAM_USER:x" "$WORKDIR"
+	fi
+	# shellcheck disable=SC2086
+	for arg in "$PWD/stream.in" "$PWD/stream.out" "$PWD/feedback-stream" $COMPARE_ARGS streaming; do
+		set -- "$@" "--stream-arg=$arg"
+	done
+	set -- "--stream-compare=$COMPARE_SCRIPT" "$@" "--stream-user=$STREAM_USER" \
+		"--stream-limits=$SCRIPTMEMLIMIT,$SCRIPTTIMELIMIT,$SCRIPTFILELIMIT"
 fi
 
 
@@ -232,14 +390,20 @@ fi
 # To suppress false positive of FILELIMIT misspelling of TIMELIMIT:
 # shellcheck disable=SC2153
 runcheck ./run $RUNARGS \
-	$GAINROOT "$RUNGUARD" ${DEBUG:+-v -V "DEBUG=$DEBUG"} ${TMPDIR:+ -V "TMPDIR=$TMPDIR"} $CPUSET_OPT \
-	${USE_CHROOT:+-r "$PWD/.."} \
+	$RUNGUARD_CMD ${DEBUG:+-v -V "DEBUG=$DEBUG"} ${TMPDIR:+ -V "TMPDIR=$TMPDIR"} $CPUSET_OPT \
+	${USE_CHROOT:+-r "$PWD/.."} ${USE_CHROOT:+${CHROOT_MOUNTS:+--chroot-mounts}} \
 	--nproc=$PROCLIMIT \
 	--no-core --streamsize=$FILELIMIT \
-	--user="$RUNUSER" --group="$RUNGROUP" \
+	$RUNGUARD_USER_OPTS ${EXECDIR_BIND:+--bind-ro="$EXECDIR_BIND:execdir"} \
 	--walltime=$TIMELIMIT --cputime=$TIMELIMIT \
 	--memsize=$MEMLIMIT --filesize=$FILELIMIT \
-	--stderr=program.err --outmeta=program.meta -- \
+	${IOMAXLIMIT:+--io-max="$IOMAXLIMIT"} ${RECLAIM_CACHE:+--reclaim-cache} \
+	${TESTOUT_MD5:+--hash-stdout} \
+	"$@" \
+	${KILL_ON_OUTPUT_LIMIT:+--kill-on-output-limit} \
+	${PHASE_TIMES:+--phase-times} ${SYSCALL_PROFILE:+--syscall-profile} \
+	--stderr=program.err --outmeta=program.meta \
+	--outmeta-json=program.meta.json -- \
 	"$PREFIX/$PROGRAM" 2>runguard.err
 
 # Check for still running processes:
@@ -248,14 +412,22 @@ if [ -n "$output" ] ; then
 	error "found processes still running as '$RUNUSER', check manually:\n$output"
 fi
 
+# runpipe aborts interactive runs where both sides block on each other.
+if [ $COMBINED_RUN_COMPARE -eq 1 ] && grep '^idle-detected: ' compare.meta >/dev/null 2>&1 ; then
+	idle_time=$(grep '^idle-detected: ' compare.meta | sed 's/idle-detected: //')
+	echo "Idleness limit exceeded: jury and program blocked on each other for ${idle_time}s." >>system.out
+	cleanexit ${E_TIMELIMIT:-1}
+fi
+
 if [ $COMBINED_RUN_COMPARE -eq 0 ]; then
 	# We first compare the output, so that even if the submission gets a
 	# timelimit exceeded or runtime error verdict later, the jury can
 	# still view the diff with what the submission produced.
 	logmsg $LOG_INFO "comparing output"
 
-	# Copy testdata output, only after program has run
-	cp "$TESTOUT" "$WORKDIR/testdata.out"
+	# Link testdata output, only after program has run
+	link_testdata "$TESTIN" testdata.in
+	link_testdata "$TESTOUT" testdata.out
 
 	logmsg $LOG_DEBUG "starting compare script '$COMPARE_SCRIPT'"
 
@@ -264,11 +436,19 @@ if [ $COMBINED_RUN_COMPARE -eq 0 ]; then
 	mkdir feedback
 	chmod a+w feedback
 
-	runcheck $GAINROOT "$RUNGUARD" ${DEBUG:+-v} $CPUSET_OPT -u "$RUNUSER" -g "$RUNGROUP" \
-		-m $SCRIPTMEMLIMIT -t $SCRIPTTIMELIMIT -c \
-		-f $SCRIPTFILELIMIT -s $SCRIPTFILELIMIT -M compare.meta -- \
-		"$COMPARE_SCRIPT" testdata.in testdata.out feedback/ $COMPARE_ARGS < program.out \
-				  >compare.tmp 2>&1
+	# Output identical to the testcase output is always correct: if
+	# we know the expected hash, skip the compare script then.
+	program_md5=$(grep '^stdout-md5: ' program.meta | sed 's/stdout-md5: //')
+	if [ -n "$TESTOUT_MD5" ] && [ "$program_md5" = "$TESTOUT_MD5" ]; then
+		logmsg $LOG_INFO "output matches testcase output hash, skipping compare"
+		exitcode=42
+	else
+		runcheck $RUNGUARD_CMD ${DEBUG:+-v} $CPUSET_OPT $RUNGUARD_USER_OPTS \
+			-m $SCRIPTMEMLIMIT -t $SCRIPTTIMELIMIT -c \
+			-f $SCRIPTFILELIMIT -s $SCRIPTFILELIMIT -M compare.meta $COMPARE_BINDS -- \
+			"$COMPARE_SCRIPT" testdata.in testdata.out feedback/ $COMPARE_ARGS < program.out \
+					  >compare.tmp 2>&1
+	fi
 fi
 
 # Make sure that all feedback files are owned by the current
@@ -321,13 +501,23 @@ resourceinfo="\
 runtime: ${program_cputime}s cpu, ${program_walltime}s wall
 memory used: ${memory_bytes} bytes"
 
+# With a runpipe relay, show how the time was divided between the
+# jury program (command 1) and the submission (command 2).
+if [ $COMBINED_RUN_COMPARE -eq 1 ] && grep '^cmd1-response-time: ' compare.meta >/dev/null 2>&1 ; then
+	jury_time=$(     grep '^cmd1-response-time: ' compare.meta | sed 's/cmd1-response-time: //')
+	jury_replies=$(  grep '^cmd1-responses: '     compare.meta | sed 's/cmd1-responses: //')
+	program_time=$(  grep '^cmd2-response-time: ' compare.meta | sed 's/cmd2-response-time: //')
+	program_replies=$(grep '^cmd2-responses: '    compare.meta | sed 's/cmd2-responses: //')
+	resourceinfo="$resourceinfo
+interaction: ${jury_time}s jury in ${jury_replies} responses, ${program_time}s program in ${program_replies} responses"
+fi
+
 if [ $COMBINED_RUN_COMPARE -eq 1 ] && grep '^exitcode: 43' compare.meta > /dev/null 2>&1 ; then
 	# For interactive problems with combined run/compare scripts, a
 	# WA may override TLE and RTE.
-	# FIXME: For now, we only write to compare.meta if the
-	# validator exited first, but we should always write the meta
-	# file and include information about which exited first and
-	# when.
+	# runpipe only writes 'exitcode' to compare.meta if the validator
+	# exited first; see 'first-exited' and the per-command 'cmdN-*'
+	# keys for which command exited when.
 	if grep '^time-result: .*timelimit' program.meta >/dev/null 2>&1 ; then
 		echo "Timelimit exceeded, but validator exited first with WA." >>system.out
 	elif [ "$program_exit" != "0" ]; then
@@ -337,6 +527,33 @@ if [ $COMBINED_RUN_COMPARE -eq 1 ] && grep '^exitcode: 43' compare.meta > /dev/n
 	cleanexit ${E_WRONG_ANSWER:-1}
 fi
 
+# A program aborted because its output was already wrong gets a WA,
+# also when it would have hit the timelimit or crashed afterwards.
+if [ $exitcode -eq 43 ] && grep '^early-verdict: wrong-answer' program.meta >/dev/null 2>&1 ; then
+	echo "Wrong answer, program aborted early." >>system.out
+	echo "$resourceinfo" >>system.out
+	cleanexit ${E_WRONG_ANSWER:-1}
+fi
+
+# A program killed for exceeding the output limit gets that verdict,
+# not the runtime error that its abortion looks like.
+if grep '^output-result: output-limit' program.meta >/dev/null 2>&1 ; then
+	echo "Output limit exceeded: $program_stdout > $((FILELIMIT*1024)), program aborted." >>system.out
+	echo "$resourceinfo" >>system.out
+	cleanexit ${E_OUTPUT_LIMIT:-1}
+fi
+
+# A program killed for running out of memory gets a memory limit verdict
+# when enabled, otherwise this is only noted with the run error.
+if grep '^memory-result: memory-limit' program.meta >/dev/null 2>&1 ; then
+	if [ -n "$MEMORY_LIMIT_VERDICT" ]; then
+		echo "Memory limit exceeded, program aborted." >>system.out
+		echo "$resourceinfo" >>system.out
+		cleanexit ${E_MEMORY_LIMIT:-1}
+	fi
+	echo "Memory limit exceeded." >>system.out
+fi
+
 if grep '^time-result: .*timelimit' program.meta >/dev/null 2>&1 ; then
 	echo "Timelimit exceeded." >>system.out
 	echo "$resourceinfo" >>system.out
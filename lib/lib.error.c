@@ -22,6 +22,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/types.h>
 #include <sys/time.h>
 
 /* Define va_copy macro if not available (ANSI C99 only).
@@ -52,27 +53,158 @@ int  loglevel     = LOG_DEBUG;
 FILE *stdlog      = NULL;
 int  syslog_open  = 0;
 
+#ifdef LOGFILE
+static int stdlog_tried = 0;
+#endif
+
+/* Log messages are collected in preallocated buffers and written out
+ * in batches, to keep logging overhead low in timing sensitive code.
+ * Buffers are flushed when full, when a warning or error is logged,
+ * when buffered data is older than LOGFLUSHMSEC, and at exit.
+ *
+ * Access to the buffers is guarded by a try-lock only: when it is
+ * held (by another thread or a signal handler interrupting us), the
+ * message is written out directly instead, so logging never blocks.
+ */
+#define LOGBUFSIZE   16384
+#define LOGLINESIZE  1024
+#define LOGFLUSHMSEC 1000
+
+struct logbuffer {
+	size_t len;
+	char data[LOGBUFSIZE];
+};
+
+static struct logbuffer errbuf, filebuf;
+static volatile int logbusy = 0;
+static int   logexit_registered = 0;
+static pid_t logpid = 0;
+static long  logfirst_msec;
+
+/* Cached timestamp string, updated only when the time has changed. */
+static time_t logtime_sec = -1;
+static long   logtime_msec = -1;
+static size_t logtime_seclen;
+static char   logtime_str[64];
+
+static void writeall(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while ( len>0 ) {
+		n = write(fd, data, len);
+		if ( n<0 ) {
+			if ( errno==EINTR ) continue;
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static void buffer_flush(struct logbuffer *buf, int fd)
+{
+	if ( buf->len>0 && fd>=0 ) writeall(fd, buf->data, buf->len);
+	buf->len = 0;
+}
+
+static void buffer_add(struct logbuffer *buf, int fd, const char *str, size_t len)
+{
+	if ( buf->len+len>LOGBUFSIZE ) buffer_flush(buf, fd);
+	if ( len>LOGBUFSIZE ) {
+		writeall(fd, str, len);
+	} else {
+		memcpy(buf->data+buf->len, str, len);
+		buf->len += len;
+	}
+}
+
+static void flush_buffers(void)
+{
+	buffer_flush(&errbuf, STDERR_FILENO);
+	buffer_flush(&filebuf, stdlog==NULL ? -1 : fileno(stdlog));
+}
+
+/* Write the timestamp for 'tv' into 'str' of size 'size'. */
+static void format_time(char *str, size_t size, const struct timeval *tv)
+{
+	struct tm tm;
+	size_t len;
+
+	len = strftime(str, size, "%b %d %H:%M:%S", localtime_r(&tv->tv_sec, &tm));
+	snprintf(str+len, size-len, ".%03d", (int)(tv->tv_usec/1000));
+}
+
+/* Return the timestamp for 'tv' from cache; call with logbusy held. */
+static const char *cached_time(const struct timeval *tv)
+{
+	struct tm tm;
+	long msec = tv->tv_usec/1000;
+
+	if ( tv->tv_sec!=logtime_sec ) {
+		logtime_seclen = strftime(logtime_str, sizeof(logtime_str),
+		                          "%b %d %H:%M:%S",
+		                          localtime_r(&tv->tv_sec, &tm));
+		logtime_sec = tv->tv_sec;
+		logtime_msec = -1;
+	}
+	if ( msec!=logtime_msec ) {
+		snprintf(logtime_str+logtime_seclen, sizeof(logtime_str)-logtime_seclen,
+		         ".%03d", (int)msec);
+		logtime_msec = msec;
+	}
+
+	return logtime_str;
+}
+
+void logflush(void)
+{
+	if ( __sync_lock_test_and_set(&logbusy, 1) ) return;
+	/* Data buffered before a fork() belongs to the parent. */
+	if ( logpid==getpid() ) flush_buffers();
+	errbuf.len = filebuf.len = 0;
+	__sync_lock_release(&logbusy);
+}
+
+/* Flush pending log messages and abort. */
+static void logabort(void)
+{
+	logflush();
+	abort();
+}
+
 /* Main function that contains logging code */
 void vlogmsg(int msglevel, const char *mesg, va_list ap)
 {
-    struct timeval currtime;
-    char timestring[128];
-	char *buffer;
-	int bufferlen;
+	struct timeval currtime;
+	char timestring[64];
+	char line[LOGLINESIZE];
+	char *buffer, *msg;
+	int len, msglen, saved_errno;
 	va_list aq;
 	char *str, *endptr;
 	int syslog_fac;
+	pid_t pid;
+	long msec;
+	int locked;
 
 	/* This should never happen when called from any of the functions below. */
-	if ( mesg==NULL ) abort();
+	if ( mesg==NULL ) logabort();
+
+	saved_errno = errno;
+
+	locked = !__sync_lock_test_and_set(&logbusy, 1);
 
-	/* Try to open logfile if it is defined */
+	/* Try to open logfile once if it is defined */
 #ifdef LOGFILE
-	if ( stdlog==NULL ) stdlog = fopen(LOGFILE,"a");
+	if ( locked && !stdlog_tried ) {
+		stdlog = fopen(LOGFILE,"a");
+		stdlog_tried = 1;
+	}
 #endif
 
 	/* Try to open syslog if it is defined */
-	if ( ! syslog_open && (str=getenv("DJ_SYSLOG"))!=NULL ) {
+	if ( locked && ! syslog_open && (str=getenv("DJ_SYSLOG"))!=NULL ) {
 		syslog_fac = strtol(str,&endptr,10);
 		if ( *endptr==0 ) {
 			openlog(PROGRAM, LOG_NDELAY | LOG_PID, syslog_fac);
@@ -81,36 +213,84 @@ void vlogmsg(int msglevel, const char *mesg, va_list ap)
 	}
 
 	gettimeofday(&currtime,NULL);
-	strftime(timestring, sizeof(timestring), "%b %d %H:%M:%S", localtime(&currtime.tv_sec));
-	sprintf(timestring+strlen(timestring), ".%03d", (int)(currtime.tv_usec/1000));
+	pid = getpid();
 
-	bufferlen = strlen(timestring)+strlen(progname)+strlen(mesg)+20;
-	buffer = (char *)malloc(bufferlen);
-	if ( buffer==NULL ) abort();
+	if ( locked ) {
+		strcpy(timestring, cached_time(&currtime));
+	} else {
+		format_time(timestring, sizeof(timestring), &currtime);
+	}
 
-	snprintf(buffer, bufferlen, "[%s] %s[%d]: %s\n",
-	         timestring, progname, getpid(), mesg);
+	/* Format the message once, after the prefix, into a stack buffer;
+	 * only allocate for very long messages. */
+	len = snprintf(line, sizeof(line), "[%s] %s[%d]: ",
+	               timestring, progname, (int)pid);
+	if ( len<0 || len>=(int)sizeof(line)-1 ) len = 0;
 
-	if ( msglevel<=verbose ) {
-		va_copy(aq, ap);
-		vfprintf(stderr, buffer, aq);
-		fflush(stderr);
-		va_end(aq);
-	}
-	if ( msglevel<=loglevel && stdlog!=NULL ) {
+	va_copy(aq, ap);
+	msglen = vsnprintf(line+len, sizeof(line)-len-1, mesg, aq);
+	va_end(aq);
+	if ( msglen<0 ) msglen = 0;
+
+	if ( msglen<(int)sizeof(line)-len-1 ) {
+		buffer = line;
+	} else {
 		va_copy(aq, ap);
-		vfprintf(stdlog, buffer, aq);
-		fflush(stdlog);
+		msg = vallocstr(mesg, aq);
 		va_end(aq);
+		msglen = strlen(msg);
+		buffer = (char *)malloc(len+msglen+2);
+		if ( buffer==NULL ) logabort();
+		memcpy(buffer, line, len);
+		memcpy(buffer+len, msg, msglen);
+		free(msg);
 	}
+	msg = buffer+len;
+	buffer[len+msglen] = '\n';
+	buffer[len+msglen+1] = 0;
 
-	free(buffer);
+	if ( locked ) {
+		msec = currtime.tv_sec*1000L + currtime.tv_usec/1000;
+
+		/* Data buffered before a fork() belongs to the parent. */
+		if ( pid!=logpid ) {
+			errbuf.len = filebuf.len = 0;
+			logpid = pid;
+		}
+		if ( !logexit_registered ) {
+			atexit(logflush);
+			logexit_registered = 1;
+		}
+		if ( errbuf.len==0 && filebuf.len==0 ) logfirst_msec = msec;
+
+		if ( msglevel<=verbose ) {
+			buffer_add(&errbuf, STDERR_FILENO, buffer, len+msglen+1);
+		}
+		if ( msglevel<=loglevel && stdlog!=NULL ) {
+			buffer_add(&filebuf, fileno(stdlog), buffer, len+msglen+1);
+		}
+		if ( msglevel<=LOG_WARNING || msec-logfirst_msec>=LOGFLUSHMSEC ) {
+			flush_buffers();
+		}
+	} else {
+		if ( msglevel<=verbose ) {
+			writeall(STDERR_FILENO, buffer, len+msglen+1);
+		}
+		if ( msglevel<=loglevel && stdlog!=NULL ) {
+			writeall(fileno(stdlog), buffer, len+msglen+1);
+		}
+	}
 
 	if ( msglevel<=loglevel && syslog_open ) {
-		buffer = vallocstr(mesg, ap);
-		syslog(msglevel, "%s", buffer);
-		free(buffer);
+		buffer[len+msglen] = 0;
+		syslog(msglevel, "%s", msg);
 	}
+
+	if ( locked ) __sync_lock_release(&logbusy);
+
+	if ( buffer!=line ) free(buffer);
+
+	errno = saved_errno;
 }
 
 /* Argument-list wrapper function around vlogmsg */
@@ -140,7 +320,7 @@ char *errorstring(const char *type, int errnum, const char *mesg)
 	/* Set errtype to given string or default to 'ERROR' */
 	if ( type==NULL ) {
 		errtype = strdup(ERRSTR);
-		if ( errtype==NULL ) abort();
+		if ( errtype==NULL ) logabort();
 	} else {
 		errtype = (char *)type;
 	}
@@ -158,7 +338,7 @@ char *errorstring(const char *type, int errnum, const char *mesg)
 	            + 5;
 
 	buffer = (char *)malloc(sizeof(char) * buffersize);
-	if ( buffer==NULL ) abort();
+	if ( buffer==NULL ) logabort();
 	buffer[0] = '\0';
 
 	strcat(buffer, errtype);
@@ -44,6 +44,16 @@ void vlogmsg(int, const char *, va_list);
  * int loglevel    syslog loglevel of this log-message
  * char *mesg      message, may include printf output format characters '%'
  * ... or va_list  optional arguments for format characters
+ *
+ * Messages are buffered and written out in batches; warnings and errors
+ * flush the buffers immediately, as does exit().
+ */
+
+void logflush(void);
+/* Write out all buffered log messages. Call this before fork() when the
+ * parent may terminate with _exit() or exec() afterwards, and before
+ * blocking indefinitely, since buffers are otherwise only flushed when
+ * a later message is logged.
  */
 
 char *errorstring(const char *, int, const char *);
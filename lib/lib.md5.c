@@ -0,0 +1,152 @@
+/*
+ * Streaming MD5 message digest for C/C++ programs, implemented from
+ * the description in RFC 1321.
+ *
+ * Part of the DOMjudge Programming Contest Jury System and licensed
+ * under the GNU GPL. See README and COPYING for details.
+ */
+
+#include <string.h>
+
+#include "lib.md5.h"
+
+/* Per-round shift amounts and sine derived constants from RFC 1321. */
+static const unsigned char md5_shift[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t md5_const[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/* Process one 64 byte block of input. */
+static void md5_transform(uint32_t state[4], const unsigned char *data)
+{
+	uint32_t a, b, c, d, f, tmp, x[16];
+	int i, g;
+
+	for(i=0; i<16; i++) {
+		x[i] = (uint32_t) data[4*i] | ((uint32_t) data[4*i+1] << 8) |
+		       ((uint32_t) data[4*i+2] << 16) | ((uint32_t) data[4*i+3] << 24);
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	for(i=0; i<64; i++) {
+		if ( i<16 ) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if ( i<32 ) {
+			f = (d & b) | (~d & c);
+			g = (5*i + 1) % 16;
+		} else if ( i<48 ) {
+			f = b ^ c ^ d;
+			g = (3*i + 5) % 16;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7*i) % 16;
+		}
+		tmp = d;
+		d = c;
+		c = b;
+		f += a + md5_const[i] + x[g];
+		b += (f << md5_shift[i]) | (f >> (32 - md5_shift[i]));
+		a = tmp;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+void md5_init(md5_ctx *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->length = 0;
+	ctx->blocklen = 0;
+}
+
+void md5_update(md5_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *ptr = (const unsigned char *) data;
+	size_t n;
+
+	ctx->length += len;
+
+	/* Complete a previously buffered partial block first. */
+	if ( ctx->blocklen>0 ) {
+		n = 64 - ctx->blocklen;
+		if ( n>len ) n = len;
+		memcpy(ctx->block + ctx->blocklen, ptr, n);
+		ctx->blocklen += n;
+		ptr += n;
+		len -= n;
+		if ( ctx->blocklen<64 ) return;
+		md5_transform(ctx->state, ctx->block);
+		ctx->blocklen = 0;
+	}
+
+	for(; len>=64; ptr+=64, len-=64) md5_transform(ctx->state, ptr);
+
+	memcpy(ctx->block, ptr, len);
+	ctx->blocklen = len;
+}
+
+void md5_final(md5_ctx *ctx, unsigned char *digest)
+{
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	/* Pad with a single 1 bit and zeros up to 56 bytes modulo 64,
+	   followed by the message length in bits (little endian). */
+	ctx->block[ctx->blocklen++] = 0x80;
+	if ( ctx->blocklen>56 ) {
+		memset(ctx->block + ctx->blocklen, 0, 64 - ctx->blocklen);
+		md5_transform(ctx->state, ctx->block);
+		ctx->blocklen = 0;
+	}
+	memset(ctx->block + ctx->blocklen, 0, 56 - ctx->blocklen);
+	for(i=0; i<8; i++) ctx->block[56+i] = (unsigned char)(bits >> (8*i));
+	md5_transform(ctx->state, ctx->block);
+
+	for(i=0; i<16; i++) digest[i] = (unsigned char)(ctx->state[i/4] >> (8*(i%4)));
+}
+
+char *md5_hex(const unsigned char *digest, char *hex)
+{
+	static const char hexdigits[] = "0123456789abcdef";
+	int i;
+
+	for(i=0; i<MD5_DIGEST_LENGTH; i++) {
+		hex[2*i]   = hexdigits[digest[i] >> 4];
+		hex[2*i+1] = hexdigits[digest[i] & 0xf];
+	}
+	hex[2*MD5_DIGEST_LENGTH] = 0;
+
+	return hex;
+}
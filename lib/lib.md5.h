@@ -0,0 +1,42 @@
+/*
+ * Streaming MD5 message digest for C/C++ programs.
+ */
+
+#ifndef LIB_MD5_H
+#define LIB_MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MD5_DIGEST_LENGTH 16
+
+typedef struct {
+	uint32_t state[4];
+	uint64_t length;          /* total number of bytes processed */
+	unsigned char block[64];  /* partial input block */
+	size_t blocklen;
+} md5_ctx;
+
+void md5_init(md5_ctx *) __attribute__((nonnull (1)));
+/* Initialize 'ctx' for hashing a new message. */
+
+void md5_update(md5_ctx *, const void *, size_t) __attribute__((nonnull (1)));
+/* Add 'len' bytes of 'data' to the message hashed in 'ctx'. */
+
+void md5_final(md5_ctx *, unsigned char *) __attribute__((nonnull (1, 2)));
+/* Finish hashing and write the MD5_DIGEST_LENGTH byte digest. */
+
+char *md5_hex(const unsigned char *, char *) __attribute__((nonnull (1, 2)));
+/* Write digest as 32 lowercase hexadecimal characters plus NUL, as
+ * used by md5sum and PHP md5_file(), to the second argument, which
+ * it returns. */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIB_MD5_H */
@@ -5,6 +5,9 @@
  * under the GNU GPL. See README and COPYING for details.
  */
 
+/* For close_range() and posix_spawn_file_actions_addclosefrom_np() */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <stdlib.h>
@@ -12,6 +15,8 @@
 #include <string.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <errno.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
@@ -24,6 +29,11 @@
 
 const int def_stdio_fd[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
 
+/* Size of argument vector for execute() that is kept on the stack */
+#define EXEC_STACK_ARGS 32
+
+extern char **environ;
+
 void _alert(const char *libdir, const char *msgtype, const char *description)
 {
 	static char none[1] = "";
@@ -45,16 +55,149 @@ void _alert(const char *libdir, const char *msgtype, const char *description)
 	free(cmd);
 }
 
+/* Create a pipe with both ends close-on-exec. */
+static int pipe_cloexec(int fd[2])
+{
+	if ( pipe(fd)!=0 ) return -1;
+	if ( fcntl(fd[0],F_SETFD,FD_CLOEXEC)!=0 ||
+	     fcntl(fd[1],F_SETFD,FD_CLOEXEC)!=0 ) {
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the file descriptor that should become the i-th standard
+ * file descriptor of the child, or -1 to leave it alone.
+ */
+static int child_stdio_fd(int i, int stdio_fd[3], int pipe_fd[3][2])
+{
+	/* stdin must be connected to the pipe output,
+	   stdout/stderr to the pipe input: */
+	if ( stdio_fd[i]==FDREDIR_PIPE ) return pipe_fd[i][i==0 ? PIPE_OUT : PIPE_IN];
+	if ( stdio_fd[i]>=0 ) return stdio_fd[i];
+	return -1;
+}
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+
+/* Start the command with posix_spawnp(), which avoids copying the
+ * page tables of a large parent and reports exec errors directly. */
+static pid_t spawn_command(const char *cmd, char **argv, int stdio_fd[3],
+                           int pipe_fd[3][2], int err2out)
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int i, fd, res;
+
+	if ( (res = posix_spawn_file_actions_init(&actions))!=0 ) {
+		errno = res;
+		return -1;
+	}
+	for(i=0; i<3 && res==0; i++) {
+		if ( (fd = child_stdio_fd(i,stdio_fd,pipe_fd))>=0 ) {
+			res = posix_spawn_file_actions_adddup2(&actions,fd,def_stdio_fd[i]);
+		}
+	}
+	if ( err2out && res==0 ) {
+		res = posix_spawn_file_actions_adddup2(&actions,STDOUT_FILENO,STDERR_FILENO);
+	}
+	/* Do not leak any other file descriptors into the command. */
+	if ( res==0 ) res = posix_spawn_file_actions_addclosefrom_np(&actions,3);
+
+	if ( res==0 ) res = posix_spawnp(&pid,cmd,&actions,NULL,argv,environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	if ( res!=0 ) {
+		errno = res;
+		return -1;
+	}
+	return pid;
+}
+
+#else /* HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP */
+
+/* Start the command with fork() and execvp(). A close-on-exec pipe
+ * reports the errno of a failed redirection or exec to the parent:
+ * it is closed without data when the exec succeeds. */
+static pid_t spawn_command(const char *cmd, char **argv, int stdio_fd[3],
+                           int pipe_fd[3][2], int err2out)
+{
+	pid_t pid;
+	int err_fd[2];
+	int i, fd, err;
+	ssize_t nread;
+
+	if ( pipe_cloexec(err_fd)!=0 ) return -1;
+
+	switch ( pid = fork() ) {
+	case -1: /* error */
+		err = errno;
+		close(err_fd[0]);
+		close(err_fd[1]);
+		errno = err;
+		return -1;
+
+	case  0: /* child process */
+		/* Connect pipes/fd's to command stdin/stdout/stderr */
+		for(i=0; i<3; i++) {
+			if ( (fd = child_stdio_fd(i,stdio_fd,pipe_fd))>=0 &&
+			     dup2(fd,def_stdio_fd[i])<0 ) goto child_error;
+		}
+		/* Redirect stderr to stdout */
+		if ( err2out && dup2(STDOUT_FILENO,STDERR_FILENO)<0 ) goto child_error;
+
+#ifdef HAVE_CLOSE_RANGE
+		/* Do not leak any other file descriptors into the command. */
+		if ( err_fd[1]>3 ) close_range(3,err_fd[1]-1,0);
+		close_range(err_fd[1]+1,~0U,0);
+#endif
+
+		/* Replace child with command */
+		execvp(cmd,argv);
+
+	  child_error:
+		err = errno;
+		if ( write(err_fd[1],&err,sizeof(err))!=sizeof(err) ) {
+			/* Nothing we can do about it. */
+		}
+		_exit(127);
+
+	default: /* parent process */
+		close(err_fd[1]);
+		do {
+			nread = read(err_fd[0],&err,sizeof(err));
+		} while ( nread<0 && errno==EINTR );
+		close(err_fd[0]);
+
+		if ( nread==sizeof(err) ) {
+			/* Reap the failed child, the command never started. */
+			while ( waitpid(pid,NULL,0)<0 && errno==EINTR );
+			errno = err;
+			return -1;
+		}
+		return pid;
+	}
+}
+
+#endif /* HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP */
+
 int execute(const char *cmd, const char **args, int nargs, int stdio_fd[3], int err2out)
 {
 	pid_t pid, child_pid;
 	int redirect;
 	int status;
 	int pipe_fd[3][2];
+	char *argv_stack[EXEC_STACK_ARGS];
 	char **argv;
-	int i, dir;
+	int i, j, dir, err;
 
-	if ( (argv=(char **) malloc((nargs+2)*sizeof(char **)))==NULL ) return -1;
+	if ( nargs+2<=EXEC_STACK_ARGS ) {
+		argv = argv_stack;
+	} else if ( (argv=(char **) malloc((nargs+2)*sizeof(char **)))==NULL ) {
+		return -1;
+	}
 
 	if ( err2out ) stdio_fd[2] = FDREDIR_NONE;
 
@@ -70,76 +213,62 @@ int execute(const char *cmd, const char **args, int nargs, int stdio_fd[3], int
 	for(i=0; i<nargs; i++) argv[i+1] = (char *) args[i];
 	argv[nargs+1] = NULL;
 
-	/* Open pipes for IO redirection */
+	/* Open pipes for IO redirection; these are close-on-exec, only
+	 * their duplicates as stdin/stdout/stderr are passed on. */
 	for(i=0; i<3; i++) {
-		if ( stdio_fd[i]==FDREDIR_PIPE && pipe(pipe_fd[i])!=0 ) goto ret_error;
-	}
-
-	switch ( child_pid = fork() ) {
-	case -1: /* error */
-		free(argv);
-		return -1;
-
-	case  0: /* child process */
-		/* Connect pipes to command stdin/stdout/stderr and close unneeded fd's */
-		for(i=0; i<3; i++) {
-			if ( stdio_fd[i]==FDREDIR_PIPE ) {
-				/* stdin must be connected to the pipe output,
-				   stdout/stderr to the pipe input: */
-				dir = (i==0 ? PIPE_OUT : PIPE_IN);
-				if ( dup2(pipe_fd[i][dir],def_stdio_fd[i])<0 ) goto ret_error;
-				if ( close(pipe_fd[i][dir])!=0 ) goto ret_error;
-				if ( close(pipe_fd[i][1-dir])!=0 ) goto ret_error;
-			}
-			if ( stdio_fd[i]>=0 ) {
-				if ( dup2(stdio_fd[i],def_stdio_fd[i])<0 ) goto ret_error;
-				if ( close(stdio_fd[i])!=0 ) goto ret_error;
+		if ( stdio_fd[i]==FDREDIR_PIPE && pipe_cloexec(pipe_fd[i])!=0 ) {
+			err = errno;
+			for(j=0; j<i; j++) {
+				if ( stdio_fd[j]==FDREDIR_PIPE ) {
+					close(pipe_fd[j][0]);
+					close(pipe_fd[j][1]);
+				}
 			}
+			errno = err;
+			goto ret_error;
 		}
-		/* Redirect stderr to stdout */
-		if ( err2out && dup2(STDOUT_FILENO,STDERR_FILENO)<0 ) goto ret_error;
-
-		/* Replace child with command */
-		execvp(cmd,argv);
-		abort();
+	}
 
-	default: /* parent process */
+	child_pid = spawn_command(cmd,argv,stdio_fd,pipe_fd,err2out);
 
-		free(argv);
+	if ( argv!=argv_stack ) free(argv);
 
-		/* Set and close file descriptors */
-		for(i=0; i<3; i++) {
-			if ( stdio_fd[i]==FDREDIR_PIPE ) {
-				/* parent process output must connect to the input of
-				   the pipe to child, and vice versa for stdout/stderr: */
-				dir = (i==0 ? PIPE_IN : PIPE_OUT);
+	/* Set and close file descriptors */
+	err = errno;
+	for(i=0; i<3; i++) {
+		if ( stdio_fd[i]==FDREDIR_PIPE ) {
+			/* parent process output must connect to the input of
+			   the pipe to child, and vice versa for stdout/stderr: */
+			dir = (i==0 ? PIPE_IN : PIPE_OUT);
+			if ( child_pid<0 ) {
+				close(pipe_fd[i][dir]);
+			} else {
 				stdio_fd[i] = pipe_fd[i][dir];
-				if ( close(pipe_fd[i][1-dir])!=0 ) return -1;
 			}
+			if ( close(pipe_fd[i][1-dir])!=0 && child_pid>=0 ) return -1;
 		}
+	}
+	errno = err;
+	if ( child_pid<0 ) return -1;
 
-		/* Return if some IO is redirected to be able to read/write to child */
-		if ( redirect ) return child_pid;
+	/* Return if some IO is redirected to be able to read/write to child */
+	if ( redirect ) return child_pid;
 
-		/* Wait for the child command to finish */
-		while ( (pid = wait(&status))!=-1 && pid!=child_pid );
-		if ( pid!=child_pid ) return -1;
+	/* Wait for the child command to finish */
+	while ( (pid = wait(&status))!=-1 && pid!=child_pid );
+	if ( pid!=child_pid ) return -1;
 
-		/* Test whether command has finished abnormally */
-		if ( ! WIFEXITED(status) ) {
-			if ( WIFSIGNALED(status) ) return 128+WTERMSIG(status);
-			if ( WIFSTOPPED (status) ) return 128+WSTOPSIG(status);
-			return -2;
-		}
-		return WEXITSTATUS(status);
+	/* Test whether command has finished abnormally */
+	if ( ! WIFEXITED(status) ) {
+		if ( WIFSIGNALED(status) ) return 128+WTERMSIG(status);
+		if ( WIFSTOPPED (status) ) return 128+WSTOPSIG(status);
+		return -2;
 	}
-
-	/* This should never be reached */
-	return -2;
+	return WEXITSTATUS(status);
 
 	/* Handle resources before returning on error */
   ret_error:
-	free(argv);
+	if ( argv!=argv_stack ) free(argv);
 	return -1;
 }
 
@@ -197,11 +326,14 @@ void daemonize(const char *_pidfile)
 	int fd, maxfd;
 	char str[15];
 
+	logflush();
+
 	switch ( pid = fork() ) {
 	case -1: error(errno, "cannot fork daemon");
 	case  0: break;     /* child process: do nothing here. */
 	default: _exit(0);  /* parent process: exit. */
 	}
+	pid = getpid();
 
 	/* Check and write PID to file */
 	if ( _pidfile!=NULL ) {
@@ -223,9 +355,9 @@ void daemonize(const char *_pidfile)
 	/* Reopen std{in,out,err} file descriptors to /dev/null.
 	   Closing them gives error when the daemon or a child process
 	   tries to read/write to them. */
-	if ( freopen("/dev/null", "r", stdin )!=NULL ||
-	     freopen("/dev/null", "w", stdout)!=NULL ||
-	     freopen("/dev/null", "w", stderr)!=NULL ) {
+	if ( freopen("/dev/null", "r", stdin )==NULL ||
+	     freopen("/dev/null", "w", stdout)==NULL ||
+	     freopen("/dev/null", "w", stderr)==NULL ) {
 		error(errno, "cannot reopen stdio files to /dev/null");
 	}
 
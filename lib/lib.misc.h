@@ -41,8 +41,15 @@ int execute(const char *, const char **, int, int[3], int)
  * int err2out      Set non-zero to redirect command stderr to stdout. When set
  *                    the redirection of stderr by stdio_fd[2] is ignored.
  *
+ * The command does not inherit any file descriptors other than
+ * stdin/stdout/stderr where supported (close_range or posix_spawn
+ * closefrom file action). When available, posix_spawn is used instead
+ * of fork to avoid copying a large parent process.
+ *
  * Returns:
  * On errors from system calls -1 is returned: check errno for extra information.
+ * This includes failure to execute the command, which is reported back
+ * from the child process.
  * On internal errors -2 is returned.
  *
  * When no redirection is done (except for err2out) waits for the command to
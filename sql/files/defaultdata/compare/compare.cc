@@ -1,41 +1,22 @@
 // default_validator from kattis problemtools package
 // licensed under MIT license
 //
-// modified: float comparison
-#include <fstream>
-#include <iostream>
+// modified: float comparison, mmap-based tokenizer, comparison logic
+// moved to the default_validator library, streaming mode
 #include <string>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
-#include <cmath>
 #include <cstdarg>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
 
-const int EXIT_AC = 42;
-const int EXIT_WA = 43;
+#include "default_validator.h"
 
-std::ifstream judgein, judgeans;
 FILE *judgemessage = NULL;
 FILE *diffpos = NULL;
-int judgeans_pos, stdin_pos;
-int judgeans_line, stdin_line;
-
-/* The floating point type we use internally: */
-typedef long double flt;
-
-void wrong_answer(const char *err, ...) {
-	va_list pvar;
-	va_start(pvar, err);
-	fprintf(judgemessage, "Wrong answer on line %d of output (corresponding to line %d in answer file)\n",
-			stdin_line, judgeans_line);
-	vfprintf(judgemessage, err, pvar);
-	fprintf(judgemessage, "\n");
-	if (diffpos) {
-		fprintf(diffpos, "%d %d", judgeans_pos, stdin_pos);
-	}
-	exit(EXIT_WA);
-}
 
 void judge_error(const char *err, ...) {
 	va_list pvar;
@@ -47,18 +28,8 @@ void judge_error(const char *err, ...) {
 	assert(!"Judge Error");
 }
 
-bool isfloat(const char *s, flt &val) {
-	char trash[20];
-	flt v;
-	if (sscanf(s, "%Lf%10s", &v, trash) != 1) return false;
-	val = v;
-	return true;
-}
-
-template <typename Stream>
-void openfile(Stream &stream, const char *file, const char *whoami) {
-	stream.open(file);
-	if (stream.fail()) {
+void openfile(validator_input &in, const char *file, const char *whoami) {
+	if (validator_read_file(file, &in) != 0) {
 		judge_error("%s: failed to open %s\n", whoami, file);
 	}
 }
@@ -72,30 +43,55 @@ FILE *openfeedback(const char *feedbackdir, const char *feedback, const char *wh
 	return res;
 }
 
-/* Test two numbers for equality, accounting for +/-INF, NaN and
- * precision. Float f2 is considered the reference value for relative
- * error.
+/* Read the team output from fd like validator_read_fd, but compare
+ * each block read against the judge answer right away, so that wrong
+ * output is reported while it is still being written.
  */
-int equal(flt f1, flt f2, flt float_abs_tol, flt float_rel_tol)
-{
-	flt absdiff, reldiff;
-	/* Finite values are compared with some tolerance */
-	if ( std::isfinite(f1) && std::isfinite(f2) ) {
-		absdiff = fabsl(f1-f2);
-		reldiff = fabsl((f1-f2)/f2);
-		return !(absdiff > float_abs_tol && reldiff > float_rel_tol);
-	}
-	/* NaN is equal to NaN */
-	if ( std::isnan(f1) && std::isnan(f2) ) return 1;
-	/* Infinite values are equal if their sign matches */
-	if ( std::isinf(f1) && std::isinf(f2) ) {
-		return std::signbit(f1) == std::signbit(f2);
+void read_streaming(int fd, validator_input &teamout, const validator_input &judgeans,
+                    const validator_options &opts, const char *whoami) {
+	size_t alloc = 1 << 16, end;
+	char *buf = (char *)malloc(alloc), *newbuf;
+	ssize_t nread;
+	validator_input prefix;
+	validator_result res;
+
+	if (buf == NULL) judge_error("%s: failed to allocate memory", whoami);
+	teamout.size = 0;
+	teamout.mapped = 0;
+	validator_init_prefix(&res);
+	while (true) {
+		if (teamout.size == alloc) {
+			alloc *= 2;
+			if ((newbuf = (char *)realloc(buf, alloc)) == NULL) {
+				judge_error("%s: failed to allocate memory", whoami);
+			}
+			buf = newbuf;
+		}
+		nread = read(fd, buf + teamout.size, alloc - teamout.size);
+		if (nread < 0 && errno == EINTR) continue;
+		if (nread < 0) judge_error("%s: failed to read stdin: %s\n", whoami, strerror(errno));
+		if (nread == 0) break;
+
+		// Compare up to the last whitespace in the new data.
+		end = teamout.size + nread;
+		teamout.size = end;
+		while (end > teamout.size - nread && buf[end-1] != ' ' &&
+		       (buf[end-1] < '\t' || buf[end-1] > '\r')) --end;
+		if (end == teamout.size - nread) continue;
+		prefix.data = buf;
+		prefix.size = end;
+		prefix.mapped = 0;
+		if (validator_compare_prefix(&judgeans, &prefix, &opts, &res) == VALIDATOR_WRONG_ANSWER) {
+			if (validator_write_feedback(judgemessage, diffpos, &res) != 0) {
+				judge_error("%s: failed to write feedback", whoami);
+			}
+			exit(res.verdict);
+		}
 	}
-	/* Values in different classes are always different. */
-	return 0;
+	teamout.data = buf;
 }
 
-const char *USAGE = "Usage: %s judge_in judge_ans feedback_dir [options] < team_out";
+const char *USAGE = "Usage: %s judge_in judge_ans feedback_dir [options] [streaming] < team_out";
 
 int main(int argc, char **argv) {
 	if(argc < 4) {
@@ -103,99 +99,41 @@ int main(int argc, char **argv) {
 	}
 	judgemessage = openfeedback(argv[3], "judgemessage.txt", argv[0]);
 	diffpos = openfeedback(argv[3], "diffposition.txt", argv[0]);
-	openfile(judgein, argv[1], argv[0]);
-	openfile(judgeans, argv[2], argv[0]);
+	int judgein = open(argv[1], O_RDONLY);
+	if (judgein < 0) {
+		judge_error("%s: failed to open %s\n", argv[0], argv[1]);
+	}
+	close(judgein);
 
-	bool case_sensitive = false;
-	bool space_change_sensitive = false;
-	bool use_floats = false;
-	flt float_abs_tol = -1;
-	flt float_rel_tol = -1;
+	validator_options opts;
+	validator_input judgeans, teamout;
+	validator_result res;
 
+	// With 'streaming', team output is compared while it is read.
+	bool streaming = false;
+	int nopts = 0;
 	for (int a = 4; a < argc; ++a) {
-		if        (!strcmp(argv[a], "case_sensitive")) {
-			case_sensitive = true;
-		} else if (!strcmp(argv[a], "space_change_sensitive")) {
-			space_change_sensitive = true;
-		} else if (!strcmp(argv[a], "float_absolute_tolerance")) {
-			if (a+1 == argc || !isfloat(argv[a+1], float_abs_tol))
-				judge_error(USAGE, argv[0]);
-			++a;
-		} else if (!strcmp(argv[a], "float_relative_tolerance")) {
-			if (a+1 == argc || !isfloat(argv[a+1], float_rel_tol))
-				judge_error(USAGE, argv[0]);
-			++a;
-		} else if (!strcmp(argv[a], "float_tolerance")) {
-			if (a+1 == argc || !isfloat(argv[a+1], float_rel_tol))
-				judge_error(USAGE, argv[0]);
-			float_abs_tol = float_rel_tol;
-			++a;
+		if (!strcmp(argv[a], "streaming")) {
+			streaming = true;
 		} else {
-			judge_error(USAGE, argv[0]);
+			argv[4 + nopts++] = argv[a];
 		}
 	}
-	use_floats = float_abs_tol >= 0 || float_rel_tol >= 0;
-
-	judgeans_pos = stdin_pos;
-	judgeans_line = stdin_line = 1;
 
-	std::string judge, team;
-	while (true) {
-		// Space!  Can't live with it, can't live without it...
-		while (isspace(judgeans.peek())) {
-			char c = (char)judgeans.get();
-			if (space_change_sensitive) {
-				int d = std::cin.get();
-				if (c != d) {
-					wrong_answer("Space change error: got %d expected %d", d, c);
-				}
-				if (d == '\n') ++stdin_line;
-				++stdin_pos;
-			}
-			if (c == '\n') ++judgeans_line;
-			++judgeans_pos;
-		}
-		while (isspace(std::cin.peek())) {
-			char d = (char)std::cin.get();
-			if (space_change_sensitive) {
-				wrong_answer("Space change error: judge out of space, got %d from team", d);
-			}
-			if (d == '\n') ++stdin_line;
-			++stdin_pos;
-		}
-
-		if (!(judgeans >> judge))
-			break;
-
-		if (!(std::cin >> team)) {
-			wrong_answer("User EOF while judge had more output\n(Next judge token: %s)", judge.c_str());
-		}
-
-		flt jval, tval;
-		if (use_floats && isfloat(judge.c_str(), jval)) {
-			if (!isfloat(team.c_str(), tval)) {
-				wrong_answer("Expected float, got: %s", team.c_str());
-			}
-			if (!equal(tval, jval, float_abs_tol, float_rel_tol)) {
-				wrong_answer("Too large difference.\n Judge: %s\n Team: %s\n Difference: %Lg\n (abs tol %Lg rel tol %Lg)",
-							 judge.c_str(), team.c_str(), fabsl(jval-tval), float_abs_tol, float_rel_tol);
-			}
-		} else if (case_sensitive) {
-			if (strcmp(judge.c_str(), team.c_str()) != 0) {
-				wrong_answer("String tokens mismatch\nJudge: \"%s\"\nTeam: \"%s\"", judge.c_str(), team.c_str());
-			}
-		} else {
-			if(strcasecmp(judge.c_str(), team.c_str()) != 0) {
-				wrong_answer("String tokens mismatch\nJudge: \"%s\"\nTeam: \"%s\"", judge.c_str(), team.c_str());
-			}
-		}
-		judgeans_pos += judge.length();
-		stdin_pos += team.length();
+	validator_default_options(&opts);
+	if (validator_parse_options(nopts, argv+4, &opts) != 0) {
+		judge_error(USAGE, argv[0]);
 	}
-
-	if (std::cin >> team) {
-		wrong_answer("Trailing output:\n%s", team.c_str());
+	openfile(judgeans, argv[2], argv[0]);
+	if (streaming) {
+		read_streaming(STDIN_FILENO, teamout, judgeans, opts, argv[0]);
+	} else if (validator_read_fd(STDIN_FILENO, &teamout) != 0) {
+		judge_error("%s: failed to read stdin: %s\n", argv[0], strerror(errno));
 	}
 
-	exit(EXIT_AC);
+	validator_compare(&judgeans, &teamout, &opts, &res);
+	if (validator_write_feedback(judgemessage, diffpos, &res) != 0) {
+		judge_error("%s: failed to write feedback", argv[0]);
+	}
+	exit(res.verdict);
 }
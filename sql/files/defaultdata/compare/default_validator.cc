@@ -0,0 +1,824 @@
+// default_validator from kattis problemtools package
+// licensed under MIT license
+//
+// modified: float comparison, mmap-based tokenizer, library interface
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cstdarg>
+#include <cctype>
+#include <cfloat>
+#include <stdint.h>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "default_validator.h"
+
+/* The floating point type we use internally: */
+typedef long double flt;
+
+/* Read position in one of the inputs while comparing. */
+struct cursor {
+	const char *data;
+	size_t size;
+	size_t pos;
+};
+
+/* Length of a token as a C string would see it, i.e. up to an
+ * embedded NUL character. This retains the strcmp() semantics of the
+ * string comparison the validator always used.
+ */
+static inline size_t cstrlen(const char *tok, size_t len) {
+	const char *nul = (const char *)memchr(tok, '\0', len);
+	return nul ? (size_t)(nul - tok) : len;
+}
+
+static bool isfloat(const char *s, flt &val) {
+	char trash[20];
+	flt v;
+	if (sscanf(s, "%Lf%10s", &v, trash) != 1) return false;
+	val = v;
+	return true;
+}
+
+#if LDBL_MANT_DIG >= 64
+/* Exact powers of ten: 5^27 < 2^64, so these fit in the mantissa. */
+static const int MAX_EXACT_POW10 = 27;
+static const flt exact_pow10[MAX_EXACT_POW10+1] = {
+	1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+	1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+	1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+#endif
+
+/* Parse token [s, s+len) as float, with the same result as isfloat()
+ * on a NUL-terminated copy of it. Plain decimal numbers with at most
+ * 19 significant digits and a small decimal exponent are converted
+ * directly: both the mantissa and the power of ten are exact as long
+ * double, so a single multiplication or division yields the correctly
+ * rounded value, just like strtold(). Anything else (hex floats,
+ * inf/nan, long mantissas, malformed input) is handed to isfloat().
+ */
+static bool parsefloat(const char *s, size_t len, flt &val, std::string &buf) {
+	const char *p = s, *end = s + cstrlen(s, len);
+	bool neg = false, truncated = false;
+	uint64_t m = 0;
+	int ndigits = 0, nsig = 0, exp10 = 0;
+
+	if (p < end && (*p == '+' || *p == '-')) neg = (*p++ == '-');
+	for (; p < end && isdigit((unsigned char)*p); ++p, ++ndigits) {
+		if (m == 0 && *p == '0') continue;
+		if (nsig < 19) {
+			m = m*10 + (*p - '0');
+			++nsig;
+		} else {
+			++exp10;
+			if (*p != '0') truncated = true;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (++p; p < end && isdigit((unsigned char)*p); ++p, ++ndigits) {
+			if (m == 0 && *p == '0') {
+				--exp10;
+			} else if (nsig < 19) {
+				m = m*10 + (*p - '0');
+				++nsig;
+				--exp10;
+			} else if (*p != '0') {
+				truncated = true;
+			}
+		}
+	}
+	if (ndigits == 0) goto slow;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		bool eneg = false;
+		int e = 0;
+		++p;
+		if (p < end && (*p == '+' || *p == '-')) eneg = (*p++ == '-');
+		if (p == end || !isdigit((unsigned char)*p)) goto slow;
+		for (; p < end && isdigit((unsigned char)*p); ++p) {
+			if (e < 100000) e = e*10 + (*p - '0');
+		}
+		exp10 += eneg ? -e : e;
+	}
+	if (p != end || truncated) goto slow;
+
+	if (m == 0) {
+		val = neg ? -0.0L : 0.0L;
+		return true;
+	}
+#if LDBL_MANT_DIG >= 64
+	if (exp10 >= 0 && exp10 <= MAX_EXACT_POW10) {
+		val = (flt)m * exact_pow10[exp10];
+		if (neg) val = -val;
+		return true;
+	}
+	if (exp10 < 0 && exp10 >= -MAX_EXACT_POW10) {
+		val = (flt)m / exact_pow10[-exp10];
+		if (neg) val = -val;
+		return true;
+	}
+#endif
+
+  slow:
+	buf.assign(s, len);
+	return isfloat(buf.c_str(), val);
+}
+
+/* Whitespace as classified by isspace() in the C locale, which is
+ * what operator>> on the original streams used as token separator.
+ */
+static inline bool isspacechar(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int peekchar(const cursor &in) {
+	return in.pos < in.size ? (unsigned char)in.data[in.pos] : EOF;
+}
+
+/* Skip whitespace and return the next token [tok, tok+len) in 'in';
+ * returns false at end of input.
+ */
+static bool readtoken(cursor &in, const char *&tok, size_t &len) {
+	while (in.pos < in.size && isspacechar(in.data[in.pos])) ++in.pos;
+	if (in.pos == in.size) return false;
+	tok = in.data + in.pos;
+	while (in.pos < in.size && !isspacechar(in.data[in.pos])) ++in.pos;
+	len = in.data + in.pos - tok;
+	return true;
+}
+
+/* Matching kernels: return the length of the common prefix of a and
+ * b (at most n bytes), ignoring ASCII case if 'fold' is set, and add
+ * the number of newlines in that prefix to 'newlines'. Since folding
+ * only maps 'A'-'Z' to 'a'-'z', a byte-equal prefix tokenizes the same
+ * on both sides and all its tokens compare equal in every mode.
+ */
+static size_t match_scalar(const char *a, const char *b, size_t n, bool fold, int &newlines) {
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		unsigned char ca = a[i], cb = b[i];
+		if (fold) {
+			if (ca >= 'A' && ca <= 'Z') ca |= 0x20;
+			if (cb >= 'A' && cb <= 'Z') cb |= 0x20;
+		}
+		if (ca != cb) break;
+		if (ca == '\n') ++newlines;
+	}
+	return i;
+}
+
+#if defined(__SSE2__)
+static inline __m128i fold_sse2(__m128i v) {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)),
+	                              _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static size_t match_sse2(const char *a, const char *b, size_t n, bool fold, int &newlines) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if (fold) {
+			va = fold_sse2(va);
+			vb = fold_sse2(vb);
+		}
+		unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		unsigned lines = _mm_movemask_epi8(_mm_cmpeq_epi8(va, nl));
+		if (eq != 0xffff) {
+			unsigned len = __builtin_ctz(~eq);
+			newlines += __builtin_popcount(lines & ((1u << len) - 1));
+			return i + len;
+		}
+		newlines += __builtin_popcount(lines);
+	}
+	return i + match_scalar(a + i, b + i, n - i, fold, newlines);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fold_avx2(__m256i v) {
+	__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A'-1)),
+	                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), v));
+	return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static size_t match_avx2(const char *a, const char *b, size_t n, bool fold, int &newlines) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i;
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		if (fold) {
+			va = fold_avx2(va);
+			vb = fold_avx2(vb);
+		}
+		unsigned eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		unsigned lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, nl));
+		if (eq != 0xffffffffu) {
+			unsigned len = __builtin_ctz(~eq);
+			newlines += __builtin_popcount(lines & ((1u << len) - 1));
+			return i + len;
+		}
+		newlines += __builtin_popcount(lines);
+	}
+	return i + match_sse2(a + i, b + i, n - i, fold, newlines);
+}
+#endif
+
+#if defined(__aarch64__)
+static inline uint8x16_t fold_neon(uint8x16_t v) {
+	uint8x16_t upper = vcleq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8('Z'-'A'));
+	return vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20)));
+}
+
+static size_t match_neon(const char *a, const char *b, size_t n, bool fold, int &newlines) {
+	const uint8x16_t nl = vdupq_n_u8('\n'), one = vdupq_n_u8(1);
+	size_t i;
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t va = vld1q_u8((const uint8_t *)(a + i));
+		uint8x16_t vb = vld1q_u8((const uint8_t *)(b + i));
+		if (fold) {
+			va = fold_neon(va);
+			vb = fold_neon(vb);
+		}
+		if (vminvq_u8(vceqq_u8(va, vb)) != 0xff) break;
+		newlines += vaddvq_u8(vandq_u8(vceqq_u8(va, nl), one));
+	}
+	return i + match_scalar(a + i, b + i, n - i, fold, newlines);
+}
+#endif
+
+typedef size_t (*match_func)(const char *, const char *, size_t, bool, int &);
+
+static match_func select_match() {
+#if defined(__SSE2__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return match_avx2;
+	return match_sse2;
+#elif defined(__aarch64__)
+	return match_neon;
+#else
+	return match_scalar;
+#endif
+}
+
+static const match_func match_prefix = select_match();
+
+static bool tokens_equal(const char *a, size_t alen, const char *b, size_t blen, bool case_sensitive) {
+	alen = cstrlen(a, alen);
+	blen = cstrlen(b, blen);
+	if (alen != blen) return false;
+	if (case_sensitive) return memcmp(a, b, alen) == 0;
+	int newlines = 0;
+	return match_prefix(a, b, alen, true, newlines) == alen;
+}
+
+/* Test two numbers for equality, accounting for +/-INF, NaN and
+ * precision. Float f2 is considered the reference value for relative
+ * error.
+ */
+static int equal(flt f1, flt f2, flt float_abs_tol, flt float_rel_tol)
+{
+	flt absdiff, reldiff;
+	/* Finite values are compared with some tolerance */
+	if ( std::isfinite(f1) && std::isfinite(f2) ) {
+		absdiff = fabsl(f1-f2);
+		reldiff = fabsl((f1-f2)/f2);
+		return !(absdiff > float_abs_tol && reldiff > float_rel_tol);
+	}
+	/* NaN is equal to NaN */
+	if ( std::isnan(f1) && std::isnan(f2) ) return 1;
+	/* Infinite values are equal if their sign matches */
+	if ( std::isinf(f1) && std::isinf(f2) ) {
+		return std::signbit(f1) == std::signbit(f2);
+	}
+	/* Values in different classes are always different. */
+	return 0;
+}
+
+
+/* Record a wrong answer at the current position in res. The message
+ * is formatted twice, to determine its length and to fill it in.
+ */
+static int wrong_answer(validator_result *res, const char *err, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int wrong_answer(validator_result *res, const char *err, ...) {
+	va_list pvar;
+	char header[128];
+	int hlen, len;
+
+	hlen = snprintf(header, sizeof(header),
+	                "Wrong answer on line %d of output (corresponding to line %d in answer file)\n",
+	                res->stdin_line, res->judgeans_line);
+	va_start(pvar, err);
+	len = vsnprintf(NULL, 0, err, pvar);
+	va_end(pvar);
+
+	res->verdict = VALIDATOR_WRONG_ANSWER;
+	res->message = (char *)malloc(hlen + len + 2);
+	if (res->message != NULL) {
+		memcpy(res->message, header, hlen);
+		va_start(pvar, err);
+		vsnprintf(res->message + hlen, len + 1, err, pvar);
+		va_end(pvar);
+		strcpy(res->message + hlen + len, "\n");
+	}
+	return res->verdict;
+}
+
+void validator_default_options(validator_options *opts) {
+	opts->case_sensitive = 0;
+	opts->space_change_sensitive = 0;
+	opts->float_abs_tol = -1;
+	opts->float_rel_tol = -1;
+	opts->max_threads = 0;
+}
+
+int validator_parse_options(int nargs, const char *const *args, validator_options *opts) {
+	for (int a = 0; a < nargs; ++a) {
+		if        (!strcmp(args[a], "case_sensitive")) {
+			opts->case_sensitive = 1;
+		} else if (!strcmp(args[a], "space_change_sensitive")) {
+			opts->space_change_sensitive = 1;
+		} else if (!strcmp(args[a], "float_absolute_tolerance")) {
+			if (a+1 == nargs || !isfloat(args[a+1], opts->float_abs_tol))
+				return -1;
+			++a;
+		} else if (!strcmp(args[a], "float_relative_tolerance")) {
+			if (a+1 == nargs || !isfloat(args[a+1], opts->float_rel_tol))
+				return -1;
+			++a;
+		} else if (!strcmp(args[a], "float_tolerance")) {
+			if (a+1 == nargs || !isfloat(args[a+1], opts->float_rel_tol))
+				return -1;
+			opts->float_abs_tol = opts->float_rel_tol;
+			++a;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int validator_read_fd(int fd, validator_input *in) {
+	struct stat st;
+	in->data = NULL;
+	in->size = 0;
+	in->mapped = 0;
+	if (fstat(fd, &st) != 0) return -1;
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			in->data = (const char *)p;
+			in->size = st.st_size;
+			in->mapped = 1;
+			return 0;
+		}
+	}
+	/* Fall back to reading everything into a growing buffer. */
+	size_t alloc = 1 << 16;
+	char *buf = (char *)malloc(alloc), *newbuf;
+	ssize_t nread;
+	while (buf != NULL) {
+		if (in->size == alloc) {
+			alloc *= 2;
+			if ((newbuf = (char *)realloc(buf, alloc)) == NULL) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = newbuf;
+		}
+		nread = read(fd, buf + in->size, alloc - in->size);
+		if (nread < 0 && errno == EINTR) continue;
+		if (nread < 0) {
+			int saved_errno = errno;
+			free(buf);
+			errno = saved_errno;
+			return -1;
+		}
+		if (nread == 0) break;
+		in->size += nread;
+	}
+	if (buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	in->data = buf;
+	return 0;
+}
+
+int validator_read_file(const char *path, validator_input *in) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return -1;
+	int ret = validator_read_fd(fd, in);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+void validator_free_input(validator_input *in) {
+	if (in->data == NULL) return;
+	if (in->mapped) {
+		munmap((void *)in->data, in->size);
+	} else {
+		free((void *)in->data);
+	}
+	in->data = NULL;
+	in->size = 0;
+}
+
+/* Parallel comparison of large outputs (without space change
+ * sensitivity, where only the token sequences matter). Both inputs
+ * are cut into chunks at whitespace. A first pass counts tokens and
+ * newlines per chunk; a second pass compares the tokens of each team
+ * chunk against the judge tokens with the same indices. The earliest
+ * mismatching token pair over all chunks is the one that the
+ * sequential loop would stop at, so we resume that loop right before
+ * it, with positions and line numbers reconstructed from the counts.
+ */
+static const size_t PARALLEL_MIN_CHUNK = 4 << 20;
+static const int PARALLEL_MAX_THREADS = 64;
+
+struct chunk {
+	size_t begin, end;
+	size_t tokens, newlines;
+	size_t first_token;         // number of tokens before this chunk
+	size_t first_newline;       // number of newlines before this chunk
+};
+
+struct parallel_job {
+	const validator_input *judgeans, *teamout;
+	const validator_options *opts;
+	chunk *judgechunks, *teamchunks;
+	int nchunks, index;
+	size_t judgetokens;
+	size_t mismatch;            // first mismatching token index, or -1
+};
+
+static void split_chunks(const validator_input *in, chunk *chunks, int nchunks) {
+	size_t pos = 0;
+	for (int i = 0; i < nchunks; ++i) {
+		chunks[i].begin = pos;
+		pos = i+1 == nchunks ? in->size : std::max(pos, in->size / nchunks * (i+1));
+		while (pos < in->size && !isspacechar(in->data[pos])) ++pos;
+		chunks[i].end = pos;
+	}
+}
+
+static void count_chunk(const validator_input *in, chunk *c) {
+	bool intoken = false;
+	c->tokens = c->newlines = 0;
+	for (size_t i = c->begin; i < c->end; ++i) {
+		char ch = in->data[i];
+		if (isspacechar(ch)) {
+			intoken = false;
+			if (ch == '\n') ++c->newlines;
+		} else if (!intoken) {
+			intoken = true;
+			++c->tokens;
+		}
+	}
+}
+
+/* Position a cursor right after token number 'ntokens' (counting from
+ * zero tokens at offset 0), and return the number of newlines before
+ * that position.
+ */
+static size_t seek_token(const validator_input *in, const chunk *chunks, int nchunks,
+                         size_t ntokens, cursor &cur) {
+	int i = 0;
+	while (i+1 < nchunks && chunks[i+1].first_token < ntokens) ++i;
+	size_t left = ntokens - chunks[i].first_token;
+	size_t newlines = chunks[i].first_newline;
+	const char *tok;
+	size_t len;
+
+	cur.data = in->data;
+	cur.size = in->size;
+	cur.pos = chunks[i].begin;
+	while (left-- > 0) {
+		size_t start = cur.pos;
+		readtoken(cur, tok, len);
+		for (size_t j = start; j < (size_t)(tok - in->data); ++j) {
+			if (in->data[j] == '\n') ++newlines;
+		}
+	}
+	return newlines;
+}
+
+static bool pair_equal(const char *jtok, size_t jlen, const char *ttok, size_t tlen,
+                       const validator_options *opts, std::string &buf) {
+	bool use_floats = opts->float_abs_tol >= 0 || opts->float_rel_tol >= 0;
+	flt jval, tval;
+	if (use_floats && parsefloat(jtok, jlen, jval, buf)) {
+		return parsefloat(ttok, tlen, tval, buf) &&
+		       equal(tval, jval, opts->float_abs_tol, opts->float_rel_tol);
+	}
+	return tokens_equal(jtok, jlen, ttok, tlen, opts->case_sensitive);
+}
+
+static void *count_thread(void *arg) {
+	parallel_job *job = (parallel_job *)arg;
+	count_chunk(job->judgeans, &job->judgechunks[job->index]);
+	count_chunk(job->teamout,  &job->teamchunks[job->index]);
+	return NULL;
+}
+
+static void *compare_thread(void *arg) {
+	parallel_job *job = (parallel_job *)arg;
+	const chunk *tc = &job->teamchunks[job->index];
+	cursor judgeans, teamout = { job->teamout->data, tc->end, tc->begin };
+	std::string buf;
+	const char *jtok, *ttok;
+	size_t jlen, tlen;
+
+	job->mismatch = (size_t)-1;
+	if (tc->tokens == 0 || tc->first_token >= job->judgetokens) return NULL;
+	seek_token(job->judgeans, job->judgechunks, job->nchunks, tc->first_token, judgeans);
+	for (size_t t = tc->first_token; t < tc->first_token + tc->tokens; ++t) {
+		if (!readtoken(judgeans, jtok, jlen)) break;
+		readtoken(teamout, ttok, tlen);
+		if (!pair_equal(jtok, jlen, ttok, tlen, job->opts, buf)) {
+			job->mismatch = t;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Run func on all jobs in parallel, returns false if threads could
+ * not be created (the jobs that did run are waited for).
+ */
+static bool run_threads(void *(*func)(void *), parallel_job *jobs, int njobs) {
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	int started;
+	for (started = 0; started < njobs; ++started) {
+		if (pthread_create(&threads[started], NULL, func, &jobs[started]) != 0) break;
+	}
+	for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+	return started == njobs;
+}
+
+static int parallel_threads(const validator_input *judgeans, const validator_input *teamout,
+                            const validator_options *opts) {
+	int ncpu = opts->max_threads;
+	if (ncpu <= 0) {
+		cpu_set_t cpus;
+		ncpu = 1;
+		if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ncpu = CPU_COUNT(&cpus);
+	}
+	size_t minsize = std::min(judgeans->size, teamout->size);
+	int n = std::min((size_t)std::min(ncpu, PARALLEL_MAX_THREADS), minsize / PARALLEL_MIN_CHUNK);
+	return n < 2 || opts->space_change_sensitive ? 1 : n;
+}
+
+/* Find the position to resume the sequential comparison at: right
+ * after the last token before the first difference. Returns false if
+ * the parallel pass could not be run.
+ */
+static bool parallel_resume(const validator_input *judgeinput, const validator_input *teaminput,
+                            const validator_options *opts, int nthreads,
+                            cursor &judgeans, cursor &teamout, validator_result *res) {
+	chunk judgechunks[PARALLEL_MAX_THREADS], teamchunks[PARALLEL_MAX_THREADS];
+	parallel_job jobs[PARALLEL_MAX_THREADS];
+
+	split_chunks(judgeinput, judgechunks, nthreads);
+	split_chunks(teaminput, teamchunks, nthreads);
+	for (int i = 0; i < nthreads; ++i) {
+		jobs[i].judgeans = judgeinput;
+		jobs[i].teamout = teaminput;
+		jobs[i].opts = opts;
+		jobs[i].judgechunks = judgechunks;
+		jobs[i].teamchunks = teamchunks;
+		jobs[i].nchunks = nthreads;
+		jobs[i].index = i;
+	}
+	if (!run_threads(count_thread, jobs, nthreads)) return false;
+
+	size_t judgetokens = 0, teamtokens = 0, judgenl = 0, teamnl = 0;
+	for (int i = 0; i < nthreads; ++i) {
+		judgechunks[i].first_token = judgetokens;
+		judgechunks[i].first_newline = judgenl;
+		judgetokens += judgechunks[i].tokens;
+		judgenl += judgechunks[i].newlines;
+		teamchunks[i].first_token = teamtokens;
+		teamchunks[i].first_newline = teamnl;
+		teamtokens += teamchunks[i].tokens;
+		teamnl += teamchunks[i].newlines;
+	}
+	for (int i = 0; i < nthreads; ++i) jobs[i].judgetokens = judgetokens;
+	if (!run_threads(compare_thread, jobs, nthreads)) return false;
+
+	size_t resume = std::min(judgetokens, teamtokens);
+	for (int i = 0; i < nthreads; ++i) {
+		if (jobs[i].mismatch != (size_t)-1) {
+			resume = jobs[i].mismatch;
+			break;
+		}
+	}
+	res->judgeans_line = 1 + seek_token(judgeinput, judgechunks, nthreads, resume, judgeans);
+	res->stdin_line = 1 + seek_token(teaminput, teamchunks, nthreads, resume, teamout);
+	res->judgeans_pos = judgeans.pos;
+	res->stdin_pos = teamout.pos;
+	return true;
+}
+
+/* The sequential comparison, starting at the positions and lines in
+ * res. With 'partial' set, teaminput is only a prefix of the team
+ * output ending in whitespace: where the comparison would need more
+ * team output, the positions of the last complete token pair are kept
+ * in res and VALIDATOR_UNDECIDED is returned.
+ */
+static int compare_sequential(const validator_input *judgeinput, const validator_input *teaminput,
+                              const validator_options *opts, validator_result *res, bool partial) {
+	cursor judgeans = { judgeinput->data, judgeinput->size, (size_t)res->judgeans_pos };
+	cursor teamout  = { teaminput->data,  teaminput->size,  (size_t)res->stdin_pos };
+	bool case_sensitive = opts->case_sensitive;
+	bool space_change_sensitive = opts->space_change_sensitive;
+	flt float_abs_tol = opts->float_abs_tol;
+	flt float_rel_tol = opts->float_rel_tol;
+	bool use_floats = float_abs_tol >= 0 || float_rel_tol >= 0;
+
+	// Aliases to keep the comparison loop readable.
+	int &judgeans_pos = res->judgeans_pos, &stdin_pos = res->stdin_pos;
+	int &judgeans_line = res->judgeans_line, &stdin_line = res->stdin_line;
+
+	// Where to resume a partial comparison: before the whitespace
+	// following the last matching tokens.
+	validator_result resume = *res;
+
+	// Tokens point into the input buffers; these strings only hold
+	// NUL-terminated copies for float parsing and error messages.
+	std::string judge, team;
+	const char *jtok, *ttok;
+	size_t jlen, tlen;
+	while (true) {
+		if (partial) resume = *res;
+		// Space!  Can't live with it, can't live without it...
+		while (judgeans.pos < judgeans.size && isspacechar(judgeans.data[judgeans.pos])) {
+			char c = judgeans.data[judgeans.pos++];
+			if (space_change_sensitive) {
+				int d = peekchar(teamout);
+				if (d == EOF && partial) {
+					*res = resume;
+					return VALIDATOR_UNDECIDED;
+				}
+				if (d != EOF) ++teamout.pos;
+				if (c != d) {
+					return wrong_answer(res, "Space change error: got %d expected %d", d, c);
+				}
+				if (d == '\n') ++stdin_line;
+				++stdin_pos;
+			}
+			if (c == '\n') ++judgeans_line;
+			++judgeans_pos;
+		}
+		while (teamout.pos < teamout.size && isspacechar(teamout.data[teamout.pos])) {
+			char d = teamout.data[teamout.pos++];
+			if (space_change_sensitive) {
+				return wrong_answer(res, "Space change error: judge out of space, got %d from team", d);
+			}
+			if (d == '\n') ++stdin_line;
+			++stdin_pos;
+		}
+
+		// Skip ahead over the part where both outputs are identical
+		// up to (folded) case. Back up to the last whitespace so we
+		// only skip complete tokens, and restart the loop at that
+		// point so whitespace is handled as before.
+		int newlines = 0;
+		size_t len = match_prefix(judgeans.data + judgeans.pos, teamout.data + teamout.pos,
+		                          std::min(judgeans.size - judgeans.pos, teamout.size - teamout.pos),
+		                          !case_sensitive, newlines);
+		while (len > 0 && !isspacechar(judgeans.data[judgeans.pos + len - 1])) --len;
+		if (len > 0) {
+			judgeans.pos += len;
+			teamout.pos += len;
+			judgeans_pos += len;
+			stdin_pos += len;
+			judgeans_line += newlines;
+			stdin_line += newlines;
+			continue;
+		}
+
+		if (!readtoken(judgeans, jtok, jlen))
+			break;
+
+		if (!readtoken(teamout, ttok, tlen)) {
+			if (partial) {
+				*res = resume;
+				return VALIDATOR_UNDECIDED;
+			}
+			judge.assign(jtok, jlen);
+			return wrong_answer(res, "User EOF while judge had more output\n(Next judge token: %s)", judge.c_str());
+		}
+
+		flt jval, tval;
+		if (use_floats && parsefloat(jtok, jlen, jval, judge)) {
+			if (!parsefloat(ttok, tlen, tval, team)) {
+				team.assign(ttok, tlen);
+				return wrong_answer(res, "Expected float, got: %s", team.c_str());
+			}
+			if (!equal(tval, jval, float_abs_tol, float_rel_tol)) {
+				judge.assign(jtok, jlen);
+				team.assign(ttok, tlen);
+				return wrong_answer(res, "Too large difference.\n Judge: %s\n Team: %s\n Difference: %Lg\n (abs tol %Lg rel tol %Lg)",
+				                    judge.c_str(), team.c_str(), fabsl(jval-tval), float_abs_tol, float_rel_tol);
+			}
+		} else if (!tokens_equal(jtok, jlen, ttok, tlen, case_sensitive)) {
+			judge.assign(jtok, jlen);
+			team.assign(ttok, tlen);
+			return wrong_answer(res, "String tokens mismatch\nJudge: \"%s\"\nTeam: \"%s\"", judge.c_str(), team.c_str());
+		}
+		judgeans_pos += jlen;
+		stdin_pos += tlen;
+	}
+
+	if (readtoken(teamout, ttok, tlen)) {
+		team.assign(ttok, tlen);
+		return wrong_answer(res, "Trailing output:\n%s", team.c_str());
+	}
+
+	if (partial) {
+		*res = resume;
+		return VALIDATOR_UNDECIDED;
+	}
+	return res->verdict;
+}
+
+static void init_result(validator_result *res) {
+	res->verdict = VALIDATOR_ACCEPTED;
+	res->message = NULL;
+	res->judgeans_pos = res->stdin_pos = 0;
+	res->judgeans_line = res->stdin_line = 1;
+}
+
+int validator_compare(const validator_input *judgeinput, const validator_input *teaminput,
+                      const validator_options *opts, validator_result *res) {
+	init_result(res);
+
+	int nthreads = parallel_threads(judgeinput, teaminput, opts);
+	if (nthreads > 1) {
+		cursor judgeans = { judgeinput->data, judgeinput->size, 0 };
+		cursor teamout  = { teaminput->data,  teaminput->size,  0 };
+		if (!parallel_resume(judgeinput, teaminput, opts, nthreads, judgeans, teamout, res)) {
+			// Fall back to comparing everything sequentially.
+			init_result(res);
+		}
+	}
+
+	return compare_sequential(judgeinput, teaminput, opts, res, false);
+}
+
+void validator_init_prefix(validator_result *res) {
+	init_result(res);
+}
+
+int validator_compare_prefix(const validator_input *judgeans, const validator_input *teamprefix,
+                             const validator_options *opts, validator_result *res) {
+	// The last token could still continue otherwise.
+	if (teamprefix->size <= (size_t)res->stdin_pos ||
+	    !isspacechar(teamprefix->data[teamprefix->size-1])) {
+		return VALIDATOR_UNDECIDED;
+	}
+
+	return compare_sequential(judgeans, teamprefix, opts, res, true);
+}
+
+int validator_write_feedback(FILE *judgemessage, FILE *diffpos, const validator_result *res) {
+	if (res->verdict != VALIDATOR_WRONG_ANSWER) return 0;
+	if (judgemessage && res->message) {
+		if (fputs(res->message, judgemessage) == EOF) return -1;
+	}
+	if (diffpos) {
+		if (fprintf(diffpos, "%d %d", res->judgeans_pos, res->stdin_pos) < 0) return -1;
+	}
+	return 0;
+}
+
+void validator_free_result(validator_result *res) {
+	free(res->message);
+	res->message = NULL;
+}
@@ -0,0 +1,120 @@
+/* Default validator library: the comparison logic of the default
+ * compare script, usable in-process. Derived from default_validator
+ * of the kattis problemtools package, licensed under MIT license.
+ *
+ * The interface is plain C, so it can be linked into C programs such
+ * as a native testcase runner (link with the C++ runtime). Typical
+ * use mirrors compare.cc:
+ *
+ *   validator_default_options(&opts);
+ *   validator_parse_options(nargs, args, &opts);
+ *   validator_read_file("testdata.out", &judgeans);
+ *   validator_read_fd(fd, &teamout);
+ *   validator_compare(&judgeans, &teamout, &opts, &res);
+ *   validator_write_feedback(judgemessage, diffpos, &res);
+ *
+ * None of the functions exit or abort on errors.
+ */
+
+#ifndef DEFAULT_VALIDATOR_H
+#define DEFAULT_VALIDATOR_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Verdicts, equal to the exit codes of the compare script. */
+#define VALIDATOR_ACCEPTED      42
+#define VALIDATOR_WRONG_ANSWER  43
+/* No verdict yet on a prefix of the team output. */
+#define VALIDATOR_UNDECIDED     0
+
+struct validator_options {
+	int case_sensitive;
+	int space_change_sensitive;
+	/* Float tolerances: floats are compared if either is >= 0. */
+	long double float_abs_tol;
+	long double float_rel_tol;
+	/* Maximum number of threads to compare large outputs with;
+	 * 0 means one per CPU in our affinity mask. */
+	int max_threads;
+};
+
+/* An input file held completely in memory, either mmap()ed or read
+ * in large blocks when mapping is not possible (e.g. a pipe).
+ */
+struct validator_input {
+	const char *data;
+	size_t size;
+	int mapped;
+};
+
+struct validator_result {
+	int verdict;
+	/* Lines (1-based) and byte offsets of the first difference in
+	 * the answer file and team output, as in diffposition.txt. */
+	int judgeans_line, stdin_line;
+	int judgeans_pos, stdin_pos;
+	/* Full text for judgemessage.txt, malloc()ed; NULL if accepted. */
+	char *message;
+};
+
+/* Set default options: case and space change insensitive, no floats,
+ * as many threads as CPUs available. */
+void validator_default_options(struct validator_options *opts);
+
+/* Parse validator options (e.g. "float_tolerance 1e-6") from
+ * args[0..nargs-1] into opts. Returns 0 on success, -1 on invalid
+ * options.
+ */
+int validator_parse_options(int nargs, const char *const *args,
+                            struct validator_options *opts);
+
+/* Read a file or file descriptor completely. Returns 0 on success,
+ * -1 on failure with errno set.
+ */
+int validator_read_fd(int fd, struct validator_input *in);
+int validator_read_file(const char *path, struct validator_input *in);
+void validator_free_input(struct validator_input *in);
+
+/* Compare team output against the judge answer and store verdict,
+ * position and message in res. Returns the verdict.
+ */
+int validator_compare(const struct validator_input *judgeans,
+                      const struct validator_input *teamout,
+                      const struct validator_options *opts,
+                      struct validator_result *res);
+
+/* Compare team output that is still being read: teamprefix holds the
+ * output read so far, up to whitespace such that its last token is
+ * complete (otherwise nothing is compared). Returns VALIDATOR_WRONG_ANSWER (with res filled
+ * in as by validator_compare) if the output is wrong whatever follows,
+ * otherwise VALIDATOR_UNDECIDED. Each call resumes where the previous
+ * one stopped, so the prefix must only grow; initialize res with
+ * validator_init_prefix() first. Accepted output is only known at the
+ * end, with validator_compare() on the complete output.
+ */
+void validator_init_prefix(struct validator_result *res);
+int validator_compare_prefix(const struct validator_input *judgeans,
+                             const struct validator_input *teamprefix,
+                             const struct validator_options *opts,
+                             struct validator_result *res);
+
+/* Write the message and difference position of a wrong answer to the
+ * judgemessage.txt and diffposition.txt streams; either may be NULL.
+ * Nothing is written for an accepted result. Returns 0 on success,
+ * -1 on write errors.
+ */
+int validator_write_feedback(FILE *judgemessage, FILE *diffpos,
+                             const struct validator_result *res);
+
+void validator_free_result(struct validator_result *res);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DEFAULT_VALIDATOR_H */
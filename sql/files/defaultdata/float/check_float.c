@@ -20,12 +20,20 @@
    absolute and relative deviation of the teams output from the
    reference output. If the floats are within either bounds, they are
    assumed equal.
+
+   For large numeric outputs, option '--batch' collects the floats of
+   each line in blocks that are first screened in double precision;
+   only values not clearly within tolerance are checked exactly. It
+   prints summary statistics of the differences, and at most
+   '--max-diagnostics' (default 10 in batch mode) detailed messages.
  */
 
 #include "config.h"
 
 /* For having access to isfinite() macro in math.h */
 #define _ISOC99_SOURCE
+/* For getline() */
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -35,6 +43,8 @@
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <float.h>
+#include <sys/types.h>
 
 #define PROGRAM "check_float"
 #define VERSION DOMJUDGE_VERSION
@@ -42,8 +52,6 @@
 #include "lib.error.h"
 #include "lib.misc.h"
 
-#define MAXLINELEN 1024
-
 extern int errno;
 
 /* The floating point type we use internally: */
@@ -60,6 +68,32 @@ FILE *file1, *file2;
 flt abs_prec;
 flt rel_prec;
 int ignore_ws;
+int batch;
+int max_diagnostics;
+
+int ndiagnostics, nsuppressed;
+int diff;
+
+/* Block of float pairs pending in batch mode, file 1 and 2 values
+   parsed as double with references to their tokens. */
+#define BLOCKSIZE 1024
+
+struct blockentry {
+	int linenr, tokennr;
+	char *tok1, *tok2;
+	size_t len1, len2;
+};
+
+int nblock;
+double block1[BLOCKSIZE], block2[BLOCKSIZE];
+double blockabs[BLOCKSIZE];
+int blockok[BLOCKSIZE];
+struct blockentry blockentries[BLOCKSIZE];
+
+/* Statistics of float differences in batch mode */
+int nfloats;
+flt max_absdiff, max_reldiff;
+int max_abs_line, max_abs_token, max_rel_line, max_rel_token;
 
 int show_help;
 int show_version;
@@ -68,6 +102,8 @@ struct option const long_opts[] = {
 	{"abs-prec", required_argument, NULL,         'a'},
 	{"rel-prec", required_argument, NULL,         'r'},
 	{"ignore-ws",no_argument,       NULL,         'w'},
+	{"batch",    no_argument,       NULL,         'b'},
+	{"max-diagnostics",required_argument,NULL,    'm'},
 	{"help",     no_argument,       &show_help,    1 },
 	{"version",  no_argument,       &show_version, 1 },
 	{ NULL,      0,                 NULL,          0 }
@@ -84,6 +120,9 @@ void usage()
 	printf("  -a, --abs-prec=PREC  use PREC as relative precision (default: 1E-7)\n");
 	printf("  -r, --rel-prec=PREC  use PREC as absolute precision (default: 1E-7)\n");
 	printf("  -w, --ignore-ws      ignore whitespace differences\n");
+	printf("  -b, --batch          check floats in blocks and report summary statistics\n");
+	printf("  -m, --max-diagnostics=N  print at most N detailed differences\n");
+	printf("                       (default: unlimited, 10 in batch mode)\n");
 	printf("      --help           display this help and exit\n");
 	printf("      --version        output version information and exit\n");
 	printf("\n");
@@ -114,31 +153,198 @@ int equal(flt f1, flt f2)
 	return 0;
 }
 
-/* Read whitespace from str into res, returns number of characters read */
-int scanspace(const char *str, char *res)
+/* Read the next line (including newline) from file into *line, which
+ * is grown as needed. Returns its length, or -1 at end of file.
+ */
+ssize_t readline(char **line, size_t *size, FILE *file, const char *filename)
 {
-	int pos = 0;
-	while ( isspace(str[pos]) ) {
-		res[pos] = str[pos];
-		pos++;
+	ssize_t len;
+
+	errno = 0;
+	if ( (len = getline(line,size,file))<0 ) {
+		if ( errno!=0 ) error(errno,"reading '%s'",filename);
+		return -1;
 	}
 
-	res[pos] = 0;
+	/* Like with fgets(), anything after a NUL character is ignored. */
+	return strlen(*line);
+}
+
+/* Skip whitespace in line from pos, returns position after it */
+size_t scanspace(const char *line, size_t pos)
+{
+	while ( isspace((unsigned char)line[pos]) ) pos++;
+	return pos;
+}
+
+/* Skip a token in line from pos, returns position after it */
+size_t scantoken(const char *line, size_t pos)
+{
+	while ( line[pos]!=0 && !isspace((unsigned char)line[pos]) ) pos++;
 	return pos;
 }
 
+/* Test whether line1[pos1..end1) and line2[pos2..end2) are equal */
+int substrequal(const char *line1, size_t pos1, size_t end1,
+                const char *line2, size_t pos2, size_t end2)
+{
+	return end1-pos1==end2-pos2 && memcmp(&line1[pos1],&line2[pos2],end1-pos1)==0;
+}
+
+/* Print a detailed diagnostic, unless the maximum has been reached.
+   Pending batch mode floats are checked first to keep messages in
+   order. Returns whether the message was printed. */
+void batch_flush();
+
+int diagnostic(const char *fmt, ...)
+{
+	va_list ap;
+
+	if ( max_diagnostics>=0 && ndiagnostics>=max_diagnostics ) {
+		nsuppressed++;
+		return 0;
+	}
+	if ( nblock>0 ) batch_flush();
+	if ( max_diagnostics>=0 && ndiagnostics>=max_diagnostics ) {
+		nsuppressed++;
+		return 0;
+	}
+	ndiagnostics++;
+
+	va_start(ap,fmt);
+	vprintf(fmt,ap);
+	va_end(ap);
+	return 1;
+}
+
+void float_differs(int linenr, int tokennr, flt f1, flt f2)
+{
+	flt absdiff, reldiff;
+
+	if ( !diagnostic("line %3d: %d-th float differs: %8LG != %-8LG",
+	                 linenr,tokennr,f1,f2) ) return;
+	if ( isfinite(f1) && isfinite(f2) ) {
+		absdiff = fabsl(f1-f2);
+		reldiff = fabsl((f1-f2)/f2);
+		if ( absdiff>abs_prec ) printf("  absdiff = %9.5LE",absdiff);
+		if ( reldiff>rel_prec ) printf("  reldiff = %9.5LE",reldiff);
+	}
+	printf("\n");
+}
+
+void update_stats(int linenr, int tokennr, flt absdiff, flt reldiff)
+{
+	if ( absdiff>max_absdiff ) {
+		max_absdiff = absdiff;
+		max_abs_line = linenr;
+		max_abs_token = tokennr;
+	}
+	if ( reldiff>max_reldiff ) {
+		max_reldiff = reldiff;
+		max_rel_line = linenr;
+		max_rel_token = tokennr;
+	}
+}
+
+/* Screen the pending block: a pair is ok if it is within tolerance
+   even after accounting for the rounding error of the double values.
+   Written as a simple loop over arrays so it can be vectorized. */
+void screen_block(int n)
+{
+	int i;
+	double d, e;
+	double abs_lim = (double)abs_prec*(1-4*DBL_EPSILON);
+	double rel_lim = (double)rel_prec*(1-4*DBL_EPSILON);
+
+	for(i=0; i<n; i++) {
+		d = fabs(block1[i]-block2[i]);
+		e = 4*DBL_EPSILON*(fabs(block1[i])+fabs(block2[i])) + DBL_MIN;
+		blockok[i] = (d+e<=abs_lim) | (d+e<=rel_lim*(fabs(block2[i])-e));
+		blockabs[i] = d;
+	}
+}
+
+/* Check all pending floats: screened pairs that are not clearly
+   within tolerance are parsed and compared exactly as long double. */
+void batch_flush()
+{
+	int i, n;
+	struct blockentry *b;
+	char save1, save2;
+	flt f1, f2;
+
+	n = nblock;
+	nblock = 0;
+	screen_block(n);
+
+	for(i=0; i<n; i++) {
+		b = &blockentries[i];
+		nfloats++;
+		if ( blockok[i] ) {
+			if ( block2[i]!=0 ) {
+				update_stats(b->linenr,b->tokennr,blockabs[i],blockabs[i]/fabs(block2[i]));
+			}
+			continue;
+		}
+
+		save1 = b->tok1[b->len1]; b->tok1[b->len1] = 0;
+		save2 = b->tok2[b->len2]; b->tok2[b->len2] = 0;
+		sscanf(b->tok1,"%Lf",&f1);
+		sscanf(b->tok2,"%Lf",&f2);
+		b->tok1[b->len1] = save1;
+		b->tok2[b->len2] = save2;
+
+		if ( isfinite(f1) && isfinite(f2) ) {
+			update_stats(b->linenr,b->tokennr,fabsl(f1-f2),
+			             f2!=0 ? fabsl((f1-f2)/f2) : 0);
+		}
+		if ( ! equal(f1,f2) ) {
+			diff++;
+			float_differs(b->linenr,b->tokennr,f1,f2);
+		}
+	}
+}
+
+/* Add a pair of tokens to the pending block if both parse completely
+   as double; returns whether they were added. */
+int batch_add(int linenr, int tokennr, char *tok1, size_t len1, char *tok2, size_t len2)
+{
+	char *end1, *end2;
+	char save1, save2;
+	struct blockentry *b;
+
+	save1 = tok1[len1]; tok1[len1] = 0;
+	save2 = tok2[len2]; tok2[len2] = 0;
+	block1[nblock] = strtod(tok1,&end1);
+	block2[nblock] = strtod(tok2,&end2);
+	tok1[len1] = save1;
+	tok2[len2] = save2;
+	if ( end1!=tok1+len1 || end2!=tok2+len2 ) return 0;
+
+	b = &blockentries[nblock++];
+	b->linenr = linenr;
+	b->tokennr = tokennr;
+	b->tok1 = tok1;
+	b->tok2 = tok2;
+	b->len1 = len1;
+	b->len2 = len2;
+
+	if ( nblock==BLOCKSIZE ) batch_flush();
+	return 1;
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
 	char *ptr;
-	int linenr, tokennr, diff, wsdiff;
-	char line1[MAXLINELEN], line2[MAXLINELEN];
-	char *ptr1, *ptr2;
-	int pos1, pos2;
-	int read1, read2, n1, n2;
-	char str1[MAXLINELEN], str2[MAXLINELEN];
+	int linenr, tokennr, wsdiff;
+	char *line1, *line2;
+	size_t size1, size2;
+	ssize_t len1, len2;
+	size_t pos1, pos2, end1, end2;
+	char save1, save2;
+	int read1, read2;
 	flt f1, f2;
-	flt absdiff, reldiff;
 
 	progname = argv[0];
 
@@ -146,9 +352,11 @@ int main(int argc, char **argv)
 	abs_prec = default_abs_prec;
 	rel_prec = default_rel_prec;
 	ignore_ws = 0;
+	batch = 0;
+	max_diagnostics = -2;
 	show_help = show_version = 0;
 	opterr = 0;
-	while ( (opt = getopt_long(argc,argv,"a:r:w",long_opts,(int *) 0))!=-1 ) {
+	while ( (opt = getopt_long(argc,argv,"a:r:wbm:",long_opts,(int *) 0))!=-1 ) {
 		switch ( opt ) {
 		case 0:   /* long-only option */
 			break;
@@ -165,6 +373,14 @@ int main(int argc, char **argv)
 		case 'w': /* ignore whitespace errors */
 			ignore_ws = 1;
 			break;
+		case 'b': /* batch mode */
+			batch = 1;
+			break;
+		case 'm': /* maximum number of diagnostics */
+			max_diagnostics = strtol(optarg,&ptr,10);
+			if ( *ptr!=0 || ptr==optarg || max_diagnostics<0 )
+				error(0,"incorrect maximum number of diagnostics specified");
+			break;
 		case ':': /* getopt error */
 		case '?':
 			error(0,"unknown option or missing argument `%c'",optopt);
@@ -173,6 +389,7 @@ int main(int argc, char **argv)
 			error(0,"getopt returned character code `%c' ??",(char)opt);
 		}
 	}
+	if ( max_diagnostics==-2 ) max_diagnostics = batch ? 10 : -1;
 	if ( show_help ) usage();
 	if ( show_version ) version(PROGRAM,VERSION);
 
@@ -199,119 +416,146 @@ int main(int argc, char **argv)
 	linenr = 0;
 	diff = 0;
 	wsdiff = 0;
+	line1 = line2 = NULL;
+	size1 = size2 = 0;
 
+	/* Each line is scanned once: we walk alternating whitespace and
+	   token ranges [pos,end) through both lines simultaneously. */
 	while ( 1 ) {
 		linenr++;
-		ptr1 = fgets(line1,MAXLINELEN,file1);
-		ptr2 = fgets(line2,MAXLINELEN,file2);
+		len1 = readline(&line1,&size1,file1,file1name);
+		len2 = readline(&line2,&size2,file2,file2name);
 
-		if ( ptr1==NULL && ptr2==NULL ) break;
+		if ( len1<0 && len2<0 ) break;
 
-		if ( ptr1==NULL && ptr2!=NULL ) {
-			printf("line %3d: file 1 ended before 2.\n",linenr);
+		if ( len1<0 && len2>=0 ) {
+			diagnostic("line %3d: file 1 ended before 2.\n",linenr);
 			diff++;
 			break;
 		}
-		if ( ptr1!=NULL && ptr2==NULL ) {
-			printf("line %3d: file 2 ended before 1.\n",linenr);
+		if ( len1>=0 && len2<0 ) {
+			diagnostic("line %3d: file 2 ended before 1.\n",linenr);
 			diff++;
 			break;
 		}
 
 		/* Check leading whitespace */
-		n1 = scanspace(line1,str1);
-		n2 = scanspace(line2,str2);
-		if ( strcmp(str1,str2)!=0 ) {
+		end1 = scanspace(line1,0);
+		end2 = scanspace(line2,0);
+		if ( !substrequal(line1,0,end1,line2,0,end2) ) {
 			wsdiff++;
 			if ( !ignore_ws ) {
-				printf("line %3d: whitespace mismatch at begin of line.\n",linenr);
+				diagnostic("line %3d: whitespace mismatch at begin of line.\n",linenr);
 			}
 		}
+		pos1 = end1;
+		pos2 = end2;
+
+		/* No tokens on this line at all */
+		if ( line1[pos1]==0 && line2[pos2]==0 ) continue;
 
 		tokennr = 0;
-		pos1 = n1;
-		pos2 = n2;
 		while ( 1 ) {
 			tokennr++;
 
-			read1 = sscanf(&line1[pos1],"%s",str1);
-			read2 = sscanf(&line2[pos2],"%s",str2);
-			sscanf(&line1[pos1],"%*s%n",&n1);
-			sscanf(&line2[pos2],"%*s%n",&n2);
-			pos1 += n1;
-			pos2 += n2;
+			end1 = scantoken(line1,pos1);
+			end2 = scantoken(line2,pos2);
 
-			if ( read1!=1 && read2==1 ) {
-				printf("line %3d: file 1 misses %d-th token.\n",linenr,tokennr);
+			if ( end1==pos1 && end2!=pos2 ) {
+				diagnostic("line %3d: file 1 misses %d-th token.\n",linenr,tokennr);
 				diff++;
 				break;
 			}
-			if ( read1==1 && read2!=1 ) {
-				printf("line %3d: file 1 has excess %d-th token.\n",linenr,tokennr);
+			if ( end1!=pos1 && end2==pos2 ) {
+				diagnostic("line %3d: file 1 has excess %d-th token.\n",linenr,tokennr);
 				diff++;
 				break;
 			}
 
 			/* Check if tokens are equal as strings */
-			if ( strcmp(str1,str2)==0 ) goto tokendone;
+			if ( substrequal(line1,pos1,end1,line2,pos2,end2) ) goto tokendone;
+
+			if ( batch && batch_add(linenr,tokennr,&line1[pos1],end1-pos1,
+			                        &line2[pos2],end2-pos2) ) goto tokendone;
+
+			/* Temporarily terminate the tokens for sscanf/printf */
+			save1 = line1[end1]; line1[end1] = 0;
+			save2 = line2[end2]; line2[end2] = 0;
 
-			read1 = sscanf(str1,"%Lf",&f1);
-			read2 = sscanf(str2,"%Lf",&f2);
+			read1 = sscanf(&line1[pos1],"%Lf",&f1);
+			read2 = sscanf(&line2[pos2],"%Lf",&f2);
 
 			if ( read1==0 ) {
-				printf("line %3d: file 1, %d-th entry cannot be parsed as float.\n",
-				       linenr,tokennr);
+				diagnostic("line %3d: file 1, %d-th entry cannot be parsed as float.\n",
+				           linenr,tokennr);
 				diff++;
 				break;
 			}
 			if ( read2==0 ) {
-				printf("line %3d: file 2, %d-th entry cannot be parsed as float.\n",
-				       linenr,tokennr);
+				diagnostic("line %3d: file 2, %d-th entry cannot be parsed as float.\n",
+				           linenr,tokennr);
 				diff++;
 				break;
 			}
 
 			if ( !(read1==1 && read2==1) ) {
-				printf("line %3d: %d-th non-float tokens differ: '%s' != '%s'.\n",
-				       linenr,tokennr,str1,str2);
+				diagnostic("line %3d: %d-th non-float tokens differ: '%s' != '%s'.\n",
+				           linenr,tokennr,&line1[pos1],&line2[pos2]);
 				diff++;
 			}
 
-			if ( ! equal(f1,f2) ) {
-				diff++;
-				printf("line %3d: %d-th float differs: %8LG != %-8LG",
-				       linenr,tokennr,f1,f2);
+			line1[end1] = save1;
+			line2[end2] = save2;
+
+			if ( batch && read1==1 && read2==1 ) {
+				nfloats++;
 				if ( isfinite(f1) && isfinite(f2) ) {
-					absdiff = fabsl(f1-f2);
-					reldiff = fabsl((f1-f2)/f2);
-					if ( absdiff>abs_prec ) printf("  absdiff = %9.5LE",absdiff);
-					if ( reldiff>rel_prec ) printf("  reldiff = %9.5LE",reldiff);
+					update_stats(linenr,tokennr,fabsl(f1-f2),
+					             f2!=0 ? fabsl((f1-f2)/f2) : 0);
 				}
-				printf("\n");
+			}
+
+			if ( ! equal(f1,f2) ) {
+				diff++;
+				float_differs(linenr,tokennr,f1,f2);
 			}
 
 		  tokendone:
 			/* Check whitespace after tokens */
-			n1 = scanspace(&line1[pos1],str1);
-			n2 = scanspace(&line2[pos2],str2);
-			if ( strcmp(str1,str2)!=0 ) {
+			pos1 = end1;
+			pos2 = end2;
+			end1 = scanspace(line1,pos1);
+			end2 = scanspace(line2,pos2);
+			if ( !substrequal(line1,pos1,end1,line2,pos2,end2) ) {
 				wsdiff++;
 				if ( !ignore_ws ) {
-					printf("line %3d: whitespace mismatch after %d-th token.\n",
-					       linenr,tokennr);
+					diagnostic("line %3d: whitespace mismatch after %d-th token.\n",
+					           linenr,tokennr);
 				}
 			}
-			pos1 += n1;
-			pos2 += n2;
+			pos1 = end1;
+			pos2 = end2;
 
 			/* No more tokens on this line */
 			if ( line1[pos1]==0 && line2[pos2]==0 ) break;
 		}
+
+		/* Block entries refer to the line buffers */
+		if ( nblock>0 ) batch_flush();
 	}
 
+	free(line1);
+	free(line2);
 	fclose(file1);
 	fclose(file2);
 
+	if ( nsuppressed > 0 ) printf("%d more diagnostics not shown\n",nsuppressed);
+	if ( batch && diff > 0 ) {
+		printf("Compared %d floats, max absdiff = %9.5LE (line %d, %d-th token), "
+		       "max reldiff = %9.5LE (line %d, %d-th token)\n",
+		       nfloats,max_absdiff,max_abs_line,max_abs_token,
+		       max_reldiff,max_rel_line,max_rel_token);
+	}
 	if ( diff > 0 ) printf("Found %d differences in %d lines\n",diff,linenr-1);
 	if ( !ignore_ws && wsdiff > 0 ) {
 		printf("Found %d whitespace differences in %d lines\n",wsdiff,linenr-1);
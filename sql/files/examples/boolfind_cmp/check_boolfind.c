@@ -1,57 +1,119 @@
+/*
+ * Checker for the sample "boolfind" interactive problem.
+ *
+ * The testdata file is mmapped and each testcase's array is scanned
+ * once, keeping only the two values at the position the contestant
+ * answered, so memory use does not depend on the array length.
+ */
+
+/* Include POSIX.1-2008 base specification */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+FILE *progout;
+
+/* Testdata file contents and current read position */
+const char *testdata, *testpos, *testend;
 
-FILE *testin, *progout;
+/* Parse the next integer from the testdata into *val. Returns 0 on
+ * success, -1 at end of data or on malformed input.
+ */
+int nextint(long *val)
+{
+	int neg = 0;
+
+	while ( testpos<testend && isspace((unsigned char)*testpos) ) testpos++;
+	if ( testpos<testend && (*testpos=='-' || *testpos=='+') ) {
+		neg = (*testpos=='-');
+		testpos++;
+	}
+	if ( testpos>=testend || !isdigit((unsigned char)*testpos) ) return -1;
+
+	*val = 0;
+	while ( testpos<testend && isdigit((unsigned char)*testpos) ) {
+		*val = *val*10 + (*testpos-'0');
+		testpos++;
+	}
+	if ( neg ) *val = -*val;
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
 	int run, nruns;
-	long pos, nbools;
-	int *bools;
-	char line[256];
-	int i, outputvalid;
+	long pos, nbools, i, val;
+	int bool1, bool2;
+	char *line;
+	size_t linesize;
+	ssize_t len;
+	int outputvalid;
+	int fd;
+	struct stat st;
 
 	if ( argc-1<2 ) {
 		fprintf(stderr,"error: not enough arguments: 2 required\n");
 		return 1;
 	}
-	testin  = fopen(argv[1],"r");
 	progout = stdin;
 
-	if ( testin==NULL || progout==NULL ) {
+	if ( (fd = open(argv[1],O_RDONLY))<0 || fstat(fd,&st)!=0 ) {
 		fprintf(stderr,"error: cannot open files\n");
 		return 1;
 	}
+	testdata = "";
+	if ( st.st_size>0 ) {
+		testdata = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if ( testdata==MAP_FAILED ) {
+			fprintf(stderr,"error: cannot map '%s'\n",argv[1]);
+			return 1;
+		}
+		posix_madvise((void *)testdata,st.st_size,POSIX_MADV_SEQUENTIAL);
+	}
+	close(fd);
+	testpos = testdata;
+	testend = testdata + st.st_size;
 
-	fscanf(testin,"%d\n",&nruns);
+	line = NULL;
+	linesize = 0;
 
-	for(run=1; run<=nruns; run++) {
-		fscanf(testin,"%ld\n",&nbools);
+	if ( nextint(&val)!=0 ) {
+		fprintf(stderr,"error: failed to read number of test cases\n");
+		return 1;
+	}
+	nruns = val;
 
-		bools = malloc(nbools*sizeof(int));
-		if ( bools==NULL ) {
-			fprintf(stderr,"error: cannot allocate memory\n");
+	for(run=1; run<=nruns; run++) {
+		if ( nextint(&nbools)!=0 ) {
+			fprintf(stderr,"error: failed to read data in test case %d\n",run);
 			return 1;
 		}
 
-		for(pos=0; pos<nbools; pos++) fscanf(testin,"%d\n",&bools[pos]);
+		/* Check the answer first, so the array can be scanned once. */
+		pos = -1;
 
-		if ( fgets(line,255,progout)==NULL ) {
+		if ( (len = getline(&line,&linesize,progout))<0 ) {
 			printf("testcase %d: cannot read line\n",run);
 			goto next;
 		}
 
-		i = strlen(line)-1;
-		while ( i>=0 && line[i]=='\n' ) line[i--] = 0;
+		while ( len>0 && line[len-1]=='\n' ) line[--len] = 0;
 
 		outputvalid = 1;
 		if ( strncmp(line,"OUTPUT ",7)!=0 ||
-		     strlen(line)<7 || line[7]=='0' ) outputvalid = 0;
+		     len<7 || line[7]=='0' ) outputvalid = 0;
 
-		for(i=7; i<strlen(line); i++) {
-			if ( !isdigit(line[i]) ) {
+		for(i=7; i<len; i++) {
+			if ( !isdigit((unsigned char)line[i]) ) {
 				outputvalid = 0;
 				break;
 			}
@@ -65,25 +127,33 @@ int main(int argc, char **argv)
 		sscanf(line,"OUTPUT %ld",&pos);
 		if ( pos<0 || pos>=nbools-1 ) {
 			printf("testcase %d: position %ld out of range\n",run,pos);
+			pos = -1;
 			goto next;
 		}
 
-		if ( !bools[pos] || bools[pos+1] ) {
-			printf("testcase %d: position %ld,%ld = %s,%s\n",run,pos,pos+1,
-			       (bools[pos]   ? "true" : "false"),
-			       (bools[pos+1] ? "true" : "false"));
-			goto next;
+	  next:
+		bool1 = bool2 = 0;
+		for(i=0; i<nbools; i++) {
+			if ( nextint(&val)!=0 ) {
+				fprintf(stderr,"error: failed to read data in test case %d\n",run);
+				return 1;
+			}
+			if ( i==pos   ) bool1 = (val!=0);
+			if ( i==pos+1 ) bool2 = (val!=0);
 		}
 
-	  next:
-		free(bools);
+		if ( pos>=0 && (!bool1 || bool2) ) {
+			printf("testcase %d: position %ld,%ld = %s,%s\n",run,pos,pos+1,
+			       (bool1 ? "true" : "false"),
+			       (bool2 ? "true" : "false"));
+		}
 	}
 
-	if ( fgets(line,255,progout)!=NULL ) {
+	if ( getline(&line,&linesize,progout)>=0 ) {
 		printf("extra data after last testcase:\n%s",line);
 	}
 
-	fclose(testin);
+	free(line);
 	fclose(progout);
 
 	return 0;
@@ -0,0 +1,129 @@
+/*
+ * Buffered line-based I/O for jury programs of interactive problems.
+ * See interactor.h for a description.
+ */
+
+/* Include POSIX.1-2008 base specification */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "interactor.h"
+
+#define INITBUFSIZE 65536
+
+static char *inbuf;
+static size_t insize, inhead, intail;
+static int ineof;
+
+int interactor_init(void)
+{
+	insize = INITBUFSIZE;
+	inhead = intail = 0;
+	ineof = 0;
+	if ( (inbuf = malloc(insize))==NULL ) return -1;
+
+	if ( setvbuf(stdout, NULL, _IOFBF, INITBUFSIZE)!=0 ) return -1;
+
+	return 0;
+}
+
+/* Read more input into the buffer, after flushing our output, since
+ * the other side may be waiting for it. Returns the number of bytes
+ * read, 0 at end of file or on error.
+ */
+static size_t fill_buffer(void)
+{
+	ssize_t nread;
+	char *newbuf;
+
+	if ( ineof ) return 0;
+
+	if ( inhead>0 ) {
+		memmove(inbuf, inbuf+inhead, intail-inhead);
+		intail -= inhead;
+		inhead = 0;
+	}
+	/* Keep one byte available for terminating a final line. */
+	if ( intail+1>=insize ) {
+		if ( (newbuf = realloc(inbuf, 2*insize))==NULL ) {
+			ineof = 1;
+			return 0;
+		}
+		inbuf = newbuf;
+		insize *= 2;
+	}
+
+	interactor_flush();
+
+	do {
+		nread = read(STDIN_FILENO, inbuf+intail, insize-intail-1);
+	} while ( nread<0 && errno==EINTR );
+
+	if ( nread<=0 ) {
+		ineof = 1;
+		return 0;
+	}
+	intail += nread;
+	return nread;
+}
+
+char *interactor_getline(void)
+{
+	char *line, *newline;
+	size_t searched = 0;
+
+	while ( 1 ) {
+		newline = memchr(inbuf+inhead+searched, '\n', intail-inhead-searched);
+		if ( newline!=NULL ) break;
+		searched = intail-inhead;
+		if ( fill_buffer()==0 ) {
+			/* Return a final line without newline, if any. */
+			if ( inhead==intail ) return NULL;
+			line = inbuf+inhead;
+			inbuf[intail] = 0;
+			inhead = intail;
+			return line;
+		}
+	}
+
+	line = inbuf+inhead;
+	*newline = 0;
+	inhead = newline-inbuf+1;
+	return line;
+}
+
+size_t interactor_read(char *buf, size_t count)
+{
+	size_t n;
+
+	if ( inhead==intail && fill_buffer()==0 ) return 0;
+
+	n = intail-inhead;
+	if ( n>count ) n = count;
+	memcpy(buf, inbuf+inhead, n);
+	inhead += n;
+	return n;
+}
+
+int interactor_printf(const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	va_start(ap, fmt);
+	res = vprintf(fmt, ap);
+	va_end(ap);
+
+	return res;
+}
+
+int interactor_flush(void)
+{
+	return fflush(stdout);
+}
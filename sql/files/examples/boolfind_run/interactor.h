@@ -0,0 +1,39 @@
+/*
+ * Buffered line-based I/O for jury programs of interactive problems.
+ *
+ * Input from the contestants' program on stdin is read in large
+ * blocks and split into lines, without limit on line length. Output
+ * to stdout is fully buffered and only flushed when we need more
+ * input that is not yet available. A program that sends a batch of
+ * queries at once thus gets all answers in a single write, while
+ * one-query-at-a-time programs still never wait on unflushed output.
+ */
+
+#ifndef INTERACTOR_H
+#define INTERACTOR_H
+
+#include <stddef.h>
+
+/* Set up buffering; call before any other I/O on stdin/stdout.
+ * Returns 0 on success, -1 on failure.
+ */
+int interactor_init(void);
+
+/* Return the next line from stdin without trailing newline, or NULL
+ * at end of file or on read error. The line is only valid until the
+ * next call. A final line without newline is returned as well.
+ */
+char *interactor_getline(void);
+
+/* Read up to 'count' bytes of remaining (raw) input into buf,
+ * returns the number of bytes read, 0 at end of file.
+ */
+size_t interactor_read(char *buf, size_t count);
+
+/* Write output to the contestants' program; this is buffered. */
+int interactor_printf(const char *fmt, ...);
+
+/* Force pending output to be written. */
+int interactor_flush(void);
+
+#endif /* INTERACTOR_H */
@@ -1,6 +1,12 @@
 /*
  * Jury program to communicate with contestants' program
  * for the sample "boolfind" interactive problem.
+ *
+ * Communication goes through the buffered helpers in interactor.c,
+ * which only flush answers when waiting for more queries. Besides
+ * "READ x" a query may also ask for multiple positions at once as
+ * "READ x1 x2 ...", which is answered with a single line of
+ * space-separated values.
  */
 
 /* Include POSIX.1-2008 base specification */
@@ -12,6 +18,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "interactor.h"
+
 const struct timespec delay = { 0, 1000000 }; /* 1 millisec. */
 
 #define maxn 1000000
@@ -23,36 +31,54 @@ int run,  nruns;
 long n;
 int data[maxn];
 
+/* Parse the next position from a READ query at *ptr. Returns 1 and
+ * advances *ptr if a valid position was found, 0 at end of the query,
+ * and -1 on invalid input.
+ */
+int nextpos(char **ptr, long *pos)
+{
+	char *end;
+
+	while ( **ptr==' ' ) (*ptr)++;
+	if ( **ptr==0 ) return 0;
+
+	*pos = strtol(*ptr,&end,10);
+	if ( end==*ptr || (*end!=' ' && *end!=0) || *pos>=n || *pos<0 ) return -1;
+
+	*ptr = end;
+	return 1;
+}
+
 void talk()
 {
 	int nqueries = 0;
-	char line[256];
-	int i;
+	char *line, *ptr;
+	int res, npos, i;
 	long pos;
 
-	printf("%ld\n",n); fflush(NULL);
+	interactor_printf("%ld\n",n);
 
 	do {
-		if ( fgets(line,255,stdin)==NULL ) break;
-		for(i=strlen(line)-1; i>=0 && line[i]=='\n'; i--) line[i] = 0;
+		if ( (line = interactor_getline())==NULL ) break;
 
 		if ( strncmp(line,"READ ",5)==0 ) {
-			/* We should do a more rigorous syntax check in input
-			 * here! E.g. check that nothing follows the number read.
-			 */
-			if ( sscanf(&line[5],"%ld",&pos)!=1 || pos>=n || pos<0 ) {
+			/* First validate all positions, then answer them. */
+			ptr = &line[5];
+			npos = 0;
+			while ( (res = nextpos(&ptr,&pos))==1 ) npos++;
+			if ( res<0 || npos==0 ) {
 				fprintf(out,"invalid READ query '%s' after %d queries\n",line,nqueries);
 				break;
 			}
 			/* Simulate slow query: delay for short while */
 			nanosleep(&delay,NULL);
-			if ( data[pos] ) {
-				printf("true\n");
-			} else {
-				printf("false\n");
+			ptr = &line[5];
+			for(i=0; i<npos; i++) {
+				nextpos(&ptr,&pos);
+				interactor_printf("%s%s", i>0 ? " " : "", data[pos] ? "true" : "false");
+				nqueries++;
 			}
-			fflush(NULL);
-			nqueries++;
+			interactor_printf("\n");
 		} else if ( strncmp(line,"OUTPUT ",6)==0 ) {
 			fprintf(out,"%s\n",line);
 			fprintf(stderr,"#queries = %d\n",nqueries);
@@ -75,10 +101,8 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	/* Make stdin/stdout unbuffered, just to be sure */
-	if ( setvbuf(stdin,  NULL, _IONBF, 0)!=0 ||
-	     setvbuf(stdout, NULL, _IONBF, 0)!=0 ) {
-		fprintf(stderr,"error: cannot set unbuffered I/O\n");
+	if ( interactor_init()!=0 ) {
+		fprintf(stderr,"error: cannot set up buffered I/O\n");
 		exit(1);
 	}
 
@@ -93,8 +117,7 @@ int main(int argc, char **argv)
 		fprintf(stderr,"error: failed to read number of test cases\n");
 		exit(1);
 	}
-	printf("%d\n",nruns);
-	fflush(NULL);
+	interactor_printf("%d\n",nruns);
 
 	for(run=1; run<=nruns; run++) {
 		if ( fscanf(in,"%ld\n",&n)!=1 ) {
@@ -116,7 +139,7 @@ int main(int argc, char **argv)
 	fclose(stdout);
 
 	/* Copy any additional data from program */
-	while ( (nbuf=fread(buf,1,256,stdin))>0 ) {
+	while ( (nbuf=interactor_read(buf,256))>0 ) {
 		if ( fwrite(buf,1,nbuf,out)!=nbuf ) {
 			fprintf(stderr,"error: failed to write additional program data\n");
 			exit(1);
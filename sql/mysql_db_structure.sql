@@ -269,6 +269,7 @@ CREATE TABLE `judging_run` (
   `runresult` varchar(32) DEFAULT NULL COMMENT 'Result of this run, NULL if not finished yet',
   `runtime` float DEFAULT NULL COMMENT 'Submission running time on this testcase',
   `endtime` decimal(32,9) unsigned NOT NULL COMMENT 'Time run judging ended',
+  `metadata` text COMMENT 'Metadata of the run reported by runguard, as JSON object',
   `output_run` longblob COMMENT 'Output of running the program',
   `output_diff` longblob COMMENT 'Diffing the program output and testcase output',
   `output_error` longblob COMMENT 'Standard error output of the program',
@@ -19,6 +19,8 @@ ALTER TABLE `configuration`
   ADD COLUMN `category` varchar(32) NOT NULL DEFAULT 'Uncategorized' COMMENT 'Option category of the configuration variable' AFTER `public`;
 ALTER TABLE `problem`
   ADD COLUMN `combined_run_compare` tinyint(1) unsigned NOT NULL DEFAULT '0' COMMENT 'Use the exit code of the run script to compute the verdict' AFTER `special_compare_args`;
+ALTER TABLE `judging_run`
+  ADD COLUMN `metadata` text COMMENT 'Metadata of the run reported by runguard, as JSON object' AFTER `endtime`;
 
 
 --
@@ -37,10 +37,14 @@
 #ifdef HAVE_MAGIC_H
 #include <magic.h>
 #endif
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 
 /* C++ includes for easy string handling */
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -76,6 +80,9 @@ const char *progname;
 
 int quiet;
 int assume_yes;
+int skip_metadata;
+int compress_files;
+char *batchfile;
 int show_help;
 int show_version;
 
@@ -88,6 +95,9 @@ struct option const long_opts[] = {
 	{"entry_point", optional_argument, NULL,         'e'},
 	{"quiet",       no_argument,       NULL,         'q'},
 	{"assume_yes",  no_argument,       NULL,         'y'},
+	{"skip_metadata",no_argument,      &skip_metadata,1 },
+	{"compress",    no_argument,       &compress_files,1 },
+	{"batch",       required_argument, NULL,         'b'},
 	{"help",        no_argument,       &show_help,    1 },
 	{"version",     no_argument,       &show_version, 1 },
 	{ NULL,         0,                 NULL,          0 }
@@ -100,13 +110,14 @@ void curl_cleanup();
 void usage2(int , const char *, ...) __attribute__((format (printf, 2, 3)));
 void warnuser(const char *, ...)     __attribute__((format (printf, 1, 2)));
 char readanswer(const char *answers);
-#ifdef HAVE_MAGIC_H
 bool file_istext(char *filename);
-#endif
 
-bool doAPIsubmit();
+struct submission;
+bool doAPIsubmit(const submission &);
+int doAPIsubmitbatch(const vector<submission> &);
+vector<submission> readbatch(const char *);
 
-Json::Value doAPIrequest(const char *);
+Json::Value doAPIrequest(const char *, bool usecache = false);
 bool readlanguages();
 bool readproblems();
 bool readcontests();
@@ -130,6 +141,41 @@ std::string stringtolower(std::string str)
 	return str;
 }
 
+/* Cached API response with the headers to revalidate it. */
+struct cacheentry {
+	string etag, lastmodified, body;
+};
+
+/* Helper function to store the validation headers of a response */
+size_t readheader(char *ptr, size_t size, size_t nmemb, void *eptr)
+{
+	cacheentry *entry = (cacheentry *) eptr;
+	string header(ptr,size*nmemb);
+	string name, value;
+	size_t pos;
+
+	if ( (pos = header.find(':'))==string::npos ) return size*nmemb;
+
+	name = stringtolower(header.substr(0,pos));
+	value = header.substr(pos+1);
+	value.erase(0,value.find_first_not_of(" \t"));
+	value.erase(value.find_last_not_of(" \t\r\n")+1);
+
+	if ( name=="etag" )          entry->etag = value;
+	if ( name=="last-modified" ) entry->lastmodified = value;
+
+	return size*nmemb;
+}
+
+/* Parse JSON text into value, returns false with errors set on failure */
+bool parsejson(const string &text, Json::Value &value, string &errors)
+{
+	Json::CharReaderBuilder builder;
+	istringstream stream(text);
+
+	return Json::parseFromStream(builder, stream, &value, &errors);
+}
+
 const int nHTML_entities = 5;
 const char HTML_entities[nHTML_entities][2][8] = {
 	{"&amp;", "&"},
@@ -187,6 +233,14 @@ struct problem {
 vector<problem> problems;
 problem myproblem;
 
+/* A submission to make, see also the batch option */
+struct submission {
+	problem prob;
+	language lang;
+	string entry_point;
+	vector<string> filenames;
+};
+
 CURL *handle;
 char curlerrormsg[CURL_ERROR_SIZE];
 
@@ -204,6 +258,72 @@ string kotlin_base_entry_point(string filebase)
 	return filebase;
 }
 
+/* Look up the language with ID or extension 'langid' */
+bool findlanguage(string langid, language &lang)
+{
+	if ( skip_metadata ) {
+		lang.id = lang.name = langid;
+		return !langid.empty();
+	}
+
+	langid = stringtolower(langid);
+	for(size_t i=0; i<languages.size(); i++) {
+		for(size_t j=0; j<languages[i].extensions.size(); j++) {
+			if ( stringtolower(languages[i].extensions[j]) == langid ) {
+				lang = languages[i];
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Look up the problem with ID or label 'probid' */
+bool findproblem(string probid, problem &prob)
+{
+	if ( skip_metadata ) {
+		prob.id = prob.label = probid;
+		return !probid.empty();
+	}
+
+	probid = stringtolower(probid);
+	for(size_t i=0; i<problems.size(); i++) {
+		if ( stringtolower(problems[i].id) == probid || stringtolower(problems[i].label) == probid ) {
+			prob = problems[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Guess the entry point from the first filename, if required */
+string guess_entry_point(const language &lang, const string &filebase, const string &fileext)
+{
+	if ( !lang.require_entry_point ) return "";
+
+	if ( lang.name == "Java" ) {
+		return filebase;
+	} else if ( lang.name == "Kotlin" ) {
+		return kotlin_base_entry_point(filebase) + "Kt";
+	} else if ( lang.name == "Python 2" ||
+	            lang.name == "Python 2 (pypy)" ||
+	            lang.name == "Python 3" ) {
+		return filebase + "." + fileext;
+	}
+	return "";
+}
+
+/* Split a filename into its base name (up to the first '.') and extension */
+void splitfilename(const string &filename, string &filebase, string &fileext)
+{
+	filebase = string(gnu_basename(filename.c_str()));
+	fileext = "";
+	if ( filebase.find('.')!=string::npos ) {
+		fileext = filebase.substr(filebase.rfind('.')+1);
+		filebase.erase(filebase.find('.'));
+	}
+}
+
 int main(int argc, char **argv)
 {
 	size_t i,j;
@@ -256,7 +376,7 @@ int main(int argc, char **argv)
 
 	quiet = show_help = show_version = 0;
 	opterr = 0;
-	while ( (c = getopt_long(argc,argv,"p:l:u:c:e:v::qy",long_opts,NULL))!=-1 ) {
+	while ( (c = getopt_long(argc,argv,"p:l:u:c:e:b:v::qy",long_opts,NULL))!=-1 ) {
 		switch ( c ) {
 		case 0:   /* long-only option */
 			break;
@@ -266,6 +386,7 @@ int main(int argc, char **argv)
 		case 'u': baseurl     = string(optarg); break;
 		case 'c': contestid   = string(optarg); break;
 		case 'e': entry_point = string(optarg); break;
+		case 'b': batchfile   = optarg;         break;
 
 		case 'v': /* verbose option */
 			if ( optarg!=NULL ) {
@@ -293,36 +414,54 @@ int main(int argc, char **argv)
 		}
 	}
 
+#ifndef HAVE_ZLIB_H
+	if ( compress_files ) {
+		warning(0,"compression not supported, submitting files uncompressed");
+		compress_files = 0;
+	}
+#endif
+
 	/* Make sure that baseurl terminates with a '/' for later concatenation. */
 	if ( !baseurl.empty() && baseurl[baseurl.length()-1]!='/' ) baseurl += '/';
 
-	if ( !readcontests() ) warning(0,"could not obtain active contests");
-
-	if ( contestid.empty() ) {
-		if ( contests.size()==0 ) {
-			warnuser("no active contests found (and no contest specified)");
-		}
-		if ( contests.size()==1 ) {
-			mycontest = contests[0];
-		}
-		if ( contests.size()>1 ) {
-			warnuser("multiple active contests found, please specify one");
+	bool languagesRead = false;
+	bool problemsRead  = false;
+	if ( skip_metadata ) {
+		/* Use the explicitly given IDs as is, without any requests
+		   for contest, problem and language data. */
+		if ( contestid.empty() ||
+		     (batchfile==NULL && (probid.empty() || langid.empty())) ) {
+			usage2(0,"option `skip_metadata' requires contest, problem and language");
 		}
+		mycontest.id  = mycontest.shortname = contestid;
+		languagesRead = problemsRead = true;
 	} else {
-		contestid = stringtolower(contestid);
-		for(i=0; i<contests.size(); i++) {
-			if ( stringtolower(contests[i].id) == contestid || stringtolower(contests[i].shortname) == contestid ) {
-				mycontest = contests[i];
-				break;
+		if ( !readcontests() ) warning(0,"could not obtain active contests");
+
+		if ( contestid.empty() ) {
+			if ( contests.size()==0 ) {
+				warnuser("no active contests found (and no contest specified)");
+			}
+			if ( contests.size()==1 ) {
+				mycontest = contests[0];
+			}
+			if ( contests.size()>1 ) {
+				warnuser("multiple active contests found, please specify one");
+			}
+		} else {
+			contestid = stringtolower(contestid);
+			for(i=0; i<contests.size(); i++) {
+				if ( stringtolower(contests[i].id) == contestid || stringtolower(contests[i].shortname) == contestid ) {
+					mycontest = contests[i];
+					break;
+				}
 			}
 		}
-	}
 
-	bool languagesRead = false;
-	bool problemsRead  = false;
-	if ( !mycontest.id.empty() ) {
-		languagesRead = readlanguages();
-		problemsRead = readproblems();
+		if ( !mycontest.id.empty() ) {
+			languagesRead = readlanguages();
+			problemsRead = readproblems();
+		}
 	}
 
 	if ( show_help ) usage();
@@ -334,6 +473,12 @@ int main(int argc, char **argv)
 
 	if ( !problemsRead ) warning(0,"could not obtain problem data");
 
+	if ( batchfile!=NULL ) {
+		if ( argc>optind ) usage2(0,"no file(s) allowed with option `batch'");
+		if ( baseurl.empty() ) usage2(0,"no url specified");
+		return doAPIsubmitbatch(readbatch(batchfile))==0 ? 0 : 1;
+	}
+
 	if ( argc<=optind ) usage2(0,"no file(s) specified");
 
 	/* Process all source files */
@@ -363,9 +508,7 @@ int main(int argc, char **argv)
 			warnuser("`%s' has not been modified for %d minutes",ptr,(int)fileage);
 		}
 
-#ifdef HAVE_MAGIC_H
 		if ( !file_istext(ptr) ) warnuser("`%s' is detected as binary/data",ptr);
-#endif
 
 		filenames.push_back(ptr);
 
@@ -373,50 +516,23 @@ int main(int argc, char **argv)
 	}
 
 	/* Try to parse problem and language from first filename */
-	filebase = string(gnu_basename(filenames[0].c_str()));
-	if ( filebase.find('.')!=string::npos ) {
-		fileext = filebase.substr(filebase.rfind('.')+1);
-		filebase.erase(filebase.find('.'));
-
+	splitfilename(filenames[0],filebase,fileext);
+	if ( !fileext.empty() ) {
 		if ( probid.empty() ) probid = filebase;
 		if ( langid.empty() ) langid = fileext;
 	}
 
 	/* Check for languages matching file extension */
-	langid = stringtolower(langid);
-	for(i=0; i<languages.size(); i++) {
-		for(j=0; j<languages[i].extensions.size(); j++) {
-			if ( stringtolower(languages[i].extensions[j]) == langid ) {
-				mylanguage = languages[i];
-				goto lang_found;
-			}
-		}
-	}
-lang_found:
-
-	probid = stringtolower(probid);
-	for(i=0; i<problems.size(); i++) {
-		if ( stringtolower(problems[i].id) == probid || stringtolower(problems[i].label) == probid ) {
-			myproblem = problems[i];
-			break;
-		}
-	}
+	findlanguage(langid,mylanguage);
+	findproblem(probid,myproblem);
 
 	if ( myproblem.id.empty()  ) usage2(0,"no problem specified or detected");
 	if ( mylanguage.id.empty() ) usage2(0,"no language specified or detected");
 	if ( baseurl.empty()       ) usage2(0,"no url specified");
 
 	/* Guess entry point if not already specified. */
-	if ( entry_point.empty() && mylanguage.require_entry_point ) {
-		if ( mylanguage.name == "Java" ) {
-			entry_point = filebase;
-		} else if ( mylanguage.name == "Kotlin" ) {
-			entry_point = kotlin_base_entry_point(filebase) + "Kt";
-		} else if ( mylanguage.name == "Python 2" ||
-		            mylanguage.name == "Python 2 (pypy)" ||
-		            mylanguage.name == "Python 3" ) {
-			entry_point = filebase + "." + fileext;
-		}
+	if ( entry_point.empty() ) {
+		entry_point = guess_entry_point(mylanguage,filebase,fileext);
 	}
 
 	if ( entry_point.empty() && mylanguage.require_entry_point ) {
@@ -456,7 +572,12 @@ lang_found:
 		if ( c=='n' ) error(0,"submission aborted by user");
 	}
 
-	doAPIsubmit();
+	submission sub;
+	sub.prob = myproblem;
+	sub.lang = mylanguage;
+	sub.entry_point = entry_point;
+	sub.filenames = filenames;
+	doAPIsubmit(sub);
 	return 0;
 }
 
@@ -475,6 +596,9 @@ void curl_setup()
 	curl_easy_setopt(handle, CURLOPT_MAXREDIRS,     10);
 	curl_easy_setopt(handle, CURLOPT_NETRC,         CURL_NETRC_OPTIONAL);
 	curl_easy_setopt(handle, CURLOPT_TIMEOUT,       timeout_secs);
+	curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(handle, CURLOPT_PIPEWAIT,      1L);
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION,  CURL_HTTP_VERSION_2TLS);
 	curl_easy_setopt(handle, CURLOPT_USERAGENT,     DOMJUDGE_PROGRAM " (" PROGRAM " using cURL)");
 
 	if ( verbose >= LOG_DEBUG ) {
@@ -512,6 +636,13 @@ void usage()
 "                                     defaults to LOG_INFO without argument\n"
 "  -q, --quiet                    suppress warning/info messages, set verbosity=LOG_ERR\n"
 "  -y, --assume-yes               suppress user input and assume yes\n"
+"      --skip_metadata            do not fetch contest, problem and language data;\n"
+"                                     CONTEST, PROBLEM and LANGUAGE must then be\n"
+"                                     given as IDs\n"
+"      --compress                 upload the files gzip compressed\n"
+"  -b, --batch=FILE               make all submissions listed in FILE, one per line\n"
+"                                     as PROBLEM LANGUAGE FILENAME...; no FILENAME\n"
+"                                     arguments and confirmation are used then\n"
 "      --help                     display this help and exit\n"
 "      --version                  output version information and exit\n"
 "\n"
@@ -659,57 +790,238 @@ char readanswer(const char *answers)
 	return (char) c;
 }
 
+/* Number of bytes at the start of a file inspected by file_istext */
+#define TEXTCHECK_SIZE 65536
+
+/* Bytes mask and multiplier for handling a word of bytes at once */
+#define BYTES_ONES  (~(unsigned long)0/255)
+#define BYTES_HIGH  (BYTES_ONES*128)
+
+enum textcheck { TEXT_YES, TEXT_NO, TEXT_UNKNOWN };
+
+/*
+ * Quickly classify the contents of 'buf' as text or not, based on
+ * UTF-8 validity and the fraction of control characters. Plain ASCII
+ * without control characters, the bulk of any source file, is
+ * checked a word at a time. 'truncated' indicates that 'buf' is only
+ * the start of the file, so an incomplete final UTF-8 sequence is
+ * allowed.
+ */
+textcheck text_heuristic(const unsigned char *buf, size_t len, bool truncated)
+{
+	size_t i = 0, ncontrol = 0, nextra;
+	bool validutf8 = true;
+	unsigned long word;
+	unsigned char c;
+
+	while ( i<len ) {
+		/* Skip a word if all its bytes are in the range 0x20-0x7e. */
+		if ( i+sizeof(word)<=len ) {
+			memcpy(&word,buf+i,sizeof(word));
+			if ( ((word | (word - BYTES_ONES*0x20) | (word + BYTES_ONES))
+			      & BYTES_HIGH)==0 ) {
+				i += sizeof(word);
+				continue;
+			}
+		}
+
+		c = buf[i++];
+		if ( c=='\0' ) return TEXT_NO;
+		if ( c<0x80 ) {
+			if ( (c<0x20 && strchr("\t\n\v\f\r",c)==NULL) || c==0x7f ) ncontrol++;
+			continue;
+		}
+
+		/* Check a multibyte UTF-8 sequence (without overlong forms). */
+		if      ( c>=0xc2 && c<=0xdf ) nextra = 1;
+		else if ( c>=0xe0 && c<=0xef ) nextra = 2;
+		else if ( c>=0xf0 && c<=0xf4 ) nextra = 3;
+		else {
+			validutf8 = false;
+			continue;
+		}
+		if ( i+nextra>len ) {
+			if ( !truncated ) validutf8 = false;
+			break;
+		}
+		for(size_t j=0; j<nextra; j++) {
+			if ( (buf[i+j] & 0xc0)!=0x80 ) {
+				validutf8 = false;
+				break;
+			}
+		}
+		if ( validutf8 ) i += nextra;
+	}
+
+	/* Allow for example an occasional ESC or form feed. */
+	if ( ncontrol*10>len ) return TEXT_NO;
+	if ( validutf8 && ncontrol*100<=len ) return TEXT_YES;
+
+	return TEXT_UNKNOWN;
+}
+
 #ifdef HAVE_MAGIC_H
+/* Loaded only once, and only when the heuristic cannot decide. */
+magic_t magic_cookie;
+bool magic_failed;
 
-bool file_istext(char *filename)
+bool magic_istext(char *filename)
 {
-	magic_t cookie;
 	const char *filetype;
-	bool res;
 
-	if ( (cookie = magic_open(MAGIC_MIME|MAGIC_SYMLINK))==NULL ) goto magicerror;
+	if ( magic_failed ) return true;
 
-	if ( magic_load(cookie,NULL)!=0 ) goto magicerror;
+	if ( magic_cookie==NULL ) {
+		if ( (magic_cookie = magic_open(MAGIC_MIME|MAGIC_SYMLINK))==NULL ) goto magicerror;
+		if ( magic_load(magic_cookie,NULL)!=0 ) goto magicerror;
+	}
 
-	if ( (filetype = magic_file(cookie,filename))==NULL ) goto magicerror;
+	if ( (filetype = magic_file(magic_cookie,filename))==NULL ) goto magicerror;
 
 	logmsg(LOG_DEBUG,"mime-type of '%s'",filetype);
 
-	res = ( strncmp(filetype,"text/",5)==0 );
-
-	magic_close(cookie);
-
-	return res;
+	return ( strncmp(filetype,"text/",5)==0 );
 
 magicerror:
-	warning(magic_errno(cookie),"%s",magic_error(cookie));
+	if ( magic_cookie==NULL ) {
+		warning(errno,"cannot initialize libmagic");
+	} else {
+		warning(magic_errno(magic_cookie),"%s",magic_error(magic_cookie));
+	}
+	magic_failed = true;
 
 	return true; // return 'text' by default on error
 }
-
 #endif /* HAVE_MAGIC_H */
 
+bool file_istext(char *filename)
+{
+	unsigned char buf[TEXTCHECK_SIZE];
+	size_t len;
+	FILE *f;
+	bool truncated;
+	textcheck res;
+
+	if ( (f = fopen(filename,"rb"))==NULL ) return true;
+	len = fread(buf,1,sizeof(buf),f);
+	truncated = ( len==sizeof(buf) && fgetc(f)!=EOF );
+	fclose(f);
+
+	res = text_heuristic(buf,len,truncated);
+	logmsg(LOG_DEBUG,"text heuristic for '%s': %s",filename,
+	       res==TEXT_YES ? "text" : res==TEXT_NO ? "binary" : "unknown");
+
+	if ( res!=TEXT_UNKNOWN ) return res==TEXT_YES;
+
+#ifdef HAVE_MAGIC_H
+	return magic_istext(filename);
+#else
+	return true;
+#endif
+}
+
+/*
+ * Return the cache file for the API call 'funcname'.
+ */
+string cachefile(const char *funcname)
+{
+	string name = baseurl + API_VERSION + funcname;
+
+	for(size_t i=0; i<name.length(); i++) {
+		if ( !isalnum(name[i]) && name[i]!='.' && name[i]!='-' ) name[i] = '_';
+	}
+
+	return string(submitdir) + "/" + CACHEDIR + "/" + name;
+}
+
+/*
+ * Read a cached API response, returns false if not available.
+ */
+bool readcache(const string &filename, cacheentry &entry)
+{
+	ifstream in(filename.c_str());
+	stringstream body;
+
+	if ( !in ) return false;
+	if ( !getline(in,entry.etag) || !getline(in,entry.lastmodified) ) return false;
+	body << in.rdbuf();
+	entry.body = body.str();
+
+	return !entry.body.empty();
+}
+
+/*
+ * Store an API response in the cache; failures are only logged, since
+ * the cache is just an optimization.
+ */
+void writecache(const string &filename, const cacheentry &entry)
+{
+	string dir = string(submitdir) + "/" + CACHEDIR;
+	string tmpname = filename + ".tmp";
+	struct stat fstats;
+
+	if ( stat(dir.c_str(),&fstats)!=0 && mkdir(dir.c_str(),USERPERMDIR)!=0 ) {
+		logmsg(LOG_WARNING,"cannot create cache directory `%s'",dir.c_str());
+		return;
+	}
+
+	ofstream out(tmpname.c_str());
+	out << entry.etag << '\n' << entry.lastmodified << '\n' << entry.body;
+	out.close();
+	if ( !out || rename(tmpname.c_str(),filename.c_str())!=0 ) {
+		logmsg(LOG_WARNING,"cannot write cache file `%s'",filename.c_str());
+		unlink(tmpname.c_str());
+	}
+}
+
 /*
  * Make an API call 'funcname'. A NULL value is returned when the call fails.
+ * With 'usecache', the response is cached on disk and revalidated with
+ * the ETag or Last-Modified header of the previous response, so that
+ * unchanged data is not transferred again.
  */
-Json::Value doAPIrequest(const char *funcname)
+Json::Value doAPIrequest(const char *funcname, bool usecache)
 {
 	CURLcode res;
 	char *url;
 	stringstream curloutput;
-	Json::Reader reader;
 	Json::Value result;
+	struct curl_slist *headers = NULL;
+	cacheentry cached, received;
+	string filename, body, errors;
+	bool havecache = false;
+	long http_code = 0;
 
 	url = strdup((baseurl+"api/"+API_VERSION+string(funcname)).c_str());
 
+	if ( usecache ) {
+		filename = cachefile(funcname);
+		havecache = readcache(filename,cached);
+		if ( havecache && !cached.etag.empty() ) {
+			headers = curl_slist_append(headers,("If-None-Match: "+cached.etag).c_str());
+		}
+		if ( havecache && !cached.lastmodified.empty() ) {
+			headers = curl_slist_append(headers,("If-Modified-Since: "+cached.lastmodified).c_str());
+		}
+		curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, readheader);
+		curl_easy_setopt(handle, CURLOPT_HEADERDATA,     (void *)&received);
+	}
+
 	curlerrormsg[0] = 0;
 
 	curl_easy_setopt(handle, CURLOPT_URL,           url);
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA,     (void *)&curloutput);
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER,    headers);
 
 	logmsg(LOG_INFO,"connecting to %s",url);
 
-	if ( (res=curl_easy_perform(handle))!=CURLE_OK ) {
+	res = curl_easy_perform(handle);
+
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER,     NULL);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, NULL);
+	curl_slist_free_all(headers);
+
+	if ( res!=CURLE_OK ) {
 		warning(0,"downloading '%s': %s",url,curlerrormsg);
 		free(url);
 		return result;
@@ -717,11 +1029,23 @@ Json::Value doAPIrequest(const char *funcname)
 
 	free(url);
 
-	logmsg(LOG_DEBUG,"API call '%s' returned:\n%s\n",funcname,curloutput.str().c_str());
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
+	if ( http_code==304 && havecache ) {
+		logmsg(LOG_DEBUG,"API call '%s' not modified, using cached data",funcname);
+		body = cached.body;
+	} else {
+		body = curloutput.str();
+		if ( usecache && http_code==200 &&
+		     (!received.etag.empty() || !received.lastmodified.empty()) ) {
+			received.body = body;
+			writecache(filename,received);
+		}
+	}
+
+	logmsg(LOG_DEBUG,"API call '%s' returned:\n%s\n",funcname,body.c_str());
 
-	if ( !reader.parse(curloutput, result) ) {
-		warning(0,"parsing REST API output: %s",
-		        reader.getFormattedErrorMessages().c_str());
+	if ( !parsejson(body, result, errors) ) {
+		warning(0,"parsing REST API output: %s",errors.c_str());
 	}
 
 	return result;
@@ -732,7 +1056,7 @@ bool readlanguages()
 	Json::Value res, exts;
 
 	string endpoint = "contests/" + mycontest.id + "/languages";
-	res = doAPIrequest(endpoint.c_str());
+	res = doAPIrequest(endpoint.c_str(), true);
 
 	if ( res.isNull() || !res.isArray() ) return false;
 
@@ -769,7 +1093,7 @@ bool readproblems()
 	Json::Value res;
 
 	string endpoint = "contests/" + mycontest.id + "/problems";
-	res = doAPIrequest(endpoint.c_str());
+	res = doAPIrequest(endpoint.c_str(), true);
 
 	if ( res.isNull() || !res.isArray() ) return false;
 
@@ -796,7 +1120,7 @@ bool readcontests()
 {
 	Json::Value res;
 
-	res = doAPIrequest("contests");
+	res = doAPIrequest("contests", true);
 
 	if ( res.isNull() || !res.isArray() ) return false;
 
@@ -819,38 +1143,195 @@ bool readcontests()
 	return true;
 }
 
-bool doAPIsubmit()
+/*
+ * Read the submissions listed in batch file 'filename': each line
+ * contains the problem, language and filenames separated by
+ * whitespace. Empty lines and lines starting with '#' are skipped.
+ */
+vector<submission> readbatch(const char *filename)
+{
+	ifstream in(filename);
+	vector<submission> subs;
+	string line, probid, langid, word, filebase, fileext;
+	struct stat fstats;
+	int lineno = 0;
+
+	if ( !in ) error(errno,"cannot open batch file `%s'",filename);
+
+	while ( getline(in,line) ) {
+		istringstream words(line);
+		submission sub;
+
+		lineno++;
+		if ( !(words >> probid) || probid[0]=='#' ) continue;
+		if ( !(words >> langid) ) {
+			error(0,"%s:%d: no language and file(s) specified",filename,lineno);
+		}
+		while ( words >> word ) {
+			if ( stat(word.c_str(),&fstats)!=0 || !S_ISREG(fstats.st_mode) ) {
+				error(errno,"%s:%d: cannot find file `%s'",filename,lineno,word.c_str());
+			}
+			sub.filenames.push_back(word);
+		}
+		if ( sub.filenames.empty() ) error(0,"%s:%d: no file(s) specified",filename,lineno);
+
+		if ( !findproblem(probid,sub.prob) ) {
+			error(0,"%s:%d: problem `%s' not found",filename,lineno,probid.c_str());
+		}
+		if ( !findlanguage(langid,sub.lang) ) {
+			error(0,"%s:%d: language `%s' not found",filename,lineno,langid.c_str());
+		}
+		splitfilename(sub.filenames[0],filebase,fileext);
+		sub.entry_point = guess_entry_point(sub.lang,filebase,fileext);
+		if ( sub.entry_point.empty() && sub.lang.require_entry_point ) {
+			error(0,"%s:%d: entry point required but not detected",filename,lineno);
+		}
+
+		subs.push_back(sub);
+	}
+
+	logmsg(LOG_INFO,"read %d submissions from `%s'",(int)subs.size(),filename);
+
+	return subs;
+}
+
+#ifdef HAVE_ZLIB_H
+/*
+ * Read file 'filename' and return its gzip compressed contents in
+ * 'data'. Returns false on errors.
+ */
+bool gzipfile(const string &filename, string &data)
+{
+	ifstream in(filename.c_str(), ios::binary);
+	stringstream contents;
+	string src;
+	z_stream strm;
+	int ret;
+
+	if ( !in ) return false;
+	contents << in.rdbuf();
+	src = contents.str();
+
+	memset(&strm,0,sizeof(strm));
+	/* Window bits 15+16 select the gzip instead of zlib format. */
+	if ( deflateInit2(&strm,Z_BEST_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)!=Z_OK ) {
+		return false;
+	}
+	/* Reserve room for the gzip header and trailer as well. */
+	data.resize(deflateBound(&strm,src.size()) + 32);
+	strm.next_in   = (Bytef *) src.data();
+	strm.avail_in  = src.size();
+	strm.next_out  = (Bytef *) &data[0];
+	strm.avail_out = data.size();
+	ret = deflate(&strm,Z_FINISH);
+	data.resize(strm.total_out);
+	deflateEnd(&strm);
+
+	return ret==Z_STREAM_END;
+}
+#endif
+
+/*
+ * Build the multipart form to post submission 'sub' with handle 'h'.
+ */
+curl_mime *buildform(CURL *h, const submission &sub)
+{
+	curl_mime *form;
+	curl_mimepart *part;
+
+	if ( (form = curl_mime_init(h))==NULL ) error(0,"curl_mime_init() error");
+
+	for(size_t i=0; i<sub.filenames.size(); i++) {
+		part = curl_mime_addpart(form);
+#ifdef HAVE_ZLIB_H
+		if ( compress_files ) {
+			string data;
+
+			if ( !gzipfile(sub.filenames[i],data) ) {
+				error(errno,"compressing `%s'",sub.filenames[i].c_str());
+			}
+			logmsg(LOG_DEBUG,"compressed `%s' to %d bytes",
+			       sub.filenames[i].c_str(),(int)data.size());
+			curl_mime_name(part,"code_gz[]");
+			curl_mime_data(part,data.data(),data.size());
+			curl_mime_filename(part,gnu_basename(sub.filenames[i].c_str()));
+			curl_mime_type(part,"application/gzip");
+			continue;
+		}
+#endif
+		curl_mime_name(part,"code[]");
+		if ( curl_mime_filedata(part,sub.filenames[i].c_str())!=CURLE_OK ) {
+			error(0,"cannot read file `%s'",sub.filenames[i].c_str());
+		}
+	}
+
+	part = curl_mime_addpart(form);
+	curl_mime_name(part,"problem");
+	curl_mime_data(part,sub.prob.id.c_str(),CURL_ZERO_TERMINATED);
+	part = curl_mime_addpart(form);
+	curl_mime_name(part,"language");
+	curl_mime_data(part,sub.lang.id.c_str(),CURL_ZERO_TERMINATED);
+	if ( !sub.entry_point.empty() ) {
+		part = curl_mime_addpart(form);
+		curl_mime_name(part,"entry_point");
+		curl_mime_data(part,sub.entry_point.c_str(),CURL_ZERO_TERMINATED);
+	}
+
+	return form;
+}
+
+/*
+ * Check the API response to a submission and return the submission
+ * ID. On failure, the error is reported and -1 returned, or the
+ * program exits if 'fatal' is set.
+ */
+int checksubmission(long http_code, stringstream &curloutput, bool fatal)
+{
+	string line, errors, msg;
+	Json::Value root;
+
+	// The connection worked, but we may have received an HTTP error
+	if ( http_code >= 300 ) {
+		while ( getline(curloutput,line) ) {
+			printf("%s\n", decode_HTML_entities(line).c_str());
+		}
+		if ( http_code == 401 ) {
+			msg = "Authentication failed. Please check your DOMjudge credentials.";
+		} else {
+			msg = "Submission failed (code " + to_string(http_code) + ")";
+		}
+	} else if ( !parsejson(curloutput.str(), root, errors) ) {
+		// We got a successful HTTP response. It worked.
+		// But check that we indeed received a submission ID.
+		msg = "parsing REST API output: " + errors;
+	} else if ( !root.isInt() ) {
+		msg = "REST API returned unexpected JSON data";
+	} else {
+		return root.asInt();
+	}
+
+	if ( fatal ) error(0,"%s",msg.c_str());
+	logerror(0,"%s",msg.c_str());
+	return -1;
+}
+
+bool doAPIsubmit(const submission &sub)
 {
 	CURLcode res;
-	struct curl_httppost *post = NULL;
-	struct curl_httppost *last = NULL;
+	curl_mime *form;
 	long http_code;
 	char *url;
 	stringstream curloutput;
-	string line;
-	Json::Reader reader;
-	Json::Value root;
 
 	url = strdup((baseurl + "api/" + API_VERSION + "contests/" + mycontest.id + "/submissions").c_str());
 
 	curlerrormsg[0] = 0;
 
 	/* Fill post form */
-	for(size_t i=0; i<filenames.size(); i++) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "code[]",
-			CURLFORM_FILE, filenames[i].c_str(), CURLFORM_END);
-	}
-	curl_formadd(&post, &last, CURLFORM_COPYNAME, "problem",
-		CURLFORM_COPYCONTENTS, myproblem.id.c_str(), CURLFORM_END);
-	curl_formadd(&post, &last, CURLFORM_COPYNAME, "language",
-		CURLFORM_COPYCONTENTS, mylanguage.id.c_str(), CURLFORM_END);
-	if ( !entry_point.empty() ) {
-		curl_formadd(&post, &last, CURLFORM_COPYNAME, "entry_point",
-			CURLFORM_COPYCONTENTS, entry_point.c_str(), CURLFORM_END);
-	}
+	form = buildform(handle,sub);
 
 	/* Set options for post */
-	curl_easy_setopt(handle, CURLOPT_HTTPPOST,      post);
+	curl_easy_setopt(handle, CURLOPT_MIMEPOST,      form);
 	curl_easy_setopt(handle, CURLOPT_URL,           url);
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA,     (void *)&curloutput);
 
@@ -858,45 +1339,123 @@ bool doAPIsubmit()
 
 	// Something went wrong when connecting to the API
 	if ( (res=curl_easy_perform(handle))!=CURLE_OK ) {
-		curl_formfree(post);
+		curl_mime_free(form);
 		curl_cleanup();
-		free(url);
 		error(0,"'%s': %s",url,curlerrormsg);
 	}
 
-	curl_formfree(post);
+	curl_mime_free(form);
 	free(url);
 
 	logmsg(LOG_DEBUG,"API call 'submissions' returned:\n%s\n",curloutput.str().c_str());
 
-	// The connection worked, but we may have received an HTTP error
 	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &http_code);
 	curl_cleanup();
-	if ( http_code >= 300 ) {
-		while ( getline(curloutput,line) ) {
-			printf("%s\n", decode_HTML_entities(line).c_str());
-		}
-		if ( http_code == 401 ) {
-			error(0, "Authentication failed. Please check your DOMjudge credentials.");
-		} else {
-			error(0, "Submission failed (code %li)", http_code);
+
+	logmsg(LOG_NOTICE,"Submission received, id = s%i",
+	       checksubmission(http_code, curloutput, true));
+
+	return true;
+}
+
+/* State of one submission of a batch */
+struct transfer {
+	CURL *handle;
+	curl_mime *form;
+	stringstream output;
+	char errormsg[CURL_ERROR_SIZE];
+};
+
+/*
+ * Make all submissions of a batch concurrently, multiplexed over a
+ * single HTTP/2 connection when the server supports it, or one after
+ * the other over a single HTTP/1.1 connection otherwise. Each
+ * submission ID is reported as soon as it is received. Returns the
+ * number of failed submissions.
+ */
+int doAPIsubmitbatch(const vector<submission> &subs)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	vector<transfer *> transfers;
+	transfer *t;
+	string url, names;
+	long http_code;
+	int running, nmsgs, id, nfailed = 0;
+
+	url = baseurl + "api/" + API_VERSION + "contests/" + mycontest.id + "/submissions";
+
+	if ( (multi = curl_multi_init())==NULL ) error(0,"curl_multi_init() error");
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING,           CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+
+	logmsg(LOG_INFO,"connecting to %s",url.c_str());
+
+	for(size_t i=0; i<subs.size(); i++) {
+		t = new transfer;
+		t->errormsg[0] = 0;
+		if ( (t->handle = curl_easy_duphandle(handle))==NULL ) {
+			error(0,"curl_easy_duphandle() error");
 		}
+		t->form = buildform(t->handle,subs[i]);
+		curl_easy_setopt(t->handle, CURLOPT_MIMEPOST,    t->form);
+		curl_easy_setopt(t->handle, CURLOPT_URL,         url.c_str());
+		curl_easy_setopt(t->handle, CURLOPT_WRITEDATA,   (void *)&t->output);
+		curl_easy_setopt(t->handle, CURLOPT_ERRORBUFFER, t->errormsg);
+		curl_easy_setopt(t->handle, CURLOPT_PRIVATE,     (void *)i);
+		curl_multi_add_handle(multi, t->handle);
+		transfers.push_back(t);
 	}
 
-	// We got a successful HTTP response. It worked.
-	// But check that we indeed received a submission ID.
-	if ( !reader.parse(curloutput, root) ) {
-		error(0,"parsing REST API output: %s",
-		        reader.getFormattedErrorMessages().c_str());
-	}
+	do {
+		if ( curl_multi_perform(multi, &running)!=CURLM_OK ) {
+			error(0,"curl_multi_perform() error");
+		}
 
-	if ( !root.isInt() ) {
-		error(0,"REST API returned unexpected JSON data");
-	}
+		while ( (msg = curl_multi_info_read(multi, &nmsgs))!=NULL ) {
+			if ( msg->msg!=CURLMSG_DONE ) continue;
 
-	logmsg(LOG_NOTICE,"Submission received, id = s%i", root.asInt());
+			void *ptr;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &ptr);
+			size_t i = (size_t) ptr;
+			t = transfers[i];
 
-	return true;
+			names = subs[i].filenames[0];
+			for(size_t j=1; j<subs[i].filenames.size(); j++) names += " " + subs[i].filenames[j];
+
+			if ( msg->data.result!=CURLE_OK ) {
+				logerror(0,"submission %d (%s): %s",(int)i+1,names.c_str(),t->errormsg);
+				id = -1;
+			} else {
+				logmsg(LOG_DEBUG,"API call 'submissions' returned:\n%s\n",t->output.str().c_str());
+				curl_easy_getinfo(t->handle, CURLINFO_RESPONSE_CODE, &http_code);
+				id = checksubmission(http_code, t->output, false);
+			}
+			if ( id<0 ) {
+				nfailed++;
+			} else {
+				logmsg(LOG_NOTICE,"Submission %d received (problem %s, language %s, %s), id = s%i",
+				       (int)i+1,subs[i].prob.label.c_str(),subs[i].lang.id.c_str(),names.c_str(),id);
+			}
+
+			curl_multi_remove_handle(multi, t->handle);
+			curl_easy_cleanup(t->handle);
+			curl_mime_free(t->form);
+			delete t;
+			transfers[i] = NULL;
+		}
+
+		if ( running && curl_multi_wait(multi, NULL, 0, 1000, NULL)!=CURLM_OK ) {
+			error(0,"curl_multi_wait() error");
+		}
+	} while ( running );
+
+	curl_multi_cleanup(multi);
+	curl_cleanup();
+
+	if ( nfailed>0 ) logerror(0,"%d of %d submissions failed",nfailed,(int)subs.size());
+
+	return nfailed;
 }
 
 //  vim:ts=4:sw=4:
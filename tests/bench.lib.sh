@@ -0,0 +1,82 @@
+# Option handling and report output shared by the bench-* scripts in
+# this directory, which source this file. Each benchmark writes its
+# report to REPORT as one JSON object per line, starting with an object
+# describing the host.
+#
+# Part of the DOMjudge Programming Contest Jury System and licensed
+# under the GNU GPL. See README and COPYING for details.
+
+NRUNS=3
+REPORT=/dev/stdout
+
+error()
+{
+	echo "$(basename "$0"): error: $*" >&2
+	exit 1
+}
+
+# Handle option $1 with argument $2 if it is one of the options common
+# to the benchmarks:
+#
+# -s <megabytes>  approximate size of the generated data (sets SIZE)
+# -n <runs>       number of runs per measurement (sets NRUNS)
+# -o <file>       file to write the report to (sets REPORT)
+#
+# Other options are an error.
+bench_option()
+{
+	case $1 in
+		s) SIZE="$2" ;;
+		n) NRUNS="$2" ;;
+		o) REPORT="$2" ;;
+		*) error "unknown option, see the header of this script" ;;
+	esac
+}
+
+# Create a temporary work directory for benchmark $1 and change to it.
+# It is removed on exit, using sudo when $2 is set because files in it
+# were created by root.
+bench_workdir()
+{
+	WORKDIR="$(mktemp -d --tmpdir "$1.XXXXXX")"
+	# shellcheck disable=SC2064
+	trap "${2:+sudo -n }rm -rf '$WORKDIR'" EXIT
+	cd "$WORKDIR"
+}
+
+now()
+{
+	date +%s.%N
+}
+
+# Print the awk expression $2 formatted with printf format $1, e.g.
+# bench_calc %.6f "$end-$start".
+bench_calc()
+{
+	awk "BEGIN { printf(\"$1\", $2) }"
+}
+
+# Append a JSON object with the members given as key=value arguments on
+# one line to REPORT. Values that are numbers are written unquoted.
+bench_report()
+{
+	awk 'BEGIN {
+		printf("{")
+		for(i=1; i<ARGC; i++) {
+			k = ARGV[i]; sub(/=.*/, "", k)
+			v = substr(ARGV[i], length(k)+2)
+			if ( v !~ /^-?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?$/ ) v = "\"" v "\""
+			printf("%s\"%s\":%s", i>1 ? "," : "", k, v)
+		}
+		printf("}\n")
+	}' "$@" >> "$REPORT"
+}
+
+# Start the report in REPORT with an object describing the host and the
+# benchmark settings given as key=value arguments, as for bench_report.
+bench_header()
+{
+	: > "$REPORT"
+	bench_report host="$(hostname)" kernel="$(uname -r)" cpus="$(nproc)" \
+		date="$(date -Iseconds)" "$@"
+}
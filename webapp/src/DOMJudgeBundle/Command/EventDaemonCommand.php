@@ -4,11 +4,11 @@ namespace DOMJudgeBundle\Command;
 
 use Doctrine\ORM\EntityManagerInterface;
 use DOMJudgeBundle\Entity\Contest;
-use DOMJudgeBundle\Entity\Event;
 use DOMJudgeBundle\Entity\User;
 use DOMJudgeBundle\Service\DOMJudgeService;
 use DOMJudgeBundle\Service\EventLogService;
 use DOMJudgeBundle\Utils\FreezeData;
+use DOMJudgeBundle\Utils\Utils;
 use Psr\Log\LoggerInterface;
 use Psr\Log\LogLevel;
 use Symfony\Bundle\FrameworkBundle\Command\ContainerAwareCommand;
@@ -29,6 +29,10 @@ use Symfony\Component\Security\Core\Authentication\Token\UsernamePasswordToken;
  *   for static data: contest, teams, problems, ...
  * - Contest state change events: start, freeze, end, finalize, ...
  *
+ * The contest and the latest events of the configuration endpoints
+ * are kept in memory, such that each iteration only checks for changes
+ * with a single small query, independent of the size of the contest.
+ *
  * @package DOMJudgeBundle\Command
  */
 class EventDaemonCommand extends ContainerAwareCommand
@@ -63,6 +67,18 @@ class EventDaemonCommand extends ContainerAwareCommand
      */
     protected $logger;
 
+    /**
+     * Latest event per configuration endpoint and endpoint ID, as its
+     * action and JSON encoded content, see updateLatestEvents().
+     * @var array[]
+     */
+    protected $latestEvents = [];
+
+    /**
+     * @var int
+     */
+    protected $latestEventId = 0;
+
     public function __construct(
         EntityManagerInterface $entityManager,
         DOMJudgeService $DOMJudgeService,
@@ -160,13 +176,8 @@ class EventDaemonCommand extends ContainerAwareCommand
         $token = new UsernamePasswordToken($user, null, 'main', $user->getRoles());
         $this->tokenStorage->setToken($token);
 
+        $contestFields = null;
         while (true) {
-            // Make sure we clear the entity manager class, to make sure we have fresh objects
-            $this->entityManager->clear();
-
-            // Reload the contest to get the new data
-            $selectedContest = $this->entityManager->getRepository(Contest::class)->find($selectedContestId);
-
             // Check whether we have received an exit signal
             if (function_exists('pcntl_signal_dispatch')) {
                 pcntl_signal_dispatch();
@@ -176,11 +187,17 @@ class EventDaemonCommand extends ContainerAwareCommand
                 return 0;
             }
 
-            $contests = $this->DOMJudgeService->getCurrentContests();
+            // Only reload the contest, with fresh objects, when it changed.
+            $fields = $this->getContestFields($selectedContestId);
+            if ($fields !== $contestFields) {
+                $this->entityManager->clear();
+                $selectedContest = $this->entityManager->getRepository(Contest::class)->find($selectedContestId);
+                $contestFields   = $fields;
+            }
 
-            if (!array_key_exists($selectedContest->getCid(), $contests)) {
+            if ($selectedContest === null || !$this->isActive($selectedContest)) {
                 $this->logger->error(sprintf('Contest ID \'%s\' not found (anymore) in active contests.',
-                                             $selectedContest->getCid()));
+                                             $selectedContestId));
                 return 1;
             }
 
@@ -191,6 +208,7 @@ class EventDaemonCommand extends ContainerAwareCommand
                 $contestIdGetter = sprintf('get%s', ucfirst($contestIdField));
                 $contestId       = $selectedContest->{$contestIdGetter}();
                 $url             = sprintf('/contests/%s', $contestId);
+                $this->updateLatestEvents($selectedContest);
                 $this->DOMJudgeService->withAllRoles(function () use ($url, $selectedContest) {
                     $this->insertEvent($selectedContest, 'contests',
                                        $this->DOMJudgeService->internalApiRequest($url, Request::METHOD_GET));
@@ -235,42 +253,99 @@ class EventDaemonCommand extends ContainerAwareCommand
     }
 
     /**
+     * Get the fields of the contest that determine whether it is active
+     * and its state, or null when it does not exist.
+     * @param int $contestId
+     * @return array|null
+     */
+    protected function getContestFields(int $contestId)
+    {
+        $fields = $this->entityManager->createQueryBuilder()
+            ->from('DOMJudgeBundle:Contest', 'c')
+            ->select('c.activatetime, c.starttime, c.starttimeEnabled, c.freezetime, c.endtime',
+                     'c.unfreezetime, c.finalizetime, c.deactivatetime, c.enabled')
+            ->andWhere('c.cid = :cid')
+            ->setParameter(':cid', $contestId)
+            ->getQuery()
+            ->getArrayResult();
+
+        return $fields ? reset($fields) : null;
+    }
+
+    /**
+     * Whether the contest is active, in the same way as
+     * DOMJudgeService::getCurrentContests() determines this.
      * @param Contest $contest
-     * @param string  $endpoint
-     * @param         $data
-     * @throws \Doctrine\ORM\NonUniqueResultException
+     * @return bool
      */
-    protected function insertEvent(Contest $contest, string $endpoint, $data)
+    protected function isActive(Contest $contest)
+    {
+        $now = Utils::now();
+        return $contest->getEnabled() &&
+            ($contest->getDeactivatetime() === null || $contest->getDeactivatetime() > $now) &&
+            $contest->getActivatetime() <= $now;
+    }
+
+    /**
+     * Add the events of the configuration endpoints of the contest that
+     * were logged since the last call to the in-memory latest events.
+     * @param Contest $contest
+     */
+    protected function updateLatestEvents(Contest $contest)
     {
-        /** @var Event $event */
-        $event = $this->entityManager->createQueryBuilder()
+        $endpoints = [];
+        foreach ($this->eventLogService->apiEndpoints as $endpoint => $endpointData) {
+            if ($endpointData[EventLogService::KEY_TYPE] === EventLogService::TYPE_CONFIGURATION) {
+                $endpoints[] = $endpoint;
+            }
+        }
+
+        $events = $this->entityManager->createQueryBuilder()
             ->from('DOMJudgeBundle:Event', 'e')
-            ->select('e')
+            ->select('e.eventid, e.endpointtype, e.endpointid, e.action, e.content')
             ->andWhere('e.cid = :cid')
-            ->andWhere('e.endpointtype = :endpoint')
-            ->andWhere('e.endpointid = :endpointid')
+            ->andWhere('e.eventid > :eventid')
+            ->andWhere('e.endpointtype IN (:endpoints)')
             ->setParameter(':cid', $contest->getCid())
-            ->setParameter(':endpoint', $endpoint)
-            ->setParameter(':endpointid', $data['id'])
-            ->setMaxResults(1)
-            ->orderBy('e.eventid', 'DESC')
+            ->setParameter(':eventid', $this->latestEventId)
+            ->setParameter(':endpoints', $endpoints)
+            ->orderBy('e.eventid', 'ASC')
             ->getQuery()
-            ->getOneOrNullResult();
+            ->getArrayResult();
+
+        foreach ($events as $event) {
+            $json = empty($event['content']) ? null : $this->DOMJudgeService->jsonEncode($event['content']);
+            $this->latestEvents[$event['endpointtype']][$event['endpointid']] = [$event['action'], $json];
+            $this->latestEventId = (int)$event['eventid'];
+        }
+    }
+
+    /**
+     * Insert a create or update event for $data, unless the latest event
+     * for it already has this content. The latest events must have been
+     * brought up to date with updateLatestEvents() first.
+     * @param Contest $contest
+     * @param string  $endpoint
+     * @param         $data
+     */
+    protected function insertEvent(Contest $contest, string $endpoint, $data)
+    {
+        $event = $this->latestEvents[$endpoint][(string)$data['id']] ?? null;
 
         $json = $this->DOMJudgeService->jsonEncode($data);
 
         // Check if there's already an old event and create/update
         // depending on previous state.
-        if (!$event || $event->getAction() === EventLogService::ACTION_DELETE) {
-            $this->eventLogService->log($endpoint, null, EventLogService::ACTION_CREATE, $contest->getCid(), $json,
-                                        $data['id']);
+        if (!$event || $event[0] === EventLogService::ACTION_DELETE) {
+            $action = EventLogService::ACTION_CREATE;
+        } elseif ($event[1] !== $json) {
+            $action = EventLogService::ACTION_UPDATE;
         } else {
-            if (empty($event->getContent()) || $this->DOMJudgeService->jsonEncode($event->getContent()) !== $json) {
-                $this->eventLogService->log($endpoint, null, 'update', $contest->getCid(), $json, $data['id']);
-            } else {
-                $this->logger->debug(sprintf('Skipping create %s/%s: already present', $endpoint, $data['id']));
-            }
+            $this->logger->debug(sprintf('Skipping create %s/%s: already present', $endpoint, $data['id']));
+            return;
         }
+        $this->eventLogService->log($endpoint, null, $action, $contest->getCid(), $json, $data['id']);
+        $this->latestEvents[$endpoint][(string)$data['id']] = [$action, $json];
     }
 
     /**
@@ -282,6 +357,7 @@ class EventDaemonCommand extends ContainerAwareCommand
     protected function initializeEvents(Contest $contest)
     {
         $this->logger->notice('Initializing configuration events.');
+        $this->updateLatestEvents($contest);
 
         foreach ($this->eventLogService->apiEndpoints as $endpoint => $endpointData) {
             if ($endpointData[EventLogService::KEY_TYPE] === EventLogService::TYPE_CONFIGURATION &&
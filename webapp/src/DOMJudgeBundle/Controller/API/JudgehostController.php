@@ -26,6 +26,7 @@ use Nelmio\ApiDocBundle\Annotation\Model;
 use Psr\Log\LoggerInterface;
 use Sensio\Bundle\FrameworkExtraBundle\Configuration\Security;
 use Swagger\Annotations as SWG;
+use Symfony\Component\HttpFoundation\File\UploadedFile;
 use Symfony\Component\HttpFoundation\Request;
 use Symfony\Component\HttpKernel\Exception\BadRequestHttpException;
 
@@ -37,6 +38,15 @@ use Symfony\Component\HttpKernel\Exception\BadRequestHttpException;
  */
 class JudgehostController extends FOSRestController
 {
+    /**
+     * Maximum time in seconds a next-judging request may wait for work,
+     * and the interval in seconds to check for it while waiting. The
+     * latter is the interval at which an idle judgedaemon polls by
+     * itself, so waiting does not add database load.
+     */
+    const MAX_NEXT_JUDGING_WAIT = 60;
+    const NEXT_JUDGING_POLL_INTERVAL = 5;
+
     /**
      * @var EntityManagerInterface
      */
@@ -265,12 +275,27 @@ class JudgehostController extends FOSRestController
      *     type="string",
      *     description="The hostname of the judgehost to get the next judging for"
      * )
-     * @param string $hostname
+     * @SWG\Parameter(
+     *     name="wait",
+     *     in="formData",
+     *     type="number",
+     *     description="Wait at most this many seconds for a submission to judge before returning an empty result",
+     *     required=false
+     * )
+     * @SWG\Parameter(
+     *     name="testcase_stats",
+     *     in="formData",
+     *     type="boolean",
+     *     description="Whether to add the number of runs, failures and total runtime over all valid judgings to each testcase",
+     *     required=false
+     * )
+     * @param Request $request
+     * @param string  $hostname
      * @return array|string
      * @throws \Doctrine\DBAL\DBALException
      * @throws \Exception
      */
-    public function getNextJudgingAction(string $hostname)
+    public function getNextJudgingAction(Request $request, string $hostname)
     {
         /** @var Judgehost $judgehost */
         $judgehost = $this->entityManager->getRepository(Judgehost::class)->find($hostname);
@@ -282,94 +307,30 @@ class JudgehostController extends FOSRestController
         $judgehost->setPolltime(Utils::now());
         $this->entityManager->flush();
 
-        // If this judgehost is not active, there's nothing to do
-        if (!$judgehost->getActive()) {
-            return '';
-        }
-
-        // Get all active contests
-        $contests   = $this->DOMJudgeService->getCurrentContests();
-        $contestIds = array_map(function (Contest $contest) {
-            return $contest->getCid();
-        }, $contests);
-
-        // If there are no active contests, there is nothing to do
-        if (empty($contestIds)) {
-            return '';
-        }
-
-        // Determine all viable submissions
-        $queryBuilder = $this->entityManager->createQueryBuilder()
-            ->from('DOMJudgeBundle:Submission', 's')
-            ->join('s.team', 't')
-            ->join('s.language', 'l')
-            ->join('s.contest_problem', 'cp')
-            ->select('s')
-            ->andWhere('s.judgehost IS NULL')
-            ->andWhere('s.cid IN (:contestIds)')
-            ->setParameter(':contestIds', $contestIds)
-            ->andWhere('l.allowJudge= 1')
-            ->andWhere('cp.allowJudge = 1')
-            ->andWhere('s.valid = 1')
-            ->orderBy('t.judging_last_started', 'ASC')
-            ->addOrderBy('s.submittime', 'ASC')
-            ->addOrderBy('s.submitid', 'ASC');
-
-        // Apply restrictions
-        if ($judgehost->getRestriction()) {
-            $restrictions = $judgehost->getRestriction()->getRestrictions();
-
-            if (isset($restrictions['contest'])) {
-                $queryBuilder
-                    ->andWhere('s.cid IN (:restrictionContestIds)')
-                    ->setParameter(':restrictionContestIds', $restrictions['contest']);
+        // Long-poll: check for new submissions until one can be claimed
+        // or the requested wait time has passed.
+        $wait     = min(max((float)$request->request->get('wait', 0), 0), static::MAX_NEXT_JUDGING_WAIT);
+        $deadline = Utils::now() + $wait;
+        while (($submission = $this->claimSubmission($judgehost)) === null) {
+            if (Utils::now() + static::NEXT_JUDGING_POLL_INTERVAL > $deadline) {
+                return '';
             }
 
-            if (isset($restrictions['problem'])) {
-                $queryBuilder
-                    ->andWhere('s.probid IN (:restrictionProblemIds)')
-                    ->setParameter(':restrictionProblemIds', $restrictions['problem']);
-            }
-
-            if (isset($restrictions['language'])) {
-                $queryBuilder
-                    ->andWhere('s.langid IN (:restrictionLanguageIds)')
-                    ->setParameter(':restrictionLanguageIds', $restrictions['language']);
-            }
-
-            if (isset($restrictions['rejudge_own']) && (bool)$restrictions['rejudge_own'] == false) {
-                $queryBuilder
-                    ->leftJoin('s.judgings', 'j', Join::WITH, 'j.judgehost = :judgehost')
-                    ->andWhere('j.judgehost IS NULL')
-                    ->setParameter(':judgehost', $judgehost->getHostname());
-            }
-        }
-
-        /** @var Submission[] $submissions */
-        $submissions = $queryBuilder->getQuery()->getResult();
-
-        $numUpdated = 0;
+            // Do not hold a database connection while sleeping, it is
+            // reopened by the next query.
+            $this->entityManager->clear();
+            $this->entityManager->getConnection()->close();
+            sleep(static::NEXT_JUDGING_POLL_INTERVAL);
 
-        // Pick first submission
-        foreach ($submissions as $submission) {
-            // update exactly one submission with our judgehost name
-            // Note: this might still return 0 if another judgehost beat us to it
-            // We do this directly as an SQL query so we can get the number of affected rows
-            $numUpdated = $this->entityManager->getConnection()->executeUpdate(
-                'UPDATE submission SET judgehost = :judgehost WHERE submitid = :submitid AND judgehost IS NULL',
-                [
-                    ':judgehost' => $judgehost->getHostname(),
-                    ':submitid' => $submission->getSubmitid()
-                ]
-            );
-            if ($numUpdated == 1) {
-                break;
+            // Reload the judgehost, its active flag or restrictions may have changed
+            $judgehost = $this->entityManager->getRepository(Judgehost::class)->find($hostname);
+            if (!$judgehost) {
+                return '';
             }
-        }
 
-        // No submission can be claimed
-        if (empty($submission) || $numUpdated == 0) {
-            return '';
+            // Keep the judgehost from showing up as not responding
+            $judgehost->setPolltime(Utils::now());
+            $this->entityManager->flush();
         }
 
         // Update judging last started for team
@@ -394,7 +355,8 @@ class JudgehostController extends FOSRestController
             'compare' => $submission->getProblem()->getSpecialCompare(),
             'compare_args' => $submission->getProblem()->getSpecialCompareArgs(),
             'compile_script' => $submission->getLanguage()->getCompileScript(),
-            'combined_run_compare' => $submission->getProblem()->getCombinedRunCompare()
+            'combined_run_compare' => $submission->getProblem()->getCombinedRunCompare(),
+            'submittime' => Utils::roundedFloat($submission->getSubmittime(), 3)
         ];
 
         // Merge defaults
@@ -496,19 +458,160 @@ class JudgehostController extends FOSRestController
         /** @var Testcase[] $testcases */
         $testcases     = $submission->getProblem()->getTestcases();
         $testcase_md5s = array();
+        $testcaseids   = array();
         foreach ($testcases as $testcase) {
             $testcase_md5s[$testcase->getRank()] = array(
                 'md5sum_input' => $testcase->getMd5sumInput(),
                 'md5sum_output' => $testcase->getMd5sumOutput(),
                 'testcaseid' => $testcase->getTestcaseid(),
-                'rank' => $testcase->getRank()
+                'rank' => $testcase->getRank(),
             );
+            $testcaseids[$testcase->getTestcaseid()] = $testcase->getRank();
+        }
+
+        // Add statistics of the runs in valid judgings per testcase, such
+        // that judgehosts can run the testcases that fail most often first.
+        // This aggregates over all runs of the problem, so only do so for
+        // judgehosts that ask for it.
+        if (!empty($testcaseids) && $request->request->getBoolean('testcase_stats')) {
+            foreach ($testcase_md5s as &$testcase_md5) {
+                $testcase_md5['runs']     = 0;
+                $testcase_md5['failures'] = 0;
+                $testcase_md5['runtime']  = 0.0;
+            }
+            unset($testcase_md5);
+
+            $stats = $this->entityManager->createQueryBuilder()
+                ->from('DOMJudgeBundle:JudgingRun', 'jr')
+                ->join('jr.judging', 'j')
+                ->select('jr.testcaseid, COUNT(jr.runid) AS runs, ' .
+                         'SUM(CASE WHEN jr.runresult = :correct THEN 0 ELSE 1 END) AS failures, ' .
+                         'SUM(jr.runtime) AS runtime')
+                ->andWhere('jr.testcaseid IN (:testcaseids)')
+                ->andWhere('jr.runresult IS NOT NULL')
+                ->andWhere('j.valid = 1')
+                ->setParameter(':correct', 'correct')
+                ->setParameter(':testcaseids', array_keys($testcaseids))
+                ->groupBy('jr.testcaseid')
+                ->getQuery()
+                ->getResult();
+            foreach ($stats as $stat) {
+                $rank = $testcaseids[$stat['testcaseid']];
+                $testcase_md5s[$rank]['runs']     = (int)$stat['runs'];
+                $testcase_md5s[$rank]['failures'] = (int)$stat['failures'];
+                $testcase_md5s[$rank]['runtime']  = (float)$stat['runtime'];
+            }
         }
         $result['testcases'] = $testcase_md5s;
 
         return $result;
     }
 
+    /**
+     * Claim the first submission the given judgehost may judge
+     * @param Judgehost $judgehost
+     * @return Submission|null The claimed submission or null if there is none
+     * @throws \Doctrine\DBAL\DBALException
+     * @throws \Exception
+     */
+    private function claimSubmission(Judgehost $judgehost)
+    {
+        // If this judgehost is not active, there's nothing to do
+        if (!$judgehost->getActive()) {
+            return null;
+        }
+
+        // Get all active contests
+        $contests   = $this->DOMJudgeService->getCurrentContests();
+        $contestIds = array_map(function (Contest $contest) {
+            return $contest->getCid();
+        }, $contests);
+
+        // If there are no active contests, there is nothing to do
+        if (empty($contestIds)) {
+            return null;
+        }
+
+        // Determine all viable submissions
+        $queryBuilder = $this->entityManager->createQueryBuilder()
+            ->from('DOMJudgeBundle:Submission', 's')
+            ->join('s.team', 't')
+            ->join('s.language', 'l')
+            ->join('s.contest_problem', 'cp')
+            ->select('s')
+            ->addSelect('CASE WHEN s.rejudgingid IS NULL THEN 0 ELSE 1 END AS HIDDEN is_rejudging')
+            ->andWhere('s.judgehost IS NULL')
+            ->andWhere('s.cid IN (:contestIds)')
+            ->setParameter(':contestIds', $contestIds)
+            ->andWhere('l.allowJudge= 1')
+            ->andWhere('cp.allowJudge = 1')
+            ->andWhere('s.valid = 1')
+            // Judge contest submissions before rejudgings
+            ->orderBy('is_rejudging', 'ASC')
+            ->addOrderBy('t.judging_last_started', 'ASC')
+            ->addOrderBy('s.submittime', 'ASC')
+            ->addOrderBy('s.submitid', 'ASC');
+
+        // Apply restrictions
+        if ($judgehost->getRestriction()) {
+            $restrictions = $judgehost->getRestriction()->getRestrictions();
+
+            if (isset($restrictions['contest'])) {
+                $queryBuilder
+                    ->andWhere('s.cid IN (:restrictionContestIds)')
+                    ->setParameter(':restrictionContestIds', $restrictions['contest']);
+            }
+
+            if (isset($restrictions['problem'])) {
+                $queryBuilder
+                    ->andWhere('s.probid IN (:restrictionProblemIds)')
+                    ->setParameter(':restrictionProblemIds', $restrictions['problem']);
+            }
+
+            if (isset($restrictions['language'])) {
+                $queryBuilder
+                    ->andWhere('s.langid IN (:restrictionLanguageIds)')
+                    ->setParameter(':restrictionLanguageIds', $restrictions['language']);
+            }
+
+            if (isset($restrictions['rejudge_own']) && (bool)$restrictions['rejudge_own'] == false) {
+                $queryBuilder
+                    ->leftJoin('s.judgings', 'j', Join::WITH, 'j.judgehost = :judgehost')
+                    ->andWhere('j.judgehost IS NULL')
+                    ->setParameter(':judgehost', $judgehost->getHostname());
+            }
+        }
+
+        /** @var Submission[] $submissions */
+        $submissions = $queryBuilder->getQuery()->getResult();
+
+        $numUpdated = 0;
+
+        // Pick first submission
+        foreach ($submissions as $submission) {
+            // update exactly one submission with our judgehost name
+            // Note: this might still return 0 if another judgehost beat us to it
+            // We do this directly as an SQL query so we can get the number of affected rows
+            $numUpdated = $this->entityManager->getConnection()->executeUpdate(
+                'UPDATE submission SET judgehost = :judgehost WHERE submitid = :submitid AND judgehost IS NULL',
+                [
+                    ':judgehost' => $judgehost->getHostname(),
+                    ':submitid' => $submission->getSubmitid()
+                ]
+            );
+            if ($numUpdated == 1) {
+                break;
+            }
+        }
+
+        // No submission can be claimed
+        if (empty($submission) || $numUpdated == 0) {
+            return null;
+        }
+
+        return $submission;
+    }
+
     /**
      * Update the given judging for the given judgehost
      * @Rest\Put("/update-judging/{hostname}/{judgingId}")
@@ -688,6 +791,18 @@ class JudgehostController extends FOSRestController
      *     type="string",
      *     description="The (base64-encoded) system output of the run"
      * )
+     * @SWG\Parameter(
+     *     name="metadata",
+     *     in="formData",
+     *     type="string",
+     *     description="The metadata of the run reported by runguard, as JSON object (optional)"
+     * )
+     * @SWG\Parameter(
+     *     name="batch",
+     *     in="formData",
+     *     type="string",
+     *     description="JSON array of runs to add instead of a single one, with their outputs either base64-encoded or attached as gzip compressed files 'run<i>_output_run' etc. for the i-th run"
+     * )
      * @param Request $request
      * @param string  $hostname
      * @param int     $judgingId
@@ -738,7 +853,9 @@ class JudgehostController extends FOSRestController
             /** @var Judging $judging */
             $judging = $this->entityManager->getRepository(Judging::class)->find($judgingId);
             $this->addSingleJudgingRun($hostname, $judgingId, (int)$testCaseId, $runResult, $runTime, $judging,
-                                       $outputSystem, $outputError, $outputDiff, $outputRun);
+                                       base64_decode($outputSystem), base64_decode($outputError),
+                                       base64_decode($outputDiff), base64_decode($outputRun),
+                                       $request->request->get('metadata'));
             $judgehost = $this->entityManager->getRepository(Judgehost::class)->find($hostname);
             $judgehost->setPolltime(Utils::now());
             $this->entityManager->flush();
@@ -746,7 +863,9 @@ class JudgehostController extends FOSRestController
     }
 
     /**
-     * Add multiple judgings runs to a given judging
+     * Add multiple judgings runs to a given judging. The outputs of the
+     * i-th run are either base64-encoded in the 'batch' JSON, or sent
+     * as gzip compressed files 'run<i>_output_run', etc.
      * @param Request $request
      * @param string  $hostname
      * @param int     $judgingId
@@ -768,15 +887,11 @@ class JudgehostController extends FOSRestController
             throw new BadRequestHttpException(
                 sprintf("Judgehost unknown, please register yourself first!"));
         }
-        foreach ($judgingRuns as $judgingRun) {
+        foreach ($judgingRuns as $index => $judgingRun) {
             $required = [
                 'testcaseid',
                 'runresult',
-                'runtime',
-                'output_run',
-                'output_diff',
-                'output_error',
-                'output_system'
+                'runtime'
             ];
 
             foreach ($required as $argument) {
@@ -786,13 +901,26 @@ class JudgehostController extends FOSRestController
                 }
             }
 
+            $outputs = [];
+            foreach (['output_run', 'output_diff', 'output_error', 'output_system'] as $argument) {
+                $file = $request->files->get(sprintf('run%d_%s', $index, $argument));
+                if ($file instanceof UploadedFile) {
+                    $outputs[$argument] = $this->readCompressedOutput($file);
+                } elseif (isset($judgingRun[$argument])) {
+                    $outputs[$argument] = base64_decode($judgingRun[$argument]);
+                } else {
+                    throw new BadRequestHttpException(
+                        sprintf("Argument '%s' is mandatory, got '%s'.", $argument, var_export($judgingRun, true)));
+                }
+            }
+
             $testCaseId   = $judgingRun['testcaseid'];
             $runResult    = $judgingRun['runresult'];
             $runTime      = $judgingRun['runtime'];
-            $outputRun    = $judgingRun['output_run'];
-            $outputDiff   = $judgingRun['output_diff'];
-            $outputError  = $judgingRun['output_error'];
-            $outputSystem = $judgingRun['output_system'];
+            $outputRun    = $outputs['output_run'];
+            $outputDiff   = $outputs['output_diff'];
+            $outputError  = $outputs['output_error'];
+            $outputSystem = $outputs['output_system'];
             /** @var Judging $judging */
             $judging = $this->entityManager->getRepository(Judging::class)->find($judgingId);
             if (!$judging) {
@@ -800,13 +928,29 @@ class JudgehostController extends FOSRestController
                     sprintf("Unknown judging, don't send us any imaginary data!"));
             }
             $this->addSingleJudgingRun($hostname, $judgingId, (int)$testCaseId, $runResult, $runTime, $judging,
-                                       $outputSystem, $outputError, $outputDiff, $outputRun);
+                                       $outputSystem, $outputError, $outputDiff, $outputRun,
+                                       $judgingRun['metadata'] ?? null);
         }
         $judgehost = $this->entityManager->getRepository(Judgehost::class)->find($hostname);
         $judgehost->setPolltime(Utils::now());
         $this->entityManager->flush();
     }
 
+    /**
+     * Read and decompress a gzip compressed judging run output file
+     * @param UploadedFile $file
+     * @return string
+     */
+    private function readCompressedOutput(UploadedFile $file): string
+    {
+        if (!$file->isValid() ||
+            ($contents = @gzdecode(file_get_contents($file->getRealPath()))) === false) {
+            throw new BadRequestHttpException(
+                sprintf("Invalid compressed output file '%s'", $file->getClientOriginalName()));
+        }
+        return $contents;
+    }
+
     /**
      * Internal error reporting (back from judgehost)
      *
@@ -959,6 +1103,7 @@ class JudgehostController extends FOSRestController
      * @param string  $outputError
      * @param string  $outputDiff
      * @param string  $outputRun
+     * @param string|null $metadata
      * @throws \Doctrine\DBAL\DBALException
      * @throws \Doctrine\ORM\NoResultException
      * @throws \Doctrine\ORM\NonUniqueResultException
@@ -974,7 +1119,8 @@ class JudgehostController extends FOSRestController
         string $outputSystem,
         string $outputError,
         string $outputDiff,
-        string $outputRun
+        string $outputRun,
+        $metadata = null
     ) {
         /** @var Testcase $testCase */
         $testCase = $this->entityManager->getRepository(Testcase::class)->find($testCaseId);
@@ -996,7 +1142,8 @@ class JudgehostController extends FOSRestController
             $outputSystem,
             $outputError,
             $outputDiff,
-            $outputRun
+            $outputRun,
+            $metadata
         ) {
             $judgingRun = new JudgingRunWithOutput();
             $judgingRun
@@ -1005,10 +1152,11 @@ class JudgehostController extends FOSRestController
                 ->setRunresult($runResult)
                 ->setRuntime($runTime)
                 ->setEndtime(Utils::now())
-                ->setOutputRun(base64_decode($outputRun))
-                ->setOutputDiff(base64_decode($outputDiff))
-                ->setOutputError(base64_decode($outputError))
-                ->setOutputSystem(base64_decode($outputSystem));
+                ->setOutputRun($outputRun)
+                ->setOutputDiff($outputDiff)
+                ->setOutputError($outputError)
+                ->setOutputSystem($outputSystem)
+                ->setMetadata(is_string($metadata) && is_array(json_decode($metadata, true)) ? $metadata : null);
 
             $this->entityManager->persist($judgingRun);
             $this->entityManager->flush();
@@ -17,6 +17,7 @@ use FOS\RestBundle\Controller\Annotations as Rest;
 use Nelmio\ApiDocBundle\Annotation\Model;
 use Sensio\Bundle\FrameworkExtraBundle\Configuration\Security;
 use Swagger\Annotations as SWG;
+use Symfony\Component\HttpFoundation\File\UploadedFile;
 use Symfony\Component\HttpFoundation\Request;
 use Symfony\Component\HttpFoundation\Response;
 use Symfony\Component\HttpFoundation\StreamedResponse;
@@ -136,6 +137,12 @@ class SubmissionController extends AbstractRestController
      *     description="The file to submit"
      * )
      * @SWG\Parameter(
+     *     name="code_gz[]",
+     *     in="formData",
+     *     type="file",
+     *     description="A gzip compressed file to submit, used instead of or in addition to code[]"
+     * )
+     * @SWG\Parameter(
      *     name="entry_point",
      *     in="formData",
      *     type="string",
@@ -215,13 +222,25 @@ class SubmissionController extends AbstractRestController
             $entryPoint = $request->request->get('entry_point');
         }
 
-        // Get the files we want to submit
+        // Get the files we want to submit, decompressing the ones that
+        // the client compressed.
         $files = $request->files->get('code') ?: [];
+        $tmpnames = [];
+        try {
+            foreach ($request->files->get('code_gz') ?: [] as $file) {
+                $files[] = $this->decompressUploadedFile($file, $tmpnames);
+            }
 
-        // Now submit the solution
-        $team       = $this->DOMJudgeService->getUser()->getTeam();
-        $submission = $this->submissionService->submitSolution($team, $problem, $problem->getContest(), $language,
-                                                               $files, null, $entryPoint, null, null, null, $message);
+            // Now submit the solution
+            $team       = $this->DOMJudgeService->getUser()->getTeam();
+            $submission = $this->submissionService->submitSolution($team, $problem, $problem->getContest(),
+                                                                   $language, $files, null, $entryPoint,
+                                                                   null, null, null, $message);
+        } finally {
+            foreach ($tmpnames as $tmpname) {
+                @unlink($tmpname);
+            }
+        }
 
         if (!$submission) {
             throw new BadRequestHttpException($message);
@@ -230,6 +249,31 @@ class SubmissionController extends AbstractRestController
         return $submission->getSubmitid();
     }
 
+    /**
+     * Decompress a gzip compressed uploaded file into a temporary file,
+     * whose name is added to $tmpnames. Decompression stops at the
+     * source size limit, to not be fooled by highly compressed data.
+     * @param UploadedFile $file
+     * @param string[]     $tmpnames
+     * @return UploadedFile
+     */
+    private function decompressUploadedFile(UploadedFile $file, array &$tmpnames)
+    {
+        $maxSize  = 1024 * (int)$this->DOMJudgeService->dbconfig_get('sourcesize_limit');
+        $contents = $file->isValid() ? @gzdecode(file_get_contents($file->getRealPath()), $maxSize) : false;
+        if ($contents === false) {
+            throw new BadRequestHttpException(
+                sprintf("File '%s' is not gzip compressed or too large", $file->getClientOriginalName()));
+        }
+        $tmpname = tempnam(sys_get_temp_dir(), 'submission-');
+        $tmpnames[] = $tmpname;
+        if (file_put_contents($tmpname, $contents) === false) {
+            throw new \Exception(sprintf("Could not write temporary file '%s'", $tmpname));
+        }
+        // Mark as test file: it was not moved here by PHP's upload handling.
+        return new UploadedFile($tmpname, $file->getClientOriginalName(), null, null, null, true);
+    }
+
     /**
      * Get the files for the given submission as a ZIP archive
      * @Rest\Get("/{id}/files", name="submission_files")
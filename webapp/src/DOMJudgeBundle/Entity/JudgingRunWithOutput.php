@@ -41,6 +41,12 @@ class JudgingRunWithOutput
      */
     private $endtime;
 
+    /**
+     * @var string
+     * @ORM\Column(type="text", name="metadata", options={"comment"="Metadata of the run reported by runguard, as JSON object"}, nullable=true)
+     */
+    private $metadata;
+
     /**
      * @var string
      * @ORM\Column(type="string", name="output_run", options={"comment"="Output of running the program"}, nullable=true)
@@ -159,6 +165,30 @@ class JudgingRunWithOutput
         return $this->endtime;
     }
 
+    /**
+     * Set metadata
+     *
+     * @param string $metadata
+     *
+     * @return JudgingRunWithOutput
+     */
+    public function setMetadata($metadata)
+    {
+        $this->metadata = $metadata;
+
+        return $this;
+    }
+
+    /**
+     * Get metadata
+     *
+     * @return string
+     */
+    public function getMetadata()
+    {
+        return $this->metadata;
+    }
+
     /**
      * Set outputRun
      *
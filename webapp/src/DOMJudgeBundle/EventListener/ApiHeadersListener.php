@@ -14,6 +14,15 @@ class ApiHeadersListener
             // It is, so add CORS headers
             $response = $event->getResponse();
             $response->headers->set('Access-Control-Allow-Origin', '*');
+
+            // Let clients revalidate cached GET responses, such as the
+            // contest metadata cached by the submit client. The ETag is
+            // weak, since web servers may compress the response.
+            if ($request->isMethod('GET') && $response->isOk() &&
+                ($content = $response->getContent()) !== false) {
+                $response->setEtag(md5($content), true);
+                $response->isNotModified($request);
+            }
         }
     }
 }